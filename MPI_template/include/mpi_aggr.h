@@ -0,0 +1,294 @@
+#ifndef MPI_AGGR_H
+#define MPI_AGGR_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mpi.h>
+
+#include "mpi_helper.h"
+
+/*
+ * Small-message aggregation: many tiny records, few MPI messages.
+ *
+ * Sending one double per message (week_2) or one edge update per message is
+ * bound by per-message latency. Here records are posted to a destination rank
+ * and appended to a per-destination buffer; the buffer goes out as one message
+ * when it reaches the size threshold, when its oldest record has waited longer
+ * than the timeout, or on an explicit flush. The receiver unpacks every message
+ * and calls the registered handler once per record, so throughput approaches
+ * bandwidth rather than 1 / latency.
+ *
+ *   mpi_aggr a;
+ *   mpi_aggr_create(&a, MPI_COMM_WORLD, on_record, &state, 0, 0);
+ *   for (...) mpi_aggr_post(&a, owner(v), &update, sizeof(update));
+ *   mpi_aggr_complete(&a);     // collective: every record has been handled everywhere
+ *   mpi_aggr_free(&a);
+ *
+ * Records are delivered in posting order per source/destination pair. Handlers
+ * run inside mpi_aggr_post/progress/complete and may post further records
+ * (e.g. graph traversals); mpi_aggr_complete returns only once those have been
+ * handled too. Records to the calling rank go straight to the handler.
+ * Buffers come from mpi_pool, so steady-state posting does not allocate.
+ */
+
+#ifndef MPI_AGGR_THRESHOLD
+#define MPI_AGGR_THRESHOLD 16384    // default bytes per destination before a buffer is sent
+#endif
+#ifndef MPI_AGGR_TIMEOUT
+#define MPI_AGGR_TIMEOUT 1e-3       // default seconds a record may wait in a buffer
+#endif
+
+typedef void (*mpi_aggr_handler)(int src, const void *record, int bytes, void *ctx);
+
+typedef struct {
+	char *data;          // from mpi_pool, NULL until the first record
+	size_t len;
+	double first_post;   // MPI_Wtime of the oldest record in the buffer
+} _mpi_aggr_buffer;
+
+typedef struct {
+	MPI_Comm comm;              // private duplicate, so the traffic cannot match user receives
+	int rank, size;
+	mpi_aggr_handler handler;
+	void *ctx;
+	size_t threshold;
+	double timeout;
+
+	_mpi_aggr_buffer *out;      // one per destination
+	int pending_flushes;        // destinations with a non-empty buffer
+
+	// buffers sent but not yet known to be delivered
+	MPI_Request *requests;
+	char **in_flight;
+	int num_in_flight, cap_in_flight;
+	int *indices;
+	int progressing;            // inside mpi_aggr_progress (handlers posting records do not recurse into it)
+
+	long long messages_sent, messages_received;
+	long long records_posted, records_handled;
+} mpi_aggr;
+
+/*
+ * Set up aggregation over comm (collective)
+ *
+ * handler: called for every record delivered to this rank
+ * ctx: passed to handler
+ * threshold: buffer size in bytes that triggers a send (0 for MPI_AGGR_THRESHOLD)
+ * timeout: seconds before a partly filled buffer is sent anyway (0 for MPI_AGGR_TIMEOUT, < 0 for never)
+ */
+int mpi_aggr_create(mpi_aggr *a, MPI_Comm comm, mpi_aggr_handler handler, void *ctx, size_t threshold, double timeout) {
+	memset(a, 0, sizeof(*a));
+	int err = MPI_Comm_dup(comm, &a->comm);
+	if (err != MPI_SUCCESS) {
+		return err;
+	}
+	MPI_Comm_rank(a->comm, &a->rank);
+	MPI_Comm_size(a->comm, &a->size);
+	a->handler = handler;
+	a->ctx = ctx;
+	a->threshold = threshold > 0 ? threshold : MPI_AGGR_THRESHOLD;
+	a->timeout = timeout != 0 ? timeout : MPI_AGGR_TIMEOUT;
+	a->out = (_mpi_aggr_buffer *)calloc(a->size, sizeof(_mpi_aggr_buffer));
+	a->cap_in_flight = 16;
+	a->requests = (MPI_Request *)malloc(a->cap_in_flight * sizeof(MPI_Request));
+	a->in_flight = (char **)malloc(a->cap_in_flight * sizeof(char *));
+	a->indices = (int *)malloc(a->cap_in_flight * sizeof(int));
+	return MPI_SUCCESS;
+}
+
+/*
+ * Release everything (collective; call mpi_aggr_complete first so no record is lost)
+ */
+void mpi_aggr_free(mpi_aggr *a) {
+	MPI_Waitall(a->num_in_flight, a->requests, MPI_STATUSES_IGNORE);
+	for (int i = 0; i < a->num_in_flight; i++) {
+		mpi_pool_free(a->in_flight[i]);
+	}
+	for (int d = 0; d < a->size; d++) {
+		mpi_pool_free(a->out[d].data);
+	}
+	free(a->indices);
+	free(a->in_flight);
+	free(a->requests);
+	free(a->out);
+	MPI_Comm_free(&a->comm);
+}
+
+/*
+ * Walk the [uint32 length][record] frames of a message and hand each record to the handler
+ */
+void _mpi_aggr_dispatch(mpi_aggr *a, int src, const char *data, size_t len) {
+	size_t pos = 0;
+	while (pos < len) {
+		uint32_t bytes;
+		memcpy(&bytes, data + pos, sizeof(bytes));
+		pos += sizeof(bytes);
+		a->handler(src, data + pos, (int)bytes, a->ctx);
+		a->records_handled++;
+		pos += bytes;
+	}
+}
+
+/*
+ * Send one destination's buffer as a single message
+ */
+void _mpi_aggr_send(mpi_aggr *a, int dst) {
+	_mpi_aggr_buffer *b = &a->out[dst];
+	if (b->len == 0) {
+		return;
+	}
+	if (a->num_in_flight == a->cap_in_flight) {
+		a->cap_in_flight *= 2;
+		a->requests = (MPI_Request *)realloc(a->requests, a->cap_in_flight * sizeof(MPI_Request));
+		a->in_flight = (char **)realloc(a->in_flight, a->cap_in_flight * sizeof(char *));
+		a->indices = (int *)realloc(a->indices, a->cap_in_flight * sizeof(int));
+	}
+	MPI_Isend(b->data, (int)b->len, MPI_BYTE, dst, 0, a->comm, &a->requests[a->num_in_flight]);
+	a->in_flight[a->num_in_flight++] = b->data;
+	a->messages_sent++;
+	b->data = NULL;
+	b->len = 0;
+	a->pending_flushes--;
+}
+
+/*
+ * Retire completed sends and handle every message that has arrived (never blocks)
+ */
+void mpi_aggr_progress(mpi_aggr *a) {
+	if (a->progressing) {
+		return;
+	}
+	a->progressing = 1;
+
+	if (a->num_in_flight > 0) {
+		int outcount;
+		MPI_Testsome(a->num_in_flight, a->requests, &outcount, a->indices, MPI_STATUSES_IGNORE);
+		if (outcount != MPI_UNDEFINED && outcount > 0) {
+			for (int k = 0; k < outcount; k++) {
+				mpi_pool_free(a->in_flight[a->indices[k]]);
+			}
+			int kept = 0;
+			for (int i = 0; i < a->num_in_flight; i++) {
+				if (a->requests[i] != MPI_REQUEST_NULL) {
+					a->requests[kept] = a->requests[i];
+					a->in_flight[kept] = a->in_flight[i];
+					kept++;
+				}
+			}
+			a->num_in_flight = kept;
+		}
+	}
+
+	for (;;) {
+		int flag;
+		MPI_Status status;
+		MPI_Iprobe(MPI_ANY_SOURCE, 0, a->comm, &flag, &status);
+		if (!flag) {
+			break;
+		}
+		int bytes;
+		MPI_Get_count(&status, MPI_BYTE, &bytes);
+		char *data = (char *)mpi_pool_alloc(bytes > 0 ? bytes : 1);
+		MPI_Recv(data, bytes, MPI_BYTE, status.MPI_SOURCE, 0, a->comm, MPI_STATUS_IGNORE);
+		a->messages_received++;
+		_mpi_aggr_dispatch(a, status.MPI_SOURCE, data, bytes);
+		mpi_pool_free(data);
+	}
+
+	if (a->pending_flushes > 0 && a->timeout >= 0) {
+		double now = MPI_Wtime();
+		for (int d = 0; d < a->size && a->pending_flushes > 0; d++) {
+			if (a->out[d].len > 0 && now - a->out[d].first_post >= a->timeout) {
+				_mpi_aggr_send(a, d);
+			}
+		}
+	}
+	a->progressing = 0;
+}
+
+/*
+ * Queue a record for dst (copied, so the caller's buffer can be reused straight away)
+ *
+ * returns MPI_ERR_RANK for a bad destination, MPI_ERR_NO_MEM if no buffer could be had
+ */
+int mpi_aggr_post(mpi_aggr *a, int dst, const void *record, int bytes) {
+	if (dst < 0 || dst >= a->size) {
+		return MPI_ERR_RANK;
+	}
+	a->records_posted++;
+	if (dst == a->rank) {
+		a->handler(dst, record, bytes, a->ctx);
+		a->records_handled++;
+		return MPI_SUCCESS;
+	}
+
+	_mpi_aggr_buffer *b = &a->out[dst];
+	size_t frame = sizeof(uint32_t) + (size_t)bytes;
+	if (b->len > 0 && b->len + frame > a->threshold) {
+		_mpi_aggr_send(a, dst);
+	}
+	if (b->data == NULL) {
+		// a record larger than the threshold travels alone in a buffer of its own size
+		b->data = (char *)mpi_pool_alloc(frame > a->threshold ? frame : a->threshold);
+		if (b->data == NULL) {
+			return MPI_ERR_NO_MEM;
+		}
+	}
+	if (b->len == 0) {
+		b->first_post = MPI_Wtime();
+		a->pending_flushes++;
+	}
+	uint32_t len32 = (uint32_t)bytes;
+	memcpy(b->data + b->len, &len32, sizeof(len32));
+	memcpy(b->data + b->len + sizeof(len32), record, bytes);
+	b->len += frame;
+
+	// keep the receive side and timeouts moving every so often without a clock read per record
+	if ((a->records_posted & 255) == 0) {
+		mpi_aggr_progress(a);
+	}
+	return MPI_SUCCESS;
+}
+
+/*
+ * Send the buffer for dst now, or every buffer for dst < 0
+ */
+void mpi_aggr_flush(mpi_aggr *a, int dst) {
+	if (dst >= 0) {
+		_mpi_aggr_send(a, dst);
+		return;
+	}
+	for (int d = 0; d < a->size && a->pending_flushes > 0; d++) {
+		_mpi_aggr_send(a, d);
+	}
+}
+
+/*
+ * Flush and keep handling until every record posted on any rank has been handled (collective)
+ *
+ * Termination by counting: a rank only enters the reduction with empty
+ * buffers, and records posted by handlers are flushed before that, so every
+ * message counted as received was counted as sent. Once the global totals
+ * match nothing is left in flight.
+ */
+void mpi_aggr_complete(mpi_aggr *a) {
+	for (;;) {
+		mpi_aggr_progress(a);
+		mpi_aggr_flush(a, -1);
+		long long local[2] = {a->messages_sent, a->messages_received}, global[2];
+		MPI_Allreduce(local, global, 2, MPI_LONG_LONG, MPI_SUM, a->comm);
+		if (global[0] == global[1]) {
+			break;
+		}
+	}
+	MPI_Waitall(a->num_in_flight, a->requests, MPI_STATUSES_IGNORE);
+	for (int i = 0; i < a->num_in_flight; i++) {
+		mpi_pool_free(a->in_flight[i]);
+	}
+	a->num_in_flight = 0;
+}
+
+#endif
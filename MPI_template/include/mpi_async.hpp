@@ -0,0 +1,346 @@
+#ifndef MPI_ASYNC_HPP
+#define MPI_ASYNC_HPP
+
+#include <coroutine>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "mpi_helper.hpp"
+
+/*
+ * C++20 coroutines over MPI requests (header only).
+ *
+ * A coroutine returning mpi::async::task<T> can co_await nonblocking MPI
+ * operations as if they were blocking calls. The operation starts when
+ * isend/irecv/ibcast is called, so starting several and then awaiting them
+ * overlaps them:
+ *
+ *   mpi::async::task<int> ring_step(const mpi::comm &c, int value) {
+ *       int in;
+ *       auto s = mpi::async::isend(c, std::span(&value, 1), right);
+ *       auto r = mpi::async::irecv(c, std::span(&in, 1), left);
+ *       co_await r;
+ *       co_await s;
+ *       co_return in;
+ *   }
+ *
+ *   mpi::async::loop loop;
+ *   loop.spawn(exchange(...));      // any number of independent tasks
+ *   loop.spawn(compute(...));
+ *   loop.run();                     // returns when all of them have finished
+ *
+ * There are no threads. A suspended coroutine's request goes into the loop's
+ * request array; run() resumes whatever is ready, then polls every pending
+ * request with one MPI_Testsome and resumes the coroutines whose requests
+ * completed. Long compute tasks can co_await mpi::async::yield() between
+ * chunks so the loop gets to poll (and MPI to progress) in between.
+ *
+ * Tasks are lazy: they run once spawned or awaited. An exception thrown in a
+ * task propagates to the task awaiting it, and out of run() for spawned ones.
+ * An operation that is destroyed without being awaited waits in its destructor.
+ */
+
+namespace mpi::async {
+
+class loop;
+class operation;
+
+template <typename T = void>
+class task;
+
+namespace detail {
+
+struct promise_base {
+	loop *owner = nullptr;                   // event loop driving this task (inherited from the awaiting task)
+	std::coroutine_handle<> continuation;    // task awaiting this one, none for spawned tasks
+	std::exception_ptr error;
+
+	struct final_awaiter {
+		bool await_ready() const noexcept { return false; }
+		template <typename P> std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept;
+		void await_resume() const noexcept {}
+	};
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+	final_awaiter final_suspend() noexcept { return {}; }
+	void unhandled_exception() noexcept { error = std::current_exception(); }
+};
+
+template <typename T>
+struct promise : promise_base {
+	std::optional<T> value;
+	task<T> get_return_object() noexcept;
+	template <typename U> void return_value(U &&v) { value.emplace(std::forward<U>(v)); }
+};
+
+template <>
+struct promise<void> : promise_base {
+	task<void> get_return_object() noexcept;
+	void return_void() noexcept {}
+};
+
+} // namespace detail
+
+/*
+ * Coroutine returning T; co_await it from another task, or spawn it on a loop
+ */
+template <typename T>
+class [[nodiscard]] task {
+public:
+	using promise_type = detail::promise<T>;
+
+	task(task &&o) noexcept : h_(std::exchange(o.h_, nullptr)) {}
+	task &operator=(task &&o) noexcept {
+		if (this != &o) {
+			reset();
+			h_ = std::exchange(o.h_, nullptr);
+		}
+		return *this;
+	}
+	task(const task &) = delete;
+	task &operator=(const task &) = delete;
+	~task() { reset(); }
+
+	bool await_ready() const noexcept { return !h_ || h_.done(); }
+	// start the child on the awaiting task's loop, it resumes the awaiting task when it finishes
+	template <typename P> std::coroutine_handle<> await_suspend(std::coroutine_handle<P> parent) noexcept {
+		h_.promise().owner = parent.promise().owner;
+		h_.promise().continuation = parent;
+		return h_;
+	}
+	T await_resume() {
+		if (h_.promise().error) {
+			std::rethrow_exception(h_.promise().error);
+		}
+		if constexpr (!std::is_void_v<T>) {
+			return std::move(*h_.promise().value);
+		}
+	}
+
+private:
+	friend class loop;
+	friend struct detail::promise<T>;
+	explicit task(std::coroutine_handle<promise_type> h) noexcept : h_(h) {}
+	void reset() noexcept {
+		if (h_) {
+			h_.destroy();
+			h_ = nullptr;
+		}
+	}
+
+	std::coroutine_handle<promise_type> h_;
+};
+
+template <typename T>
+task<T> detail::promise<T>::get_return_object() noexcept {
+	return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+}
+
+inline task<void> detail::promise<void>::get_return_object() noexcept {
+	return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this));
+}
+
+/*
+ * A started nonblocking operation; co_await gives its MPI_Status once it completes
+ */
+class operation {
+public:
+	explicit operation(MPI_Request r) noexcept : r_(r) {}
+	operation(operation &&o) noexcept : r_(std::exchange(o.r_, MPI_REQUEST_NULL)), status_(o.status_) {}
+	operation(const operation &) = delete;
+	operation &operator=(const operation &) = delete;
+	operation &operator=(operation &&) = delete;
+	~operation() {
+		if (r_ != MPI_REQUEST_NULL) {
+			MPI_Wait(&r_, MPI_STATUS_IGNORE);
+		}
+	}
+
+	// already complete (a test is cheap and often succeeds for small messages): no suspension
+	bool await_ready() noexcept {
+		int done = 1;
+		if (r_ != MPI_REQUEST_NULL) {
+			MPI_Test(&r_, &done, &status_);
+		}
+		return done != 0;
+	}
+	template <typename P> void await_suspend(std::coroutine_handle<P> h);
+	MPI_Status await_resume() const noexcept { return status_; }
+
+private:
+	friend class loop;
+	MPI_Request r_ = MPI_REQUEST_NULL;
+	MPI_Status status_{};
+};
+
+/*
+ * Per-rank event loop: runs spawned tasks and drives their requests with MPI_Testsome
+ */
+class loop {
+public:
+	loop() = default;
+	loop(const loop &) = delete;
+	loop &operator=(const loop &) = delete;
+	~loop() {
+		for (auto h : roots_) {
+			h.destroy();
+		}
+	}
+
+	void spawn(task<> t) {
+		auto h = std::exchange(t.h_, nullptr);
+		h.promise().owner = this;
+		roots_.push_back(h);
+		alive_++;
+		schedule(h);
+	}
+
+	/*
+	 * Run until every spawned task has finished (rethrows the first exception a spawned task ended with)
+	 */
+	void run() {
+		while (alive_ > 0) {
+			// only what was ready when the pass started, so a task that keeps yielding cannot starve the poll
+			for (std::size_t n = ready_.size(); n > 0; n--) {
+				auto h = ready_.front();
+				ready_.pop_front();
+				h.resume();
+			}
+			if (error_) {
+				std::rethrow_exception(std::exchange(error_, nullptr));
+			}
+			if (alive_ == 0) {
+				break;
+			}
+			if (requests_.empty()) {
+				if (ready_.empty()) {
+					throw std::logic_error("mpi::async::loop: tasks suspended with no MPI request pending");
+				}
+				continue;
+			}
+			poll();
+		}
+		for (auto h : roots_) {
+			h.destroy();
+		}
+		roots_.clear();
+	}
+
+	void schedule(std::coroutine_handle<> h) { ready_.push_back(h); }
+
+	// requests currently waited on
+	std::size_t pending() const noexcept { return requests_.size(); }
+
+private:
+	friend class operation;
+	friend struct detail::promise_base;
+
+	struct waiter {
+		operation *op;
+		std::coroutine_handle<> h;
+	};
+
+	void watch(operation *op, std::coroutine_handle<> h) {
+		requests_.push_back(op->r_);
+		waiters_.push_back({op, h});
+	}
+
+	void finished(std::exception_ptr error) noexcept {
+		alive_--;
+		if (error && !error_) {
+			error_ = error;
+		}
+	}
+
+	void poll() {
+		int n = static_cast<int>(requests_.size()), outcount;
+		indices_.resize(n);
+		statuses_.resize(n);
+		MPI_Testsome(n, requests_.data(), &outcount, indices_.data(), statuses_.data());
+		if (outcount == MPI_UNDEFINED || outcount == 0) {
+			return;
+		}
+		for (int k = 0; k < outcount; k++) {
+			waiter &w = waiters_[indices_[k]];
+			w.op->r_ = MPI_REQUEST_NULL;
+			w.op->status_ = statuses_[k];
+			schedule(w.h);
+		}
+		// completed slots were set to MPI_REQUEST_NULL by MPI_Testsome, squeeze them out
+		std::size_t kept = 0;
+		for (std::size_t i = 0; i < requests_.size(); i++) {
+			if (requests_[i] != MPI_REQUEST_NULL) {
+				requests_[kept] = requests_[i];
+				waiters_[kept] = waiters_[i];
+				kept++;
+			}
+		}
+		requests_.resize(kept);
+		waiters_.resize(kept);
+	}
+
+	std::deque<std::coroutine_handle<>> ready_;
+	std::vector<MPI_Request> requests_;   // one per suspended operation, same order as waiters_
+	std::vector<waiter> waiters_;
+	std::vector<int> indices_;
+	std::vector<MPI_Status> statuses_;
+	std::vector<std::coroutine_handle<detail::promise<void>>> roots_;
+	int alive_ = 0;
+	std::exception_ptr error_;
+};
+
+template <typename P>
+std::coroutine_handle<> detail::promise_base::final_awaiter::await_suspend(std::coroutine_handle<P> h) noexcept {
+	promise_base &p = h.promise();
+	if (p.continuation) {
+		return p.continuation;
+	}
+	p.owner->finished(p.error);
+	return std::noop_coroutine();
+}
+
+template <typename P>
+void operation::await_suspend(std::coroutine_handle<P> h) {
+	h.promise().owner->watch(this, h);
+}
+
+/*
+ * Awaitable that puts the task at the back of the ready queue (lets the loop poll MPI)
+ */
+struct yield {
+	bool await_ready() const noexcept { return false; }
+	template <typename P> void await_suspend(std::coroutine_handle<P> h) const { h.promise().owner->schedule(h); }
+	void await_resume() const noexcept {}
+};
+
+// the operations, started on call
+template <transferable T>
+[[nodiscard]] operation isend(const comm &c, std::span<T> buf, int dst, int tag = 0) {
+	MPI_Request r;
+	MPI_Isend(buf.data(), static_cast<int>(buf.size()), datatype<T>(), dst, tag, c.native(), &r);
+	return operation(r);
+}
+
+template <writable T>
+[[nodiscard]] operation irecv(const comm &c, std::span<T> buf, int src, int tag = 0) {
+	MPI_Request r;
+	MPI_Irecv(buf.data(), static_cast<int>(buf.size()), datatype<T>(), src, tag, c.native(), &r);
+	return operation(r);
+}
+
+template <writable T>
+[[nodiscard]] operation ibcast(const comm &c, std::span<T> buf, int root) {
+	MPI_Request r;
+	MPI_Ibcast(buf.data(), static_cast<int>(buf.size()), datatype<T>(), root, c.native(), &r);
+	return operation(r);
+}
+
+} // namespace mpi::async
+
+#endif
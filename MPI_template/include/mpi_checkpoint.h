@@ -0,0 +1,335 @@
+#ifndef MPI_CHECKPOINT_H
+#define MPI_CHECKPOINT_H
+
+#include <stdint.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mpi_helper.h"
+#include "mpi_io.h"
+
+/*
+ * Parallel checkpoint/restart of block-distributed arrays.
+ *
+ * File layout:
+ *   [header, padded to MPI_CKPT_DATA_OFFSET bytes][global array in row-major order]
+ *
+ * The array is distributed over the ranks by rows (first dimension), each rank
+ * holding a contiguous block of whole rows in rank order. Every rank writes its
+ * block straight to its place in the file with one collective MPI-IO call, so
+ * checkpointing runs at file system bandwidth and never goes through rank 0.
+ * Because the header records global shape and type and the data is stored as
+ * the plain global array, a restart can use any number of ranks, and serial
+ * tools can mmap the file and index the array directly.
+ */
+
+#define MPI_CKPT_MAGIC "MPICKPT"
+#define MPI_CKPT_VERSION 1
+#define MPI_CKPT_MAX_DIMS 4
+#define MPI_CKPT_ENDIAN_CHECK 0x01020304u
+#define MPI_CKPT_DATA_OFFSET 4096  // data starts page aligned so it can be mmap'd/read with O_DIRECT
+#ifndef MPI_CKPT_CHUNK_ROWS
+#define MPI_CKPT_CHUNK_ROWS (1 << 30)  // most rows per collective call (MPI-IO counts are ints)
+#endif
+
+enum {
+	MPI_CKPT_CHAR = 1,
+	MPI_CKPT_INT,
+	MPI_CKPT_LONG_LONG,
+	MPI_CKPT_FLOAT,
+	MPI_CKPT_DOUBLE,
+};
+
+enum {
+	MPI_CKPT_BLOCK_ROWS = 1,  // contiguous blocks of whole rows in rank order
+};
+
+typedef struct {
+	char magic[8];               // "MPICKPT\0"
+	uint32_t version;
+	uint32_t endian_check;       // MPI_CKPT_ENDIAN_CHECK as written by the writer
+	uint32_t dtype;              // MPI_CKPT_* element type
+	uint32_t elem_size;          // bytes per element
+	uint32_t ndims;
+	uint32_t distribution;       // MPI_CKPT_BLOCK_ROWS
+	uint64_t shape[MPI_CKPT_MAX_DIMS];
+	uint32_t nprocs;             // number of ranks that wrote the file (informational)
+	uint32_t reserved0;
+	uint64_t data_offset;        // byte offset of element [0, 0, ...]
+	uint64_t data_bytes;         // total bytes of array data
+} mpi_checkpoint_header;
+
+MPI_Datatype mpi_checkpoint_mpi_type(uint32_t dtype) {
+	switch (dtype) {
+	case MPI_CKPT_CHAR: return MPI_CHAR;
+	case MPI_CKPT_INT: return MPI_INT;
+	case MPI_CKPT_LONG_LONG: return MPI_LONG_LONG;
+	case MPI_CKPT_FLOAT: return MPI_FLOAT;
+	case MPI_CKPT_DOUBLE: return MPI_DOUBLE;
+	default: return MPI_DATATYPE_NULL;
+	}
+}
+
+/*
+ * Number of elements in one row (product of all but the first dimension)
+ */
+uint64_t mpi_checkpoint_row_elems(const mpi_checkpoint_header *h) {
+	uint64_t n = 1;
+	for (uint32_t d = 1; d < h->ndims; d++) {
+		n *= h->shape[d];
+	}
+	return n;
+}
+
+/*
+ * Check a header read from disk
+ * returns 0 if it is a checkpoint this build can read, -1 otherwise
+ */
+int mpi_checkpoint_check_header(const mpi_checkpoint_header *h) {
+	if (memcmp(h->magic, MPI_CKPT_MAGIC, sizeof(MPI_CKPT_MAGIC)) != 0 || h->version != MPI_CKPT_VERSION) {
+		return -1;
+	}
+	if (h->endian_check != MPI_CKPT_ENDIAN_CHECK || h->ndims < 1 || h->ndims > MPI_CKPT_MAX_DIMS) {
+		return -1;
+	}
+	if (mpi_checkpoint_mpi_type(h->dtype) == MPI_DATATYPE_NULL || h->distribution != MPI_CKPT_BLOCK_ROWS) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * File type of one row: plain bytes, or a large type once a row passes INT_MAX bytes (free with MPI_Type_free)
+ */
+void _mpi_checkpoint_row_type(uint64_t row_bytes, MPI_Datatype *row_type) {
+	if (row_bytes <= (uint64_t)MY_MPI_LARGE_COUNT_MAX) {
+		MPI_Type_contiguous((int)row_bytes, MPI_BYTE, row_type);
+		MPI_Type_commit(row_type);
+	} else {
+		my_mpi_type_large((MPI_Count)row_bytes, MPI_BYTE, row_type);
+	}
+}
+
+/*
+ * Collective read (write = 0) or write of rows rows starting at offset, in
+ * calls of at most MPI_CKPT_CHUNK_ROWS rows; every rank makes the same number
+ * of calls, ranks that are done pass a count of 0
+ */
+int _mpi_checkpoint_rows_all(MPI_Comm comm, MPI_File fh, MPI_Offset offset, void *data, long long rows,
+		uint64_t row_bytes, int write) {
+	MPI_Datatype row_type;
+	_mpi_checkpoint_row_type(row_bytes, &row_type);
+
+	const long long chunk = MPI_CKPT_CHUNK_ROWS;
+	long long my_chunks = (rows + chunk - 1) / chunk, chunks;
+	MPI_Allreduce(&my_chunks, &chunks, 1, MPI_LONG_LONG, MPI_MAX, comm);
+	int err = MPI_SUCCESS;
+	for (long long c = 0; c < chunks; c++) {
+		long long done = c * chunk < rows ? c * chunk : rows;
+		int this_count = (int)(rows - done < chunk ? rows - done : chunk);
+		char *buf = (char *)data + (size_t)done * row_bytes;
+		MPI_Offset at = offset + (MPI_Offset)((uint64_t)done * row_bytes);
+		int e = write ? MPI_File_write_at_all(fh, at, buf, this_count, row_type, MPI_STATUS_IGNORE)
+		              : MPI_File_read_at_all(fh, at, buf, this_count, row_type, MPI_STATUS_IGNORE);
+		// keep making the calls after an error, the other ranks are waiting in them
+		if (e != MPI_SUCCESS && err == MPI_SUCCESS) {
+			err = e;
+		}
+	}
+	MPI_Type_free(&row_type);
+	return err;
+}
+
+/*
+ * Write a block-distributed array to one file (collective)
+ *
+ * comm: MPI communicator
+ * filename: checkpoint file (overwritten)
+ * dtype: MPI_CKPT_* element type
+ * ndims: number of dimensions (1..MPI_CKPT_MAX_DIMS)
+ * shape: global shape, shape[0] is the distributed dimension
+ * local_rows: number of rows (along shape[0]) held by this rank
+ * local_data: this rank's rows, row-major and contiguous
+ * returns MPI_SUCCESS, MPI_ERR_ARG if the local rows do not add up to shape[0], or the MPI-IO error
+ */
+int mpi_checkpoint_write(MPI_Comm comm, const char *filename, uint32_t dtype, int ndims, const uint64_t *shape,
+		long long local_rows, const void *local_data) {
+	int rank, size;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &size);
+
+	mpi_checkpoint_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, MPI_CKPT_MAGIC, sizeof(MPI_CKPT_MAGIC));
+	h.version = MPI_CKPT_VERSION;
+	h.endian_check = MPI_CKPT_ENDIAN_CHECK;
+	h.dtype = dtype;
+	h.ndims = (uint32_t)ndims;
+	h.distribution = MPI_CKPT_BLOCK_ROWS;
+	for (int d = 0; d < ndims && d < MPI_CKPT_MAX_DIMS; d++) {
+		h.shape[d] = shape[d];
+	}
+	h.nprocs = (uint32_t)size;
+	h.data_offset = MPI_CKPT_DATA_OFFSET;
+
+	MPI_Datatype elem_type = mpi_checkpoint_mpi_type(dtype);
+	if (elem_type == MPI_DATATYPE_NULL || ndims < 1 || ndims > MPI_CKPT_MAX_DIMS) {
+		return MPI_ERR_ARG;
+	}
+	int elem_size;
+	MPI_Type_size(elem_type, &elem_size);
+	h.elem_size = (uint32_t)elem_size;
+	uint64_t row_bytes = mpi_checkpoint_row_elems(&h) * (uint64_t)elem_size;
+	h.data_bytes = h.shape[0] * row_bytes;
+
+	// where my rows start, and a sanity check that the blocks cover the array exactly
+	long long first_row = 0, total_rows = 0;
+	MPI_Exscan(&local_rows, &first_row, 1, MPI_LONG_LONG, MPI_SUM, comm);
+	if (rank == 0) {
+		first_row = 0;
+	}
+	MPI_Allreduce(&local_rows, &total_rows, 1, MPI_LONG_LONG, MPI_SUM, comm);
+	if ((uint64_t)total_rows != h.shape[0]) {
+		return MPI_ERR_ARG;
+	}
+
+	MPI_File fh;
+	int err = MPI_File_open(comm, filename, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &fh);
+	if (err != MPI_SUCCESS) {
+		return err;
+	}
+	MPI_File_set_size(fh, 0);
+
+	if (rank == 0) {
+		err = MPI_File_write_at(fh, 0, &h, (int)sizeof(h), MPI_BYTE, MPI_STATUS_IGNORE);
+	}
+
+	// one row is one element of the file type, so counts stay small for big arrays
+	MPI_Offset offset = (MPI_Offset)(h.data_offset + (uint64_t)first_row * row_bytes);
+	int write_err = _mpi_checkpoint_rows_all(comm, fh, offset, (void *)local_data, local_rows, row_bytes, 1);
+
+	int close_err = MPI_File_close(&fh);
+
+	// rank 0's header write is the only non-collective step, share its outcome
+	MPI_Bcast(&err, 1, MPI_INT, 0, comm);
+	if (err != MPI_SUCCESS) return err;
+	if (write_err != MPI_SUCCESS) return write_err;
+	return close_err;
+}
+
+/*
+ * Read a checkpoint back onto the ranks of comm (collective), any number of ranks
+ *
+ * The rows are split into near-equal contiguous blocks by mpi_block_range.
+ *
+ * comm: MPI communicator
+ * filename: checkpoint file
+ * header: set to the file's header
+ * local_data: set to a malloc'd buffer with this rank's rows (free it after use)
+ * local_rows: set to the number of rows on this rank
+ * first_row: set to the global index of this rank's first row (can be NULL)
+ * returns MPI_SUCCESS, MPI_ERR_FILE for a file that is not a checkpoint or is shorter than its header says, or the MPI-IO error
+ */
+int mpi_checkpoint_read(MPI_Comm comm, const char *filename, mpi_checkpoint_header *header,
+		void **local_data, long long *local_rows, long long *first_row) {
+	int rank, size;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &size);
+	*local_data = NULL;
+	*local_rows = 0;
+
+	MPI_File fh;
+	int err = MPI_File_open(comm, filename, MPI_MODE_RDONLY, MPI_INFO_NULL, &fh);
+	if (err != MPI_SUCCESS) {
+		return err;
+	}
+
+	// one small read on rank 0 instead of p ranks hitting the metadata at once
+	if (rank == 0) {
+		err = MPI_File_read_at(fh, 0, header, (int)sizeof(*header), MPI_BYTE, MPI_STATUS_IGNORE);
+		if (err == MPI_SUCCESS && mpi_checkpoint_check_header(header) != 0) {
+			err = MPI_ERR_FILE;
+		}
+		// the array has to be exactly what the header promises, and all of it in the file
+		MPI_Offset file_size;
+		if (err == MPI_SUCCESS && MPI_File_get_size(fh, &file_size) != MPI_SUCCESS) {
+			err = MPI_ERR_FILE;
+		}
+		if (err == MPI_SUCCESS) {
+			uint64_t row_bytes = mpi_checkpoint_row_elems(header) * header->elem_size;
+			int elem_size;
+			MPI_Type_size(mpi_checkpoint_mpi_type(header->dtype), &elem_size);
+			if ((uint32_t)elem_size != header->elem_size || header->data_bytes != header->shape[0] * row_bytes ||
+					header->data_offset + header->data_bytes > (uint64_t)file_size) {
+				err = MPI_ERR_FILE;
+			}
+		}
+	}
+	MPI_Bcast(&err, 1, MPI_INT, 0, comm);
+	if (err != MPI_SUCCESS) {
+		MPI_File_close(&fh);
+		return err;
+	}
+	MPI_Bcast(header, (int)sizeof(*header), MPI_BYTE, 0, comm);
+
+	long long start, count;
+	mpi_block_range((long long)header->shape[0], rank, size, &start, &count);
+	uint64_t row_bytes = mpi_checkpoint_row_elems(header) * header->elem_size;
+
+	*local_data = malloc(count > 0 ? count * row_bytes : 1);
+	*local_rows = count;
+	if (first_row != NULL) {
+		*first_row = start;
+	}
+
+	MPI_Offset offset = (MPI_Offset)(header->data_offset + (uint64_t)start * row_bytes);
+	err = _mpi_checkpoint_rows_all(comm, fh, offset, *local_data, count, row_bytes, 0);
+
+	int close_err = MPI_File_close(&fh);
+	return (err != MPI_SUCCESS) ? err : close_err;
+}
+
+/*
+ * Map a whole checkpoint into memory for serial use (no MPI needed)
+ *
+ * filename: checkpoint file
+ * header: set to the file's header
+ * data: set to the first element of the global array
+ * map_len: set to the length of the mapping
+ * returns the mapping to pass to mpi_checkpoint_unmap, or NULL on error
+ */
+void *mpi_checkpoint_mmap(const char *filename, mpi_checkpoint_header *header, const void **data, size_t *map_len) {
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(*header)) {
+		close(fd);
+		return NULL;
+	}
+
+	void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd); // the mapping keeps the file alive
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+
+	memcpy(header, map, sizeof(*header));
+	if (mpi_checkpoint_check_header(header) != 0 || header->data_offset + header->data_bytes > (uint64_t)st.st_size) {
+		munmap(map, (size_t)st.st_size);
+		return NULL;
+	}
+	*data = (const char *)map + header->data_offset;
+	*map_len = (size_t)st.st_size;
+	return map;
+}
+
+void mpi_checkpoint_unmap(void *map, size_t map_len) {
+	munmap(map, map_len);
+}
+
+#endif
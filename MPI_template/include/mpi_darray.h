@@ -0,0 +1,302 @@
+#ifndef MPI_DARRAY_H
+#define MPI_DARRAY_H
+
+#include "mpi_helper.h"
+#include "mpi_io.h"
+
+/*
+ * Distributed 1D arrays: one place for the start/end ranges, local buffers and
+ * index arithmetic every week program used to redo by hand.
+ *
+ * An mpi_darray records the global length, the distribution and this rank's
+ * part of the array. Two distributions are supported:
+ *
+ *   MPI_DARRAY_BLOCK   contiguous blocks in rank order, the first n % p ranks
+ *                      one element larger (same split as mpi_block_range)
+ *   MPI_DARRAY_CYCLIC  element g lives on rank g % p at local index g / p
+ *
+ * Block arrays can have 'ghost' extra elements on each side that hold copies of
+ * the neighbouring ranks' edge elements after mpi_darray_exchange_ghosts.
+ *
+ * Local storage is allocated once, cache line aligned, and zeroed by the owning
+ * rank right away, so with first-touch page placement it lands on the memory
+ * of the NUMA node the rank runs on rather than wherever it is first read.
+ */
+
+#define MPI_DARRAY_ALIGN 64
+
+enum {
+	MPI_DARRAY_BLOCK = 0,
+	MPI_DARRAY_CYCLIC,
+};
+
+typedef struct {
+	MPI_Comm comm;
+	int rank, size;
+	long long global_count;  // elements in the whole array
+	int distribution;        // MPI_DARRAY_BLOCK or MPI_DARRAY_CYCLIC
+	MPI_Datatype etype;      // element type (a basic or contiguous type)
+	int elem_size;           // bytes per element
+	long long first;         // global index of my first element (block only)
+	long long count;         // my elements, not counting ghosts
+	int ghost;               // ghost elements on each side (block only)
+	void *storage;           // aligned allocation, ghosts included
+	void *data;              // my first element (storage + ghost elements)
+} mpi_darray;
+
+/*
+ * Number of elements of an array of n elements that rank owns
+ */
+long long _mpi_darray_count(int distribution, long long n, int rank, int size) {
+	if (distribution == MPI_DARRAY_CYCLIC) {
+		return n / size + (rank < n % size ? 1 : 0);
+	}
+	long long start, count;
+	mpi_block_range(n, rank, size, &start, &count);
+	return count;
+}
+
+/*
+ * Create a distributed array of global_count elements over comm (collective only in that every rank must call it)
+ *
+ * a: array to fill in, free with mpi_darray_free
+ * comm: MPI communicator
+ * global_count: elements in the whole array
+ * etype: element type
+ * distribution: MPI_DARRAY_BLOCK or MPI_DARRAY_CYCLIC
+ * ghost: ghost elements on each side (0 for none, block distribution only)
+ * returns MPI_SUCCESS, MPI_ERR_ARG for ghosts on a cyclic array or MPI_ERR_NO_MEM
+ */
+int mpi_darray_create(mpi_darray *a, MPI_Comm comm, long long global_count, MPI_Datatype etype, int distribution, int ghost) {
+	memset(a, 0, sizeof(*a));
+	if (ghost < 0 || (ghost > 0 && distribution != MPI_DARRAY_BLOCK)) {
+		return MPI_ERR_ARG;
+	}
+	a->comm = comm;
+	MPI_Comm_rank(comm, &a->rank);
+	MPI_Comm_size(comm, &a->size);
+	a->global_count = global_count;
+	a->distribution = distribution;
+	a->etype = etype;
+	MPI_Type_size(etype, &a->elem_size);
+	a->ghost = ghost;
+
+	if (distribution == MPI_DARRAY_BLOCK) {
+		mpi_block_range(global_count, a->rank, a->size, &a->first, &a->count);
+	} else {
+		a->first = a->rank;
+		a->count = _mpi_darray_count(distribution, global_count, a->rank, a->size);
+	}
+
+	size_t bytes = (size_t)(a->count + 2 * ghost) * a->elem_size;
+	bytes = (bytes + MPI_DARRAY_ALIGN - 1) / MPI_DARRAY_ALIGN * MPI_DARRAY_ALIGN;
+	if (posix_memalign(&a->storage, MPI_DARRAY_ALIGN, bytes > 0 ? bytes : MPI_DARRAY_ALIGN) != 0) {
+		a->storage = NULL;
+		return MPI_ERR_NO_MEM;
+	}
+	memset(a->storage, 0, bytes); // first touch by the owning rank
+	a->data = (char *)a->storage + (size_t)ghost * a->elem_size;
+	return MPI_SUCCESS;
+}
+
+void mpi_darray_free(mpi_darray *a) {
+	free(a->storage);
+	a->storage = NULL;
+	a->data = NULL;
+}
+
+/*
+ * Element i of my part (negative i / i >= count reach into the ghosts)
+ */
+#define mpi_darray_at(a, type, i) (((type *)(a)->data)[i])
+
+/*
+ * Rank that owns global element g
+ */
+int mpi_darray_owner(const mpi_darray *a, long long g) {
+	if (a->distribution == MPI_DARRAY_CYCLIC) {
+		return (int)(g % a->size);
+	}
+	long long per_rank = a->global_count / a->size, remainder = a->global_count % a->size;
+	long long big = remainder * (per_rank + 1); // elements held by the ranks with an extra one
+	return (g < big) ? (int)(g / (per_rank + 1)) : (int)(remainder + (g - big) / per_rank);
+}
+
+/*
+ * Local index of global element g, or -1 if another rank owns it
+ */
+long long mpi_darray_local_index(const mpi_darray *a, long long g) {
+	if (a->distribution == MPI_DARRAY_CYCLIC) {
+		return (g % a->size == a->rank) ? g / a->size : -1;
+	}
+	return (g >= a->first && g < a->first + a->count) ? g - a->first : -1;
+}
+
+/*
+ * Global index of my local element i
+ */
+long long mpi_darray_global_index(const mpi_darray *a, long long i) {
+	if (a->distribution == MPI_DARRAY_CYCLIC) {
+		return i * a->size + a->rank;
+	}
+	return a->first + i;
+}
+
+/*
+ * Loop over my elements: i is the local index, g the global one
+ * Usage:
+ *   mpi_darray_for_each_local(&a, i, g) {
+ *       mpi_darray_at(&a, double, i) = f(g);
+ *   }
+ */
+#define mpi_darray_for_each_local(a, i, g) \
+	for (long long i = 0, g = mpi_darray_global_index((a), 0); i < (a)->count; i++, g = mpi_darray_global_index((a), i))
+
+/*
+ * Counts and displacements (in elements of the global array) of every rank's part, as laid out on the root
+ * For a cyclic array the root's copy is packed in rank order.
+ */
+void _mpi_darray_layout(const mpi_darray *a, int *counts, int *displs) {
+	long long offset = 0;
+	for (int r = 0; r < a->size; r++) {
+		counts[r] = (int)_mpi_darray_count(a->distribution, a->global_count, r, a->size);
+		displs[r] = (int)offset;
+		offset += counts[r];
+	}
+}
+
+/*
+ * Copy between the natural global order and rank order (cyclic arrays only)
+ * to_ranks: 1 to pack global into rank order, 0 to unpack
+ */
+void _mpi_darray_cyclic_pack(const mpi_darray *a, char *global, char *packed, const int *displs, int to_ranks) {
+	for (long long g = 0; g < a->global_count; g++) {
+		char *slot = packed + ((size_t)displs[g % a->size] + g / a->size) * a->elem_size;
+		char *elem = global + (size_t)g * a->elem_size;
+		if (to_ranks) {
+			memcpy(slot, elem, a->elem_size);
+		} else {
+			memcpy(elem, slot, a->elem_size);
+		}
+	}
+}
+
+/*
+ * Distribute a whole array held on root (collective)
+ *
+ * global: global_count elements in global order, only significant on root
+ */
+void mpi_darray_scatter(mpi_darray *a, const void *global, int root) {
+	int *counts = (int *)malloc(2 * (size_t)a->size * sizeof(int)), *displs = counts + a->size;
+	_mpi_darray_layout(a, counts, displs);
+
+	const void *send = global;
+	char *packed = NULL;
+	if (a->rank == root && a->distribution == MPI_DARRAY_CYCLIC) {
+		packed = (char *)malloc((size_t)a->global_count * a->elem_size + 1);
+		_mpi_darray_cyclic_pack(a, (char *)global, packed, displs, 1);
+		send = packed;
+	}
+	MPI_Scatterv(send, counts, displs, a->etype, a->data, (int)a->count, a->etype, root, a->comm);
+
+	free(packed);
+	free(counts);
+}
+
+/*
+ * Collect the whole array on root (collective)
+ *
+ * global: receives global_count elements in global order, only significant on root
+ */
+void mpi_darray_gather(const mpi_darray *a, void *global, int root) {
+	int *counts = (int *)malloc(2 * (size_t)a->size * sizeof(int)), *displs = counts + a->size;
+	_mpi_darray_layout(a, counts, displs);
+
+	void *recv = global;
+	char *packed = NULL;
+	if (a->rank == root && a->distribution == MPI_DARRAY_CYCLIC) {
+		packed = (char *)malloc((size_t)a->global_count * a->elem_size + 1);
+		recv = packed;
+	}
+	MPI_Gatherv(a->data, (int)a->count, a->etype, recv, counts, displs, a->etype, root, a->comm);
+	if (packed != NULL) {
+		_mpi_darray_cyclic_pack(a, (char *)global, packed, displs, 0);
+		free(packed);
+	}
+	free(counts);
+}
+
+/*
+ * Copy a into a new array out with another distribution and/or ghost width (collective)
+ *
+ * Both layouts are known everywhere, so only the elements move: each rank sends
+ * its elements in global order and the receiver walks its new elements in
+ * global order taking each from the stream of its old owner. No indices are sent.
+ *
+ * returns the result of mpi_darray_create for out
+ */
+int mpi_darray_redistribute(const mpi_darray *a, int distribution, int ghost, mpi_darray *out) {
+	int err = mpi_darray_create(out, a->comm, a->global_count, a->etype, distribution, ghost);
+	if (err != MPI_SUCCESS) {
+		return err;
+	}
+	int size = a->size;
+	size_t elem = (size_t)a->elem_size;
+	int *buf = (int *)calloc(4 * (size_t)size, sizeof(int));
+	int *send_counts = buf, *send_displs = buf + size, *recv_counts = buf + 2 * size, *recv_displs = buf + 3 * size;
+
+	for (long long i = 0; i < a->count; i++) {
+		send_counts[mpi_darray_owner(out, mpi_darray_global_index(a, i))]++;
+	}
+	for (long long i = 0; i < out->count; i++) {
+		recv_counts[mpi_darray_owner(a, mpi_darray_global_index(out, i))]++;
+	}
+	for (int r = 1; r < size; r++) {
+		send_displs[r] = send_displs[r - 1] + send_counts[r - 1];
+		recv_displs[r] = recv_displs[r - 1] + recv_counts[r - 1];
+	}
+
+	char *send = (char *)malloc((size_t)a->count * elem + 1);
+	char *recv = (char *)malloc((size_t)out->count * elem + 1);
+	int *next = (int *)malloc((size_t)size * sizeof(int));
+	memcpy(next, send_displs, (size_t)size * sizeof(int));
+	for (long long i = 0; i < a->count; i++) {
+		int dst = mpi_darray_owner(out, mpi_darray_global_index(a, i));
+		memcpy(send + (size_t)next[dst]++ * elem, (char *)a->data + (size_t)i * elem, elem);
+	}
+
+	MPI_Alltoallv(send, send_counts, send_displs, a->etype, recv, recv_counts, recv_displs, a->etype, a->comm);
+
+	memcpy(next, recv_displs, (size_t)size * sizeof(int));
+	for (long long i = 0; i < out->count; i++) {
+		int src = mpi_darray_owner(a, mpi_darray_global_index(out, i));
+		memcpy((char *)out->data + (size_t)i * elem, recv + (size_t)next[src]++ * elem, elem);
+	}
+
+	free(next);
+	free(recv);
+	free(send);
+	free(buf);
+	return MPI_SUCCESS;
+}
+
+/*
+ * Fill the ghost elements with the edge elements of rank - 1 and rank + 1 (collective)
+ * Ghosts past either end of the global array are left alone. Every rank needs at least 'ghost' elements.
+ */
+void mpi_darray_exchange_ghosts(mpi_darray *a) {
+	if (a->ghost == 0) {
+		return;
+	}
+	int lo = (a->rank > 0) ? a->rank - 1 : MPI_PROC_NULL;
+	int hi = (a->rank < a->size - 1) ? a->rank + 1 : MPI_PROC_NULL;
+	char *data = (char *)a->data;
+	size_t g = (size_t)a->ghost * a->elem_size;
+	size_t n = (size_t)a->count * a->elem_size;
+
+	// my first elements go down into hi ghosts of rank - 1, my last ones up into lo ghosts of rank + 1
+	MPI_Sendrecv(data, a->ghost, a->etype, lo, 0, data + n, a->ghost, a->etype, hi, 0, a->comm, MPI_STATUS_IGNORE);
+	MPI_Sendrecv(data + n - g, a->ghost, a->etype, hi, 1, data - g, a->ghost, a->etype, lo, 1, a->comm, MPI_STATUS_IGNORE);
+}
+
+#endif
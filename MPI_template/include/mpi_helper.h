@@ -1,9 +1,16 @@
+#ifndef MPI_HELPER_H
+#define MPI_HELPER_H
+
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <mpi.h>
 
+#include "mpi_log.h"
+#include "mpi_pool.h"
+
 /*
  * A custom implementation of broadcast
  *
@@ -67,16 +74,17 @@ int my_mpi_scatter(void *sendbuf, int sendcount, MPI_Datatype sendtype, void *re
     MPI_Comm_size(comm, &size);
 
     if (rank == 0) {
+      // element size in bytes (sizeof(sendtype) would be the size of the handle, not of an element)
+      int typesize;
+      MPI_Type_size(sendtype, &typesize);
       for (int i = 0; i < size; i++) {
         if (i == 0) {
           // rank 0 just copies from sendbuf to recvbuf
-          memcpy(recvbuf, sendbuf, sendcount * sizeof(sendtype));
+          memcpy(recvbuf, sendbuf, (size_t)sendcount * typesize);
           continue;
         }
         // we should send the section that corrosponds to the rank (for example rank 2 gets section 2 of buffer)
-        int typesize;
-        MPI_Type_size(sendtype, &typesize);
-        char *shifted_buffer = (char *)sendbuf + (i * sendcount) * typesize;
+        char *shifted_buffer = (char *)sendbuf + ((size_t)i * sendcount) * typesize;
         MPI_Send(shifted_buffer, sendcount, sendtype, i, 0, comm);
       }
     } else {
@@ -147,6 +155,748 @@ int my_mpi_scatter_collective(void *sendbuf, int sendcount, MPI_Datatype sendtyp
 	return 0;
 }
 
+/*
+ * All-to-all by pairwise exchange: in step s every rank sends to rank + s and
+ * receives from rank - s, so each step is a perfect matching and no rank is
+ * flooded. p - 1 steps, best for large blocks.
+ *
+ * sendbuf: size blocks of sendcount elements, block i goes to rank i
+ * sendcount: number of elements sent to each process
+ * sendtype: MPI datatype of the elements in the send buffer
+ * recvbuf: size blocks of recvcount elements, block i comes from rank i
+ * recvcount: number of elements received from each process
+ * recvtype: MPI datatype of the elements in the receive buffer
+ * comm: MPI communicator
+ */
+int my_mpi_alltoall_pairwise(void *sendbuf, int sendcount, MPI_Datatype sendtype, void *recvbuf, int recvcount, MPI_Datatype recvtype, MPI_Comm comm) {
+	int rank, size;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &size);
+
+	MPI_Aint lb, send_extent, recv_extent;
+	MPI_Type_get_extent(sendtype, &lb, &send_extent);
+	MPI_Type_get_extent(recvtype, &lb, &recv_extent);
+
+	// step 0 is the copy to myself
+	for (int s = 0; s < size; s++) {
+		int dst = (rank + s) % size;
+		int src = (rank - s + size) % size;
+		MPI_Sendrecv((char *)sendbuf + (MPI_Aint)dst * sendcount * send_extent, sendcount, sendtype, dst, 0,
+					 (char *)recvbuf + (MPI_Aint)src * recvcount * recv_extent, recvcount, recvtype, src, 0,
+					 comm, MPI_STATUS_IGNORE);
+	}
+	return 0;
+}
+
+/*
+ * All-to-all with the Bruck algorithm: ceil(log2 p) steps, in step k every
+ * block whose (rotated) index has bit k set moves k ranks further. Blocks are
+ * sent more than once, so this only wins for small blocks where latency
+ * dominates. Same arguments as my_mpi_alltoall_pairwise, but the datatypes
+ * must be contiguous and have the same size (blocks are moved as bytes).
+ */
+int my_mpi_alltoall_bruck(void *sendbuf, int sendcount, MPI_Datatype sendtype, void *recvbuf, int recvcount, MPI_Datatype recvtype, MPI_Comm comm) {
+	int rank, size;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &size);
+	(void)recvcount;
+	(void)recvtype;
+
+	int typesize;
+	MPI_Type_size(sendtype, &typesize);
+	size_t block = (size_t)sendcount * typesize;
+
+	// rotate so that my own block is first: tmp block i is for rank + i
+	char *tmp = (char *)mpi_pool_alloc(block * size);
+	char *packed = (char *)mpi_pool_alloc(block * ((size + 1) / 2));
+	char *incoming = (char *)mpi_pool_alloc(block * ((size + 1) / 2));
+	for (int i = 0; i < size; i++) {
+		memcpy(tmp + block * i, (char *)sendbuf + block * ((rank + i) % size), block);
+	}
+
+	for (int k = 1; k < size; k <<= 1) {
+		int n = 0;
+		for (int i = 0; i < size; i++) {
+			if (i & k) {
+				memcpy(packed + block * n++, tmp + block * i, block);
+			}
+		}
+		MPI_Sendrecv(packed, (int)(block * n), MPI_BYTE, (rank + k) % size, 0,
+					 incoming, (int)(block * n), MPI_BYTE, (rank - k + size) % size, 0,
+					 comm, MPI_STATUS_IGNORE);
+		n = 0;
+		for (int i = 0; i < size; i++) {
+			if (i & k) {
+				memcpy(tmp + block * i, incoming + block * n++, block);
+			}
+		}
+	}
+
+	// tmp block i now came from rank - i
+	for (int i = 0; i < size; i++) {
+		memcpy((char *)recvbuf + block * ((rank - i + size) % size), tmp + block * i, block);
+	}
+
+	mpi_pool_free(incoming);
+	mpi_pool_free(packed);
+	mpi_pool_free(tmp);
+	return 0;
+}
+
+/*
+ * Blocks up to this many bytes use the Bruck algorithm in my_mpi_alltoall
+ */
+#ifndef MY_MPI_ALLTOALL_BRUCK_MAX
+#define MY_MPI_ALLTOALL_BRUCK_MAX 256
+#endif
+
+/*
+ * A custom implementation of alltoall, picks Bruck for small blocks and pairwise exchange otherwise
+ * Same arguments as my_mpi_alltoall_pairwise.
+ */
+int my_mpi_alltoall(void *sendbuf, int sendcount, MPI_Datatype sendtype, void *recvbuf, int recvcount, MPI_Datatype recvtype, MPI_Comm comm) {
+	int typesize;
+	MPI_Type_size(sendtype, &typesize);
+
+	// Bruck moves raw bytes, so it is only used when both sides are the same contiguous layout
+	MPI_Aint lb, extent;
+	MPI_Type_get_extent(sendtype, &lb, &extent);
+	int contiguous = (sendtype == recvtype && sendcount == recvcount && extent == typesize && lb == 0);
+
+	if (contiguous && (long long)sendcount * typesize <= MY_MPI_ALLTOALL_BRUCK_MAX) {
+		return my_mpi_alltoall_bruck(sendbuf, sendcount, sendtype, recvbuf, recvcount, recvtype, comm);
+	}
+	return my_mpi_alltoall_pairwise(sendbuf, sendcount, sendtype, recvbuf, recvcount, recvtype, comm);
+}
+
+/*
+ * Large counts: the _c variants take MPI_Count element counts (more than
+ * INT_MAX elements, or buffers beyond 2 GiB of a small type).
+ *
+ * With an MPI-4 library the point-to-point steps use the large-count bindings
+ * (MPI_Send_c, MPI_Bcast_c, ...). Otherwise a count above INT_MAX becomes one
+ * element of a derived type (whole chunks of MY_MPI_LARGE_CHUNK elements plus a
+ * remainder block), so every transfer is still a single message with no
+ * staging copies. Counts that fit in an int take the usual path.
+ */
+#ifndef MY_MPI_LARGE_CHUNK
+#define MY_MPI_LARGE_CHUNK (1 << 30)     // elements per chunk of the large derived type
+#endif
+#ifndef MY_MPI_LARGE_COUNT_MAX
+#define MY_MPI_LARGE_COUNT_MAX INT_MAX   // largest count passed as a plain int
+#endif
+
+#if MPI_VERSION >= 4
+#define MY_MPI_HAS_LARGE_COUNT 1
+#else
+#define MY_MPI_HAS_LARGE_COUNT 0
+#endif
+
+/*
+ * Committed datatype covering count elements of datatype, for a count too large for an int
+ *
+ * large: set to the new type (free with MPI_Type_free); its extent is count extents of datatype
+ */
+int my_mpi_type_large(MPI_Count count, MPI_Datatype datatype, MPI_Datatype *large) {
+	MPI_Count chunks = count / MY_MPI_LARGE_CHUNK, rest = count % MY_MPI_LARGE_CHUNK;
+	MPI_Aint lb, extent;
+	MPI_Type_get_extent(datatype, &lb, &extent);
+
+	MPI_Datatype chunk, blocks;
+	MPI_Type_contiguous(MY_MPI_LARGE_CHUNK, datatype, &chunk);
+	MPI_Type_contiguous((int)chunks, chunk, &blocks);
+	MPI_Type_free(&chunk);
+	if (rest == 0) {
+		*large = blocks;
+	} else {
+		MPI_Datatype tail;
+		MPI_Type_contiguous((int)rest, datatype, &tail);
+		int lengths[2] = {1, 1};
+		MPI_Aint displs[2] = {0, (MPI_Aint)(chunks * MY_MPI_LARGE_CHUNK) * extent};
+		MPI_Datatype types[2] = {blocks, tail};
+		MPI_Type_create_struct(2, lengths, displs, types, large);
+		MPI_Type_free(&tail);
+		MPI_Type_free(&blocks);
+	}
+	return MPI_Type_commit(large);
+}
+
+/*
+ * Express count elements of datatype as an int count of some type
+ *
+ * temp: set to the type that was built (MPI_DATATYPE_NULL if none), to be freed by the caller
+ */
+void _my_mpi_large_args(MPI_Count count, MPI_Datatype datatype, int *n, MPI_Datatype *type, MPI_Datatype *temp) {
+	*temp = MPI_DATATYPE_NULL;
+	if (count <= MY_MPI_LARGE_COUNT_MAX) {
+		*n = (int)count;
+		*type = datatype;
+		return;
+	}
+	my_mpi_type_large(count, datatype, temp);
+	*n = 1;
+	*type = *temp;
+}
+
+static inline void _my_mpi_large_free(MPI_Datatype *temp) {
+	if (*temp != MPI_DATATYPE_NULL) {
+		MPI_Type_free(temp);
+	}
+}
+
+int _my_mpi_send_c(const void *buf, MPI_Count count, MPI_Datatype datatype, int dst, int tag, MPI_Comm comm) {
+#if MY_MPI_HAS_LARGE_COUNT
+	return MPI_Send_c(buf, count, datatype, dst, tag, comm);
+#else
+	int n, err;
+	MPI_Datatype type, temp;
+	_my_mpi_large_args(count, datatype, &n, &type, &temp);
+	err = MPI_Send(buf, n, type, dst, tag, comm);
+	_my_mpi_large_free(&temp);
+	return err;
+#endif
+}
+
+int _my_mpi_recv_c(void *buf, MPI_Count count, MPI_Datatype datatype, int src, int tag, MPI_Comm comm) {
+#if MY_MPI_HAS_LARGE_COUNT
+	return MPI_Recv_c(buf, count, datatype, src, tag, comm, MPI_STATUS_IGNORE);
+#else
+	int n, err;
+	MPI_Datatype type, temp;
+	_my_mpi_large_args(count, datatype, &n, &type, &temp);
+	err = MPI_Recv(buf, n, type, src, tag, comm, MPI_STATUS_IGNORE);
+	_my_mpi_large_free(&temp);
+	return err;
+#endif
+}
+
+/*
+ * my_mpi_broadcast with a large count (same arguments otherwise)
+ */
+int my_mpi_broadcast_c(void *buffer, MPI_Count count, MPI_Datatype datatype, int src, int *dsts, MPI_Comm comm) {
+	int rank, size;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &size);
+
+	if (dsts == NULL) {
+		if (rank == src) {
+			for (int i = 0; i < size; i++) {
+				if (i != src) {
+					_my_mpi_send_c(buffer, count, datatype, i, 0, comm);
+				}
+			}
+		} else {
+			_my_mpi_recv_c(buffer, count, datatype, src, 0, comm);
+		}
+		return 0;
+	}
+
+	int is_dst = 0;
+	for (int i = 0; dsts[i] != -1; i++) {
+		if (rank == dsts[i]) {
+			is_dst = 1;
+			break;
+		}
+	}
+	if (rank == src) {
+		for (int i = 0; dsts[i] != -1; i++) {
+			_my_mpi_send_c(buffer, count, datatype, dsts[i], 0, comm);
+		}
+	} else if (is_dst) {
+		_my_mpi_recv_c(buffer, count, datatype, src, 0, comm);
+	}
+	return 0;
+}
+
+/*
+ * my_mpi_scatter with large counts (same arguments otherwise)
+ */
+int my_mpi_scatter_c(void *sendbuf, MPI_Count sendcount, MPI_Datatype sendtype, void *recvbuf, MPI_Count recvcount, MPI_Comm comm) {
+	int rank, size;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &size);
+
+	if (rank == 0) {
+		MPI_Count typesize;
+		MPI_Type_size_x(sendtype, &typesize);
+		size_t block = (size_t)sendcount * (size_t)typesize;
+		memcpy(recvbuf, sendbuf, block);
+		for (int i = 1; i < size; i++) {
+			_my_mpi_send_c((char *)sendbuf + (size_t)i * block, sendcount, sendtype, i, 0, comm);
+		}
+	} else {
+		_my_mpi_recv_c(recvbuf, recvcount, sendtype, 0, 0, comm);
+	}
+	return 0;
+}
+
+/*
+ * my_mpi_broadcast_collective with a large count
+ */
+int my_mpi_broadcast_collective_c(void *buffer, MPI_Count count, MPI_Datatype datatype, int src, int *dsts, MPI_Comm comm) {
+#if MY_MPI_HAS_LARGE_COUNT
+	if (dsts == NULL) {
+		return MPI_Bcast_c(buffer, count, datatype, src, comm);
+	}
+#endif
+	int n;
+	MPI_Datatype type, temp;
+	_my_mpi_large_args(count, datatype, &n, &type, &temp);
+	int err = my_mpi_broadcast_collective(buffer, n, type, src, dsts, comm);
+	_my_mpi_large_free(&temp);
+	return err;
+}
+
+/*
+ * my_mpi_scatter_collective with large counts
+ */
+int my_mpi_scatter_collective_c(void *sendbuf, MPI_Count sendcount, MPI_Datatype sendtype, void *recvbuf, MPI_Count recvcount, MPI_Comm comm) {
+#if MY_MPI_HAS_LARGE_COUNT
+	MPI_Scatter_c(sendbuf, sendcount, sendtype, recvbuf, recvcount, sendtype, 0, comm);
+	return 0;
+#else
+	// the large type's extent is a whole block, so the root's per-rank offsets stay right
+	int send_n, recv_n;
+	MPI_Datatype send_type, recv_type, send_temp, recv_temp;
+	_my_mpi_large_args(sendcount, sendtype, &send_n, &send_type, &send_temp);
+	_my_mpi_large_args(recvcount, sendtype, &recv_n, &recv_type, &recv_temp);
+	MPI_Scatter(sendbuf, send_n, send_type, recvbuf, recv_n, recv_type, 0, comm);
+	_my_mpi_large_free(&recv_temp);
+	_my_mpi_large_free(&send_temp);
+	return 0;
+#endif
+}
+
+/*
+ * my_mpi_alltoall with large blocks (always pairwise, a block this size is far past the Bruck range)
+ */
+int my_mpi_alltoall_c(void *sendbuf, MPI_Count sendcount, MPI_Datatype sendtype, void *recvbuf, MPI_Count recvcount, MPI_Datatype recvtype, MPI_Comm comm) {
+	if (sendcount <= MY_MPI_LARGE_COUNT_MAX && recvcount <= MY_MPI_LARGE_COUNT_MAX) {
+		return my_mpi_alltoall(sendbuf, (int)sendcount, sendtype, recvbuf, (int)recvcount, recvtype, comm);
+	}
+	int send_n, recv_n;
+	MPI_Datatype send_type, recv_type, send_temp, recv_temp;
+	_my_mpi_large_args(sendcount, sendtype, &send_n, &send_type, &send_temp);
+	_my_mpi_large_args(recvcount, recvtype, &recv_n, &recv_type, &recv_temp);
+	int err = my_mpi_alltoall_pairwise(sendbuf, send_n, send_type, recvbuf, recv_n, recv_type, comm);
+	_my_mpi_large_free(&recv_temp);
+	_my_mpi_large_free(&send_temp);
+	return err;
+}
+
+/*
+ * A custom implementation of alltoallv (pairwise exchange)
+ *
+ * sendcounts/sdispls: elements and offset (in elements of sendtype) of the block for each rank
+ * recvcounts/rdispls: elements and offset (in elements of recvtype) of the block from each rank
+ * the other arguments are as for my_mpi_alltoall_pairwise
+ */
+int my_mpi_alltoallv(void *sendbuf, const int *sendcounts, const int *sdispls, MPI_Datatype sendtype,
+		void *recvbuf, const int *recvcounts, const int *rdispls, MPI_Datatype recvtype, MPI_Comm comm) {
+	int rank, size;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &size);
+
+	MPI_Aint lb, send_extent, recv_extent;
+	MPI_Type_get_extent(sendtype, &lb, &send_extent);
+	MPI_Type_get_extent(recvtype, &lb, &recv_extent);
+
+	for (int s = 0; s < size; s++) {
+		int dst = (rank + s) % size;
+		int src = (rank - s + size) % size;
+		MPI_Sendrecv((char *)sendbuf + sdispls[dst] * send_extent, sendcounts[dst], sendtype, dst, 0,
+					 (char *)recvbuf + rdispls[src] * recv_extent, recvcounts[src], recvtype, src, 0,
+					 comm, MPI_STATUS_IGNORE);
+	}
+	return 0;
+}
+
+/*
+ * Tags of my_mpi_alltoallv_sparse, alternated between calls so a fast rank's
+ * next exchange can never be mistaken for the current one
+ */
+#ifndef MY_MPI_SPARSE_TAG
+#define MY_MPI_SPARSE_TAG 0x5350
+#endif
+
+/*
+ * Sparse dynamic exchange (NBX): every rank sends to a few destinations and
+ * does not know who will send to it. Messages go out with MPI_Issend, which
+ * completes only once matched; the receive loop probes for anything that
+ * arrives, and once all my sends are matched I join an MPI_Ibarrier. When the
+ * barrier completes every message in the system has been received. No O(p)
+ * counts array is exchanged, so the cost follows the number of real messages.
+ *
+ * sendbuf: outgoing data
+ * num_dsts: number of destinations
+ * dsts: destination ranks (each at most once)
+ * sendcounts/sdispls: elements and offset (in elements) of the message for each destination
+ * datatype: MPI datatype of the elements (basic types, counts are taken from the status)
+ * recvbuf: set to a malloc'd buffer with all incoming messages back to back, in source rank order
+ * num_srcs: set to the number of ranks that sent to me
+ * srcs: set to a malloc'd array of those ranks (ascending)
+ * recvcounts: set to a malloc'd array with the elements received from each of them
+ * comm: MPI communicator (must be called by every rank, uses tags MY_MPI_SPARSE_TAG and MY_MPI_SPARSE_TAG + 1)
+ */
+int my_mpi_alltoallv_sparse(void *sendbuf, int num_dsts, const int *dsts, const int *sendcounts, const int *sdispls,
+		MPI_Datatype datatype, void **recvbuf, int *num_srcs, int **srcs, int **recvcounts, MPI_Comm comm) {
+	static int call = 0;
+	int tag = MY_MPI_SPARSE_TAG + (call++ & 1);
+
+	MPI_Aint lb, extent;
+	MPI_Type_get_extent(datatype, &lb, &extent);
+
+	MPI_Request *requests = (MPI_Request *)mpi_pool_alloc((num_dsts > 0 ? num_dsts : 1) * sizeof(MPI_Request));
+	for (int i = 0; i < num_dsts; i++) {
+		MPI_Issend((char *)sendbuf + sdispls[i] * extent, sendcounts[i], datatype, dsts[i], tag, comm, &requests[i]);
+	}
+
+	// messages are kept in arrival order first, then put in source order
+	int capacity = 8, n = 0;
+	int *from = (int *)malloc(capacity * sizeof(int));
+	int *counts = (int *)malloc(capacity * sizeof(int));
+	char **data = (char **)malloc(capacity * sizeof(char *));
+
+	MPI_Request barrier = MPI_REQUEST_NULL;
+	int done = 0;
+	while (!done) {
+		int flag;
+		MPI_Status status;
+		MPI_Iprobe(MPI_ANY_SOURCE, tag, comm, &flag, &status);
+		if (flag) {
+			if (n == capacity) {
+				capacity *= 2;
+				from = (int *)realloc(from, capacity * sizeof(int));
+				counts = (int *)realloc(counts, capacity * sizeof(int));
+				data = (char **)realloc(data, capacity * sizeof(char *));
+			}
+			MPI_Get_count(&status, datatype, &counts[n]);
+			from[n] = status.MPI_SOURCE;
+			data[n] = (char *)mpi_pool_alloc(counts[n] > 0 ? counts[n] * extent : 1);
+			MPI_Recv(data[n], counts[n], datatype, from[n], tag, comm, MPI_STATUS_IGNORE);
+			n++;
+		}
+
+		if (barrier == MPI_REQUEST_NULL) {
+			int sent;
+			MPI_Testall(num_dsts, requests, &sent, MPI_STATUSES_IGNORE);
+			if (sent) {
+				MPI_Ibarrier(comm, &barrier);
+			}
+		} else {
+			MPI_Test(&barrier, &done, MPI_STATUS_IGNORE);
+		}
+	}
+
+	// source order makes the result independent of timing
+	int *order = (int *)mpi_pool_alloc((n > 0 ? n : 1) * sizeof(int));
+	for (int i = 0; i < n; i++) {
+		int j = i;
+		while (j > 0 && from[order[j - 1]] > from[i]) {
+			order[j] = order[j - 1];
+			j--;
+		}
+		order[j] = i;
+	}
+
+	size_t total = 0;
+	for (int i = 0; i < n; i++) {
+		total += (size_t)counts[i] * extent;
+	}
+	*recvbuf = malloc(total > 0 ? total : 1);
+	*srcs = (int *)malloc((n > 0 ? n : 1) * sizeof(int));
+	*recvcounts = (int *)malloc((n > 0 ? n : 1) * sizeof(int));
+	*num_srcs = n;
+	size_t offset = 0;
+	for (int i = 0; i < n; i++) {
+		int m = order[i];
+		memcpy((char *)*recvbuf + offset, data[m], (size_t)counts[m] * extent);
+		offset += (size_t)counts[m] * extent;
+		(*srcs)[i] = from[m];
+		(*recvcounts)[i] = counts[m];
+		mpi_pool_free(data[m]);
+	}
+
+	mpi_pool_free(order);
+	free(data);
+	free(counts);
+	free(from);
+	mpi_pool_free(requests);
+	return 0;
+}
+
+/*
+ * Scan building blocks: combine(left, right) leaves left op right in right, which is
+ * the order MPI_Reduce_local uses, so non-commutative user ops come out right too
+ */
+#define _my_mpi_scan_combine(left, right, count, datatype, op) MPI_Reduce_local((left), (right), (count), (datatype), (op))
+
+size_t _my_mpi_scan_bytes(int count, MPI_Datatype datatype) {
+	MPI_Aint lb, extent;
+	MPI_Type_get_extent(datatype, &lb, &extent);
+	return (size_t)count * extent;
+}
+
+/*
+ * Inclusive (and optionally exclusive) scan with Hillis-Steele recursive doubling:
+ * log2(p) rounds, in round d every rank passes its partial result to rank + d.
+ * Fewest rounds, but every rank sends the whole vector every round.
+ *
+ * inclusive: receives the inclusive result (can be NULL)
+ * exclusive: receives the exclusive result (can be NULL, untouched on rank 0)
+ */
+void _my_mpi_scan_hillis_steele(const void *sendbuf, void *inclusive, void *exclusive, int count, MPI_Datatype datatype, MPI_Op op, MPI_Comm comm) {
+	int rank, size;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &size);
+	size_t bytes = _my_mpi_scan_bytes(count, datatype);
+
+	char *val = (char *)mpi_pool_alloc(bytes + 1), *tmp = (char *)mpi_pool_alloc(bytes + 1);
+	memcpy(val, sendbuf, bytes);
+	int have_exclusive = 0;
+
+	for (int d = 1; d < size; d <<= 1) {
+		int dst = (rank + d < size) ? rank + d : MPI_PROC_NULL;
+		int src = (rank - d >= 0) ? rank - d : MPI_PROC_NULL;
+		MPI_Sendrecv(val, count, datatype, dst, 0, tmp, count, datatype, src, 0, comm, MPI_STATUS_IGNORE);
+		if (src == MPI_PROC_NULL) {
+			continue;
+		}
+		// tmp covers the ranks just before the ones folded in so far
+		if (exclusive != NULL) {
+			if (have_exclusive) {
+				_my_mpi_scan_combine(tmp, exclusive, count, datatype, op);
+			} else {
+				memcpy(exclusive, tmp, bytes);
+				have_exclusive = 1;
+			}
+		}
+		_my_mpi_scan_combine(tmp, val, count, datatype, op);
+	}
+
+	if (inclusive != NULL) {
+		memcpy(inclusive, val, bytes);
+	}
+	mpi_pool_free(tmp);
+	mpi_pool_free(val);
+}
+
+/*
+ * Inclusive scan with an up-sweep / down-sweep over a binary tree of ranks
+ * (Brent-Kung): about 2 log2(p) rounds but only ~2p messages in total, so
+ * every rank sends its vector about twice instead of log2(p) times.
+ * No identity element is needed, so any MPI_Op works.
+ */
+void _my_mpi_scan_sweep(const void *sendbuf, void *inclusive, int count, MPI_Datatype datatype, MPI_Op op, MPI_Comm comm) {
+	int rank, size;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &size);
+	size_t bytes = _my_mpi_scan_bytes(count, datatype);
+
+	char *val = (char *)inclusive, *tmp = (char *)mpi_pool_alloc(bytes + 1);
+	memcpy(val, sendbuf, bytes);
+
+	// up-sweep: the right end of every block of 2d ranks folds in the left half
+	int top = 1;
+	for (int d = 1; d < size; d <<= 1) {
+		if ((rank + 1) % (2 * d) == d && rank + d < size) {
+			MPI_Send(val, count, datatype, rank + d, 0, comm);
+		} else if ((rank + 1) % (2 * d) == 0) {
+			MPI_Recv(tmp, count, datatype, rank - d, 0, comm, MPI_STATUS_IGNORE);
+			_my_mpi_scan_combine(tmp, val, count, datatype, op);
+		}
+		top = d;
+	}
+
+	// down-sweep: ranks holding a complete prefix hand it to the middle of the block to their right
+	for (int d = top / 2 > 0 ? top / 2 : 0; d >= 1; d >>= 1) {
+		if ((rank + 1) % (2 * d) == 0 && rank + d < size) {
+			MPI_Send(val, count, datatype, rank + d, 1, comm);
+		} else if ((rank + 1) % (2 * d) == d && rank >= 2 * d) {
+			MPI_Recv(tmp, count, datatype, rank - d, 1, comm, MPI_STATUS_IGNORE);
+			_my_mpi_scan_combine(tmp, val, count, datatype, op);
+		}
+	}
+	mpi_pool_free(tmp);
+}
+
+/*
+ * Payloads of at least this many bytes use the up-sweep/down-sweep scan
+ */
+#ifndef MY_MPI_SCAN_SWEEP_MIN
+#define MY_MPI_SCAN_SWEEP_MIN 4096
+#endif
+
+/*
+ * A custom implementation of scan (inclusive prefix reduction over ranks)
+ *
+ * sendbuf: count elements contributed by this rank
+ * recvbuf: receives op applied to the sendbufs of ranks 0..rank, element by element
+ * count: number of elements
+ * datatype: MPI datatype of the elements
+ * op: any MPI_Op, including user ops from MPI_Op_create (applied in rank order)
+ * comm: MPI communicator
+ */
+int my_mpi_scan(const void *sendbuf, void *recvbuf, int count, MPI_Datatype datatype, MPI_Op op, MPI_Comm comm) {
+	if (_my_mpi_scan_bytes(count, datatype) >= MY_MPI_SCAN_SWEEP_MIN) {
+		_my_mpi_scan_sweep(sendbuf, recvbuf, count, datatype, op, comm);
+	} else {
+		_my_mpi_scan_hillis_steele(sendbuf, recvbuf, NULL, count, datatype, op, comm);
+	}
+	return 0;
+}
+
+/*
+ * A custom implementation of exscan (op over the sendbufs of ranks 0..rank-1)
+ * Same arguments as my_mpi_scan, recvbuf is left untouched on rank 0.
+ */
+int my_mpi_exscan(const void *sendbuf, void *recvbuf, int count, MPI_Datatype datatype, MPI_Op op, MPI_Comm comm) {
+	if (_my_mpi_scan_bytes(count, datatype) < MY_MPI_SCAN_SWEEP_MIN) {
+		_my_mpi_scan_hillis_steele(sendbuf, NULL, recvbuf, count, datatype, op, comm);
+		return 0;
+	}
+
+	// without an inverse for op, the exclusive result is my left neighbour's inclusive one
+	int rank, size;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &size);
+	char *inclusive = (char *)mpi_pool_alloc(_my_mpi_scan_bytes(count, datatype) + 1);
+	_my_mpi_scan_sweep(sendbuf, inclusive, count, datatype, op, comm);
+	MPI_Sendrecv(inclusive, count, datatype, rank + 1 < size ? rank + 1 : MPI_PROC_NULL, 2,
+				 recvbuf, count, datatype, rank > 0 ? rank - 1 : MPI_PROC_NULL, 2, comm, MPI_STATUS_IGNORE);
+	mpi_pool_free(inclusive);
+	return 0;
+}
+
+/*
+ * Segmented scan: like my_mpi_scan, but a rank with start_segment set begins a
+ * new segment, i.e. it and the ranks after it (up to the next segment start)
+ * only combine values from the segment start onwards. Hillis-Steele on
+ * (flag, value) pairs, so segments cost no extra rounds.
+ *
+ * start_segment: 1 if this rank starts a new segment (rank 0 always does)
+ */
+int my_mpi_scan_segmented(const void *sendbuf, void *recvbuf, int count, MPI_Datatype datatype, MPI_Op op,
+		int start_segment, MPI_Comm comm) {
+	int rank, size;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &size);
+	size_t bytes = _my_mpi_scan_bytes(count, datatype);
+
+	char *val = (char *)recvbuf, *tmp = (char *)mpi_pool_alloc(bytes + 1);
+	memcpy(val, sendbuf, bytes);
+	int flag = start_segment, tmp_flag;
+
+	for (int d = 1; d < size; d <<= 1) {
+		int dst = (rank + d < size) ? rank + d : MPI_PROC_NULL;
+		int src = (rank - d >= 0) ? rank - d : MPI_PROC_NULL;
+		MPI_Sendrecv(&flag, 1, MPI_INT, dst, 3, &tmp_flag, 1, MPI_INT, src, 3, comm, MPI_STATUS_IGNORE);
+		MPI_Sendrecv(val, count, datatype, dst, 4, tmp, count, datatype, src, 4, comm, MPI_STATUS_IGNORE);
+		if (src == MPI_PROC_NULL || flag) {
+			continue; // a segment start below me cuts off everything further left
+		}
+		_my_mpi_scan_combine(tmp, val, count, datatype, op);
+		flag = tmp_flag;
+	}
+	mpi_pool_free(tmp);
+	return 0;
+}
+
+/*
+ * Fused local + global scan of a distributed array: every rank passes its whole
+ * local part and gets back the inclusive prefix over the global array (all
+ * elements of lower ranks, then its own up to that element). Only the local
+ * totals are scanned across ranks, so the communication is one element per
+ * round however long the arrays are.
+ *
+ * sendbuf: n local elements
+ * recvbuf: receives the n global prefix values (can be the same as sendbuf)
+ * n: number of local elements (can differ between ranks, can be 0)
+ * datatype: MPI datatype of one element
+ * op: any MPI_Op (MPI_SUM on int, long long and double has a fast path)
+ * comm: MPI communicator
+ */
+int my_mpi_scan_array(const void *sendbuf, void *recvbuf, long long n, MPI_Datatype datatype, MPI_Op op, MPI_Comm comm) {
+	int rank;
+	MPI_Comm_rank(comm, &rank);
+	size_t elem = _my_mpi_scan_bytes(1, datatype);
+	const char *in = (const char *)sendbuf;
+	char *out = (char *)recvbuf;
+
+	// local inclusive scan
+	if (n > 0 && out != in) {
+		memcpy(out, in, elem);
+	}
+	if (op == MPI_SUM && datatype == MPI_INT) {
+		for (long long i = 1; i < n; i++) ((int *)out)[i] = ((int *)out)[i - 1] + ((const int *)in)[i];
+	} else if (op == MPI_SUM && datatype == MPI_LONG_LONG) {
+		for (long long i = 1; i < n; i++) ((long long *)out)[i] = ((long long *)out)[i - 1] + ((const long long *)in)[i];
+	} else if (op == MPI_SUM && datatype == MPI_DOUBLE) {
+		for (long long i = 1; i < n; i++) ((double *)out)[i] = ((double *)out)[i - 1] + ((const double *)in)[i];
+	} else {
+		for (long long i = 1; i < n; i++) {
+			if (out != in) {
+				memcpy(out + i * elem, in + i * elem, elem);
+			}
+			_my_mpi_scan_combine(out + (i - 1) * elem, out + i * elem, 1, datatype, op);
+		}
+	}
+
+	// exclusive scan of the local totals; empty ranks are skipped rather than
+	// contributing a zero, so ops without an identity (max, user ops) work too
+	int size;
+	MPI_Comm_size(comm, &size);
+	char *carry = (char *)mpi_pool_alloc(elem), *offset = (char *)mpi_pool_alloc(elem), *tmp = (char *)mpi_pool_alloc(elem);
+	if (n > 0) {
+		memcpy(carry, out + (n - 1) * elem, elem);
+	}
+	int valid = (n > 0), tmp_valid, offset_valid = 0;
+	for (int d = 1; d < size; d <<= 1) {
+		int dst = (rank + d < size) ? rank + d : MPI_PROC_NULL;
+		int src = (rank - d >= 0) ? rank - d : MPI_PROC_NULL;
+		MPI_Sendrecv(&valid, 1, MPI_INT, dst, 5, &tmp_valid, 1, MPI_INT, src, 5, comm, MPI_STATUS_IGNORE);
+		MPI_Sendrecv(carry, 1, datatype, dst, 6, tmp, 1, datatype, src, 6, comm, MPI_STATUS_IGNORE);
+		if (src == MPI_PROC_NULL || !tmp_valid) {
+			continue;
+		}
+		if (offset_valid) {
+			_my_mpi_scan_combine(tmp, offset, 1, datatype, op);
+		} else {
+			memcpy(offset, tmp, elem);
+			offset_valid = 1;
+		}
+		if (valid) {
+			_my_mpi_scan_combine(tmp, carry, 1, datatype, op);
+		} else {
+			memcpy(carry, tmp, elem);
+			valid = 1;
+		}
+	}
+
+	// fold the offset into every local element
+	if (offset_valid) {
+		if (op == MPI_SUM && datatype == MPI_INT) {
+			int o = *(int *)offset;
+			for (long long i = 0; i < n; i++) ((int *)out)[i] += o;
+		} else if (op == MPI_SUM && datatype == MPI_LONG_LONG) {
+			long long o = *(long long *)offset;
+			for (long long i = 0; i < n; i++) ((long long *)out)[i] += o;
+		} else if (op == MPI_SUM && datatype == MPI_DOUBLE) {
+			double o = *(double *)offset;
+			for (long long i = 0; i < n; i++) ((double *)out)[i] += o;
+		} else {
+			for (long long i = 0; i < n; i++) {
+				_my_mpi_scan_combine(offset, out + i * elem, 1, datatype, op);
+			}
+		}
+	}
+
+	mpi_pool_free(tmp);
+	mpi_pool_free(offset);
+	mpi_pool_free(carry);
+	return 0;
+}
+
 /*
  * Function to get string prefix for the current MPI rank (for printing)
  */
@@ -165,11 +915,13 @@ int my_mpi_scatter_collective(void *sendbuf, int sendcount, MPI_Datatype sendtyp
 #define mpi_print_int_array(x, size) { \
 	mpi_printf("Array: "); \
 	for (int i = 0; i < size; i++) { \
-		printf("%d ", x[i]); \
+		mpi_printf_raw("%d ", x[i]); \
 	} \
-  printf("\n"); \
+  mpi_printf_raw("\n"); \
 } \
 
+#ifdef MPI_HELPER_UNBUFFERED_LOG
+
 /*
  * MPI print to only print with processor 0 (no verbose logging)
  */
@@ -191,6 +943,34 @@ int my_mpi_scatter_collective(void *sendbuf, int sendcount, MPI_Datatype sendtyp
   printf(__VA_ARGS__); \
 }
 
+/*
+ * MPI print without the rank prefix (continues an mpi_printf line)
+ */
+#define mpi_printf_raw(...) printf(__VA_ARGS__)
+
+#else
+
+/*
+ * MPI print to only print with processor 0 (no verbose logging)
+ */
+#define mpi_printf_once(...) { \
+  if (mpi_log_rank() == 0) { \
+    mpi_log_append(0, __VA_ARGS__); \
+  } \
+}
+
+/*
+ * MPI print with all processors (buffered, printed in rank order at the next mpi_log_flush)
+ */
+#define mpi_printf(...) mpi_log_append(1, __VA_ARGS__)
+
+/*
+ * MPI print without the rank prefix (continues an mpi_printf line)
+ */
+#define mpi_printf_raw(...) mpi_log_append(0, __VA_ARGS__)
+
+#endif
+
 /*
  * Macro to time a section of code.
  * Usage:
@@ -216,7 +996,76 @@ int my_mpi_scatter_collective(void *sendbuf, int sendcount, MPI_Datatype sendtyp
       mpi_printf("Time: %f seconds\n", total_time); \
     } \
   } \
+  mpi_log_flush(MPI_COMM_WORLD); \
+}
+
+/*
+ * Macro to time a section of code and sample hardware counters around it.
+ * Same as mpi_time, but each rank also counts cycles, instructions, cache and
+ * branch misses for the timed code only (the barriers are not counted). The
+ * counts are reduced over all ranks and printed under the timing. Falls back
+ * to plain timing when perf counters are not permitted.
+ * Usage:
+ *   mpi_time_perf( number of samples,
+ *       // code to time here
+ *   );
+ */
+#define mpi_time_perf(samples, ...) { \
+  double start_time, end_time; \
+  double total_time = 0.0; \
+  mpi_perf_counters _perf; \
+  mpi_perf_open(&_perf); \
+  for (int i = 0; i < samples; i++) { \
+    MPI_Barrier(MPI_COMM_WORLD); \
+    start_time = MPI_Wtime(); \
+    mpi_perf_start(&_perf); \
+    __VA_ARGS__ \
+    mpi_perf_stop(&_perf); \
+    MPI_Barrier(MPI_COMM_WORLD); \
+    end_time = MPI_Wtime(); \
+    total_time += (end_time - start_time); \
+  } \
+  if (_mpi_rank == 0) { \
+    if (samples > 1) { \
+      mpi_printf("Average time over %d samples: %f seconds\n", samples, total_time / samples); \
+    } else { \
+      mpi_printf("Time: %f seconds\n", total_time); \
+    } \
+  } \
+  mpi_perf_report(&_perf, samples, MPI_COMM_WORLD); \
+  mpi_perf_close(&_perf); \
+  mpi_log_flush(MPI_COMM_WORLD); \
+}
+
+/*
+ * MPI_MAIN start-up and tear-down. -DMPI_HELPER_PROGRESS_THREAD initialises
+ * MPI with MPI_THREAD_MULTIPLE and runs the progress thread of mpi_progress.h
+ * for the whole program, -DMPI_HELPER_THREAD_MULTIPLE only asks for the thread
+ * level (the program starts/stops the thread itself).
+ */
+#if defined(MPI_HELPER_PROGRESS_THREAD)
+#define _MPI_MAIN_INIT(argc, argv) { \
+  int _mpi_provided; \
+  MPI_Init_thread(argc, argv, MPI_THREAD_MULTIPLE, &_mpi_provided); \
+  if (mpi_progress_start(-1) != MPI_SUCCESS) { \
+    if (_mpi_provided < MPI_THREAD_MULTIPLE) { \
+      mpi_printf_once("Progress thread not started (thread level %d < MPI_THREAD_MULTIPLE)\n", _mpi_provided); \
+    } else { \
+      mpi_printf_once("Progress thread not started (one core per rank, give each rank two, e.g. srun -c 2)\n"); \
+    } \
+  } \
 }
+#define _MPI_MAIN_FINALIZE() mpi_progress_stop()
+#elif defined(MPI_HELPER_THREAD_MULTIPLE)
+#define _MPI_MAIN_INIT(argc, argv) { \
+  int _mpi_provided; \
+  MPI_Init_thread(argc, argv, MPI_THREAD_MULTIPLE, &_mpi_provided); \
+}
+#define _MPI_MAIN_FINALIZE() mpi_progress_stop()
+#else
+#define _MPI_MAIN_INIT(argc, argv) MPI_Init(argc, argv)
+#define _MPI_MAIN_FINALIZE()
+#endif
 
 /* 
  * Macro to wrap MPI boilerplate around the user’s main code.
@@ -227,12 +1076,24 @@ int my_mpi_scatter_collective(void *sendbuf, int sendcount, MPI_Datatype sendtyp
  */
 #define MPI_MAIN(...) \
     int main(int argc, char **argv) { \
-        MPI_Init(&argc, &argv); \
+        _MPI_MAIN_INIT(&argc, &argv); \
         int _mpi_rank, _mpi_size; \
         MPI_Comm_rank(MPI_COMM_WORLD, &_mpi_rank); \
         MPI_Comm_size(MPI_COMM_WORLD, &_mpi_size); \
         (void)_mpi_rank; (void)_mpi_size; /* silence unused warnings */ \
         __VA_ARGS__ \
+        mpi_log_flush(MPI_COMM_WORLD); \
+        _MPI_MAIN_FINALIZE(); \
+        mpi_pool_trim(); \
         MPI_Finalize(); \
+        mpi_log_free(); \
         return 0; \
-    }
\ No newline at end of file
+    }
+
+#include "mpi_perf.h"
+
+#if defined(MPI_HELPER_PROGRESS_THREAD) || defined(MPI_HELPER_THREAD_MULTIPLE)
+#include "mpi_progress.h"
+#endif
+
+#endif
@@ -0,0 +1,421 @@
+#ifndef MPI_HELPER_HPP
+#define MPI_HELPER_HPP
+
+// the deprecated MPI-2 C++ bindings are not needed and only add warnings
+#define OMPI_SKIP_MPICXX 1
+#define MPICH_SKIP_MPICXX 1
+
+#include <array>
+#include <complex>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "mpi_helper.h"
+
+/*
+ * Type-safe C++20 front-end for mpi_helper.h (header only).
+ *
+ * The C helpers take void * + count + MPI_Datatype, so nothing stops a count
+ * in elements of the wrong type or a sizeof(MPI_Datatype) in place of the
+ * element size. Here buffers are std::span<T>: the element type picks the
+ * MPI_Datatype at compile time (mpi::datatype<T>()) and the count is the
+ * span's size, so the two cannot disagree and nothing queries type sizes at run time.
+ *
+ *   mpi::comm world = mpi::comm::world();
+ *   std::vector<double> x(n);
+ *   world.bcast(std::span(x), 0);
+ *   double total = world.allreduce(local, MPI_SUM);
+ *   mpi::request r = world.isend(std::span(x), 1, 0);   // waits in its destructor
+ *
+ * Trivially copyable structs get a cached contiguous byte datatype
+ * automatically; specialise mpi::type_traits with mpi::make_struct_type to
+ * describe their fields instead (needed to reduce them with built-in ops).
+ * Communicators, groups, windows and requests are move-only RAII handles.
+ */
+
+namespace mpi {
+
+/*
+ * T -> MPI_Datatype. Predefined handles are link-time constants (Open MPI) or
+ * integer constants (MPICH), so get() inlines to a constant.
+ */
+template <typename T>
+struct type_traits {
+	static constexpr bool builtin = false;
+};
+
+#define MPI_HELPER_BUILTIN_TYPE(T, handle) \
+	template <> \
+	struct type_traits<T> { \
+		static constexpr bool builtin = true; \
+		static MPI_Datatype get() noexcept { return handle; } \
+	};
+
+MPI_HELPER_BUILTIN_TYPE(char, MPI_CHAR)
+MPI_HELPER_BUILTIN_TYPE(signed char, MPI_SIGNED_CHAR)
+MPI_HELPER_BUILTIN_TYPE(unsigned char, MPI_UNSIGNED_CHAR)
+MPI_HELPER_BUILTIN_TYPE(std::byte, MPI_BYTE)
+MPI_HELPER_BUILTIN_TYPE(short, MPI_SHORT)
+MPI_HELPER_BUILTIN_TYPE(unsigned short, MPI_UNSIGNED_SHORT)
+MPI_HELPER_BUILTIN_TYPE(int, MPI_INT)
+MPI_HELPER_BUILTIN_TYPE(unsigned, MPI_UNSIGNED)
+MPI_HELPER_BUILTIN_TYPE(long, MPI_LONG)
+MPI_HELPER_BUILTIN_TYPE(unsigned long, MPI_UNSIGNED_LONG)
+MPI_HELPER_BUILTIN_TYPE(long long, MPI_LONG_LONG)
+MPI_HELPER_BUILTIN_TYPE(unsigned long long, MPI_UNSIGNED_LONG_LONG)
+MPI_HELPER_BUILTIN_TYPE(float, MPI_FLOAT)
+MPI_HELPER_BUILTIN_TYPE(double, MPI_DOUBLE)
+MPI_HELPER_BUILTIN_TYPE(long double, MPI_LONG_DOUBLE)
+MPI_HELPER_BUILTIN_TYPE(bool, MPI_CXX_BOOL)
+MPI_HELPER_BUILTIN_TYPE(std::complex<float>, MPI_CXX_FLOAT_COMPLEX)
+MPI_HELPER_BUILTIN_TYPE(std::complex<double>, MPI_CXX_DOUBLE_COMPLEX)
+
+#undef MPI_HELPER_BUILTIN_TYPE
+
+template <typename T>
+concept has_type_traits = requires { { type_traits<T>::get() } -> std::same_as<MPI_Datatype>; };
+
+template <typename T>
+concept transferable = has_type_traits<std::remove_cv_t<T>> || std::is_trivially_copyable_v<std::remove_cv_t<T>>;
+
+// a buffer MPI writes into
+template <typename T>
+concept writable = transferable<T> && !std::is_const_v<T>;
+
+// send and receive spans of the same element type (either side may be const for sends)
+template <typename S, typename R>
+concept same_element = std::same_as<std::remove_cv_t<S>, std::remove_cv_t<R>>;
+
+/*
+ * Datatype of T: the trait if there is one, otherwise a contiguous byte type
+ * built on first use and kept for the rest of the run (one per T)
+ */
+template <transferable T>
+MPI_Datatype datatype() noexcept {
+	using U = std::remove_cv_t<T>;
+	if constexpr (has_type_traits<U>) {
+		return type_traits<U>::get();
+	} else {
+		static const MPI_Datatype cached = [] {
+			MPI_Datatype t;
+			MPI_Type_contiguous(static_cast<int>(sizeof(U)), MPI_BYTE, &t);
+			MPI_Type_commit(&t);
+			return t;
+		}();
+		return cached;
+	}
+}
+
+/*
+ * Field-wise datatype of a struct from member pointers, resized to sizeof(T) so arrays of T work
+ * Usage (once, e.g. in a type_traits specialisation with a static local):
+ *   mpi::make_struct_type(&particle::x, &particle::v, &particle::id)
+ */
+template <typename T, typename... M>
+MPI_Datatype make_struct_type(M T::*... members) {
+	static_assert(std::is_standard_layout_v<T>, "field offsets are only defined for standard layout types");
+	const T probe{};
+	const char *base = reinterpret_cast<const char *>(&probe);
+	std::array<int, sizeof...(M)> lengths{(static_cast<void>(members), 1)...};
+	std::array<MPI_Aint, sizeof...(M)> offsets{static_cast<MPI_Aint>(reinterpret_cast<const char *>(&(probe.*members)) - base)...};
+	std::array<MPI_Datatype, sizeof...(M)> types{datatype<M>()...};
+
+	MPI_Datatype packed, resized;
+	MPI_Type_create_struct(static_cast<int>(sizeof...(M)), lengths.data(), offsets.data(), types.data(), &packed);
+	MPI_Type_create_resized(packed, 0, sizeof(T), &resized);
+	MPI_Type_commit(&resized);
+	MPI_Type_free(&packed);
+	return resized;
+}
+
+/*
+ * Nonblocking operation handle, completes (waits) in its destructor if still pending
+ */
+class request {
+public:
+	request() = default;
+	explicit request(MPI_Request r) noexcept : r_(r) {}
+	request(request &&o) noexcept : r_(std::exchange(o.r_, MPI_REQUEST_NULL)) {}
+	request &operator=(request &&o) noexcept {
+		if (this != &o) {
+			wait();
+			r_ = std::exchange(o.r_, MPI_REQUEST_NULL);
+		}
+		return *this;
+	}
+	request(const request &) = delete;
+	request &operator=(const request &) = delete;
+	~request() { wait(); }
+
+	void wait() noexcept {
+		if (r_ != MPI_REQUEST_NULL) {
+			MPI_Wait(&r_, MPI_STATUS_IGNORE);
+		}
+	}
+	bool test() noexcept {
+		int done = 1;
+		if (r_ != MPI_REQUEST_NULL) {
+			MPI_Test(&r_, &done, MPI_STATUS_IGNORE);
+		}
+		return done != 0;
+	}
+	MPI_Request *native() noexcept { return &r_; }
+
+private:
+	MPI_Request r_ = MPI_REQUEST_NULL;
+};
+
+/*
+ * Wait for a whole set of requests with one MPI_Waitall
+ */
+inline void wait_all(std::span<request> requests) {
+	std::vector<MPI_Request> raw;
+	raw.reserve(requests.size());
+	for (request &r : requests) {
+		raw.push_back(*r.native());
+	}
+	MPI_Waitall(static_cast<int>(raw.size()), raw.data(), MPI_STATUSES_IGNORE);
+	for (request &r : requests) {
+		*r.native() = MPI_REQUEST_NULL;
+	}
+}
+
+class group {
+public:
+	explicit group(MPI_Group g) noexcept : g_(g) {}
+	group(group &&o) noexcept : g_(std::exchange(o.g_, MPI_GROUP_NULL)) {}
+	group &operator=(group &&o) noexcept {
+		if (this != &o) {
+			reset();
+			g_ = std::exchange(o.g_, MPI_GROUP_NULL);
+		}
+		return *this;
+	}
+	group(const group &) = delete;
+	group &operator=(const group &) = delete;
+	~group() { reset(); }
+
+	int size() const noexcept { int s; MPI_Group_size(g_, &s); return s; }
+	int rank() const noexcept { int r; MPI_Group_rank(g_, &r); return r; }
+	group incl(std::span<const int> ranks) const {
+		MPI_Group g;
+		MPI_Group_incl(g_, static_cast<int>(ranks.size()), ranks.data(), &g);
+		return group(g);
+	}
+	MPI_Group native() const noexcept { return g_; }
+
+private:
+	void reset() noexcept {
+		if (g_ != MPI_GROUP_NULL && g_ != MPI_GROUP_EMPTY) {
+			MPI_Group_free(&g_);
+		}
+	}
+	MPI_Group g_ = MPI_GROUP_NULL;
+};
+
+/*
+ * Communicator. world()/wrap() borrow a handle, dup/split/create give owned ones freed on destruction.
+ */
+class comm {
+public:
+	static comm world() noexcept { return comm(MPI_COMM_WORLD, false); }
+	static comm wrap(MPI_Comm c) noexcept { return comm(c, false); }
+
+	comm(comm &&o) noexcept : c_(std::exchange(o.c_, MPI_COMM_NULL)), owned_(std::exchange(o.owned_, false)) {}
+	comm &operator=(comm &&o) noexcept {
+		if (this != &o) {
+			reset();
+			c_ = std::exchange(o.c_, MPI_COMM_NULL);
+			owned_ = std::exchange(o.owned_, false);
+		}
+		return *this;
+	}
+	comm(const comm &) = delete;
+	comm &operator=(const comm &) = delete;
+	~comm() { reset(); }
+
+	int rank() const noexcept { int r; MPI_Comm_rank(c_, &r); return r; }
+	int size() const noexcept { int s; MPI_Comm_size(c_, &s); return s; }
+	MPI_Comm native() const noexcept { return c_; }
+	bool valid() const noexcept { return c_ != MPI_COMM_NULL; }
+
+	comm dup() const { MPI_Comm c; MPI_Comm_dup(c_, &c); return comm(c, true); }
+	comm split(int color, int key) const { MPI_Comm c; MPI_Comm_split(c_, color, key, &c); return comm(c, true); }
+	group get_group() const { MPI_Group g; MPI_Comm_group(c_, &g); return group(g); }
+	// ranks outside g get an invalid comm (valid() == false)
+	comm create(const group &g) const { MPI_Comm c; MPI_Comm_create(c_, g.native(), &c); return comm(c, true); }
+
+	void barrier() const { MPI_Barrier(c_); }
+
+	// point to point
+	template <transferable T> void send(std::span<T> buf, int dst, int tag = 0) const {
+		MPI_Send(buf.data(), count(buf), datatype<T>(), dst, tag, c_);
+	}
+	template <writable T> void recv(std::span<T> buf, int src, int tag = 0) const {
+		MPI_Recv(buf.data(), count(buf), datatype<T>(), src, tag, c_, MPI_STATUS_IGNORE);
+	}
+	template <transferable T> [[nodiscard]] request isend(std::span<T> buf, int dst, int tag = 0) const {
+		request r;
+		MPI_Isend(buf.data(), count(buf), datatype<T>(), dst, tag, c_, r.native());
+		return r;
+	}
+	template <writable T> [[nodiscard]] request irecv(std::span<T> buf, int src, int tag = 0) const {
+		request r;
+		MPI_Irecv(buf.data(), count(buf), datatype<T>(), src, tag, c_, r.native());
+		return r;
+	}
+	template <transferable S, writable R> requires same_element<S, R>
+	void sendrecv(std::span<S> out, int dst, std::span<R> in, int src, int tag = 0) const {
+		MPI_Sendrecv(out.data(), count(out), datatype<S>(), dst, tag, in.data(), count(in), datatype<R>(), src, tag, c_, MPI_STATUS_IGNORE);
+	}
+
+	// collectives
+	template <writable T> void bcast(std::span<T> buf, int root) const {
+		MPI_Bcast(buf.data(), count(buf), datatype<T>(), root, c_);
+	}
+	template <writable T> [[nodiscard]] request ibcast(std::span<T> buf, int root) const {
+		request r;
+		MPI_Ibcast(buf.data(), count(buf), datatype<T>(), root, c_, r.native());
+		return r;
+	}
+	// recv.size() elements per rank; send (significant on root) must hold size() blocks of that
+	template <transferable S, writable T> requires same_element<S, T>
+	int scatter(std::span<S> send, std::span<T> recv, int root) const {
+		if (rank() == root && send.size() != recv.size() * static_cast<size_t>(size())) {
+			return MPI_ERR_COUNT;
+		}
+		return MPI_Scatter(send.data(), count(recv), datatype<T>(), recv.data(), count(recv), datatype<T>(), root, c_);
+	}
+	template <transferable S, writable T> requires same_element<S, T>
+	int gather(std::span<S> send, std::span<T> recv, int root) const {
+		if (rank() == root && recv.size() != send.size() * static_cast<size_t>(size())) {
+			return MPI_ERR_COUNT;
+		}
+		return MPI_Gather(send.data(), count(send), datatype<T>(), recv.data(), count(send), datatype<T>(), root, c_);
+	}
+	template <transferable S, writable T> requires same_element<S, T>
+	int allgather(std::span<S> send, std::span<T> recv) const {
+		if (recv.size() != send.size() * static_cast<size_t>(size())) {
+			return MPI_ERR_COUNT;
+		}
+		return MPI_Allgather(send.data(), count(send), datatype<T>(), recv.data(), count(send), datatype<T>(), c_);
+	}
+	template <transferable S, writable T> requires same_element<S, T>
+	int alltoall(std::span<S> send, std::span<T> recv) const {
+		if (send.size() != recv.size() || send.size() % static_cast<size_t>(size()) != 0) {
+			return MPI_ERR_COUNT;
+		}
+		int block = static_cast<int>(send.size() / static_cast<size_t>(size()));
+		return MPI_Alltoall(send.data(), block, datatype<T>(), recv.data(), block, datatype<T>(), c_);
+	}
+	template <transferable S, writable T> requires same_element<S, T>
+	int allreduce(std::span<S> send, std::span<T> recv, MPI_Op op) const {
+		if (send.size() != recv.size()) {
+			return MPI_ERR_COUNT;
+		}
+		return MPI_Allreduce(send.data(), recv.data(), count(send), datatype<T>(), op, c_);
+	}
+	template <transferable T> T allreduce(const T &value, MPI_Op op) const {
+		T result;
+		MPI_Allreduce(&value, &result, 1, datatype<T>(), op, c_);
+		return result;
+	}
+	template <transferable T> T exscan(const T &value, MPI_Op op, const T &first = T{}) const {
+		T result = first;
+		MPI_Exscan(&value, &result, 1, datatype<T>(), op, c_);
+		return rank() == 0 ? first : result;
+	}
+
+	// the custom helpers from mpi_helper.h, same spans
+	template <writable T> void my_broadcast(std::span<T> buf, int src, int *dsts = nullptr) const {
+		my_mpi_broadcast(buf.data(), count(buf), datatype<T>(), src, dsts, c_);
+	}
+	template <transferable S, writable T> requires same_element<S, T>
+	int my_scatter(std::span<S> send, std::span<T> recv) const {
+		if (rank() == 0 && send.size() != recv.size() * static_cast<size_t>(size())) {
+			return MPI_ERR_COUNT;
+		}
+		// my_mpi_scatter only reads sendbuf, its C signature just predates const
+		void *out = const_cast<std::remove_cv_t<S> *>(send.data());
+		return my_mpi_scatter(out, count(recv), datatype<T>(), recv.data(), count(recv), c_);
+	}
+	template <writable T> int my_alltoall(std::span<T> send, std::span<T> recv) const {
+		if (send.size() != recv.size() || send.size() % static_cast<size_t>(size()) != 0) {
+			return MPI_ERR_COUNT;
+		}
+		int block = static_cast<int>(send.size() / static_cast<size_t>(size()));
+		return my_mpi_alltoall(send.data(), block, datatype<T>(), recv.data(), block, datatype<T>(), c_);
+	}
+	template <transferable S, writable T> requires same_element<S, T>
+	int my_scan(std::span<S> send, std::span<T> recv, MPI_Op op) const {
+		if (send.size() != recv.size()) {
+			return MPI_ERR_COUNT;
+		}
+		return my_mpi_scan(send.data(), recv.data(), count(send), datatype<T>(), op, c_);
+	}
+
+private:
+	comm(MPI_Comm c, bool owned) noexcept : c_(c), owned_(owned) {}
+	void reset() noexcept {
+		if (owned_ && c_ != MPI_COMM_NULL) {
+			MPI_Comm_free(&c_);
+		}
+		owned_ = false;
+	}
+	template <typename T> static int count(std::span<T> s) noexcept { return static_cast<int>(s.size()); }
+
+	MPI_Comm c_ = MPI_COMM_NULL;
+	bool owned_ = false;
+};
+
+/*
+ * One-sided window over a span of T; displacements are in elements of T
+ */
+template <transferable T>
+class window {
+public:
+	window(const comm &c, std::span<T> memory) {
+		MPI_Win_create(memory.data(), static_cast<MPI_Aint>(memory.size_bytes()), static_cast<int>(sizeof(T)),
+			MPI_INFO_NULL, c.native(), &w_);
+	}
+	window(window &&o) noexcept : w_(std::exchange(o.w_, MPI_WIN_NULL)) {}
+	window &operator=(window &&o) noexcept {
+		if (this != &o) {
+			reset();
+			w_ = std::exchange(o.w_, MPI_WIN_NULL);
+		}
+		return *this;
+	}
+	window(const window &) = delete;
+	window &operator=(const window &) = delete;
+	~window() { reset(); }
+
+	void fence(int assert_flags = 0) const { MPI_Win_fence(assert_flags, w_); }
+	void put(std::span<const T> src, int target, MPI_Aint disp) const {
+		MPI_Put(src.data(), static_cast<int>(src.size()), datatype<T>(), target, disp, static_cast<int>(src.size()), datatype<T>(), w_);
+	}
+	void get(std::span<T> dst, int target, MPI_Aint disp) const {
+		MPI_Get(dst.data(), static_cast<int>(dst.size()), datatype<T>(), target, disp, static_cast<int>(dst.size()), datatype<T>(), w_);
+	}
+	void accumulate(std::span<const T> src, int target, MPI_Aint disp, MPI_Op op) const {
+		MPI_Accumulate(src.data(), static_cast<int>(src.size()), datatype<T>(), target, disp, static_cast<int>(src.size()), datatype<T>(), op, w_);
+	}
+	MPI_Win native() const noexcept { return w_; }
+
+private:
+	void reset() noexcept {
+		if (w_ != MPI_WIN_NULL) {
+			MPI_Win_free(&w_);
+		}
+	}
+	MPI_Win w_ = MPI_WIN_NULL;
+};
+
+} // namespace mpi
+
+#endif
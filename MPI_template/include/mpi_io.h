@@ -0,0 +1,435 @@
+#ifndef MPI_IO_H
+#define MPI_IO_H
+
+#include <stdarg.h>
+
+#include "mpi_helper.h"
+
+/*
+ * Ordered, distributed output through MPI-IO.
+ *
+ * Instead of every rank taking turns to fopen/append/fclose behind a barrier,
+ * each rank works out where its bytes go in the file with an exclusive scan of
+ * the byte counts and all ranks write at once with one collective call. The
+ * result is the same file as the rank-by-rank loop (rank 0's data first).
+ *
+ * All functions are collective over comm and return MPI_SUCCESS or the MPI
+ * error code of the first failing call (files use MPI_ERRORS_RETURN).
+ */
+
+#define MPI_IO_TRUNCATE 0  // start the file from scratch
+#define MPI_IO_APPEND   1  // write after whatever is already in the file
+
+/*
+ * Open filename for writing and return the offset writing should start at
+ */
+int _mpi_io_open_write(MPI_Comm comm, const char *filename, int append, MPI_File *fh, MPI_Offset *base) {
+	int err = MPI_File_open(comm, filename, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, fh);
+	if (err != MPI_SUCCESS) {
+		return err;
+	}
+
+	*base = 0;
+	if (append) {
+		err = MPI_File_get_size(*fh, base);
+	} else {
+		err = MPI_File_set_size(*fh, 0);
+	}
+	if (err != MPI_SUCCESS) {
+		MPI_File_close(fh);
+	}
+	return err;
+}
+
+/*
+ * Write each rank's buffer to filename in rank order using an exclusive scan + MPI_File_write_at_all
+ *
+ * comm: MPI communicator
+ * filename: file to write
+ * append: MPI_IO_APPEND or MPI_IO_TRUNCATE
+ * buf: bytes written by this rank (may differ in length between ranks)
+ * bytes: number of bytes in buf (can be 0)
+ */
+int mpi_write_ordered(MPI_Comm comm, const char *filename, int append, const void *buf, int bytes) {
+	MPI_File fh;
+	MPI_Offset base;
+	int err = _mpi_io_open_write(comm, filename, append, &fh, &base);
+	if (err != MPI_SUCCESS) {
+		return err;
+	}
+
+	// my offset is the number of bytes written by all lower ranks
+	long long my_bytes = bytes, before = 0;
+	int rank;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Exscan(&my_bytes, &before, 1, MPI_LONG_LONG, MPI_SUM, comm);
+	if (rank == 0) {
+		before = 0; // MPI_Exscan leaves rank 0's result undefined
+	}
+
+	err = MPI_File_write_at_all(fh, base + (MPI_Offset)before, buf, bytes, MPI_BYTE, MPI_STATUS_IGNORE);
+	int close_err = MPI_File_close(&fh);
+	return (err != MPI_SUCCESS) ? err : close_err;
+}
+
+/*
+ * Same as mpi_write_ordered but lets the library order the writes through the shared file pointer
+ * (MPI_File_write_ordered), useful to compare against the explicit offset version
+ */
+int mpi_write_ordered_shared(MPI_Comm comm, const char *filename, int append, const void *buf, int bytes) {
+	int amode = MPI_MODE_CREATE | MPI_MODE_WRONLY | (append ? MPI_MODE_APPEND : 0);
+	MPI_File fh;
+	int err = MPI_File_open(comm, filename, amode, MPI_INFO_NULL, &fh);
+	if (err != MPI_SUCCESS) {
+		return err;
+	}
+	if (!append) {
+		err = MPI_File_set_size(fh, 0);
+	}
+	if (err == MPI_SUCCESS) {
+		err = MPI_File_write_ordered(fh, buf, bytes, MPI_BYTE, MPI_STATUS_IGNORE);
+	}
+	int close_err = MPI_File_close(&fh);
+	return (err != MPI_SUCCESS) ? err : close_err;
+}
+
+/*
+ * printf into a file with one line (or any formatted text) per rank, in rank order
+ * Usage:
+ *   mpi_printf_ordered(MPI_COMM_WORLD, "output.txt", MPI_IO_APPEND, "Rank %d: %d\n", rank, value);
+ */
+int mpi_printf_ordered(MPI_Comm comm, const char *filename, int append, const char *format, ...) {
+	char line[256];
+	char *text = line;
+
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+
+	// long output does not fit the stack buffer, format again into one that fits
+	if (len >= (int)sizeof(line)) {
+		text = (char *)malloc(len + 1);
+		va_start(args, format);
+		vsnprintf(text, len + 1, format, args);
+		va_end(args);
+	}
+	if (len < 0) {
+		len = 0;
+	}
+
+	int err = mpi_write_ordered(comm, filename, append, text, len);
+	if (text != line) {
+		free(text);
+	}
+	return err;
+}
+
+/*
+ * Write every rank's buffered mpi_printf output to filename in rank order instead of stdout
+ * (the MPI-IO counterpart of mpi_log_flush, nothing goes through rank 0)
+ */
+int mpi_log_flush_file(MPI_Comm comm, const char *filename, int append) {
+	int err = mpi_write_ordered(comm, filename, append, _mpi_log.data, (int)_mpi_log.len);
+	_mpi_log.len = 0;
+	return err;
+}
+
+/*
+ * Write fixed-width binary records, rank r's records following those of ranks < r
+ *
+ * The file is just the records back to back, so record i of the global array
+ * is at byte i * record_size and can be read back (or mmap'd) directly.
+ *
+ * comm: MPI communicator
+ * filename: file to write (truncated)
+ * records: this rank's records
+ * count: number of records on this rank
+ * record_size: size of one record in bytes (same on every rank)
+ */
+int mpi_write_records(MPI_Comm comm, const char *filename, const void *records, int count, int record_size) {
+	MPI_File fh;
+	MPI_Offset base;
+	int err = _mpi_io_open_write(comm, filename, MPI_IO_TRUNCATE, &fh, &base);
+	if (err != MPI_SUCCESS) {
+		return err;
+	}
+
+	long long my_count = count, first = 0;
+	int rank;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Exscan(&my_count, &first, 1, MPI_LONG_LONG, MPI_SUM, comm);
+	if (rank == 0) {
+		first = 0;
+	}
+
+	// one contiguous type per record keeps the count small for large records
+	MPI_Datatype record_type;
+	MPI_Type_contiguous(record_size, MPI_BYTE, &record_type);
+	MPI_Type_commit(&record_type);
+
+	err = MPI_File_write_at_all(fh, (MPI_Offset)first * record_size, records, count, record_type, MPI_STATUS_IGNORE);
+
+	MPI_Type_free(&record_type);
+	int close_err = MPI_File_close(&fh);
+	return (err != MPI_SUCCESS) ? err : close_err;
+}
+
+/*
+ * Split n items into near-equal contiguous blocks, the first n % size ranks getting one extra
+ * (the same split the week programs use for the pi intervals)
+ */
+void mpi_block_range(long long n, int rank, int size, long long *start, long long *count) {
+	long long per_rank = n / size, remainder = n % size;
+	*start = rank * per_rank + (rank < remainder ? rank : remainder);
+	*count = per_rank + (rank < remainder ? 1 : 0);
+}
+
+/*
+ * Make one rank's MPI-IO error everyone's, so no rank goes on into a collective the others skip
+ *
+ * comm: MPI communicator
+ * err: this rank's result
+ * returns the largest error code over comm (MPI_SUCCESS if all ranks succeeded)
+ */
+int _mpi_io_agree(MPI_Comm comm, int err) {
+	MPI_Allreduce(MPI_IN_PLACE, &err, 1, MPI_INT, MPI_MAX, comm);
+	return err;
+}
+
+/*
+ * MPI_File_read_at_all of n elements in chunks of at most 1 << 30 (collective)
+ *
+ * read_at_all takes an int count, so every rank makes the same number of
+ * collective calls and finished ranks pass a count of 0. Errors are shared
+ * over comm.
+ *
+ * comm: MPI communicator the file was opened on
+ * fh: file handle
+ * offset: where to start, in etype units of the current view
+ * buf: buffer for n elements
+ * n: number of elements this rank reads
+ * etype: element type of the view
+ * type_size: size of etype in bytes
+ */
+int _mpi_read_at_all_chunked(MPI_Comm comm, MPI_File fh, MPI_Offset offset, void *buf, long long n,
+		MPI_Datatype etype, int type_size) {
+	const long long chunk = 1 << 30;
+	long long my_chunks = (n + chunk - 1) / chunk, chunks;
+	MPI_Allreduce(&my_chunks, &chunks, 1, MPI_LONG_LONG, MPI_MAX, comm);
+	int err = MPI_SUCCESS;
+	for (long long c = 0; c < chunks; c++) {
+		long long done = (c * chunk < n) ? c * chunk : n;
+		int this_count = (int)((n - done < chunk) ? n - done : chunk);
+		char *dst = (char *)buf + (size_t)done * type_size;
+		int e = MPI_File_read_at_all(fh, offset + done, dst, this_count, etype, MPI_STATUS_IGNORE);
+		// keep making the calls after an error, the other ranks are waiting in them
+		if (e != MPI_SUCCESS && err == MPI_SUCCESS) {
+			err = e;
+		}
+	}
+	return _mpi_io_agree(comm, err);
+}
+
+/*
+ * Every rank reads its own block of a binary file of etype elements (collective)
+ *
+ * The file is split into near-equal blocks of whole elements and each rank sets
+ * a file view starting at its block, then all ranks read together with
+ * MPI_File_read_all. Nothing is read or held by rank 0 on behalf of the others,
+ * so the input can be bigger than one node's memory.
+ *
+ * comm: MPI communicator
+ * filename: file to read
+ * etype: element type (a contiguous/derived type for fixed-size records)
+ * header_bytes: bytes to skip at the start of the file
+ * local: set to a malloc'd buffer with this rank's elements (free it after use)
+ * count: set to the number of elements on this rank
+ * first: set to the global index of this rank's first element (can be NULL)
+ */
+int mpi_read_block(MPI_Comm comm, const char *filename, MPI_Datatype etype, MPI_Offset header_bytes,
+		void **local, long long *count, long long *first) {
+	int rank, size;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &size);
+	*local = NULL;
+	*count = 0;
+
+	MPI_File fh;
+	int err = MPI_File_open(comm, filename, MPI_MODE_RDONLY, MPI_INFO_NULL, &fh);
+	if (err != MPI_SUCCESS) {
+		return err;
+	}
+
+	int type_size;
+	MPI_Type_size(etype, &type_size);
+	MPI_Offset file_size = 0;
+	err = _mpi_io_agree(comm, MPI_File_get_size(fh, &file_size));
+	if (err != MPI_SUCCESS) {
+		MPI_File_close(&fh);
+		return err;
+	}
+	long long total = (file_size > header_bytes) ? (long long)(file_size - header_bytes) / type_size : 0;
+
+	long long start, n;
+	mpi_block_range(total, rank, size, &start, &n);
+
+	err = _mpi_io_agree(comm, MPI_File_set_view(fh, header_bytes + (MPI_Offset)start * type_size, etype, etype,
+			"native", MPI_INFO_NULL));
+	if (err != MPI_SUCCESS) {
+		MPI_File_close(&fh);
+		return err;
+	}
+
+	*local = malloc(n > 0 ? (size_t)n * type_size : 1);
+	*count = n;
+	if (first != NULL) {
+		*first = start;
+	}
+	err = _mpi_read_at_all_chunked(comm, fh, 0, *local, n, etype, type_size);
+
+	int close_err = MPI_File_close(&fh);
+	return (err != MPI_SUCCESS) ? err : close_err;
+}
+
+/*
+ * Read back a file written by mpi_write_records, split into near-equal blocks over the ranks of comm
+ * (works for any number of ranks, not only the number that wrote the file)
+ *
+ * comm: MPI communicator
+ * filename: file to read
+ * record_size: size of one record in bytes
+ * records: set to a malloc'd array of this rank's records (free it after use)
+ * count: set to the number of records on this rank
+ * first: set to the global index of this rank's first record (can be NULL)
+ */
+int mpi_read_records(MPI_Comm comm, const char *filename, int record_size, void **records, int *count, long long *first) {
+	MPI_Datatype record_type;
+	MPI_Type_contiguous(record_size, MPI_BYTE, &record_type);
+	MPI_Type_commit(&record_type);
+
+	long long n;
+	int err = mpi_read_block(comm, filename, record_type, 0, records, &n, first);
+	*count = (int)n;
+
+	MPI_Type_free(&record_type);
+	return err;
+}
+
+/*
+ * Every rank reads the lines of a text file that start inside its share of the bytes (collective)
+ *
+ * The file is cut into equal byte ranges. A rank owns every line that starts in
+ * its range: it drops the partial line at the front (the rank before finishes
+ * it) and reads on past the end of its range until the newline of its last
+ * line. The bulk of the data is read collectively, only the short tail past the
+ * range is read independently.
+ *
+ * comm: MPI communicator
+ * filename: file to read
+ * local: set to a malloc'd, nul terminated buffer with this rank's whole lines (free it after use)
+ * bytes: set to the number of bytes in local (without the nul)
+ * first_byte: set to the file offset of local[0] (can be NULL)
+ * first_line: set to the global line number of the first line in local (NULL on all ranks to skip the scan)
+ */
+int mpi_read_text_lines(MPI_Comm comm, const char *filename, char **local, long long *bytes,
+		long long *first_byte, long long *first_line) {
+	int rank, size;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &size);
+	*local = NULL;
+	*bytes = 0;
+
+	MPI_File fh;
+	int err = MPI_File_open(comm, filename, MPI_MODE_RDONLY, MPI_INFO_NULL, &fh);
+	if (err != MPI_SUCCESS) {
+		return err;
+	}
+	MPI_Offset file_size = 0;
+	err = _mpi_io_agree(comm, MPI_File_get_size(fh, &file_size));
+	if (err != MPI_SUCCESS) {
+		MPI_File_close(&fh);
+		return err;
+	}
+
+	long long start, n;
+	mpi_block_range((long long)file_size, rank, size, &start, &n);
+	long long end = start + n;
+
+	// read one byte before the range too, to see whether a line starts exactly at 'start'
+	long long read_from = (start > 0) ? start - 1 : 0;
+	long long read_len = end - read_from;
+	if (n == 0) {
+		read_len = 0;
+	}
+	size_t cap = (size_t)read_len + 1;
+	char *buf = (char *)malloc(cap);
+	err = _mpi_read_at_all_chunked(comm, fh, read_from, buf, read_len, MPI_CHAR, 1);
+
+	// first owned line: right after the first newline at or after start - 1
+	long long head = 0;
+	if (start > 0) {
+		head = -1;
+		for (long long i = 0; i < read_len; i++) {
+			if (buf[i] == '\n') {
+				head = i + 1;
+				break;
+			}
+		}
+		// a line starting at 'end' belongs to the next rank
+		if (head < 0 || read_from + head >= end) {
+			head = read_len;
+		}
+	}
+
+	// finish my last line past the end of the range, reading more until a newline or EOF
+	long long len = read_len;
+	if (err == MPI_SUCCESS && head < read_len && buf[len - 1] != '\n') {
+		const long long step = 64 * 1024;
+		long long pos = end;
+		int found = 0;
+		while (!found && pos < (long long)file_size && err == MPI_SUCCESS) {
+			long long want = ((long long)file_size - pos < step) ? (long long)file_size - pos : step;
+			if ((size_t)(len + want + 1) > cap) {
+				cap = (size_t)(len + want + 1) * 2;
+				buf = (char *)realloc(buf, cap);
+			}
+			err = MPI_File_read_at(fh, pos, buf + len, (int)want, MPI_CHAR, MPI_STATUS_IGNORE);
+			for (long long i = 0; i < want; i++) {
+				if (buf[len + i] == '\n') {
+					want = i + 1;
+					found = 1;
+					break;
+				}
+			}
+			len += want;
+			pos += want;
+		}
+	}
+
+	long long my_bytes = len - head;
+	memmove(buf, buf + head, (size_t)my_bytes);
+	buf[my_bytes] = '\0';
+	*local = buf;
+	*bytes = my_bytes;
+	if (first_byte != NULL) {
+		*first_byte = read_from + head;
+	}
+
+	if (first_line != NULL) {
+		long long lines = 0, before = 0;
+		for (long long i = 0; i < my_bytes; i++) {
+			lines += (buf[i] == '\n');
+		}
+		if (my_bytes > 0 && buf[my_bytes - 1] != '\n') {
+			lines++; // last line of the file without a newline
+		}
+		MPI_Exscan(&lines, &before, 1, MPI_LONG_LONG, MPI_SUM, comm);
+		*first_line = (rank == 0) ? 0 : before;
+	}
+
+	int close_err = MPI_File_close(&fh);
+	return (err != MPI_SUCCESS) ? err : close_err;
+}
+
+#endif
@@ -0,0 +1,198 @@
+#ifndef MPI_LOG_H
+#define MPI_LOG_H
+
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mpi.h>
+
+/*
+ * Buffered, rank-ordered logging backend for mpi_printf/mpi_printf_once.
+ *
+ * Every rank formats its messages into an in-memory buffer (no syscall, the
+ * rank and its "[Rank N] " prefix are cached on first use). The buffers are
+ * only written out at flush points: mpi_log_flush gathers them to rank 0,
+ * which prints them in rank order, so output no longer interleaves between
+ * ranks. mpi_time/mpi_time_perf and the end of MPI_MAIN flush automatically.
+ *
+ * Flushing is collective. Before an MPI_Abort use mpi_log_flush_local so the
+ * calling rank's messages are not lost. A rank whose buffer grows past
+ * MPI_LOG_MAX_BYTES between flushes writes it out on its own (out of rank
+ * order, but nothing is lost and the counts stay within an int).
+ *
+ * Compile with -DMPI_HELPER_UNBUFFERED_LOG to get the old printf-per-call
+ * behaviour back (useful when debugging a hang).
+ */
+
+#ifndef MPI_LOG_MAX_BYTES
+#define MPI_LOG_MAX_BYTES (1 << 30)   // largest buffer kept for the next collective flush
+#endif
+
+typedef struct {
+	char *data;
+	size_t len;
+	size_t cap;
+} _mpi_log_buffer;
+
+static _mpi_log_buffer _mpi_log = {NULL, 0, 0};
+static int _mpi_log_rank = -1;
+static char _mpi_log_prefix[24];
+static size_t _mpi_log_prefix_len = 0;
+
+/*
+ * Rank in MPI_COMM_WORLD, queried once and cached
+ */
+int mpi_log_rank(void) {
+	if (_mpi_log_rank < 0) {
+		MPI_Comm_rank(MPI_COMM_WORLD, &_mpi_log_rank);
+		_mpi_log_prefix_len = (size_t)snprintf(_mpi_log_prefix, sizeof(_mpi_log_prefix), "[Rank %d] ", _mpi_log_rank);
+	}
+	return _mpi_log_rank;
+}
+
+/*
+ * Make room for at least n more bytes (plus the terminating nul vsnprintf writes)
+ */
+void _mpi_log_reserve(size_t n) {
+	if (_mpi_log.len + n + 1 <= _mpi_log.cap) {
+		return;
+	}
+	size_t cap = _mpi_log.cap ? _mpi_log.cap : 4096;
+	while (cap < _mpi_log.len + n + 1) {
+		cap *= 2;
+	}
+	char *data = (char *)realloc(_mpi_log.data, cap);
+	if (data == NULL) {
+		return; // keep what we have, the message below gets truncated
+	}
+	_mpi_log.data = data;
+	_mpi_log.cap = cap;
+}
+
+/*
+ * Print only the calling rank's buffered messages right away (not collective, e.g. before MPI_Abort)
+ */
+void mpi_log_flush_local(void) {
+	if (_mpi_log.len > 0) {
+		fwrite(_mpi_log.data, 1, _mpi_log.len, stdout);
+		fflush(stdout);
+		_mpi_log.len = 0;
+	}
+}
+
+/*
+ * Format a message into this rank's log buffer
+ *
+ * with_prefix: prepend "[Rank N] " like mpi_printf does
+ * format: printf style format
+ */
+void mpi_log_vappend(int with_prefix, const char *format, va_list args) {
+	mpi_log_rank();
+	if (with_prefix) {
+		_mpi_log_reserve(_mpi_log_prefix_len);
+		if (_mpi_log.len + _mpi_log_prefix_len < _mpi_log.cap) {
+			memcpy(_mpi_log.data + _mpi_log.len, _mpi_log_prefix, _mpi_log_prefix_len);
+			_mpi_log.len += _mpi_log_prefix_len;
+		}
+	}
+
+	// try to format straight into the free space, grow and retry only if it did not fit
+	va_list retry;
+	va_copy(retry, args);
+	_mpi_log_reserve(128);
+	size_t space = _mpi_log.cap - _mpi_log.len;
+	int n = vsnprintf(_mpi_log.data + _mpi_log.len, space, format, args);
+	if (n >= 0 && (size_t)n >= space) {
+		_mpi_log_reserve((size_t)n);
+		space = _mpi_log.cap - _mpi_log.len;
+		n = vsnprintf(_mpi_log.data + _mpi_log.len, space, format, retry);
+		if ((size_t)n >= space) {
+			n = (int)space - 1;
+		}
+	}
+	va_end(retry);
+	if (n > 0) {
+		_mpi_log.len += (size_t)n;
+	}
+	if (_mpi_log.len >= MPI_LOG_MAX_BYTES) {
+		mpi_log_flush_local();
+	}
+}
+
+void mpi_log_append(int with_prefix, const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	mpi_log_vappend(with_prefix, format, args);
+	va_end(args);
+}
+
+/*
+ * Gather every rank's log buffer to rank 0 of comm and print them in rank order (collective)
+ */
+void mpi_log_flush(MPI_Comm comm) {
+	int rank, size;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &size);
+
+	int len = (int)_mpi_log.len;  // at most MPI_LOG_MAX_BYTES plus one message
+	int *lens = NULL, *displs = NULL;
+	if (rank == 0) {
+		lens = (int *)malloc(size * sizeof(int));
+		displs = (int *)malloc(size * sizeof(int));
+	}
+	MPI_Gather(&len, 1, MPI_INT, lens, 1, MPI_INT, 0, comm);
+
+	// 0: nothing to print anywhere (the common case between timed regions, skips the second round),
+	// 1: one MPI_Gatherv, 2: the total does not fit in an int, so rank 0 receives one rank at a time
+	long long total = 0;
+	int how = 0;
+	if (rank == 0) {
+		for (int i = 0; i < size; i++) {
+			displs[i] = (int)(total < INT_MAX ? total : 0);
+			total += lens[i];
+		}
+		how = total == 0 ? 0 : (total <= INT_MAX ? 1 : 2);
+	}
+	MPI_Bcast(&how, 1, MPI_INT, 0, comm);
+	if (how == 1) {
+		char *all = rank == 0 ? (char *)malloc((size_t)total) : NULL;
+		MPI_Gatherv(_mpi_log.data, len, MPI_CHAR, all, lens, displs, MPI_CHAR, 0, comm);
+		if (rank == 0 && all != NULL) {
+			fwrite(all, 1, (size_t)total, stdout);
+			fflush(stdout);
+		}
+		free(all);
+	} else if (how == 2) {
+		if (rank == 0) {
+			fwrite(_mpi_log.data, 1, _mpi_log.len, stdout);
+			for (int i = 1; i < size; i++) {
+				char *part = (char *)malloc(lens[i] > 0 ? (size_t)lens[i] : 1);
+				MPI_Recv(part, lens[i], MPI_CHAR, i, 0, comm, MPI_STATUS_IGNORE);
+				fwrite(part, 1, (size_t)lens[i], stdout);
+				free(part);
+			}
+			fflush(stdout);
+		} else {
+			MPI_Send(_mpi_log.data, len, MPI_CHAR, 0, 0, comm);
+		}
+	}
+
+	_mpi_log.len = 0;
+	free(lens);
+	free(displs);
+}
+
+/*
+ * Free the log buffer (after the final flush)
+ */
+void mpi_log_free(void) {
+	free(_mpi_log.data);
+	_mpi_log.data = NULL;
+	_mpi_log.len = 0;
+	_mpi_log.cap = 0;
+}
+
+#endif
@@ -0,0 +1,340 @@
+#ifndef MPI_MAPREDUCE_H
+#define MPI_MAPREDUCE_H
+
+#include <stdint.h>
+
+#include "mpi_helper.h"
+#include "mpi_io.h"
+
+/*
+ * Small MapReduce runtime for histogram, word count and group-by jobs.
+ *
+ *   map:     every rank calls mpi_mr_emit(key, value) for its input partition;
+ *            values for a key already in the local table are combined in place
+ *   shuffle: mpi_mr_shuffle sends every key to the rank that owns its hash with
+ *            one MPI_Alltoallv and combines what arrives
+ *   reduce:  afterwards each key lives on exactly one rank with its final value;
+ *            walk them with mpi_mr_for_each or write them with mpi_mr_write_text
+ *
+ * The combine function is the reduction, so it must be associative and
+ * commutative (sum, min, max, count, ...). Keys are byte strings, values have a
+ * fixed size.
+ *
+ * Records live in an arena (a list of large blocks handed out by bumping a
+ * pointer) and are indexed by an open-addressing hash table with linear
+ * probing, so emitting and shuffling do no malloc per record: the arena is
+ * reset and reused after the shuffle and the table only reallocates when it grows.
+ */
+
+#define MPI_MR_ARENA_BLOCK ((size_t)1 << 20)
+#define MPI_MR_INITIAL_SLOTS 1024
+
+typedef void (*mpi_mr_combine)(void *acc, const void *value, void *ctx);
+typedef void (*mpi_mr_visit)(const void *key, int key_len, const void *value, void *ctx);
+
+typedef struct _mpi_mr_block {
+	struct _mpi_mr_block *next;
+	size_t size, used;
+	char data[];
+} _mpi_mr_block;
+
+typedef struct {
+	_mpi_mr_block *head, *cur, *tail;
+} mpi_mr_arena;
+
+/*
+ * Bump-allocate n bytes (8 byte aligned), adding a block only when the current ones are full
+ */
+void *mpi_mr_arena_alloc(mpi_mr_arena *a, size_t n) {
+	n = (n + 7) & ~(size_t)7;
+	if (a->cur == NULL || a->cur->used + n > a->cur->size) {
+		// blocks after cur are empty (they were handed out before the last reset)
+		_mpi_mr_block *b = (a->cur != NULL) ? a->cur->next : a->head;
+		while (b != NULL && b->size < n) {
+			b = b->next;
+		}
+		if (b == NULL) {
+			size_t size = (n > MPI_MR_ARENA_BLOCK) ? n : MPI_MR_ARENA_BLOCK;
+			b = (_mpi_mr_block *)malloc(sizeof(_mpi_mr_block) + size);
+			b->next = NULL;
+			b->size = size;
+			b->used = 0;
+			if (a->tail != NULL) a->tail->next = b; else a->head = b;
+			a->tail = b;
+		}
+		a->cur = b;
+	}
+	void *p = a->cur->data + a->cur->used;
+	a->cur->used += n;
+	return p;
+}
+
+/*
+ * Forget everything allocated but keep the blocks for reuse
+ */
+void mpi_mr_arena_reset(mpi_mr_arena *a) {
+	for (_mpi_mr_block *b = a->head; b != NULL; b = b->next) {
+		b->used = 0;
+	}
+	a->cur = a->head;
+}
+
+void mpi_mr_arena_free(mpi_mr_arena *a) {
+	while (a->head != NULL) {
+		_mpi_mr_block *next = a->head->next;
+		free(a->head);
+		a->head = next;
+	}
+	a->cur = a->tail = NULL;
+}
+
+typedef struct {
+	uint64_t hash;   // 0 marks an empty slot (real hashes are forced non-zero)
+	int key_len;
+	char *record;    // arena: key bytes, padded to 8, then the value
+} _mpi_mr_slot;
+
+typedef struct {
+	MPI_Comm comm;
+	int rank, size;
+	int value_size;
+	mpi_mr_combine combine;
+	void *ctx;
+	mpi_mr_arena arena;
+	_mpi_mr_slot *slots;
+	long long num_slots;  // power of two
+	long long count;      // keys in the table
+} mpi_mapreduce;
+
+#define _mpi_mr_value(key_len, record) ((record) + (((size_t)(key_len) + 7) & ~(size_t)7))
+
+/*
+ * FNV-1a with a final avalanche (FNV alone leaves the high bits of short keys
+ * poorly mixed, and those pick the owner rank), never 0
+ */
+uint64_t _mpi_mr_hash(const void *key, int key_len) {
+	const unsigned char *p = (const unsigned char *)key;
+	uint64_t h = 0xcbf29ce484222325ull;
+	for (int i = 0; i < key_len; i++) {
+		h = (h ^ p[i]) * 0x100000001b3ull;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	return h ? h : 1;
+}
+
+/*
+ * Create an empty job
+ *
+ * mr: job to fill in, free with mpi_mr_free
+ * comm: MPI communicator the shuffle runs over
+ * value_size: bytes per value
+ * combine: folds value into acc in place (acc and value are value_size bytes)
+ * ctx: passed to combine
+ */
+void mpi_mr_create(mpi_mapreduce *mr, MPI_Comm comm, int value_size, mpi_mr_combine combine, void *ctx) {
+	memset(mr, 0, sizeof(*mr));
+	mr->comm = comm;
+	MPI_Comm_rank(comm, &mr->rank);
+	MPI_Comm_size(comm, &mr->size);
+	mr->value_size = value_size;
+	mr->combine = combine;
+	mr->ctx = ctx;
+	mr->num_slots = MPI_MR_INITIAL_SLOTS;
+	mr->slots = (_mpi_mr_slot *)calloc(mr->num_slots, sizeof(_mpi_mr_slot));
+}
+
+void mpi_mr_free(mpi_mapreduce *mr) {
+	mpi_mr_arena_free(&mr->arena);
+	free(mr->slots);
+	mr->slots = NULL;
+}
+
+/*
+ * Double the table (records stay where they are, only the slots move)
+ */
+void _mpi_mr_grow(mpi_mapreduce *mr) {
+	long long n = mr->num_slots * 2;
+	_mpi_mr_slot *slots = (_mpi_mr_slot *)calloc(n, sizeof(_mpi_mr_slot));
+	for (long long i = 0; i < mr->num_slots; i++) {
+		if (mr->slots[i].hash != 0) {
+			long long j = (long long)(mr->slots[i].hash & (uint64_t)(n - 1));
+			while (slots[j].hash != 0) {
+				j = (j + 1) & (n - 1);
+			}
+			slots[j] = mr->slots[i];
+		}
+	}
+	free(mr->slots);
+	mr->slots = slots;
+	mr->num_slots = n;
+}
+
+void _mpi_mr_insert(mpi_mapreduce *mr, uint64_t hash, const void *key, int key_len, const void *value) {
+	// keep the load factor under 0.7 so probe sequences stay short
+	if ((mr->count + 1) * 10 > mr->num_slots * 7) {
+		_mpi_mr_grow(mr);
+	}
+	long long mask = mr->num_slots - 1;
+	long long j = (long long)(hash & (uint64_t)mask);
+	for (;;) {
+		_mpi_mr_slot *s = &mr->slots[j];
+		if (s->hash == 0) {
+			size_t key_bytes = ((size_t)key_len + 7) & ~(size_t)7;
+			s->hash = hash;
+			s->key_len = key_len;
+			s->record = (char *)mpi_mr_arena_alloc(&mr->arena, key_bytes + mr->value_size);
+			memcpy(s->record, key, key_len);
+			memcpy(_mpi_mr_value(key_len, s->record), value, mr->value_size);
+			mr->count++;
+			return;
+		}
+		if (s->hash == hash && s->key_len == key_len && memcmp(s->record, key, key_len) == 0) {
+			mr->combine(_mpi_mr_value(key_len, s->record), value, mr->ctx);
+			return;
+		}
+		j = (j + 1) & mask;
+	}
+}
+
+/*
+ * Map output: add (key, value) to the local table, combining with the value already stored for key
+ */
+void mpi_mr_emit(mpi_mapreduce *mr, const void *key, int key_len, const void *value) {
+	_mpi_mr_insert(mr, _mpi_mr_hash(key, key_len), key, key_len, value);
+}
+
+/*
+ * Rank that owns a key after the shuffle (high hash bits, the table uses the low ones)
+ */
+int _mpi_mr_owner(const mpi_mapreduce *mr, uint64_t hash) {
+	return (int)((hash >> 32) % (uint64_t)mr->size);
+}
+
+/*
+ * Send every key to its owner and combine there (collective)
+ *
+ * Records are packed back to back per destination as [int key_len][key][value]
+ * into one send buffer, so the exchange is a count alltoall plus one alltoallv.
+ */
+void mpi_mr_shuffle(mpi_mapreduce *mr) {
+	int size = mr->size;
+	int *buf = (int *)calloc(4 * (size_t)size, sizeof(int));
+	int *send_counts = buf, *send_displs = buf + size, *recv_counts = buf + 2 * size, *recv_displs = buf + 3 * size;
+
+	for (long long i = 0; i < mr->num_slots; i++) {
+		if (mr->slots[i].hash != 0) {
+			send_counts[_mpi_mr_owner(mr, mr->slots[i].hash)] += (int)sizeof(int) + mr->slots[i].key_len + mr->value_size;
+		}
+	}
+	MPI_Alltoall(send_counts, 1, MPI_INT, recv_counts, 1, MPI_INT, mr->comm);
+	for (int r = 1; r < size; r++) {
+		send_displs[r] = send_displs[r - 1] + send_counts[r - 1];
+		recv_displs[r] = recv_displs[r - 1] + recv_counts[r - 1];
+	}
+	size_t send_bytes = (size_t)send_displs[size - 1] + send_counts[size - 1];
+	size_t recv_bytes = (size_t)recv_displs[size - 1] + recv_counts[size - 1];
+
+	char *send = (char *)malloc(send_bytes + 1);
+	char *recv = (char *)malloc(recv_bytes + 1);
+	int *next = (int *)malloc((size_t)size * sizeof(int));
+	memcpy(next, send_displs, (size_t)size * sizeof(int));
+	for (long long i = 0; i < mr->num_slots; i++) {
+		_mpi_mr_slot *s = &mr->slots[i];
+		if (s->hash == 0) {
+			continue;
+		}
+		char *p = send + next[_mpi_mr_owner(mr, s->hash)];
+		memcpy(p, &s->key_len, sizeof(int));
+		memcpy(p + sizeof(int), s->record, s->key_len);
+		memcpy(p + sizeof(int) + s->key_len, _mpi_mr_value(s->key_len, s->record), mr->value_size);
+		next[_mpi_mr_owner(mr, s->hash)] += (int)sizeof(int) + s->key_len + mr->value_size;
+	}
+
+	MPI_Alltoallv(send, send_counts, send_displs, MPI_BYTE, recv, recv_counts, recv_displs, MPI_BYTE, mr->comm);
+
+	// everything is in the send buffer now, start the table over on the same memory
+	memset(mr->slots, 0, (size_t)mr->num_slots * sizeof(_mpi_mr_slot));
+	mr->count = 0;
+	mpi_mr_arena_reset(&mr->arena);
+
+	// values may not be aligned inside the message, so go through an aligned copy
+	char *value = (char *)malloc((size_t)mr->value_size + 1);
+	for (size_t off = 0; off < recv_bytes;) {
+		int key_len;
+		memcpy(&key_len, recv + off, sizeof(int));
+		const char *key = recv + off + sizeof(int);
+		memcpy(value, key + key_len, mr->value_size);
+		_mpi_mr_insert(mr, _mpi_mr_hash(key, key_len), key, key_len, value);
+		off += sizeof(int) + key_len + mr->value_size;
+	}
+
+	free(value);
+	free(next);
+	free(recv);
+	free(send);
+	free(buf);
+}
+
+/*
+ * Call visit for every key in the local table (after mpi_mr_shuffle: the keys this rank owns)
+ */
+void mpi_mr_for_each(const mpi_mapreduce *mr, mpi_mr_visit visit, void *ctx) {
+	for (long long i = 0; i < mr->num_slots; i++) {
+		const _mpi_mr_slot *s = &mr->slots[i];
+		if (s->hash != 0) {
+			visit(s->record, s->key_len, _mpi_mr_value(s->key_len, s->record), ctx);
+		}
+	}
+}
+
+/*
+ * Format one result as text into buf (at most cap bytes), returning the length like snprintf
+ * (a negative return is an error and stops mpi_mr_write_text)
+ */
+typedef int (*mpi_mr_format)(char *buf, size_t cap, const void *key, int key_len, const void *value, void *ctx);
+
+/*
+ * Write every rank's results to one text file in parallel (collective)
+ * Ranks' parts follow each other in rank order, see mpi_write_ordered.
+ *
+ * returns MPI_SUCCESS, MPI_ERR_OTHER if format failed on any rank, MPI_ERR_COUNT if
+ * a rank's text is over INT_MAX bytes, or the MPI-IO error (nothing is written on an error)
+ */
+int mpi_mr_write_text(const mpi_mapreduce *mr, const char *filename, mpi_mr_format format, void *ctx) {
+	size_t cap = 4096, len = 0;
+	char *text = (char *)malloc(cap);
+	int err = MPI_SUCCESS;
+	for (long long i = 0; i < mr->num_slots && err == MPI_SUCCESS; i++) {
+		const _mpi_mr_slot *s = &mr->slots[i];
+		if (s->hash == 0) {
+			continue;
+		}
+		for (;;) {
+			int n = format(text + len, cap - len, s->record, s->key_len, _mpi_mr_value(s->key_len, s->record), ctx);
+			if (n < 0) {
+				err = MPI_ERR_OTHER;
+				break;
+			}
+			if ((size_t)n < cap - len) {
+				len += (size_t)n;
+				break;
+			}
+			cap = (len + (size_t)n + 1) * 2;
+			text = (char *)realloc(text, cap);
+		}
+	}
+	if (err == MPI_SUCCESS && len > INT_MAX) {
+		err = MPI_ERR_COUNT;
+	}
+	// the write is collective, so a failure on one rank has to stop all of them
+	err = _mpi_io_agree(mr->comm, err);
+	if (err == MPI_SUCCESS) {
+		err = mpi_write_ordered(mr->comm, filename, MPI_IO_TRUNCATE, text, (int)len);
+	}
+	free(text);
+	return err;
+}
+
+#endif
@@ -0,0 +1,283 @@
+#ifndef MPI_NUMA_H
+#define MPI_NUMA_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mpi.h>
+
+#include "mpi_helper.h"
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Where every rank runs: node, socket, NUMA domain and core.
+ *
+ * MPI_Get_processor_name only gives the host. Here each rank asks the kernel
+ * which cpu and NUMA domain it is on (getcpu, the system call behind
+ * sched_getcpu) and reads the cpu's socket and core from sysfs; nodes come from
+ * MPI_Comm_split_type. From that the communicator is split into one
+ * sub-communicator per level (ranks sharing my node, my socket, my NUMA
+ * domain) plus a leaders communicator per level (the first rank of every
+ * group within the enclosing one), which is what a hierarchical collective or
+ * halo exchange needs on nodes with many NUMA domains (8 on a 128-core
+ * ARCHER2 node).
+ *
+ *   const mpi_numa_topo *t = mpi_numa_get();           // MPI_COMM_WORLD, built once
+ *   MPI_Bcast(buf, n, MPI_DOUBLE, 0, t->leaders[MPI_NUMA_NODE]);   // between nodes
+ *   MPI_Bcast(buf, n, MPI_DOUBLE, 0, t->level[MPI_NUMA_NODE]);     // then within
+ *
+ * The cached topology is freed at MPI_Finalize. Other communicators get their
+ * own with mpi_numa_topo_create. The cpu is only stable if ranks are bound to
+ * cores (srun --cpu-bind=cores, the default on ARCHER2); t->bound says whether
+ * they are.
+ *
+ * mpi_numa_alloc maps page-aligned memory, asks the kernel to prefer the
+ * calling rank's NUMA domain for it and touches every page from the calling
+ * thread, so the buffer is local before the first transfer. mpi_pool touches
+ * new blocks the same way (first touch).
+ */
+
+enum {
+	MPI_NUMA_NODE = 0,    // shared-memory node
+	MPI_NUMA_SOCKET = 1,  // socket (package) within the node
+	MPI_NUMA_DOMAIN = 2,  // NUMA domain within the socket
+	MPI_NUMA_LEVELS = 3
+};
+
+typedef struct {
+	int node;     // node index, nodes numbered by their lowest rank
+	int socket;   // physical package id
+	int numa;     // NUMA domain id as numbered by the OS
+	int cpu;      // logical cpu the rank ran on when asked
+	int core;     // core id within the socket
+} mpi_numa_place;
+
+typedef struct {
+	MPI_Comm comm;                       // communicator described
+	int rank, size;
+	mpi_numa_place me;
+	mpi_numa_place *all;                 // every rank of comm
+	MPI_Comm level[MPI_NUMA_LEVELS];     // ranks sharing my node / socket / NUMA domain
+	MPI_Comm leaders[MPI_NUMA_LEVELS];   // first rank of each group within the enclosing level, MPI_COMM_NULL on the others
+	int count[MPI_NUMA_LEVELS];          // nodes; sockets on my node; NUMA domains on my socket
+	int bound;                           // every rank is bound to a single cpu
+} mpi_numa_topo;
+
+/*
+ * Integer from a sysfs file, fallback if it cannot be read
+ */
+int _mpi_numa_sysfs_int(const char *path, int fallback) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		return fallback;
+	}
+	int value;
+	if (fscanf(f, "%d", &value) != 1) {
+		value = fallback;
+	}
+	fclose(f);
+	return value;
+}
+
+/*
+ * Where the calling thread runs right now; returns 1 if its affinity is a single cpu
+ */
+int _mpi_numa_locate(mpi_numa_place *p) {
+	unsigned cpu = 0, numa = 0;
+	int bound = 0;
+#ifdef __linux__
+	if (syscall(SYS_getcpu, &cpu, &numa, NULL) != 0) {
+		cpu = 0;
+		numa = 0;
+	}
+	unsigned long mask[1024 / (8 * sizeof(unsigned long))] = {0};
+	if (syscall(SYS_sched_getaffinity, 0, sizeof(mask), mask) > 0) {
+		int cpus = 0;
+		for (size_t i = 0; i < sizeof(mask) / sizeof(mask[0]); i++) {
+			cpus += __builtin_popcountl(mask[i]);
+		}
+		bound = cpus == 1;
+	}
+#endif
+	char path[96];
+	p->cpu = (int)cpu;
+	p->numa = (int)numa;
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/physical_package_id", cpu);
+	p->socket = _mpi_numa_sysfs_int(path, 0);
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/core_id", cpu);
+	p->core = _mpi_numa_sysfs_int(path, (int)cpu);
+	return bound;
+}
+
+/*
+ * Leaders of the groups split from parent: rank 0 of each group joins, size of the result to everyone in parent
+ */
+void _mpi_numa_leaders(MPI_Comm parent, MPI_Comm group, MPI_Comm *leaders, int *count, int *index) {
+	int group_rank, parent_rank;
+	MPI_Comm_rank(group, &group_rank);
+	MPI_Comm_rank(parent, &parent_rank);
+	MPI_Comm_split(parent, group_rank == 0 ? 0 : MPI_UNDEFINED, parent_rank, leaders);
+	int info[2] = {0, 0};
+	if (*leaders != MPI_COMM_NULL) {
+		MPI_Comm_size(*leaders, &info[0]);
+		MPI_Comm_rank(*leaders, &info[1]);
+	}
+	MPI_Bcast(info, 2, MPI_INT, 0, group);
+	*count = info[0];
+	if (index != NULL) {
+		*index = info[1];
+	}
+}
+
+/*
+ * Discover the topology of comm (collective, free with mpi_numa_topo_free)
+ */
+int mpi_numa_topo_create(MPI_Comm comm, mpi_numa_topo *t) {
+	memset(t, 0, sizeof(*t));
+	int err = MPI_Comm_dup(comm, &t->comm);
+	if (err != MPI_SUCCESS) {
+		return err;
+	}
+	MPI_Comm_rank(t->comm, &t->rank);
+	MPI_Comm_size(t->comm, &t->size);
+	int bound = _mpi_numa_locate(&t->me);
+
+	// node, then socket within it, then NUMA domain within that (keys keep the rank order)
+	MPI_Comm_split_type(t->comm, MPI_COMM_TYPE_SHARED, t->rank, MPI_INFO_NULL, &t->level[MPI_NUMA_NODE]);
+	MPI_Comm_split(t->level[MPI_NUMA_NODE], t->me.socket, t->rank, &t->level[MPI_NUMA_SOCKET]);
+	MPI_Comm_split(t->level[MPI_NUMA_SOCKET], t->me.numa, t->rank, &t->level[MPI_NUMA_DOMAIN]);
+
+	_mpi_numa_leaders(t->comm, t->level[MPI_NUMA_NODE], &t->leaders[MPI_NUMA_NODE], &t->count[MPI_NUMA_NODE], &t->me.node);
+	_mpi_numa_leaders(t->level[MPI_NUMA_NODE], t->level[MPI_NUMA_SOCKET], &t->leaders[MPI_NUMA_SOCKET], &t->count[MPI_NUMA_SOCKET], NULL);
+	_mpi_numa_leaders(t->level[MPI_NUMA_SOCKET], t->level[MPI_NUMA_DOMAIN], &t->leaders[MPI_NUMA_DOMAIN], &t->count[MPI_NUMA_DOMAIN], NULL);
+
+	t->all = (mpi_numa_place *)malloc(t->size * sizeof(mpi_numa_place));
+	MPI_Allgather(&t->me, 5, MPI_INT, t->all, 5, MPI_INT, t->comm);
+	MPI_Allreduce(&bound, &t->bound, 1, MPI_INT, MPI_MIN, t->comm);
+	return MPI_SUCCESS;
+}
+
+void mpi_numa_topo_free(mpi_numa_topo *t) {
+	for (int l = 0; l < MPI_NUMA_LEVELS; l++) {
+		if (t->leaders[l] != MPI_COMM_NULL) {
+			MPI_Comm_free(&t->leaders[l]);
+		}
+		MPI_Comm_free(&t->level[l]);
+	}
+	MPI_Comm_free(&t->comm);
+	free(t->all);
+	t->all = NULL;
+}
+
+static mpi_numa_topo _mpi_numa_world;
+static int _mpi_numa_world_ready = 0;
+
+int _mpi_numa_world_delete(MPI_Comm comm, int keyval, void *value, void *extra) {
+	(void)comm;
+	(void)value;
+	(void)extra;
+	if (_mpi_numa_world_ready) {
+		mpi_numa_topo_free(&_mpi_numa_world);
+		_mpi_numa_world_ready = 0;
+	}
+	MPI_Comm_free_keyval(&keyval);
+	return MPI_SUCCESS;
+}
+
+/*
+ * Topology of MPI_COMM_WORLD, built on the first call (which must be collective) and kept until MPI_Finalize
+ */
+const mpi_numa_topo *mpi_numa_get(void) {
+	if (!_mpi_numa_world_ready) {
+		mpi_numa_topo_create(MPI_COMM_WORLD, &_mpi_numa_world);
+		_mpi_numa_world_ready = 1;
+		// attributes on MPI_COMM_SELF are deleted first thing in MPI_Finalize, while communicators can still be freed
+		int keyval;
+		MPI_Comm_create_keyval(MPI_COMM_NULL_COPY_FN, _mpi_numa_world_delete, &keyval, NULL);
+		MPI_Comm_set_attr(MPI_COMM_SELF, keyval, NULL);
+	}
+	return &_mpi_numa_world;
+}
+
+/*
+ * Print where every rank runs (collective over t->comm, lines in rank order)
+ */
+void mpi_numa_report(const mpi_numa_topo *t) {
+	char name[MPI_MAX_PROCESSOR_NAME] = {0};
+	int len;
+	MPI_Get_processor_name(name, &len);
+	if (t->rank == 0) {
+		mpi_log_append(0, "numa: %d nodes, %d sockets x %d NUMA domains on rank 0's node, ranks %s\n",
+			t->count[MPI_NUMA_NODE], t->count[MPI_NUMA_SOCKET], t->count[MPI_NUMA_DOMAIN],
+			t->bound ? "bound to cores" : "not bound (cpus may change)");
+	}
+	mpi_log_append(1, "%s node %d socket %d numa %d core %d cpu %d\n", name, t->me.node, t->me.socket, t->me.numa, t->me.core, t->me.cpu);
+	mpi_log_flush(t->comm);
+}
+
+/*
+ * Write one byte per page from the calling thread, so the kernel backs every page on this thread's NUMA domain
+ */
+void mpi_numa_touch(void *buf, size_t bytes) {
+	const size_t page = 4096;
+	volatile char *p = (volatile char *)buf;
+	for (size_t i = 0; i < bytes; i += page) {
+		p[i] = 0;
+	}
+	if (bytes > 0) {
+		p[bytes - 1] = 0;
+	}
+}
+
+/*
+ * Page-aligned zeroed memory on the calling rank's NUMA domain (free with mpi_numa_free), NULL on failure
+ *
+ * The domain is a preference (MPOL_PREFERRED), so a full domain spills over instead of failing.
+ */
+void *mpi_numa_alloc(size_t bytes) {
+	if (bytes == 0) {
+		bytes = 1;
+	}
+	void *buf;
+#ifdef __linux__
+	buf = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED) {
+		return NULL;
+	}
+	unsigned cpu, numa;
+	if (syscall(SYS_getcpu, &cpu, &numa, NULL) == 0 && numa < 1024) {
+		const int mpol_preferred = 1;
+		unsigned long nodes[1024 / (8 * sizeof(unsigned long))] = {0};
+		nodes[numa / (8 * sizeof(unsigned long))] |= 1UL << (numa % (8 * sizeof(unsigned long)));
+		// best effort: without NUMA support (or allowed by seccomp) first touch still places the pages
+		syscall(SYS_mbind, buf, bytes, mpol_preferred, nodes, (unsigned long)1024, 0);
+	}
+#else
+	if (posix_memalign(&buf, 4096, bytes) != 0) {
+		return NULL;
+	}
+	memset(buf, 0, bytes);
+#endif
+	mpi_numa_touch(buf, bytes);
+	return buf;
+}
+
+void mpi_numa_free(void *buf, size_t bytes) {
+	if (buf == NULL) {
+		return;
+	}
+#ifdef __linux__
+	munmap(buf, bytes > 0 ? bytes : 1);
+#else
+	(void)bytes;
+	free(buf);
+#endif
+}
+
+#endif
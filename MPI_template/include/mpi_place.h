@@ -0,0 +1,548 @@
+#ifndef MPI_PLACE_H
+#define MPI_PLACE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mpi.h>
+
+#include "mpi_helper.h"
+
+/*
+ * Communication-aware rank placement.
+ *
+ * The job scripts place ranks with --distribution=block:block whatever the
+ * communication pattern, so neighbours in a shuffled or badly numbered pattern
+ * can end up on different sockets or nodes. Given how many bytes every rank
+ * sends to every other rank (a row of the communication matrix per rank, e.g.
+ * counted in the application's send wrappers) and the node/socket layout, the
+ * ranks are partitioned hierarchically: first into nodes, then each node's
+ * ranks into sockets, each level by greedy graph growing followed by
+ * Kernighan-Lin style swap refinement. Heavy edges end up inside a socket,
+ * then inside a node.
+ *
+ * The plan can be used in three ways:
+ *   - mpi_place_apply: a communicator in which every logical rank runs on the
+ *     core chosen for it (MPI_Comm_split on the running job, nothing restarts)
+ *   - mpi_place_write_hostfile: one host per rank for the next run,
+ *     SLURM_HOSTFILE=<file> srun --distribution=arbitrary ... (node level only,
+ *     srun binds a node's tasks to cores in rank order)
+ *   - mpi_place_dist_graph: the weighted graph handed to MPI_Dist_graph_create
+ *     with reorder=1, leaving the mapping to the library
+ *
+ *   mpi_place_plan plan;
+ *   mpi_place_plan_create(MPI_COMM_WORLD, bytes_to, 0, &plan);
+ *   mpi_place_report(MPI_COMM_WORLD, &plan);   // estimated traffic per level, before and after
+ *   mpi_place_apply(MPI_COMM_WORLD, &plan, &comm);
+ *
+ * A core is a slot: slot s is core s % per_node of node s / per_node, and the
+ * sockets of a node own consecutive runs of cores, which is what block:block
+ * binding gives. The whole matrix is built on rank 0 (8 n^2 bytes), so this is
+ * meant for up to a few thousand ranks. mpi_place_compute and the matrix files
+ * work offline on a single rank.
+ */
+
+#ifndef MPI_PLACE_NODE_WEIGHT
+#define MPI_PLACE_NODE_WEIGHT 10.0     // relative cost of a byte between nodes
+#endif
+#ifndef MPI_PLACE_SOCKET_WEIGHT
+#define MPI_PLACE_SOCKET_WEIGHT 2.0    // relative cost of a byte between the sockets of a node
+#endif
+#ifndef MPI_PLACE_PASSES
+#define MPI_PLACE_PASSES 16            // refinement passes per partition
+#endif
+
+typedef struct {
+	int nodes;
+	int sockets;   // per node
+	int cores;     // per socket
+} mpi_place_layout;
+
+typedef struct {
+	double inter_node;     // bytes between ranks on different nodes
+	double inter_socket;   // bytes between different sockets of a node
+	double intra_socket;   // bytes that stay within a socket
+	double cost;           // the above weighted by MPI_PLACE_NODE_WEIGHT, MPI_PLACE_SOCKET_WEIGHT and 1
+} mpi_place_traffic;
+
+typedef struct {
+	int n;                     // ranks in the communicator
+	mpi_place_layout layout;
+	int *current;              // slot each rank runs on now
+	int *slot;                 // slot chosen for each rank
+	mpi_place_traffic before;  // estimated from the matrix for current
+	mpi_place_traffic after;   // and for slot
+} mpi_place_plan;
+
+static inline int _mpi_place_per_node(const mpi_place_layout *l) {
+	return l->sockets * l->cores;
+}
+
+static inline int _mpi_place_node(const mpi_place_layout *l, int slot) {
+	return slot / _mpi_place_per_node(l);
+}
+
+static inline int _mpi_place_socket(const mpi_place_layout *l, int slot) {
+	return slot / l->cores;  // global socket index
+}
+
+/*
+ * Bytes per level when rank r runs on slot[r]
+ */
+void mpi_place_traffic_of(const double *matrix, int n, const mpi_place_layout *l, const int *slot, mpi_place_traffic *t) {
+	memset(t, 0, sizeof(*t));
+	for (int i = 0; i < n; i++) {
+		for (int j = 0; j < n; j++) {
+			double bytes = matrix[(size_t)i * n + j];
+			if (i == j || bytes == 0) {
+				continue;
+			}
+			if (_mpi_place_node(l, slot[i]) != _mpi_place_node(l, slot[j])) {
+				t->inter_node += bytes;
+			} else if (_mpi_place_socket(l, slot[i]) != _mpi_place_socket(l, slot[j])) {
+				t->inter_socket += bytes;
+			} else {
+				t->intra_socket += bytes;
+			}
+		}
+	}
+	t->cost = MPI_PLACE_NODE_WEIGHT * t->inter_node + MPI_PLACE_SOCKET_WEIGHT * t->inter_socket + t->intra_socket;
+}
+
+/*
+ * Split the nv vertices verts[] into parts of exactly cap[p] vertices each, keeping heavy edges inside parts
+ *
+ * w: symmetric n x n edge weights
+ * part: set to the part of verts[i]
+ */
+void _mpi_place_partition(const double *w, int n, const int *verts, int nv, int parts, const int *cap, int *part) {
+	if (parts == 1) {
+		memset(part, 0, nv * sizeof(int));
+		return;
+	}
+	double *conn = (double *)malloc(nv * sizeof(double));
+
+	// greedy growing: each part starts from the free vertex most tied to the parts already built
+	// (continuing a chain or a surface rather than tearing it) and absorbs its heaviest neighbours
+	for (int i = 0; i < nv; i++) {
+		part[i] = -1;
+		conn[i] = 0;
+	}
+	for (int p = 0; p < parts; p++) {
+		double *to_part = (double *)calloc(nv, sizeof(double));
+		for (int filled = 0; filled < cap[p]; filled++) {
+			int best = -1;
+			for (int i = 0; i < nv; i++) {
+				if (part[i] != -1) {
+					continue;
+				}
+				double score = filled == 0 ? conn[i] : to_part[i];
+				double best_score = best < 0 ? -1 : (filled == 0 ? conn[best] : to_part[best]);
+				if (score > best_score) {
+					best = i;
+				}
+			}
+			part[best] = p;
+			const double *row = w + (size_t)verts[best] * n;
+			for (int i = 0; i < nv; i++) {
+				to_part[i] += row[verts[i]];
+				conn[i] += row[verts[i]];
+			}
+		}
+		free(to_part);
+	}
+
+	// refinement: swap vertex pairs between parts while that lowers the cut
+	// ext[i * parts + p] is the weight from verts[i] to part p
+	double *ext = (double *)calloc((size_t)nv * parts, sizeof(double));
+	for (int i = 0; i < nv; i++) {
+		const double *row = w + (size_t)verts[i] * n;
+		for (int j = 0; j < nv; j++) {
+			if (j != i) {
+				ext[(size_t)i * parts + part[j]] += row[verts[j]];
+			}
+		}
+	}
+	for (int pass = 0; pass < MPI_PLACE_PASSES; pass++) {
+		int swaps = 0;
+		for (int a = 0; a < nv; a++) {
+			int pa = part[a], best = -1;
+			double best_gain = 1e-9;
+			const double *row_a = w + (size_t)verts[a] * n;
+			for (int b = 0; b < nv; b++) {
+				int pb = part[b];
+				if (pb == pa) {
+					continue;
+				}
+				double gain = ext[(size_t)a * parts + pb] - ext[(size_t)a * parts + pa]
+					+ ext[(size_t)b * parts + pa] - ext[(size_t)b * parts + pb] - 2 * row_a[verts[b]];
+				if (gain > best_gain) {
+					best_gain = gain;
+					best = b;
+				}
+			}
+			if (best < 0) {
+				continue;
+			}
+			int pb = part[best];
+			const double *row_b = w + (size_t)verts[best] * n;
+			for (int i = 0; i < nv; i++) {
+				double wa = row_a[verts[i]], wb = row_b[verts[i]];
+				ext[(size_t)i * parts + pa] += wb - wa;
+				ext[(size_t)i * parts + pb] += wa - wb;
+			}
+			// (also right for a and best themselves, the diagonal of w being zero)
+			part[a] = pb;
+			part[best] = pa;
+			swaps++;
+		}
+		if (swaps == 0) {
+			break;
+		}
+	}
+	free(ext);
+	free(conn);
+}
+
+/*
+ * Choose a slot for each of n ranks (sequential, works offline)
+ *
+ * matrix: n x n bytes, matrix[i * n + j] sent from rank i to rank j
+ * avail: the n slots to hand out (NULL for 0 .. n-1)
+ * slot: set to the slot of every rank
+ */
+int mpi_place_compute(const double *matrix, int n, const mpi_place_layout *l, const int *avail, int *slot) {
+	int per_node = _mpi_place_per_node(l);
+	int *slots = (int *)malloc(n * sizeof(int));
+	for (int i = 0; i < n; i++) {
+		slots[i] = avail != NULL ? avail[i] : i;
+		if (slots[i] < 0 || slots[i] >= l->nodes * per_node) {
+			free(slots);
+			return MPI_ERR_ARG;
+		}
+	}
+	// slots grouped by node, then socket (ascending slot order does both)
+	for (int i = 1; i < n; i++) {
+		int s = slots[i], j = i - 1;
+		for (; j >= 0 && slots[j] > s; j--) {
+			slots[j + 1] = slots[j];
+		}
+		slots[j + 1] = s;
+	}
+
+	double *w = (double *)malloc((size_t)n * n * sizeof(double));
+	for (int i = 0; i < n; i++) {
+		for (int j = 0; j < n; j++) {
+			w[(size_t)i * n + j] = i == j ? 0.0 : matrix[(size_t)i * n + j] + matrix[(size_t)j * n + i];
+		}
+	}
+
+	int groups = l->nodes > l->sockets ? l->nodes : l->sockets;
+	int *cap = (int *)malloc(groups * sizeof(int));
+	int *verts = (int *)malloc(n * sizeof(int));
+	int *sub = (int *)malloc(n * sizeof(int));
+	int *part = (int *)malloc(n * sizeof(int));
+	int *node_of = (int *)malloc(n * sizeof(int));
+
+	// level 1: ranks to nodes, sized by the slots each node has
+	memset(cap, 0, groups * sizeof(int));
+	for (int i = 0; i < n; i++) {
+		cap[_mpi_place_node(l, slots[i])]++;
+		verts[i] = i;
+	}
+	_mpi_place_partition(w, n, verts, n, l->nodes, cap, node_of);
+
+	// level 2: each node's ranks to its sockets, then to the slots of each socket in order
+	int next = 0;
+	for (int node = 0; node < l->nodes; node++) {
+		int nv = 0;
+		for (int i = 0; i < n; i++) {
+			if (node_of[i] == node) {
+				sub[nv++] = i;
+			}
+		}
+		memset(cap, 0, groups * sizeof(int));
+		for (int k = next; k < next + nv; k++) {
+			cap[_mpi_place_socket(l, slots[k]) % l->sockets]++;
+		}
+		_mpi_place_partition(w, n, sub, nv, l->sockets, cap, part);
+		for (int s = 0; s < l->sockets; s++) {
+			for (int i = 0; i < nv; i++) {
+				if (part[i] == s) {
+					slot[sub[i]] = slots[next++];
+				}
+			}
+		}
+	}
+
+	free(node_of);
+	free(part);
+	free(sub);
+	free(verts);
+	free(cap);
+	free(w);
+	free(slots);
+	return MPI_SUCCESS;
+}
+
+/*
+ * Layout of the machine under comm (collective)
+ *
+ * Nodes come from MPI_Comm_split_type, numbered by their lowest rank.
+ * sockets: sockets per node, 0 to count them in sysfs (1 if that fails)
+ * my_slot: set to the calling rank's slot (node * per_node + rank on the node)
+ */
+int mpi_place_layout_from_comm(MPI_Comm comm, int sockets, mpi_place_layout *l, int *my_slot) {
+	int rank;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm node_comm, leaders;
+	MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node_comm);
+	int local_rank, local_size;
+	MPI_Comm_rank(node_comm, &local_rank);
+	MPI_Comm_size(node_comm, &local_size);
+
+	MPI_Comm_split(comm, local_rank == 0 ? 0 : MPI_UNDEFINED, rank, &leaders);
+	int node = 0;
+	if (leaders != MPI_COMM_NULL) {
+		MPI_Comm_rank(leaders, &node);
+		MPI_Comm_free(&leaders);
+	}
+	MPI_Bcast(&node, 1, MPI_INT, 0, node_comm);
+	MPI_Comm_free(&node_comm);
+
+	int local[2] = {node + 1, local_size}, global[2];
+	MPI_Allreduce(local, global, 2, MPI_INT, MPI_MAX, comm);
+
+	if (sockets <= 0) {
+		sockets = 0;
+		for (int cpu = 0; cpu < 4096; cpu++) {
+			char path[96];
+			snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+			FILE *f = fopen(path, "r");
+			if (f == NULL) {
+				break;
+			}
+			int id;
+			if (fscanf(f, "%d", &id) == 1 && id + 1 > sockets) {
+				sockets = id + 1;
+			}
+			fclose(f);
+		}
+		MPI_Allreduce(MPI_IN_PLACE, &sockets, 1, MPI_INT, MPI_MAX, comm);
+		if (sockets <= 0) {
+			sockets = 1;
+		}
+	}
+	if (sockets > global[1]) {
+		sockets = global[1];
+	}
+
+	l->nodes = global[0];
+	l->sockets = sockets;
+	l->cores = (global[1] + sockets - 1) / sockets;
+	*my_slot = node * _mpi_place_per_node(l) + local_rank;
+	return MPI_SUCCESS;
+}
+
+/*
+ * Work out a placement for comm (collective; the plan is the same on every rank)
+ *
+ * row: bytes this rank sends to each rank of comm (size entries)
+ * sockets: sockets per node, 0 to detect
+ *
+ * If the chosen placement is not estimated to be cheaper the current one is kept.
+ */
+int mpi_place_plan_create(MPI_Comm comm, const double *row, int sockets, mpi_place_plan *p) {
+	int rank, size;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &size);
+	memset(p, 0, sizeof(*p));
+	p->n = size;
+
+	int my_slot;
+	mpi_place_layout_from_comm(comm, sockets, &p->layout, &my_slot);
+	p->current = (int *)malloc(size * sizeof(int));
+	p->slot = (int *)malloc(size * sizeof(int));
+	MPI_Allgather(&my_slot, 1, MPI_INT, p->current, 1, MPI_INT, comm);
+
+	double *matrix = rank == 0 ? (double *)malloc((size_t)size * size * sizeof(double)) : NULL;
+	MPI_Gather(row, size, MPI_DOUBLE, matrix, size, MPI_DOUBLE, 0, comm);
+	int err = MPI_SUCCESS;
+	if (rank == 0) {
+		err = mpi_place_compute(matrix, size, &p->layout, p->current, p->slot);
+		mpi_place_traffic_of(matrix, size, &p->layout, p->current, &p->before);
+		mpi_place_traffic_of(matrix, size, &p->layout, p->slot, &p->after);
+		if (err != MPI_SUCCESS || p->after.cost >= p->before.cost) {
+			memcpy(p->slot, p->current, size * sizeof(int));
+			p->after = p->before;
+		}
+		free(matrix);
+	}
+	MPI_Bcast(&err, 1, MPI_INT, 0, comm);
+	MPI_Bcast(p->slot, size, MPI_INT, 0, comm);
+	MPI_Bcast(&p->before, 4, MPI_DOUBLE, 0, comm);
+	MPI_Bcast(&p->after, 4, MPI_DOUBLE, 0, comm);
+	return err;
+}
+
+void mpi_place_plan_free(mpi_place_plan *p) {
+	free(p->current);
+	free(p->slot);
+	p->current = p->slot = NULL;
+}
+
+/*
+ * Communicator in which rank r of comm runs on p->slot[r] (collective, free placed with MPI_Comm_free)
+ *
+ * Use placed (and ranks in it) in place of comm afterwards; data already tied to the old ranks has to move.
+ */
+int mpi_place_apply(MPI_Comm comm, const mpi_place_plan *p, MPI_Comm *placed) {
+	int rank;
+	MPI_Comm_rank(comm, &rank);
+	int key = rank;
+	for (int r = 0; r < p->n; r++) {
+		if (p->slot[r] == p->current[rank]) {
+			key = r;
+			break;
+		}
+	}
+	return MPI_Comm_split(comm, 0, key, placed);
+}
+
+/*
+ * Write the SLURM_HOSTFILE for running the plan with srun --distribution=arbitrary (collective, rank 0 writes)
+ */
+int mpi_place_write_hostfile(MPI_Comm comm, const mpi_place_plan *p, const char *path) {
+	int rank, len;
+	MPI_Comm_rank(comm, &rank);
+	char name[MPI_MAX_PROCESSOR_NAME] = {0};
+	MPI_Get_processor_name(name, &len);
+	char *names = rank == 0 ? (char *)malloc((size_t)p->n * MPI_MAX_PROCESSOR_NAME) : NULL;
+	MPI_Gather(name, MPI_MAX_PROCESSOR_NAME, MPI_CHAR, names, MPI_MAX_PROCESSOR_NAME, MPI_CHAR, 0, comm);
+
+	int err = MPI_SUCCESS;
+	if (rank == 0) {
+		// host of each node, from any rank running there
+		const char **host = (const char **)calloc(p->layout.nodes, sizeof(char *));
+		for (int r = 0; r < p->n; r++) {
+			host[_mpi_place_node(&p->layout, p->current[r])] = names + (size_t)r * MPI_MAX_PROCESSOR_NAME;
+		}
+		FILE *f = fopen(path, "w");
+		if (f == NULL) {
+			err = MPI_ERR_FILE;
+		} else {
+			for (int r = 0; r < p->n; r++) {
+				fprintf(f, "%s\n", host[_mpi_place_node(&p->layout, p->slot[r])]);
+			}
+			fclose(f);
+		}
+		free(host);
+		free(names);
+	}
+	MPI_Bcast(&err, 1, MPI_INT, 0, comm);
+	return err;
+}
+
+/*
+ * Print the estimated traffic per level before and after (on rank 0 of comm)
+ */
+void mpi_place_report(MPI_Comm comm, const mpi_place_plan *p) {
+	int rank;
+	MPI_Comm_rank(comm, &rank);
+	if (rank != 0) {
+		return;
+	}
+	const mpi_place_traffic *b = &p->before, *a = &p->after;
+	double saved = b->cost > 0 ? 100.0 * (b->cost - a->cost) / b->cost : 0.0;
+	mpi_log_append(0, "place: %d nodes x %d sockets x %d cores; inter-node %.3g -> %.3g B, inter-socket %.3g -> %.3g B, "
+		"intra-socket %.3g -> %.3g B, estimated cost -%.1f%%\n",
+		p->layout.nodes, p->layout.sockets, p->layout.cores, b->inter_node, a->inter_node,
+		b->inter_socket, a->inter_socket, b->intra_socket, a->intra_socket, saved);
+}
+
+/*
+ * Graph communicator from each rank's row of the matrix, reorder left to MPI (collective)
+ *
+ * Edge weights are the byte counts, scaled down if the largest does not fit in an int.
+ */
+int mpi_place_dist_graph(MPI_Comm comm, const double *row, MPI_Comm *graph) {
+	int size;
+	MPI_Comm_size(comm, &size);
+	double *col = (double *)malloc(size * sizeof(double));
+	MPI_Alltoall(row, 1, MPI_DOUBLE, col, 1, MPI_DOUBLE, comm);
+
+	double max = 0;
+	for (int i = 0; i < size; i++) {
+		if (row[i] > max) max = row[i];
+		if (col[i] > max) max = col[i];
+	}
+	MPI_Allreduce(MPI_IN_PLACE, &max, 1, MPI_DOUBLE, MPI_MAX, comm);
+	double scale = max > INT_MAX ? (double)INT_MAX / max : 1.0;
+
+	int *sources = (int *)malloc(size * sizeof(int)), *source_weights = (int *)malloc(size * sizeof(int));
+	int *dests = (int *)malloc(size * sizeof(int)), *dest_weights = (int *)malloc(size * sizeof(int));
+	int indegree = 0, outdegree = 0;
+	for (int i = 0; i < size; i++) {
+		if (col[i] > 0) {
+			sources[indegree] = i;
+			source_weights[indegree++] = col[i] * scale < 1 ? 1 : (int)(col[i] * scale);
+		}
+		if (row[i] > 0) {
+			dests[outdegree] = i;
+			dest_weights[outdegree++] = row[i] * scale < 1 ? 1 : (int)(row[i] * scale);
+		}
+	}
+	int err = MPI_Dist_graph_create_adjacent(comm, indegree, sources, source_weights, outdegree, dests, dest_weights,
+		MPI_INFO_NULL, 1, graph);
+
+	free(dest_weights);
+	free(dests);
+	free(source_weights);
+	free(sources);
+	free(col);
+	return err;
+}
+
+/*
+ * Communication matrix files: n, then n rows of n byte counts (text, so they can be edited or generated)
+ */
+int mpi_place_matrix_write(const char *path, const double *matrix, int n) {
+	FILE *f = fopen(path, "w");
+	if (f == NULL) {
+		return MPI_ERR_FILE;
+	}
+	fprintf(f, "%d\n", n);
+	for (int i = 0; i < n; i++) {
+		for (int j = 0; j < n; j++) {
+			fprintf(f, j + 1 < n ? "%.17g " : "%.17g\n", matrix[(size_t)i * n + j]);
+		}
+	}
+	fclose(f);
+	return MPI_SUCCESS;
+}
+
+/*
+ * returns the matrix (free with free), NULL if the file cannot be read; n is set to its size
+ */
+double *mpi_place_matrix_read(const char *path, int *n) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		return NULL;
+	}
+	double *matrix = NULL;
+	if (fscanf(f, "%d", n) == 1 && *n > 0) {
+		matrix = (double *)malloc((size_t)*n * *n * sizeof(double));
+		for (size_t i = 0; i < (size_t)*n * *n; i++) {
+			if (fscanf(f, "%lf", &matrix[i]) != 1) {
+				free(matrix);
+				matrix = NULL;
+				break;
+			}
+		}
+	}
+	fclose(f);
+	return matrix;
+}
+
+#endif
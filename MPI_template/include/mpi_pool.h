@@ -0,0 +1,331 @@
+#ifndef MPI_POOL_H
+#define MPI_POOL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mpi.h>
+
+#include "mpi_log.h"
+
+/*
+ * Size-class pool for communication buffers.
+ *
+ * Requests are rounded up to a power of two (64 B up to MPI_POOL_MAX_BYTES)
+ * and served from free lists, so a loop that needs the same temporaries every
+ * iteration only touches the system allocator on its first pass. Every block
+ * is MPI_POOL_ALIGN aligned. Larger requests bypass the pool.
+ *
+ * Freed blocks go to a small per-thread cache first (no locking), and only
+ * spill to the shared lists when that cache is full, so a block can be freed
+ * by a different thread than the one that allocated it.
+ *
+ * Blocks normally come from posix_memalign. After mpi_pool_set_backing
+ * (MPI_POOL_ALLOC_MEM), or when compiled with -DMPI_POOL_USE_ALLOC_MEM, new
+ * blocks come from MPI_Alloc_mem instead so the interconnect can register
+ * them once. That memory has to go back before MPI_Finalize: MPI_MAIN calls
+ * mpi_pool_trim for the main thread, other threads must call it themselves
+ * before they exit.
+ *
+ * New blocks are touched (one write per page) by the allocating thread, so
+ * with first-touch placement their pages land on that rank's NUMA domain
+ * rather than wherever the first MPI transfer happens to run. Compile with
+ * -DMPI_POOL_FIRST_TOUCH=0 to skip it.
+ *
+ * mpi_pool_get_stats / mpi_pool_report give hit rates and high-water marks.
+ */
+
+#ifndef MPI_POOL_ALIGN
+#define MPI_POOL_ALIGN 64               // alignment of every block (a cache line)
+#endif
+#ifndef MPI_POOL_CACHE_DEPTH
+#define MPI_POOL_CACHE_DEPTH 8          // free blocks kept per size class in each thread's cache
+#endif
+#ifndef MPI_POOL_FIRST_TOUCH
+#define MPI_POOL_FIRST_TOUCH 1          // touch every page of a new block from the allocating thread
+#endif
+#define MPI_POOL_MIN_SHIFT 6            // smallest class is 64 bytes
+#define MPI_POOL_NUM_CLASSES 21         // 64 B .. 64 MiB
+#define MPI_POOL_MAX_BYTES ((size_t)1 << (MPI_POOL_MIN_SHIFT + MPI_POOL_NUM_CLASSES - 1))
+
+#if defined(__GNUC__)
+#define MPI_POOL_TLS __thread
+#elif defined(__cplusplus)
+#define MPI_POOL_TLS thread_local
+#else
+#define MPI_POOL_TLS _Thread_local
+#endif
+
+enum {
+	MPI_POOL_MALLOC = 0,     // posix_memalign
+	MPI_POOL_ALLOC_MEM = 1   // MPI_Alloc_mem (falls back to posix_memalign outside MPI_Init/MPI_Finalize)
+};
+
+// sits in front of every block, padded so the payload keeps the block's alignment
+typedef union _mpi_pool_header {
+	struct {
+		union _mpi_pool_header *next;  // free list link while the block is free
+		void *base;                    // what the backing allocator returned
+		size_t bytes;                  // usable bytes after the header
+		int size_class;                // -1 for blocks too large for the pool
+		int backing;                   // MPI_POOL_MALLOC or MPI_POOL_ALLOC_MEM
+	} h;
+	char pad[MPI_POOL_ALIGN];
+} _mpi_pool_header;
+
+typedef struct {
+	unsigned long long allocs;       // mpi_pool_alloc calls
+	unsigned long long hits;         // served from a free list
+	unsigned long long misses;       // needed a fresh block from the backing allocator
+	size_t in_use;                   // bytes currently handed out (rounded to the size class)
+	size_t in_use_high_water;        // peak of in_use
+	size_t reserved;                 // bytes held from the backing allocator (in use + cached)
+	size_t reserved_high_water;      // peak of reserved
+} mpi_pool_stats;
+
+typedef struct {
+	_mpi_pool_header *head[MPI_POOL_NUM_CLASSES];
+	int count[MPI_POOL_NUM_CLASSES];
+} _mpi_pool_cache;
+
+static MPI_POOL_TLS _mpi_pool_cache _mpi_pool_local;
+static _mpi_pool_header *_mpi_pool_shared[MPI_POOL_NUM_CLASSES];
+static char _mpi_pool_lock = 0;
+static mpi_pool_stats _mpi_pool_counters;
+#ifdef MPI_POOL_USE_ALLOC_MEM
+static int _mpi_pool_backing = MPI_POOL_ALLOC_MEM;
+#else
+static int _mpi_pool_backing = MPI_POOL_MALLOC;
+#endif
+
+/*
+ * Choose where new blocks come from (blocks already in the pool keep their backing)
+ */
+void mpi_pool_set_backing(int backing) {
+	_mpi_pool_backing = backing;
+}
+
+/*
+ * Size class of a request, -1 if it is too large for the pool
+ */
+static inline int _mpi_pool_class(size_t bytes) {
+	if (bytes > MPI_POOL_MAX_BYTES) {
+		return -1;
+	}
+	if (bytes <= ((size_t)1 << MPI_POOL_MIN_SHIFT)) {
+		return 0;
+	}
+	// bits needed for bytes - 1 = log2 of the next power of two
+	return (int)(64 - __builtin_clzll((unsigned long long)(bytes - 1))) - MPI_POOL_MIN_SHIFT;
+}
+
+static inline void _mpi_pool_shared_lock(void) {
+	while (__atomic_test_and_set(&_mpi_pool_lock, __ATOMIC_ACQUIRE)) {
+	}
+}
+
+static inline void _mpi_pool_shared_unlock(void) {
+	__atomic_clear(&_mpi_pool_lock, __ATOMIC_RELEASE);
+}
+
+// add delta to a counter and raise its high-water mark if needed
+static inline void _mpi_pool_track(size_t *value, size_t *high_water, size_t delta) {
+	size_t now = __atomic_add_fetch(value, delta, __ATOMIC_RELAXED);
+	size_t peak = __atomic_load_n(high_water, __ATOMIC_RELAXED);
+	while (now > peak && !__atomic_compare_exchange_n(high_water, &peak, now, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	}
+}
+
+/*
+ * Get a fresh block of the given class (or exact size for oversized requests) from the backing allocator
+ */
+_mpi_pool_header *_mpi_pool_new(int size_class, size_t bytes) {
+	if (size_class >= 0) {
+		bytes = (size_t)1 << (MPI_POOL_MIN_SHIFT + size_class);
+	}
+	size_t total = sizeof(_mpi_pool_header) + bytes;
+	void *base = NULL;
+	int backing = _mpi_pool_backing;
+
+	if (backing == MPI_POOL_ALLOC_MEM) {
+		int initialized, finalized;
+		MPI_Initialized(&initialized);
+		MPI_Finalized(&finalized);
+		// MPI_Alloc_mem only promises the alignment malloc gives, so over-allocate and align by hand
+		if (!initialized || finalized || MPI_Alloc_mem((MPI_Aint)(total + MPI_POOL_ALIGN), MPI_INFO_NULL, &base) != MPI_SUCCESS) {
+			backing = MPI_POOL_MALLOC;
+			base = NULL;
+		}
+	}
+	if (backing == MPI_POOL_MALLOC && posix_memalign(&base, MPI_POOL_ALIGN, total) != 0) {
+		return NULL;
+	}
+
+	size_t addr = ((size_t)base + MPI_POOL_ALIGN - 1) & ~(size_t)(MPI_POOL_ALIGN - 1);
+	_mpi_pool_header *h = (_mpi_pool_header *)addr;
+	h->h.next = NULL;
+	h->h.base = base;
+	h->h.bytes = bytes;
+	h->h.size_class = size_class;
+	h->h.backing = backing;
+#if MPI_POOL_FIRST_TOUCH
+	volatile char *page = (volatile char *)h + sizeof(_mpi_pool_header);
+	for (size_t i = 0; i < bytes; i += 4096) {
+		page[i] = 0;
+	}
+#endif
+	_mpi_pool_track(&_mpi_pool_counters.reserved, &_mpi_pool_counters.reserved_high_water, bytes);
+	return h;
+}
+
+/*
+ * Give a block back to its backing allocator
+ */
+void _mpi_pool_release(_mpi_pool_header *h) {
+	__atomic_sub_fetch(&_mpi_pool_counters.reserved, h->h.bytes, __ATOMIC_RELAXED);
+	if (h->h.backing == MPI_POOL_ALLOC_MEM) {
+		int finalized;
+		MPI_Finalized(&finalized);
+		if (!finalized) {
+			MPI_Free_mem(h->h.base);
+		}
+		return; // after MPI_Finalize the memory is no longer ours to free
+	}
+	free(h->h.base);
+}
+
+/*
+ * Allocate a communication buffer of at least bytes bytes, MPI_POOL_ALIGN aligned
+ *
+ * returns NULL if the backing allocator fails; release with mpi_pool_free
+ */
+void *mpi_pool_alloc(size_t bytes) {
+	int c = _mpi_pool_class(bytes);
+	_mpi_pool_header *h = NULL;
+
+	if (c >= 0) {
+		h = _mpi_pool_local.head[c];
+		if (h != NULL) {
+			_mpi_pool_local.head[c] = h->h.next;
+			_mpi_pool_local.count[c]--;
+		} else if (__atomic_load_n(&_mpi_pool_shared[c], __ATOMIC_RELAXED) != NULL) {
+			_mpi_pool_shared_lock();
+			h = _mpi_pool_shared[c];
+			if (h != NULL) {
+				_mpi_pool_shared[c] = h->h.next;
+			}
+			_mpi_pool_shared_unlock();
+		}
+	}
+
+	__atomic_add_fetch(&_mpi_pool_counters.allocs, 1, __ATOMIC_RELAXED);
+	if (h != NULL) {
+		__atomic_add_fetch(&_mpi_pool_counters.hits, 1, __ATOMIC_RELAXED);
+	} else {
+		h = _mpi_pool_new(c, bytes);
+		if (h == NULL) {
+			return NULL;
+		}
+		__atomic_add_fetch(&_mpi_pool_counters.misses, 1, __ATOMIC_RELAXED);
+	}
+	_mpi_pool_track(&_mpi_pool_counters.in_use, &_mpi_pool_counters.in_use_high_water, h->h.bytes);
+	return (char *)h + sizeof(_mpi_pool_header);
+}
+
+/*
+ * Return a buffer from mpi_pool_alloc to the pool (NULL is ignored)
+ */
+void mpi_pool_free(void *ptr) {
+	if (ptr == NULL) {
+		return;
+	}
+	_mpi_pool_header *h = (_mpi_pool_header *)((char *)ptr - sizeof(_mpi_pool_header));
+	__atomic_sub_fetch(&_mpi_pool_counters.in_use, h->h.bytes, __ATOMIC_RELAXED);
+
+	int c = h->h.size_class;
+	if (c < 0) {
+		_mpi_pool_release(h);
+	} else if (_mpi_pool_local.count[c] < MPI_POOL_CACHE_DEPTH) {
+		h->h.next = _mpi_pool_local.head[c];
+		_mpi_pool_local.head[c] = h;
+		_mpi_pool_local.count[c]++;
+	} else {
+		_mpi_pool_shared_lock();
+		h->h.next = _mpi_pool_shared[c];
+		_mpi_pool_shared[c] = h;
+		_mpi_pool_shared_unlock();
+	}
+}
+
+/*
+ * Usable size of a block from mpi_pool_alloc (its size class, at least what was asked for)
+ */
+size_t mpi_pool_block_size(const void *ptr) {
+	return ((const _mpi_pool_header *)((const char *)ptr - sizeof(_mpi_pool_header)))->h.bytes;
+}
+
+/*
+ * Release the calling thread's cached blocks and the shared free lists to the backing allocator
+ *
+ * Blocks still in use are untouched. Needed before MPI_Finalize with MPI_POOL_ALLOC_MEM.
+ */
+void mpi_pool_trim(void) {
+	for (int c = 0; c < MPI_POOL_NUM_CLASSES; c++) {
+		_mpi_pool_header *h = _mpi_pool_local.head[c];
+		_mpi_pool_local.head[c] = NULL;
+		_mpi_pool_local.count[c] = 0;
+		while (h != NULL) {
+			_mpi_pool_header *next = h->h.next;
+			_mpi_pool_release(h);
+			h = next;
+		}
+	}
+
+	_mpi_pool_shared_lock();
+	for (int c = 0; c < MPI_POOL_NUM_CLASSES; c++) {
+		_mpi_pool_header *h = _mpi_pool_shared[c];
+		_mpi_pool_shared[c] = NULL;
+		while (h != NULL) {
+			_mpi_pool_header *next = h->h.next;
+			_mpi_pool_release(h);
+			h = next;
+		}
+	}
+	_mpi_pool_shared_unlock();
+}
+
+/*
+ * Snapshot of this process's pool counters
+ */
+void mpi_pool_get_stats(mpi_pool_stats *stats) {
+	stats->allocs = __atomic_load_n(&_mpi_pool_counters.allocs, __ATOMIC_RELAXED);
+	stats->hits = __atomic_load_n(&_mpi_pool_counters.hits, __ATOMIC_RELAXED);
+	stats->misses = __atomic_load_n(&_mpi_pool_counters.misses, __ATOMIC_RELAXED);
+	stats->in_use = __atomic_load_n(&_mpi_pool_counters.in_use, __ATOMIC_RELAXED);
+	stats->in_use_high_water = __atomic_load_n(&_mpi_pool_counters.in_use_high_water, __ATOMIC_RELAXED);
+	stats->reserved = __atomic_load_n(&_mpi_pool_counters.reserved, __ATOMIC_RELAXED);
+	stats->reserved_high_water = __atomic_load_n(&_mpi_pool_counters.reserved_high_water, __ATOMIC_RELAXED);
+}
+
+/*
+ * Print the pool counters summed over comm, with the largest per-rank high-water marks (collective)
+ */
+void mpi_pool_report(MPI_Comm comm) {
+	mpi_pool_stats s;
+	mpi_pool_get_stats(&s);
+	unsigned long long counts[3] = {s.allocs, s.hits, s.misses}, total[3];
+	unsigned long long peaks[2] = {s.in_use_high_water, s.reserved_high_water}, max_peaks[2];
+	MPI_Reduce(counts, total, 3, MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, comm);
+	MPI_Reduce(peaks, max_peaks, 2, MPI_UNSIGNED_LONG_LONG, MPI_MAX, 0, comm);
+
+	int rank;
+	MPI_Comm_rank(comm, &rank);
+	if (rank == 0) {
+		double hit_rate = total[0] > 0 ? 100.0 * total[1] / total[0] : 0.0;
+		mpi_log_append(0, "pool: %llu allocs, %.1f%% hits, %llu misses, high water %.1f KiB in use / %.1f KiB reserved (max over ranks)\n",
+			total[0], hit_rate, total[2], max_peaks[0] / 1024.0, max_peaks[1] / 1024.0);
+	}
+}
+
+#endif
@@ -0,0 +1,316 @@
+#ifndef MPI_PROGRESS_H
+#define MPI_PROGRESS_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <mpi.h>
+
+#include "mpi_helper.h"
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Asynchronous progress thread for nonblocking transfers.
+ *
+ * Most MPI libraries only move a large message (rendezvous handshake, pipelined
+ * copies) while some thread is inside an MPI call, so an Isend/Irecv posted
+ * before a long compute loop mostly happens in the final MPI_Wait. Here a
+ * per-rank thread keeps calling MPI_Testsome on the submitted requests while the
+ * main thread computes.
+ *
+ * Requests reach the thread through a lock-free submission queue (an intrusive
+ * stack the thread empties with one atomic exchange), each inside an
+ * mpi_progress_op that lives in the caller's memory. The thread flags the op
+ * when its request completes, so mpi_progress_wait just watches that flag and
+ * makes no MPI call.
+ *
+ * Compile with -DMPI_HELPER_PROGRESS_THREAD and MPI_MAIN initialises MPI with
+ * MPI_THREAD_MULTIPLE and starts the thread (with -DMPI_HELPER_THREAD_MULTIPLE
+ * it only does the former, so mpi_progress_start can be called later). Without
+ * the thread the same calls degrade to plain MPI_Test/MPI_Wait.
+ *
+ * Only requests handed over with mpi_progress_isend/irecv/submit are
+ * progressed. The my_mpi_* helpers post and wait for their requests inside
+ * one blocking call, so they neither go through the queue nor gain from it;
+ * a caller that starts its own MPI_Isend/MPI_Irecv and waits on it with
+ * MPI_Wait is not helped either (submit the request instead).
+ *
+ * The thread is pinned to the highest-numbered core in the rank's affinity
+ * mask and the main thread to the others, which needs at least two cores per
+ * rank (e.g. srun -c 2, mpirun --map-by slot:PE=2). With a single core
+ * (srun --cpu-bind=cores, one rank per core) mpi_progress_start(-1) refuses,
+ * since the polling thread would only take time slices from the compute loop;
+ * pass an explicit core to start it anyway.
+ */
+
+typedef struct mpi_progress_op {
+	MPI_Request request;
+	MPI_Status status;             // valid once done
+	int done;                      // set by the progress thread (or mpi_progress_test/wait) on completion
+	int queued;                    // handed to the progress thread (otherwise completed with MPI_Test/MPI_Wait)
+	struct mpi_progress_op *next;  // submission queue link
+} mpi_progress_op;
+
+#define MPI_PROGRESS_MAX_CPUS 1024
+
+static struct {
+	pthread_t thread;
+	int active;                    // thread running
+	int stop;                      // asks the thread to exit
+	int core;                      // core the thread is pinned to, -1 if unpinned
+	mpi_progress_op *queue;        // submitted, not yet picked up by the thread
+	int restore_mask;              // main thread mask was narrowed and must be restored
+	unsigned long main_mask[MPI_PROGRESS_MAX_CPUS / (8 * sizeof(unsigned long))];
+} _mpi_progress;
+
+/*
+ * Affinity of the calling thread, raw syscalls so no _GNU_SOURCE is needed
+ */
+int _mpi_progress_get_mask(unsigned long *mask, size_t bytes) {
+#ifdef __linux__
+	memset(mask, 0, bytes);
+	return syscall(SYS_sched_getaffinity, 0, bytes, mask) > 0 ? 0 : -1;
+#else
+	(void)mask;
+	(void)bytes;
+	return -1;
+#endif
+}
+
+int _mpi_progress_set_mask(const unsigned long *mask, size_t bytes) {
+#ifdef __linux__
+	return syscall(SYS_sched_setaffinity, 0, bytes, mask) == 0 ? 0 : -1;
+#else
+	(void)mask;
+	(void)bytes;
+	return -1;
+#endif
+}
+
+static inline int _mpi_progress_mask_test(const unsigned long *mask, int cpu) {
+	const int bits = 8 * sizeof(unsigned long);
+	return (mask[cpu / bits] >> (cpu % bits)) & 1UL;
+}
+
+static inline void _mpi_progress_mask_flip(unsigned long *mask, int cpu) {
+	const int bits = 8 * sizeof(unsigned long);
+	mask[cpu / bits] ^= 1UL << (cpu % bits);
+}
+
+void *_mpi_progress_main(void *arg) {
+	(void)arg;
+	if (_mpi_progress.core >= 0) {
+		unsigned long mask[MPI_PROGRESS_MAX_CPUS / (8 * sizeof(unsigned long))] = {0};
+		_mpi_progress_mask_flip(mask, _mpi_progress.core);
+		_mpi_progress_set_mask(mask, sizeof(mask));
+	}
+
+	int capacity = 64, n = 0;
+	mpi_progress_op **ops = (mpi_progress_op **)malloc(capacity * sizeof(mpi_progress_op *));
+	MPI_Request *requests = (MPI_Request *)malloc(capacity * sizeof(MPI_Request));
+	int *indices = (int *)malloc(capacity * sizeof(int));
+	MPI_Status *statuses = (MPI_Status *)malloc(capacity * sizeof(MPI_Status));
+
+	for (;;) {
+		// take everything submitted so far in one go
+		mpi_progress_op *taken = __atomic_exchange_n(&_mpi_progress.queue, NULL, __ATOMIC_ACQUIRE);
+		for (; taken != NULL; taken = taken->next) {
+			if (n == capacity) {
+				capacity *= 2;
+				ops = (mpi_progress_op **)realloc(ops, capacity * sizeof(mpi_progress_op *));
+				requests = (MPI_Request *)realloc(requests, capacity * sizeof(MPI_Request));
+				indices = (int *)realloc(indices, capacity * sizeof(int));
+				statuses = (MPI_Status *)realloc(statuses, capacity * sizeof(MPI_Status));
+			}
+			ops[n] = taken;
+			requests[n] = taken->request;
+			n++;
+		}
+		if (n == 0) {
+			// stop only once everything submitted before mpi_progress_stop has completed
+			if (__atomic_load_n(&_mpi_progress.stop, __ATOMIC_ACQUIRE) && __atomic_load_n(&_mpi_progress.queue, __ATOMIC_ACQUIRE) == NULL) {
+				break;
+			}
+			sched_yield();
+			continue;
+		}
+
+		int outcount;
+		MPI_Testsome(n, requests, &outcount, indices, statuses);
+		if (outcount == MPI_UNDEFINED || outcount == 0) {
+			sched_yield();
+			continue;
+		}
+		for (int k = 0; k < outcount; k++) {
+			mpi_progress_op *op = ops[indices[k]];
+			op->request = MPI_REQUEST_NULL;
+			op->status = statuses[k];
+			__atomic_store_n(&op->done, 1, __ATOMIC_RELEASE);
+		}
+		int kept = 0;
+		for (int i = 0; i < n; i++) {
+			if (requests[i] != MPI_REQUEST_NULL) {
+				ops[kept] = ops[i];
+				requests[kept] = requests[i];
+				kept++;
+			}
+		}
+		n = kept;
+	}
+
+	free(statuses);
+	free(indices);
+	free(requests);
+	free(ops);
+	return NULL;
+}
+
+/*
+ * Whether the progress thread is running
+ */
+int mpi_progress_active(void) {
+	return _mpi_progress.active;
+}
+
+/*
+ * Start the progress thread (needs MPI_THREAD_MULTIPLE)
+ *
+ * core: core to pin it to, -1 for the last core of the rank's affinity mask
+ * returns MPI_SUCCESS, or MPI_ERR_OTHER if the thread level is too low, core is -1 and the rank
+ * has only one core, or the thread cannot be created
+ */
+int mpi_progress_start(int core) {
+	if (_mpi_progress.active) {
+		return MPI_SUCCESS;
+	}
+	int provided;
+	MPI_Query_thread(&provided);
+	if (provided < MPI_THREAD_MULTIPLE) {
+		return MPI_ERR_OTHER;
+	}
+
+	unsigned long mask[MPI_PROGRESS_MAX_CPUS / (8 * sizeof(unsigned long))];
+	int cpus = 0, last = -1;
+	if (_mpi_progress_get_mask(mask, sizeof(mask)) == 0) {
+		for (int cpu = 0; cpu < MPI_PROGRESS_MAX_CPUS; cpu++) {
+			if (_mpi_progress_mask_test(mask, cpu)) {
+				cpus++;
+				last = cpu;
+			}
+		}
+	}
+	// sharing the only core, the thread would spin sched_yield against the compute loop
+	if (core < 0 && cpus == 1) {
+		return MPI_ERR_OTHER;
+	}
+	_mpi_progress.core = core >= 0 ? core : (cpus > 1 ? last : -1);
+	_mpi_progress.restore_mask = 0;
+	// keep the main thread off the progress core
+	if (_mpi_progress.core >= 0 && cpus > 1 && _mpi_progress_mask_test(mask, _mpi_progress.core)) {
+		memcpy(_mpi_progress.main_mask, mask, sizeof(mask));
+		_mpi_progress_mask_flip(mask, _mpi_progress.core);
+		_mpi_progress.restore_mask = _mpi_progress_set_mask(mask, sizeof(mask)) == 0;
+	}
+
+	_mpi_progress.stop = 0;
+	_mpi_progress.queue = NULL;
+	if (pthread_create(&_mpi_progress.thread, NULL, _mpi_progress_main, NULL) != 0) {
+		if (_mpi_progress.restore_mask) {
+			_mpi_progress_set_mask(_mpi_progress.main_mask, sizeof(_mpi_progress.main_mask));
+		}
+		return MPI_ERR_OTHER;
+	}
+	_mpi_progress.active = 1;
+	return MPI_SUCCESS;
+}
+
+/*
+ * Stop the progress thread once every submitted request has completed (no-op if it is not running)
+ */
+void mpi_progress_stop(void) {
+	if (!_mpi_progress.active) {
+		return;
+	}
+	__atomic_store_n(&_mpi_progress.stop, 1, __ATOMIC_RELEASE);
+	pthread_join(_mpi_progress.thread, NULL);
+	_mpi_progress.active = 0;
+	if (_mpi_progress.restore_mask) {
+		_mpi_progress_set_mask(_mpi_progress.main_mask, sizeof(_mpi_progress.main_mask));
+		_mpi_progress.restore_mask = 0;
+	}
+}
+
+/*
+ * Hand a started request to the progress thread; the caller must not touch op->request afterwards
+ */
+void mpi_progress_submit(MPI_Request request, mpi_progress_op *op) {
+	op->request = request;
+	op->done = 0;
+	op->queued = _mpi_progress.active;
+	if (!op->queued) {
+		op->next = NULL;
+		return; // completed by mpi_progress_test/wait instead
+	}
+	op->next = __atomic_load_n(&_mpi_progress.queue, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&_mpi_progress.queue, &op->next, op, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+	}
+}
+
+int mpi_progress_isend(const void *buf, int count, MPI_Datatype datatype, int dst, int tag, MPI_Comm comm, mpi_progress_op *op) {
+	MPI_Request request;
+	int err = MPI_Isend(buf, count, datatype, dst, tag, comm, &request);
+	mpi_progress_submit(request, op);
+	return err;
+}
+
+int mpi_progress_irecv(void *buf, int count, MPI_Datatype datatype, int src, int tag, MPI_Comm comm, mpi_progress_op *op) {
+	MPI_Request request;
+	int err = MPI_Irecv(buf, count, datatype, src, tag, comm, &request);
+	mpi_progress_submit(request, op);
+	return err;
+}
+
+/*
+ * Whether op has completed (never blocks)
+ */
+int mpi_progress_test(mpi_progress_op *op) {
+	if (__atomic_load_n(&op->done, __ATOMIC_ACQUIRE)) {
+		return 1;
+	}
+	if (!op->queued) {
+		MPI_Test(&op->request, &op->done, &op->status);
+	}
+	return op->done;
+}
+
+/*
+ * Block until op has completed
+ */
+void mpi_progress_wait(mpi_progress_op *op) {
+	if (!op->queued) {
+		if (!op->done) {
+			MPI_Wait(&op->request, &op->status);
+			op->done = 1;
+		}
+		return;
+	}
+	while (!__atomic_load_n(&op->done, __ATOMIC_ACQUIRE)) {
+		sched_yield();
+	}
+}
+
+void mpi_progress_wait_all(int count, mpi_progress_op *ops) {
+	for (int i = 0; i < count; i++) {
+		mpi_progress_wait(&ops[i]);
+	}
+}
+
+#endif
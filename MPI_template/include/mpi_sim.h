@@ -0,0 +1,697 @@
+#ifndef MPI_SIM_H
+#define MPI_SIM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mpi.h>
+
+#include "mpi_helper.h"
+
+/*
+ * LogGP simulator for the helper collectives.
+ *
+ * Predicts how long a collective takes on p ranks without having p ranks: the
+ * send/recv schedule every rank would execute is replayed in one process under
+ * the LogGP model (L latency, o CPU overhead per message, g gap between
+ * messages, G time per byte), with separate parameters for pairs on the same
+ * node and on different nodes. Messages up to the eager limit are buffered by
+ * the sender; larger ones wait for the receive to be posted (rendezvous, one
+ * extra round trip). A rank's NIC serialises its outgoing and its incoming
+ * bytes, so a root sending to everyone or a rank receiving from everyone pays
+ * for every byte in turn.
+ *
+ * Parameters are fitted once on the real machine (mpi_sim_fit: ping-pong within
+ * and across nodes, a stream of small Isends, a memcpy), saved with
+ * mpi_sim_params_write, and the simulation runs anywhere afterwards:
+ *
+ *   mpi_sim_params p;
+ *   mpi_sim_params_read("loggp.txt", &p);
+ *   p.ranks_per_node = 128;
+ *   double t = mpi_sim_run(&p, 16384, 1 << 20, mpi_sim_bcast_my, NULL);
+ *
+ * A schedule is a function giving rank's step-th operation. The mpi_sim_*
+ * schedules below follow the code of the helpers in mpi_helper.h step by step
+ * (same peers, sizes, order and algorithm switch points), so they must be kept
+ * in step with it. New algorithms are simulated by writing their schedule.
+ * Ranks are placed in blocks of ranks_per_node.
+ */
+
+#ifndef MPI_SIM_EAGER
+#define MPI_SIM_EAGER 8192    // default largest message sent eagerly
+#endif
+
+typedef struct {
+	double L;   // latency, seconds
+	double o;   // overhead per message on each side, seconds
+	double g;   // minimum gap between consecutive messages, seconds
+	double G;   // gap per byte (1 / bandwidth), seconds
+} mpi_sim_loggp;
+
+typedef struct {
+	mpi_sim_loggp intra;   // ranks on the same node
+	mpi_sim_loggp inter;   // ranks on different nodes
+	int ranks_per_node;
+	size_t eager;          // largest eager message, larger ones use rendezvous
+	double copy;           // seconds per byte of local copy or reduction
+} mpi_sim_params;
+
+enum {
+	MPI_SIM_NOP = 0,       // local work only
+	MPI_SIM_SEND,          // blocking send to dst
+	MPI_SIM_RECV,          // blocking receive from src
+	MPI_SIM_SENDRECV       // both at once (MPI_Sendrecv)
+};
+
+/*
+ * One operation of a schedule: the communication, then copy bytes of local work
+ * (packing, combining); dst/src -1 are MPI_PROC_NULL
+ */
+typedef struct {
+	int kind;
+	int dst, src;
+	size_t bytes;          // sent and received
+	size_t copy;
+} mpi_sim_op;
+
+/*
+ * Schedule: fill op with rank's step-th operation (steps count from 0), return 0 once rank has finished
+ *
+ * bytes: the size argument of the collective
+ */
+typedef int (*mpi_sim_schedule)(int rank, int size, size_t bytes, long step, mpi_sim_op *op);
+
+typedef struct _mpi_sim_msg {
+	int src;
+	size_t bytes;
+	int rendezvous;
+	double time;               // eager: arrival of the last byte; rendezvous: when the sender posted
+	struct _mpi_sim_msg *next;
+} _mpi_sim_msg;
+
+typedef struct {
+	long step;
+	mpi_sim_op op;
+	int started;               // op posted, waiting for its parts
+	int send_wait, recv_wait;  // rendezvous send not matched yet / receive not matched yet
+	int queued, finished;
+	double clock, send_done, recv_done;
+	double nic_out, nic_in;    // when the outgoing / incoming side is free again
+	_mpi_sim_msg *inbox, *inbox_tail;
+} _mpi_sim_rank;
+
+typedef struct {
+	const mpi_sim_params *p;
+	int size;
+	_mpi_sim_rank *ranks;
+	int *queue;
+	int head, count;
+	_mpi_sim_msg *free_msgs;
+} _mpi_sim;
+
+static inline const mpi_sim_loggp *_mpi_sim_link(const _mpi_sim *s, int a, int b) {
+	int per_node = s->p->ranks_per_node > 0 ? s->p->ranks_per_node : 1;
+	return a / per_node == b / per_node ? &s->p->intra : &s->p->inter;
+}
+
+static inline double _mpi_sim_bytes_time(const mpi_sim_loggp *l, size_t bytes) {
+	return bytes > 1 ? (double)(bytes - 1) * l->G : 0.0;
+}
+
+void _mpi_sim_wake(_mpi_sim *s, int r) {
+	if (!s->ranks[r].queued && !s->ranks[r].finished) {
+		s->ranks[r].queued = 1;
+		s->queue[(s->head + s->count++) % s->size] = r;
+	}
+}
+
+/*
+ * Post the send part of rank r's op
+ */
+void _mpi_sim_post_send(_mpi_sim *s, int r) {
+	_mpi_sim_rank *me = &s->ranks[r];
+	int dst = me->op.dst;
+	size_t bytes = me->op.bytes;
+	me->send_done = me->clock;
+	if (dst < 0) {
+		return;
+	}
+
+	_mpi_sim_msg *m = s->free_msgs;
+	if (m != NULL) {
+		s->free_msgs = m->next;
+	} else {
+		m = (_mpi_sim_msg *)malloc(sizeof(_mpi_sim_msg));
+	}
+	m->src = r;
+	m->bytes = bytes;
+	m->next = NULL;
+	m->rendezvous = dst != r && bytes > s->p->eager;
+
+	if (dst == r) {
+		// to myself: a copy
+		me->send_done = me->clock + bytes * s->p->copy;
+		m->time = me->send_done;
+	} else if (!m->rendezvous) {
+		const mpi_sim_loggp *l = _mpi_sim_link(s, r, dst);
+		double start = me->clock > me->nic_out ? me->clock : me->nic_out;
+		double injected = start + l->o + _mpi_sim_bytes_time(l, bytes);
+		me->nic_out = start + l->g > injected ? start + l->g : injected;
+		me->send_done = injected;
+		m->time = injected + l->L;
+	} else {
+		m->time = me->clock > me->nic_out ? me->clock : me->nic_out;
+		me->send_wait = 1;
+	}
+
+	_mpi_sim_rank *to = &s->ranks[dst];
+	if (to->inbox_tail != NULL) {
+		to->inbox_tail->next = m;
+	} else {
+		to->inbox = m;
+	}
+	to->inbox_tail = m;
+	if (dst != r) {
+		_mpi_sim_wake(s, dst);
+	}
+}
+
+/*
+ * Try to match the receive part of rank r's op (first message from src, MPI's non-overtaking order)
+ */
+void _mpi_sim_try_recv(_mpi_sim *s, int r) {
+	_mpi_sim_rank *me = &s->ranks[r];
+	int src = me->op.src;
+	_mpi_sim_msg *m = me->inbox, *prev = NULL;
+	while (m != NULL && m->src != src) {
+		prev = m;
+		m = m->next;
+	}
+	if (m == NULL) {
+		return;
+	}
+	if (prev != NULL) {
+		prev->next = m->next;
+	} else {
+		me->inbox = m->next;
+	}
+	if (me->inbox_tail == m) {
+		me->inbox_tail = prev;
+	}
+
+	const mpi_sim_loggp *l = _mpi_sim_link(s, src, r);
+	double arrival = m->time;
+	if (m->rendezvous) {
+		// request to send reaches me, clear to send goes back, then the data follows
+		_mpi_sim_rank *sender = &s->ranks[src];
+		double handshake = m->time + l->o + l->L;
+		double start = (handshake > me->clock ? handshake : me->clock) + l->L;
+		double injected = start + l->o + _mpi_sim_bytes_time(l, m->bytes);
+		sender->nic_out = injected;
+		sender->send_done = injected;
+		sender->send_wait = 0;
+		arrival = injected + l->L;
+		_mpi_sim_wake(s, src);
+	}
+	if (src == r) {
+		me->recv_done = arrival > me->clock ? arrival : me->clock;
+	} else {
+		// the incoming side takes the bytes one message at a time
+		double in_done = me->nic_in + _mpi_sim_bytes_time(l, m->bytes);
+		if (arrival > in_done) {
+			in_done = arrival;
+		}
+		me->nic_in = in_done;
+		me->recv_done = (in_done > me->clock ? in_done : me->clock) + l->o;
+	}
+	me->recv_wait = 0;
+
+	m->next = s->free_msgs;
+	s->free_msgs = m;
+}
+
+/*
+ * Run rank r until it blocks or finishes
+ */
+void _mpi_sim_advance(_mpi_sim *s, mpi_sim_schedule schedule, size_t bytes, int r) {
+	_mpi_sim_rank *me = &s->ranks[r];
+	for (;;) {
+		if (!me->started) {
+			if (!schedule(r, s->size, bytes, me->step, &me->op)) {
+				me->finished = 1;
+				return;
+			}
+			me->started = 1;
+			me->send_done = me->recv_done = me->clock;
+			if (me->op.kind == MPI_SIM_SEND || me->op.kind == MPI_SIM_SENDRECV) {
+				_mpi_sim_post_send(s, r);
+			}
+			me->recv_wait = (me->op.kind == MPI_SIM_RECV || me->op.kind == MPI_SIM_SENDRECV) && me->op.src >= 0;
+		}
+		if (me->recv_wait) {
+			_mpi_sim_try_recv(s, r);
+		}
+		if (me->send_wait || me->recv_wait) {
+			return;
+		}
+		double done = me->send_done > me->recv_done ? me->send_done : me->recv_done;
+		me->clock = (done > me->clock ? done : me->clock) + me->op.copy * s->p->copy;
+		me->started = 0;
+		me->step++;
+	}
+}
+
+/*
+ * Simulate schedule on size ranks
+ *
+ * bytes: passed to the schedule
+ * finish: if not NULL, set to the time each rank finished (size entries)
+ * returns the time the last rank finished, or -1 if the schedule deadlocks
+ */
+double mpi_sim_run(const mpi_sim_params *p, int size, size_t bytes, mpi_sim_schedule schedule, double *finish) {
+	_mpi_sim s;
+	s.p = p;
+	s.size = size;
+	s.ranks = (_mpi_sim_rank *)calloc(size, sizeof(_mpi_sim_rank));
+	s.queue = (int *)malloc(size * sizeof(int));
+	s.head = 0;
+	s.count = 0;
+	s.free_msgs = NULL;
+	for (int r = 0; r < size; r++) {
+		_mpi_sim_wake(&s, r);
+	}
+
+	while (s.count > 0) {
+		int r = s.queue[s.head];
+		s.head = (s.head + 1) % size;
+		s.count--;
+		s.ranks[r].queued = 0;
+		_mpi_sim_advance(&s, schedule, bytes, r);
+	}
+
+	double end = 0;
+	for (int r = 0; r < size; r++) {
+		_mpi_sim_rank *rank = &s.ranks[r];
+		if (!rank->finished) {
+			end = -1;
+		} else if (end >= 0 && rank->clock > end) {
+			end = rank->clock;
+		}
+		if (finish != NULL) {
+			finish[r] = rank->finished ? rank->clock : -1;
+		}
+		while (rank->inbox != NULL) {
+			_mpi_sim_msg *m = rank->inbox;
+			rank->inbox = m->next;
+			free(m);
+		}
+	}
+	while (s.free_msgs != NULL) {
+		_mpi_sim_msg *m = s.free_msgs;
+		s.free_msgs = m->next;
+		free(m);
+	}
+	free(s.queue);
+	free(s.ranks);
+	return end;
+}
+
+static inline void _mpi_sim_set(mpi_sim_op *op, int kind, int dst, int src, size_t bytes, size_t copy) {
+	op->kind = kind;
+	op->dst = dst;
+	op->src = src;
+	op->bytes = bytes;
+	op->copy = copy;
+}
+
+/*
+ * my_mpi_broadcast from rank 0 to everyone: the root sends to each rank in turn
+ */
+int mpi_sim_bcast_my(int rank, int size, size_t bytes, long step, mpi_sim_op *op) {
+	if (rank == 0) {
+		if (step >= size - 1) {
+			return 0;
+		}
+		_mpi_sim_set(op, MPI_SIM_SEND, (int)step + 1, -1, bytes, 0);
+		return 1;
+	}
+	if (step > 0) {
+		return 0;
+	}
+	_mpi_sim_set(op, MPI_SIM_RECV, -1, 0, bytes, 0);
+	return 1;
+}
+
+/*
+ * Binomial tree broadcast from rank 0, for comparison (the usual MPI_Bcast algorithm for small messages)
+ */
+int mpi_sim_bcast_binomial(int rank, int size, size_t bytes, long step, mpi_sim_op *op) {
+	int mask = 1;
+	long n = 0;
+	if (rank > 0) {
+		while (!(rank & mask)) {
+			mask <<= 1;
+		}
+		if (step == n++) {
+			_mpi_sim_set(op, MPI_SIM_RECV, -1, rank - mask, bytes, 0);
+			return 1;
+		}
+	} else {
+		while (mask < size) {
+			mask <<= 1;
+		}
+	}
+	for (mask >>= 1; mask > 0; mask >>= 1) {
+		if (rank + mask < size && step == n++) {
+			_mpi_sim_set(op, MPI_SIM_SEND, rank + mask, -1, bytes, 0);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * my_mpi_scatter: the root copies its own block and sends one block to each rank in turn (bytes per block)
+ */
+int mpi_sim_scatter_my(int rank, int size, size_t bytes, long step, mpi_sim_op *op) {
+	if (rank == 0) {
+		if (step == 0) {
+			_mpi_sim_set(op, MPI_SIM_NOP, -1, -1, 0, bytes);
+			return 1;
+		}
+		if (step >= size) {
+			return 0;
+		}
+		_mpi_sim_set(op, MPI_SIM_SEND, (int)step, -1, bytes, 0);
+		return 1;
+	}
+	if (step > 0) {
+		return 0;
+	}
+	_mpi_sim_set(op, MPI_SIM_RECV, -1, 0, bytes, 0);
+	return 1;
+}
+
+/*
+ * my_mpi_alltoall_pairwise: size steps, the first being the copy to myself (bytes per block)
+ */
+int mpi_sim_alltoall_pairwise(int rank, int size, size_t bytes, long step, mpi_sim_op *op) {
+	if (step >= size) {
+		return 0;
+	}
+	int s = (int)step;
+	_mpi_sim_set(op, MPI_SIM_SENDRECV, (rank + s) % size, (rank - s + size) % size, bytes, 0);
+	return 1;
+}
+
+/*
+ * my_mpi_alltoall_bruck: rotate, ceil(log2 p) exchanges of the blocks with bit k set (packed and unpacked), unrotate
+ */
+int mpi_sim_alltoall_bruck(int rank, int size, size_t bytes, long step, mpi_sim_op *op) {
+	(void)rank;
+	if (step == 0) {
+		_mpi_sim_set(op, MPI_SIM_NOP, -1, -1, 0, bytes * size);
+		return 1;
+	}
+	long n = 1;
+	for (int k = 1; k < size; k <<= 1) {
+		if (step == n++) {
+			// block indices below size with bit k set
+			size_t blocks = (size_t)(size / (2 * k)) * k + (size % (2 * k) > k ? size % (2 * k) - k : 0);
+			_mpi_sim_set(op, MPI_SIM_SENDRECV, (rank + k) % size, (rank - k + size) % size, bytes * blocks, 2 * bytes * blocks);
+			return 1;
+		}
+	}
+	if (step == n) {
+		_mpi_sim_set(op, MPI_SIM_NOP, -1, -1, 0, bytes * size);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * my_mpi_alltoall: Bruck up to MY_MPI_ALLTOALL_BRUCK_MAX bytes per block, pairwise above
+ */
+int mpi_sim_alltoall_my(int rank, int size, size_t bytes, long step, mpi_sim_op *op) {
+	if (bytes <= MY_MPI_ALLTOALL_BRUCK_MAX) {
+		return mpi_sim_alltoall_bruck(rank, size, bytes, step, op);
+	}
+	return mpi_sim_alltoall_pairwise(rank, size, bytes, step, op);
+}
+
+/*
+ * Hillis-Steele scan of my_mpi_scan: ceil(log2 p) shifted exchanges, each followed by a combine
+ */
+int mpi_sim_scan_hillis_steele(int rank, int size, size_t bytes, long step, mpi_sim_op *op) {
+	if (step == 0) {
+		_mpi_sim_set(op, MPI_SIM_NOP, -1, -1, 0, bytes);
+		return 1;
+	}
+	long n = 1;
+	for (int d = 1; d < size; d <<= 1) {
+		if (step == n++) {
+			int dst = rank + d < size ? rank + d : -1;
+			int src = rank - d >= 0 ? rank - d : -1;
+			_mpi_sim_set(op, MPI_SIM_SENDRECV, dst, src, bytes, src >= 0 ? bytes : 0);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Up-sweep/down-sweep scan of my_mpi_scan: 2 log2 p rounds, each rank sending or receiving at most once per round
+ */
+int mpi_sim_scan_sweep(int rank, int size, size_t bytes, long step, mpi_sim_op *op) {
+	if (step == 0) {
+		_mpi_sim_set(op, MPI_SIM_NOP, -1, -1, 0, bytes);
+		return 1;
+	}
+	long n = 1;
+	int top = 1;
+	for (int d = 1; d < size; d <<= 1) {
+		top = d;
+		if (step == n++) {
+			if ((rank + 1) % (2 * d) == d && rank + d < size) {
+				_mpi_sim_set(op, MPI_SIM_SEND, rank + d, -1, bytes, 0);
+			} else if ((rank + 1) % (2 * d) == 0) {
+				_mpi_sim_set(op, MPI_SIM_RECV, -1, rank - d, bytes, bytes);
+			} else {
+				_mpi_sim_set(op, MPI_SIM_NOP, -1, -1, 0, 0);
+			}
+			return 1;
+		}
+	}
+	for (int d = top / 2; d >= 1; d >>= 1) {
+		if (step == n++) {
+			if ((rank + 1) % (2 * d) == 0 && rank + d < size) {
+				_mpi_sim_set(op, MPI_SIM_SEND, rank + d, -1, bytes, 0);
+			} else if ((rank + 1) % (2 * d) == d && rank >= 2 * d) {
+				_mpi_sim_set(op, MPI_SIM_RECV, -1, rank - d, bytes, bytes);
+			} else {
+				_mpi_sim_set(op, MPI_SIM_NOP, -1, -1, 0, 0);
+			}
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * my_mpi_scan: the sweep from MY_MPI_SCAN_SWEEP_MIN bytes, Hillis-Steele below
+ */
+int mpi_sim_scan_my(int rank, int size, size_t bytes, long step, mpi_sim_op *op) {
+	if (bytes >= MY_MPI_SCAN_SWEEP_MIN) {
+		return mpi_sim_scan_sweep(rank, size, bytes, step, op);
+	}
+	return mpi_sim_scan_hillis_steele(rank, size, bytes, step, op);
+}
+
+/*
+ * Half round trip between rank 0 and peer, averaged over reps (collective over comm, result on rank 0 and peer)
+ */
+double _mpi_sim_pingpong(MPI_Comm comm, int rank, int peer, char *buf, size_t bytes, int reps) {
+	MPI_Barrier(comm);
+	double start = MPI_Wtime();
+	for (int i = 0; i < reps; i++) {
+		if (rank == 0) {
+			MPI_Send(buf, (int)bytes, MPI_BYTE, peer, 0, comm);
+			MPI_Recv(buf, (int)bytes, MPI_BYTE, peer, 0, comm, MPI_STATUS_IGNORE);
+		} else if (rank == peer) {
+			MPI_Recv(buf, (int)bytes, MPI_BYTE, 0, 0, comm, MPI_STATUS_IGNORE);
+			MPI_Send(buf, (int)bytes, MPI_BYTE, 0, 0, comm);
+		}
+	}
+	return (MPI_Wtime() - start) / reps / 2;
+}
+
+/*
+ * LogGP parameters between rank 0 and peer (collective over comm, result on rank 0)
+ *
+ * o is the cost of posting a small Isend, g the time per message of a stream
+ * of small Isends (best of 5), G the slope of the ping-pong time between 64 KiB and 1 MiB
+ * (past any eager limit) and L what is left of the small-message time after
+ * both overheads.
+ */
+void _mpi_sim_fit_link(MPI_Comm comm, int rank, int peer, mpi_sim_loggp *l) {
+	const int reps = 100, stream = 256;
+	const size_t small = 8, mid = (size_t)64 << 10, large = (size_t)1 << 20;
+	char *buf = (char *)malloc(large);
+	memset(buf, 0, large);
+
+	_mpi_sim_pingpong(comm, rank, peer, buf, small, 10);  // warm up the connection
+	double t_small = _mpi_sim_pingpong(comm, rank, peer, buf, small, reps);
+	double t_mid = _mpi_sim_pingpong(comm, rank, peer, buf, mid, reps / 10);
+	double t_large = _mpi_sim_pingpong(comm, rank, peer, buf, large, reps / 10);
+
+	MPI_Request *requests = (MPI_Request *)malloc(stream * sizeof(MPI_Request));
+	double post = 1e30, gap = 1e30;
+	for (int round = 0; round < 5; round++) {
+		if (rank == peer) {
+			for (int i = 0; i < stream; i++) {
+				MPI_Irecv(buf + (i % 8) * small, (int)small, MPI_BYTE, 0, 1, comm, &requests[i]);
+			}
+		}
+		MPI_Barrier(comm);
+		if (rank == 0) {
+			double start = MPI_Wtime();
+			for (int i = 0; i < stream; i++) {
+				MPI_Isend(buf + (i % 8) * small, (int)small, MPI_BYTE, peer, 1, comm, &requests[i]);
+			}
+			double posted = MPI_Wtime();
+			MPI_Waitall(stream, requests, MPI_STATUSES_IGNORE);
+			double end = MPI_Wtime();
+			if ((posted - start) / stream < post) post = (posted - start) / stream;
+			if ((end - start) / stream < gap) gap = (end - start) / stream;
+		} else if (rank == peer) {
+			MPI_Waitall(stream, requests, MPI_STATUSES_IGNORE);
+		}
+	}
+	free(requests);
+	free(buf);
+
+	l->o = post;
+	// a stream slower per message than a ping-pong measured scheduling (oversubscribed cores), not the NIC
+	l->g = gap < t_small ? gap : t_small;
+	if (l->g < post) {
+		l->g = post;
+	}
+	l->G = t_large > t_mid ? (t_large - t_mid) / (double)(large - mid) : 0.0;
+	l->L = t_small - 2 * l->o - _mpi_sim_bytes_time(l, small);
+	if (l->L < 0) {
+		l->L = 0;
+	}
+}
+
+/*
+ * Fit the parameters on the running machine (collective over comm, the result is on every rank)
+ *
+ * Intra-node from rank 0 and a rank on its node, inter-node from rank 0 and the
+ * first rank on another node; a link that cannot be measured (one rank per
+ * node, a single node) copies the other one.
+ * returns 1 if the inter-node parameters were measured, 0 if they were copied
+ */
+int mpi_sim_fit(MPI_Comm comm, mpi_sim_params *p) {
+	int rank, size;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &size);
+	memset(p, 0, sizeof(*p));
+	p->eager = MPI_SIM_EAGER;
+
+	MPI_Comm node;
+	MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node);
+	int node_rank, node_size;
+	MPI_Comm_rank(node, &node_rank);
+	MPI_Comm_size(node, &node_size);
+	// rank 0's node: the second rank on it, and the first rank off it
+	int on_root_node = 0;
+	if (node_rank == 0) {
+		on_root_node = rank == 0;
+	}
+	MPI_Bcast(&on_root_node, 1, MPI_INT, 0, node);
+	MPI_Comm_free(&node);
+	int candidates[2] = {on_root_node && rank > 0 ? rank : size, on_root_node ? size : rank}, peers[2];
+	MPI_Allreduce(candidates, peers, 2, MPI_INT, MPI_MIN, comm);
+	MPI_Allreduce(MPI_IN_PLACE, &node_size, 1, MPI_INT, MPI_MAX, comm);
+	p->ranks_per_node = node_size;
+
+	int have_intra = peers[0] < size, have_inter = peers[1] < size;
+	if (have_intra) {
+		_mpi_sim_fit_link(comm, rank, peers[0], &p->intra);
+	}
+	if (have_inter) {
+		_mpi_sim_fit_link(comm, rank, peers[1], &p->inter);
+	}
+	if (!have_intra) {
+		p->intra = p->inter;
+	}
+	if (!have_inter) {
+		p->inter = p->intra;
+	}
+
+	// local copies, for packing and reductions
+	size_t bytes = (size_t)8 << 20;
+	char *a = (char *)malloc(bytes), *b = (char *)malloc(bytes);
+	memset(a, 1, bytes);
+	memset(b, 0, bytes);
+	double start = MPI_Wtime();
+	for (int i = 0; i < 4; i++) {
+		memcpy(b, a, bytes);
+		a[i] = b[bytes - 1 - i];
+	}
+	p->copy = (MPI_Wtime() - start) / (4.0 * bytes);
+	free(a);
+	free(b);
+
+	MPI_Bcast(p, (int)sizeof(*p), MPI_BYTE, 0, comm);
+	return have_inter;
+}
+
+/*
+ * Parameter files: one "name value" per line
+ */
+int mpi_sim_params_write(const char *path, const mpi_sim_params *p) {
+	FILE *f = fopen(path, "w");
+	if (f == NULL) {
+		return MPI_ERR_FILE;
+	}
+	fprintf(f, "intra_L %.9g\nintra_o %.9g\nintra_g %.9g\nintra_G %.9g\n", p->intra.L, p->intra.o, p->intra.g, p->intra.G);
+	fprintf(f, "inter_L %.9g\ninter_o %.9g\ninter_g %.9g\ninter_G %.9g\n", p->inter.L, p->inter.o, p->inter.g, p->inter.G);
+	fprintf(f, "ranks_per_node %d\neager %zu\ncopy %.9g\n", p->ranks_per_node, p->eager, p->copy);
+	fclose(f);
+	return MPI_SUCCESS;
+}
+
+int mpi_sim_params_read(const char *path, mpi_sim_params *p) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		return MPI_ERR_FILE;
+	}
+	memset(p, 0, sizeof(*p));
+	p->eager = MPI_SIM_EAGER;
+	p->ranks_per_node = 1;
+	char name[32];
+	double value;
+	while (fscanf(f, "%31s %lf", name, &value) == 2) {
+		struct { const char *name; double *field; } fields[] = {
+			{"intra_L", &p->intra.L}, {"intra_o", &p->intra.o}, {"intra_g", &p->intra.g}, {"intra_G", &p->intra.G},
+			{"inter_L", &p->inter.L}, {"inter_o", &p->inter.o}, {"inter_g", &p->inter.g}, {"inter_G", &p->inter.G},
+			{"copy", &p->copy},
+		};
+		for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+			if (strcmp(name, fields[i].name) == 0) {
+				*fields[i].field = value;
+			}
+		}
+		if (strcmp(name, "ranks_per_node") == 0) {
+			p->ranks_per_node = (int)value;
+		} else if (strcmp(name, "eager") == 0) {
+			p->eager = (size_t)value;
+		}
+	}
+	fclose(f);
+	return MPI_SUCCESS;
+}
+
+#endif
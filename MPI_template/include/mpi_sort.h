@@ -0,0 +1,389 @@
+#ifndef MPI_SORT_H
+#define MPI_SORT_H
+
+#include <stdint.h>
+
+#include "mpi_helper.h"
+#include "mpi_io.h"
+
+/*
+ * Distributed sort of a block-distributed array (e.g. after my_mpi_scatter).
+ *
+ *   1. radix sort the local block
+ *   2. choose p - 1 splitters:
+ *      - MPI_SORT_SAMPLE: regular sampling, p - 1 evenly spaced keys from every
+ *        rank are allgathered and every p-th one is a splitter (one collective)
+ *      - MPI_SORT_HISTOGRAM: bisect each splitter until exactly i * n / p keys
+ *        are below it, splitting runs of equal keys between ranks, so heavy
+ *        duplicates or skewed keys still give equal buckets (<= 64 allreduces)
+ *   3. exchange the buckets with MPI_Alltoallv and radix sort them
+ *   4. rebalance: shift elements between neighbouring ranks so every rank ends
+ *      up with the standard block size (first n % p ranks get one extra)
+ *
+ * Afterwards rank r holds the r-th block of the globally sorted array.
+ * Keys are mapped to order-preserving unsigned integers, so one radix sort
+ * handles ints, doubles (NaNs sort after +inf) and key-value pairs.
+ */
+
+enum {
+	MPI_SORT_INT = 1,    // int
+	MPI_SORT_DOUBLE,     // double
+	MPI_SORT_KV,         // mpi_sort_kv, sorted by key, stable for equal keys
+};
+
+enum {
+	MPI_SORT_SAMPLE = 0,
+	MPI_SORT_HISTOGRAM,
+};
+
+typedef struct {
+	int64_t key;
+	int64_t value;
+} mpi_sort_kv;
+
+size_t mpi_sort_elem_size(int type) {
+	switch (type) {
+	case MPI_SORT_INT: return sizeof(int);
+	case MPI_SORT_DOUBLE: return sizeof(double);
+	case MPI_SORT_KV: return sizeof(mpi_sort_kv);
+	default: return 0;
+	}
+}
+
+/*
+ * Order-preserving unsigned key of element i
+ */
+static inline uint64_t _mpi_sort_key(int type, const void *data, long long i) {
+	switch (type) {
+	case MPI_SORT_INT:
+		return (uint64_t)((uint32_t)((const int *)data)[i] ^ 0x80000000u);
+	case MPI_SORT_DOUBLE: {
+		uint64_t bits;
+		memcpy(&bits, (const double *)data + i, sizeof(bits));
+		// negatives: flip everything so larger magnitudes come first, positives: set the sign bit
+		return (bits & 0x8000000000000000ull) ? ~bits : bits | 0x8000000000000000ull;
+	}
+	default:
+		return (uint64_t)((const mpi_sort_kv *)data)[i].key ^ 0x8000000000000000ull;
+	}
+}
+
+/*
+ * Sort count elements in place with an LSD radix sort (8 bit digits)
+ * Digits that are the same for every element are skipped, so small key ranges take few passes.
+ */
+void mpi_sort_local(int type, void *data, long long count) {
+	size_t elem = mpi_sort_elem_size(type);
+	int digits = (type == MPI_SORT_INT) ? 4 : 8;
+	if (count < 2 || elem == 0) {
+		return;
+	}
+
+	// histograms of every digit in one read of the data
+	long long (*hist)[256] = (long long (*)[256])calloc(digits, sizeof(*hist));
+	for (long long i = 0; i < count; i++) {
+		uint64_t k = _mpi_sort_key(type, data, i);
+		for (int d = 0; d < digits; d++) {
+			hist[d][(k >> (8 * d)) & 0xff]++;
+		}
+	}
+
+	char *src = (char *)data, *dst = (char *)malloc((size_t)count * elem);
+	for (int d = 0; d < digits; d++) {
+		if (hist[d][(_mpi_sort_key(type, src, 0) >> (8 * d)) & 0xff] == count) {
+			continue;
+		}
+		long long pos[256], sum = 0;
+		for (int b = 0; b < 256; b++) {
+			pos[b] = sum;
+			sum += hist[d][b];
+		}
+		for (long long i = 0; i < count; i++) {
+			int b = (int)((_mpi_sort_key(type, src, i) >> (8 * d)) & 0xff);
+			memcpy(dst + (size_t)pos[b]++ * elem, src + (size_t)i * elem, elem);
+		}
+		char *tmp = src; src = dst; dst = tmp;
+	}
+	if (src != (char *)data) {
+		memcpy(data, src, (size_t)count * elem);
+		free(src);
+	} else {
+		free(dst);
+	}
+	free(hist);
+}
+
+/*
+ * Number of elements of a sorted block with key < bound (or <= bound with inclusive)
+ */
+long long _mpi_sort_lower(int type, const void *data, long long count, uint64_t bound, int inclusive) {
+	long long lo = 0, hi = count;
+	while (lo < hi) {
+		long long mid = lo + (hi - lo) / 2;
+		uint64_t k = _mpi_sort_key(type, data, mid);
+		if (k < bound || (inclusive && k == bound)) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/*
+ * Regular sampling: send counts for the buckets of a locally sorted block
+ */
+void _mpi_sort_sample_split(MPI_Comm comm, int type, const void *data, long long count, long long *send) {
+	int size;
+	MPI_Comm_size(comm, &size);
+	int s = size - 1;
+
+	uint64_t *samples = (uint64_t *)malloc((size_t)size * s * sizeof(uint64_t));
+	uint64_t *mine = (uint64_t *)malloc((s > 0 ? s : 1) * sizeof(uint64_t));
+	for (int i = 0; i < s; i++) {
+		// ranks with no data send the largest key so their samples do not drag splitters down
+		mine[i] = (count > 0) ? _mpi_sort_key(type, data, (long long)(i + 1) * count / size) : UINT64_MAX;
+	}
+	MPI_Allgather(mine, s, MPI_UINT64_T, samples, s, MPI_UINT64_T, comm);
+
+	// the p(p-1) samples are small, sort them with the same radix sort as mpi_sort_kv keys
+	mpi_sort_kv *sorted = (mpi_sort_kv *)malloc((size_t)size * s * sizeof(mpi_sort_kv));
+	for (int i = 0; i < size * s; i++) {
+		sorted[i].key = (int64_t)(samples[i] ^ 0x8000000000000000ull);
+		sorted[i].value = 0;
+	}
+	mpi_sort_local(MPI_SORT_KV, sorted, (long long)size * s);
+
+	long long prev = 0;
+	for (int i = 0; i < s; i++) {
+		uint64_t splitter = (uint64_t)sorted[i * size + size / 2].key ^ 0x8000000000000000ull;
+		long long below = _mpi_sort_lower(type, data, count, splitter, 0);
+		if (below < prev) below = prev;
+		send[i] = below - prev;
+		prev = below;
+	}
+	send[s] = count - prev;
+
+	free(sorted);
+	free(mine);
+	free(samples);
+}
+
+/*
+ * Histogram sort: exact send counts so that bucket i gets global ranks [i n / p, (i + 1) n / p)
+ */
+void _mpi_sort_histogram_split(MPI_Comm comm, int type, const void *data, long long count, long long *send) {
+	int rank, size;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &size);
+	int s = size - 1;
+
+	long long total;
+	MPI_Allreduce(&count, &total, 1, MPI_LONG_LONG, MPI_SUM, comm);
+
+	uint64_t range[2] = {UINT64_MAX, 0}, global[2];
+	if (count > 0) {
+		range[0] = _mpi_sort_key(type, data, 0);
+		range[1] = ~_mpi_sort_key(type, data, count - 1); // max as a min, so one reduction does both
+	} else {
+		range[1] = UINT64_MAX;
+	}
+	MPI_Allreduce(range, global, 2, MPI_UINT64_T, MPI_MIN, comm);
+
+	long long *target = (long long *)malloc((size_t)(2 * s + 1) * sizeof(long long));
+	long long *below = target + s;
+	uint64_t *lo = (uint64_t *)malloc((size_t)(2 * s + 1) * sizeof(uint64_t));
+	uint64_t *hi = lo + s;
+	for (int i = 0; i < s; i++) {
+		long long start, n;
+		mpi_block_range(total, i + 1, size, &start, &n);
+		target[i] = start;
+		lo[i] = global[0];
+		hi[i] = ~global[1];
+	}
+
+	// smallest key with at least target[i] keys <= it: bisect all splitters together, one allreduce per round
+	long long *local = (long long *)malloc((size_t)(2 * s + 1) * sizeof(long long));
+	for (int round = 0; round < 64; round++) {
+		int open = 0;
+		for (int i = 0; i < s; i++) {
+			uint64_t mid = lo[i] + (hi[i] - lo[i]) / 2;
+			local[i] = (lo[i] < hi[i]) ? _mpi_sort_lower(type, data, count, mid, 1) : 0;
+			open |= lo[i] < hi[i];
+		}
+		if (!open) {
+			break;
+		}
+		MPI_Allreduce(local, below, s, MPI_LONG_LONG, MPI_SUM, comm);
+		for (int i = 0; i < s; i++) {
+			if (lo[i] < hi[i]) {
+				uint64_t mid = lo[i] + (hi[i] - lo[i]) / 2;
+				if (below[i] >= target[i]) hi[i] = mid; else lo[i] = mid + 1;
+			}
+		}
+	}
+
+	// split the run of keys equal to each splitter: ranks take the equal keys in rank order
+	long long *less = local, *equal = local + s, *less_global = below, *equal_before = (long long *)malloc((size_t)(2 * s + 1) * sizeof(long long));
+	for (int i = 0; i < s; i++) {
+		less[i] = _mpi_sort_lower(type, data, count, lo[i], 0);
+		equal[i] = _mpi_sort_lower(type, data, count, lo[i], 1) - less[i];
+	}
+	MPI_Allreduce(less, less_global, s, MPI_LONG_LONG, MPI_SUM, comm);
+	MPI_Exscan(equal, equal_before, s, MPI_LONG_LONG, MPI_SUM, comm);
+	if (rank == 0) {
+		memset(equal_before, 0, (size_t)s * sizeof(long long));
+	}
+
+	long long prev = 0;
+	for (int i = 0; i < s; i++) {
+		long long take = target[i] - less_global[i] - equal_before[i];
+		if (take < 0) take = 0;
+		if (take > equal[i]) take = equal[i];
+		long long cut = less[i] + take;
+		if (cut < prev) cut = prev;
+		send[i] = cut - prev;
+		prev = cut;
+	}
+	send[s] = count - prev;
+
+	free(equal_before);
+	free(local);
+	free(lo);
+	free(target);
+}
+
+/*
+ * Alltoallv of elements with 64 bit counts (returns the new malloc'd block, frees data)
+ */
+void *_mpi_sort_exchange(MPI_Comm comm, MPI_Datatype elem_type, size_t elem, void *data,
+		const long long *send, long long *recv_total) {
+	int size;
+	MPI_Comm_size(comm, &size);
+	int *counts = (int *)malloc(4 * (size_t)size * sizeof(int));
+	int *sdispls = counts + size, *rcounts = counts + 2 * size, *rdispls = counts + 3 * size;
+
+	long long off = 0;
+	for (int r = 0; r < size; r++) {
+		counts[r] = (int)send[r];
+		sdispls[r] = (int)off;
+		off += send[r];
+	}
+	MPI_Alltoall(counts, 1, MPI_INT, rcounts, 1, MPI_INT, comm);
+	off = 0;
+	for (int r = 0; r < size; r++) {
+		rdispls[r] = (int)off;
+		off += rcounts[r];
+	}
+
+	void *out = malloc(off > 0 ? (size_t)off * elem : 1);
+	MPI_Alltoallv(data, counts, sdispls, elem_type, out, rcounts, rdispls, elem_type, comm);
+	free(data);
+	free(counts);
+	*recv_total = off;
+	return out;
+}
+
+/*
+ * Sort a block-distributed array across comm (collective)
+ *
+ * comm: MPI communicator
+ * type: MPI_SORT_INT, MPI_SORT_DOUBLE or MPI_SORT_KV
+ * method: MPI_SORT_SAMPLE or MPI_SORT_HISTOGRAM (use it for skewed or duplicate-heavy keys)
+ * data: malloc'd local block, replaced by a malloc'd block of the sorted array (free it after use)
+ * count: number of local elements, set to the new number (standard block split of the total)
+ * returns MPI_SUCCESS or MPI_ERR_ARG for an unknown type
+ */
+int mpi_sort(MPI_Comm comm, int type, int method, void **data, long long *count) {
+	int rank, size;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &size);
+	size_t elem = mpi_sort_elem_size(type);
+	if (elem == 0) {
+		return MPI_ERR_ARG;
+	}
+
+	MPI_Datatype elem_type;
+	MPI_Type_contiguous((int)elem, MPI_BYTE, &elem_type);
+	MPI_Type_commit(&elem_type);
+	long long *send = (long long *)calloc(size, sizeof(long long));
+
+	mpi_sort_local(type, *data, *count);
+
+	if (size > 1) {
+		if (method == MPI_SORT_HISTOGRAM) {
+			_mpi_sort_histogram_split(comm, type, *data, *count, send);
+		} else {
+			_mpi_sort_sample_split(comm, type, *data, *count, send);
+		}
+		*data = _mpi_sort_exchange(comm, elem_type, elem, *data, send, count);
+
+		// the buckets arrive as p sorted runs, radix sort is linear so sort them again rather than merging
+		mpi_sort_local(type, *data, *count);
+
+		// rebalance: my elements are global positions [first, first + count), send each rank its block of them
+		long long first = 0, total;
+		MPI_Exscan(count, &first, 1, MPI_LONG_LONG, MPI_SUM, comm);
+		if (rank == 0) {
+			first = 0;
+		}
+		MPI_Allreduce(count, &total, 1, MPI_LONG_LONG, MPI_SUM, comm);
+		int balanced = 1;
+		for (int r = 0; r < size; r++) {
+			long long start, n;
+			mpi_block_range(total, r, size, &start, &n);
+			long long a = (start > first) ? start : first;
+			long long b = (start + n < first + *count) ? start + n : first + *count;
+			send[r] = (b > a) ? b - a : 0;
+			balanced &= (r == rank) ? send[r] == *count : send[r] == 0;
+		}
+		// histogram sort buckets are already exact, skip the second exchange when no rank needs it
+		int all_balanced;
+		MPI_Allreduce(&balanced, &all_balanced, 1, MPI_INT, MPI_LAND, comm);
+		if (!all_balanced) {
+			*data = _mpi_sort_exchange(comm, elem_type, elem, *data, send, count);
+		}
+	}
+
+	free(send);
+	MPI_Type_free(&elem_type);
+	return MPI_SUCCESS;
+}
+
+/*
+ * Check that a distributed array is globally sorted (collective)
+ * returns 1 on every rank if it is, 0 otherwise
+ */
+int mpi_sort_check(MPI_Comm comm, int type, const void *data, long long count) {
+	int rank, size;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &size);
+
+	int ok = 1;
+	for (long long i = 1; i < count; i++) {
+		ok &= _mpi_sort_key(type, data, i - 1) <= _mpi_sort_key(type, data, i);
+	}
+
+	// compare my first key with the last key of the nearest rank before me that has data
+	uint64_t ends[2] = {count > 0 ? _mpi_sort_key(type, data, 0) : 0, count > 0 ? _mpi_sort_key(type, data, count - 1) : 0};
+	uint64_t *all = (uint64_t *)malloc(2 * (size_t)size * sizeof(uint64_t));
+	long long *counts = (long long *)malloc((size_t)size * sizeof(long long));
+	MPI_Allgather(ends, 2, MPI_UINT64_T, all, 2, MPI_UINT64_T, comm);
+	MPI_Allgather(&count, 1, MPI_LONG_LONG, counts, 1, MPI_LONG_LONG, comm);
+	if (count > 0) {
+		for (int r = rank - 1; r >= 0; r--) {
+			if (counts[r] > 0) {
+				ok &= all[2 * r + 1] <= ends[0];
+				break;
+			}
+		}
+	}
+	free(counts);
+	free(all);
+
+	int all_ok;
+	MPI_Allreduce(&ok, &all_ok, 1, MPI_INT, MPI_LAND, comm);
+	return all_ok;
+}
+
+#endif
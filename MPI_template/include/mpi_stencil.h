@@ -0,0 +1,351 @@
+#ifndef MPI_STENCIL_H
+#define MPI_STENCIL_H
+
+#include <math.h>
+
+#include "mpi_helper.h"
+#include "mpi_topo.h"
+#include "mpi_checkpoint.h"
+
+/*
+ * Distributed 2D grid engine for Jacobi-style iterations and image filters.
+ *
+ * The global NX x NY grid of doubles is cut into 2D blocks over a 2D cartesian
+ * topology, every block padded with 'width' ghost cells. Each iteration:
+ *
+ *   1. start the face halo exchange of the current grid (nonblocking)
+ *   2. apply the kernel to the cells that do not touch a ghost cell
+ *   3. wait for the halos, then apply the kernel to the boundary strips
+ *   4. swap current/next
+ *
+ * The overlapped exchange only carries the faces; a short second round after
+ * it fills the edge and corner ghosts, so 9-point (3x3) kernels see correct
+ * diagonal neighbours. Kernels that read faces only (like mpi_stencil_jacobi5)
+ * can skip that round by setting corners = 0 after mpi_grid2d_create.
+ *
+ * so the messages are in flight while most of the block is computed. The
+ * global residual is only reduced every 'check_every' iterations, with an
+ * MPI_Iallreduce that is waited for at the next check, so convergence testing
+ * does not put a blocking allreduce in every iteration.
+ *
+ * Ghost cells at non-periodic edges are never written by the exchange: they
+ * hold fixed (Dirichlet) boundary values, see mpi_grid2d_set_boundary.
+ */
+
+/*
+ * Stencil kernel applied to the padded rows [i0, i1) and columns [j0, j1)
+ *
+ * in/out: padded arrays (element [i][j] is at i * stride + j), in has valid ghosts
+ * ctx: user data passed to mpi_grid2d_run
+ *
+ * A kernel is called on a range rather than per cell so its inner loop can vectorise.
+ */
+typedef void (*mpi_stencil_kernel)(const double *in, double *out, int stride,
+		int i0, int i1, int j0, int j1, void *ctx);
+
+typedef struct {
+	mpi_topo topo;
+	mpi_halo halo;
+	int global[2];          // NX, NY
+	int n[2];               // interior cells of my block
+	int offset[2];          // global index of my first interior cell
+	int width;              // ghost width
+	int corners;            // 1: fill the edge/corner ghosts every step (default), 0: faces only
+	int stride;             // padded row length
+	double *cur;            // padded current grid
+	double *next;           // padded next grid
+	MPI_Datatype interior;  // my interior cells inside the padded block
+} mpi_grid2d;
+
+/*
+ * Create the process grid and local blocks for an NX x NY grid (collective)
+ *
+ * comm: MPI communicator
+ * nx, ny: global grid size (does not have to divide evenly)
+ * width: ghost width, i.e. the stencil radius
+ * periodic: periodic[2] wrap around flags (NULL for hard edges on both)
+ * g: grid to fill in, free with mpi_grid2d_free
+ */
+int mpi_grid2d_create(MPI_Comm comm, int nx, int ny, int width, const int *periodic, mpi_grid2d *g) {
+	memset(g, 0, sizeof(*g));
+	int edges[2] = {0, 0};
+	int err = mpi_topo_create(comm, 2, periodic ? periodic : edges, 1, &g->topo);
+	if (err != MPI_SUCCESS) {
+		return err;
+	}
+
+	g->global[0] = nx;
+	g->global[1] = ny;
+	g->width = width;
+	g->corners = 1;
+	for (int d = 0; d < 2; d++) {
+		// same split as the week programs: the first global % dims blocks get one extra row/column
+		int per = g->global[d] / g->topo.dims[d], rem = g->global[d] % g->topo.dims[d];
+		int c = g->topo.coords[d];
+		g->n[d] = per + (c < rem ? 1 : 0);
+		g->offset[d] = c * per + (c < rem ? c : rem);
+	}
+
+	err = mpi_halo_create(&g->topo, g->n, width, MPI_DOUBLE, &g->halo);
+	if (err != MPI_SUCCESS) {
+		mpi_topo_free(&g->topo);
+		return err;
+	}
+	g->stride = g->n[1] + 2 * width;
+
+	size_t cells = (size_t)(g->n[0] + 2 * width) * g->stride;
+	g->cur = (double *)calloc(cells, sizeof(double));
+	g->next = (double *)calloc(cells, sizeof(double));
+
+	int starts[2] = {width, width};
+	MPI_Type_create_subarray(2, g->halo.padded, g->n, starts, MPI_ORDER_C, MPI_DOUBLE, &g->interior);
+	MPI_Type_commit(&g->interior);
+	return MPI_SUCCESS;
+}
+
+void mpi_grid2d_free(mpi_grid2d *g) {
+	MPI_Type_free(&g->interior);
+	mpi_halo_free(&g->halo);
+	mpi_topo_free(&g->topo);
+	free(g->cur);
+	free(g->next);
+}
+
+/*
+ * Pointer to padded cell [i][j] of a grid buffer (i, j are interior indices, -width allowed)
+ */
+#define mpi_grid2d_at(g, buf, i, j) ((buf)[((i) + (g)->width) * (g)->stride + (j) + (g)->width])
+
+/*
+ * Set every ghost cell on a non-periodic edge of the global grid to value, in both buffers
+ */
+void mpi_grid2d_set_boundary(mpi_grid2d *g, double value) {
+	int w = g->width, rows = g->n[0] + 2 * w, cols = g->stride;
+	int top = g->topo.lo[0] == MPI_PROC_NULL, bottom = g->topo.hi[0] == MPI_PROC_NULL;
+	int left = g->topo.lo[1] == MPI_PROC_NULL, right = g->topo.hi[1] == MPI_PROC_NULL;
+	double *bufs[2] = {g->cur, g->next};
+	for (int b = 0; b < 2; b++) {
+		for (int i = 0; i < rows; i++) {
+			for (int j = 0; j < cols; j++) {
+				int edge = (top && i < w) || (bottom && i >= rows - w) || (left && j < w) || (right && j >= cols - w);
+				if (edge) {
+					bufs[b][i * cols + j] = value;
+				}
+			}
+		}
+	}
+}
+
+/*
+ * Datatype of block 'rank' of the process grid inside the global NX x NY array (on the root)
+ */
+MPI_Datatype _mpi_grid2d_block_type(const mpi_grid2d *g, int rank) {
+	int coords[2], sizes[2], starts[2];
+	MPI_Cart_coords(g->topo.comm, rank, 2, coords);
+	for (int d = 0; d < 2; d++) {
+		int per = g->global[d] / g->topo.dims[d], rem = g->global[d] % g->topo.dims[d];
+		sizes[d] = per + (coords[d] < rem ? 1 : 0);
+		starts[d] = coords[d] * per + (coords[d] < rem ? coords[d] : rem);
+	}
+	MPI_Datatype type;
+	MPI_Type_create_subarray(2, g->global, sizes, starts, MPI_ORDER_C, MPI_DOUBLE, &type);
+	MPI_Type_commit(&type);
+	return type;
+}
+
+/*
+ * Scatter a global NX x NY array from rank 0 of the grid into the current buffer (collective)
+ * The blocks are described with subarray types, so rank 0 sends straight from the global array.
+ *
+ * global: the whole grid, only significant on rank 0 of g->topo.comm
+ */
+void mpi_grid2d_scatter(mpi_grid2d *g, const double *global) {
+	if (g->topo.rank == 0) {
+		MPI_Request *requests = (MPI_Request *)malloc(g->topo.size * sizeof(MPI_Request));
+		for (int r = 0; r < g->topo.size; r++) {
+			MPI_Datatype block = _mpi_grid2d_block_type(g, r);
+			MPI_Isend(global, 1, block, r, 0, g->topo.comm, &requests[r]);
+			MPI_Type_free(&block); // freed types stay alive until pending operations finish
+		}
+		MPI_Recv(g->cur, 1, g->interior, 0, 0, g->topo.comm, MPI_STATUS_IGNORE);
+		MPI_Waitall(g->topo.size, requests, MPI_STATUSES_IGNORE);
+		free(requests);
+	} else {
+		MPI_Recv(g->cur, 1, g->interior, 0, 0, g->topo.comm, MPI_STATUS_IGNORE);
+	}
+}
+
+/*
+ * Gather the current buffer into a global NX x NY array on rank 0 of the grid (collective)
+ *
+ * global: receives the whole grid, only significant on rank 0 of g->topo.comm
+ */
+void mpi_grid2d_gather(mpi_grid2d *g, double *global) {
+	MPI_Request request;
+	MPI_Isend(g->cur, 1, g->interior, 0, 1, g->topo.comm, &request);
+	if (g->topo.rank == 0) {
+		for (int r = 0; r < g->topo.size; r++) {
+			MPI_Datatype block = _mpi_grid2d_block_type(g, r);
+			MPI_Recv(global, 1, block, r, 1, g->topo.comm, MPI_STATUS_IGNORE);
+			MPI_Type_free(&block);
+		}
+	}
+	MPI_Wait(&request, MPI_STATUS_IGNORE);
+}
+
+/*
+ * Write the current buffer as a checkpoint file (mpi_checkpoint.h format) in parallel (collective)
+ *
+ * Every rank's block lands in the global row-major array through a subarray file
+ * view, so the file can be restarted with mpi_checkpoint_read or mmap'd serially.
+ */
+int mpi_grid2d_write(mpi_grid2d *g, const char *filename) {
+	mpi_checkpoint_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, MPI_CKPT_MAGIC, sizeof(MPI_CKPT_MAGIC));
+	h.version = MPI_CKPT_VERSION;
+	h.endian_check = MPI_CKPT_ENDIAN_CHECK;
+	h.dtype = MPI_CKPT_DOUBLE;
+	h.elem_size = sizeof(double);
+	h.ndims = 2;
+	h.distribution = MPI_CKPT_BLOCK_ROWS;
+	h.shape[0] = (uint64_t)g->global[0];
+	h.shape[1] = (uint64_t)g->global[1];
+	h.nprocs = (uint32_t)g->topo.size;
+	h.data_offset = MPI_CKPT_DATA_OFFSET;
+	h.data_bytes = h.shape[0] * h.shape[1] * sizeof(double);
+
+	MPI_File fh;
+	int err = MPI_File_open(g->topo.comm, filename, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &fh);
+	if (err != MPI_SUCCESS) {
+		return err;
+	}
+	MPI_File_set_size(fh, 0);
+	if (g->topo.rank == 0) {
+		err = MPI_File_write_at(fh, 0, &h, (int)sizeof(h), MPI_BYTE, MPI_STATUS_IGNORE);
+	}
+
+	MPI_Datatype block = _mpi_grid2d_block_type(g, g->topo.rank);
+	MPI_File_set_view(fh, MPI_CKPT_DATA_OFFSET, MPI_DOUBLE, block, "native", MPI_INFO_NULL);
+	int write_err = MPI_File_write_all(fh, g->cur, 1, g->interior, MPI_STATUS_IGNORE);
+	MPI_Type_free(&block);
+
+	int close_err = MPI_File_close(&fh);
+	MPI_Bcast(&err, 1, MPI_INT, 0, g->topo.comm);
+	if (err != MPI_SUCCESS) return err;
+	if (write_err != MPI_SUCCESS) return write_err;
+	return close_err;
+}
+
+/*
+ * Sum of squared differences between next and cur over my interior cells
+ */
+double _mpi_grid2d_local_residual(const mpi_grid2d *g) {
+	double sum = 0.0;
+	for (int i = 0; i < g->n[0]; i++) {
+		const double *a = &mpi_grid2d_at(g, g->cur, i, 0);
+		const double *b = &mpi_grid2d_at(g, g->next, i, 0);
+		for (int j = 0; j < g->n[1]; j++) {
+			double d = b[j] - a[j];
+			sum += d * d;
+		}
+	}
+	return sum;
+}
+
+/*
+ * One iteration of the kernel over my block, overlapping the halo exchange with the inner cells
+ */
+void _mpi_grid2d_step(mpi_grid2d *g, mpi_stencil_kernel kernel, void *ctx) {
+	int w = g->width;
+	int r0 = w, r1 = w + g->n[0];  // interior rows (padded indices)
+	int c0 = w, c1 = w + g->n[1];  // interior columns
+
+	mpi_halo_start(&g->halo, g->cur);
+
+	// cells at least w away from the ghosts need nothing from the neighbours
+	int inner_r0 = r0 + w, inner_r1 = r1 - w, inner_c0 = c0 + w, inner_c1 = c1 - w;
+	int has_inner = inner_r0 < inner_r1 && inner_c0 < inner_c1;
+	if (has_inner) {
+		kernel(g->cur, g->next, g->stride, inner_r0, inner_r1, inner_c0, inner_c1, ctx);
+	}
+
+	if (g->corners) {
+		mpi_halo_finish_corners(&g->halo, g->cur);
+	} else {
+		mpi_halo_finish(&g->halo);
+	}
+
+	if (!has_inner) {
+		kernel(g->cur, g->next, g->stride, r0, r1, c0, c1, ctx);
+		return;
+	}
+	// the frame of width w around the inner cells: top and bottom strips, then the sides between them
+	kernel(g->cur, g->next, g->stride, r0, inner_r0, c0, c1, ctx);
+	kernel(g->cur, g->next, g->stride, inner_r1, r1, c0, c1, ctx);
+	kernel(g->cur, g->next, g->stride, inner_r0, inner_r1, c0, inner_c0, ctx);
+	kernel(g->cur, g->next, g->stride, inner_r0, inner_r1, inner_c1, c1, ctx);
+}
+
+/*
+ * Run up to iters iterations of kernel (collective)
+ *
+ * Every check_every iterations the global residual sqrt(sum (next - cur)^2) is
+ * started with MPI_Iallreduce; it is completed at the following check and the
+ * run stops once it is below tol. All ranks see the same value at the same
+ * iteration, so they stop together. check_every <= 0 disables the residual.
+ *
+ * returns the number of iterations done, *residual is set to the last completed residual (can be NULL)
+ */
+int mpi_grid2d_run(mpi_grid2d *g, mpi_stencil_kernel kernel, void *ctx, int iters,
+		int check_every, double tol, double *residual) {
+	MPI_Request reduce = MPI_REQUEST_NULL;
+	double local_res = 0.0, global_res = 0.0, last = -1.0;
+	int it;
+
+	for (it = 0; it < iters; it++) {
+		_mpi_grid2d_step(g, kernel, ctx);
+
+		if (check_every > 0 && (it + 1) % check_every == 0) {
+			// finish the reduction started at the previous check, then start this one
+			if (reduce != MPI_REQUEST_NULL) {
+				MPI_Wait(&reduce, MPI_STATUS_IGNORE);
+				last = sqrt(global_res);
+				if (last < tol) {
+					double *tmp = g->cur; g->cur = g->next; g->next = tmp;
+					it++;
+					break;
+				}
+			}
+			local_res = _mpi_grid2d_local_residual(g);
+			MPI_Iallreduce(&local_res, &global_res, 1, MPI_DOUBLE, MPI_SUM, g->topo.comm, &reduce);
+		}
+
+		double *tmp = g->cur; g->cur = g->next; g->next = tmp;
+	}
+
+	if (reduce != MPI_REQUEST_NULL) {
+		MPI_Wait(&reduce, MPI_STATUS_IGNORE);
+		last = sqrt(global_res);
+	}
+	if (residual != NULL) {
+		*residual = last;
+	}
+	return it;
+}
+
+/*
+ * Built-in 5-point Jacobi kernel (width 1): out = average of the 4 neighbours
+ */
+void mpi_stencil_jacobi5(const double *in, double *out, int stride, int i0, int i1, int j0, int j1, void *ctx) {
+	(void)ctx;
+	for (int i = i0; i < i1; i++) {
+		const double *up = in + (i - 1) * stride, *mid = in + i * stride, *down = in + (i + 1) * stride;
+		double *o = out + i * stride;
+		for (int j = j0; j < j1; j++) {
+			o[j] = 0.25 * (up[j] + down[j] + mid[j - 1] + mid[j + 1]);
+		}
+	}
+}
+
+#endif
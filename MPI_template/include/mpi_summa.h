@@ -0,0 +1,250 @@
+#ifndef MPI_SUMMA_H
+#define MPI_SUMMA_H
+
+#include "mpi_helper.h"
+#include "mpi_io.h"
+#include "mpi_topo.h"
+
+/*
+ * Distributed dense matrix multiply (SUMMA) and matrix-vector product on a 2D process grid.
+ *
+ * The ranks form a pr x pc grid (square when p is a perfect square). Every
+ * matrix is split into pr x pc blocks with the standard block split (first
+ * n % parts blocks one larger), rank (i, j) holding block (i, j) as a dense
+ * row-major array:
+ *
+ *   A: M x K   local mpi_summa_rows(M) x mpi_summa_cols(K)
+ *   B: K x N   local mpi_summa_rows(K) x mpi_summa_cols(N)
+ *   C: M x N   local mpi_summa_rows(M) x mpi_summa_cols(N)
+ *
+ * C = A B is computed panel by panel along K: the grid column owning a panel of
+ * A broadcasts it along its grid rows, the grid row owning the matching panel of
+ * B broadcasts it down its grid columns, and everyone adds the product of the
+ * two panels to its block of C. Those are the "src + dsts" broadcasts of
+ * my_mpi_broadcast_collective, but on row/column communicators made once with
+ * MPI_Cart_sub instead of once per call, and nonblocking, so panel k + 1 is in
+ * flight while the local GEMM of panel k runs.
+ */
+
+#ifndef MPI_SUMMA_PANEL
+#define MPI_SUMMA_PANEL 128  // default panel width along K
+#endif
+
+// local GEMM blocking: a KC x NC block of B stays in L2 while MC rows of A stream through it
+#define MPI_GEMM_MC 64
+#define MPI_GEMM_KC 256
+#define MPI_GEMM_NC 512
+
+typedef struct {
+	mpi_topo topo;
+	MPI_Comm row_comm;  // ranks in my grid row, rank in it = my column
+	MPI_Comm col_comm;  // ranks in my grid column, rank in it = my row
+	int rows, cols;     // grid size pr x pc
+	int row, col;       // my position
+} mpi_summa_grid;
+
+/*
+ * Create the process grid and its cached row/column communicators (collective)
+ */
+int mpi_summa_grid_create(MPI_Comm comm, mpi_summa_grid *g) {
+	memset(g, 0, sizeof(*g));
+	int periodic[2] = {0, 0};
+	int err = mpi_topo_create(comm, 2, periodic, 1, &g->topo);
+	if (err != MPI_SUCCESS) {
+		return err;
+	}
+	g->rows = g->topo.dims[0];
+	g->cols = g->topo.dims[1];
+	g->row = g->topo.coords[0];
+	g->col = g->topo.coords[1];
+
+	int keep_cols[2] = {0, 1}, keep_rows[2] = {1, 0};
+	MPI_Cart_sub(g->topo.comm, keep_cols, &g->row_comm);
+	MPI_Cart_sub(g->topo.comm, keep_rows, &g->col_comm);
+	return MPI_SUCCESS;
+}
+
+void mpi_summa_grid_free(mpi_summa_grid *g) {
+	MPI_Comm_free(&g->row_comm);
+	MPI_Comm_free(&g->col_comm);
+	mpi_topo_free(&g->topo);
+}
+
+/*
+ * Local extent of a global dimension split over the grid rows / columns
+ */
+int mpi_summa_rows(const mpi_summa_grid *g, long long n) {
+	long long start, count;
+	mpi_block_range(n, g->row, g->rows, &start, &count);
+	return (int)count;
+}
+
+int mpi_summa_cols(const mpi_summa_grid *g, long long n) {
+	long long start, count;
+	mpi_block_range(n, g->col, g->cols, &start, &count);
+	return (int)count;
+}
+
+/*
+ * C += A B for row-major m x k A, k x n B, m x n C with leading dimensions lda, ldb, ldc
+ *
+ * Cache blocked over all three loops. The innermost loop runs along a row of B
+ * and C with unit stride, so the compiler vectorises it without intrinsics.
+ */
+void mpi_gemm_local(int m, int n, int k, const double *A, int lda, const double *B, int ldb, double *C, int ldc) {
+	for (int jj = 0; jj < n; jj += MPI_GEMM_NC) {
+		int nb = (n - jj < MPI_GEMM_NC) ? n - jj : MPI_GEMM_NC;
+		for (int kk = 0; kk < k; kk += MPI_GEMM_KC) {
+			int kb = (k - kk < MPI_GEMM_KC) ? k - kk : MPI_GEMM_KC;
+			for (int ii = 0; ii < m; ii += MPI_GEMM_MC) {
+				int mb = (m - ii < MPI_GEMM_MC) ? m - ii : MPI_GEMM_MC;
+				for (int i = ii; i < ii + mb; i++) {
+					double *restrict c = C + (size_t)i * ldc + jj;
+					const double *a = A + (size_t)i * lda + kk;
+					for (int p = 0; p < kb; p++) {
+						const double *restrict b = B + (size_t)(kk + p) * ldb + jj;
+						double av = a[p];
+						for (int j = 0; j < nb; j++) {
+							c[j] += av * b[j];
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
+typedef struct {
+	long long k0, k1;   // global columns of A / rows of B in the panel
+	int a_owner;        // grid column holding those columns of A
+	int b_owner;        // grid row holding those rows of B
+} _mpi_summa_panel;
+
+/*
+ * Cut [0, K) into panels of at most width columns that never straddle a block boundary of A or B
+ */
+int _mpi_summa_panels(const mpi_summa_grid *g, long long K, int width, _mpi_summa_panel **panels) {
+	int capacity = 16, n = 0;
+	*panels = (_mpi_summa_panel *)malloc(capacity * sizeof(_mpi_summa_panel));
+	int a_owner = 0, b_owner = 0;
+	long long a_start, a_count, b_start, b_count;
+	mpi_block_range(K, 0, g->cols, &a_start, &a_count);
+	mpi_block_range(K, 0, g->rows, &b_start, &b_count);
+
+	for (long long k = 0; k < K;) {
+		while (k >= a_start + a_count) mpi_block_range(K, ++a_owner, g->cols, &a_start, &a_count);
+		while (k >= b_start + b_count) mpi_block_range(K, ++b_owner, g->rows, &b_start, &b_count);
+		long long end = k + width;
+		if (end > a_start + a_count) end = a_start + a_count;
+		if (end > b_start + b_count) end = b_start + b_count;
+
+		if (n == capacity) {
+			capacity *= 2;
+			*panels = (_mpi_summa_panel *)realloc(*panels, capacity * sizeof(_mpi_summa_panel));
+		}
+		(*panels)[n++] = (_mpi_summa_panel){k, end, a_owner, b_owner};
+		k = end;
+	}
+	return n;
+}
+
+/*
+ * Post the row/column broadcasts of one panel into the given buffers
+ */
+void _mpi_summa_start_panel(const mpi_summa_grid *g, const _mpi_summa_panel *pn, long long K,
+		int m, int n, const double *A, int lda, const double *B, int ldb,
+		double *a_panel, double *b_panel, MPI_Request *requests) {
+	int kb = (int)(pn->k1 - pn->k0);
+	long long a_start, a_count, b_start, b_count;
+	mpi_block_range(K, g->col, g->cols, &a_start, &a_count);
+	mpi_block_range(K, g->row, g->rows, &b_start, &b_count);
+
+	// A's panel is a column slice of my block, pack it so the broadcast is contiguous
+	if (g->col == pn->a_owner) {
+		for (int i = 0; i < m; i++) {
+			memcpy(a_panel + (size_t)i * kb, A + (size_t)i * lda + (pn->k0 - a_start), kb * sizeof(double));
+		}
+	}
+	// B's panel is whole rows of my block
+	if (g->row == pn->b_owner) {
+		for (int p = 0; p < kb; p++) {
+			memcpy(b_panel + (size_t)p * n, B + (size_t)(pn->k0 - b_start + p) * ldb, n * sizeof(double));
+		}
+	}
+	MPI_Ibcast(a_panel, m * kb, MPI_DOUBLE, pn->a_owner, g->row_comm, &requests[0]);
+	MPI_Ibcast(b_panel, kb * n, MPI_DOUBLE, pn->b_owner, g->col_comm, &requests[1]);
+}
+
+/*
+ * C = A B with SUMMA (collective over the grid)
+ *
+ * g: process grid
+ * M, N, K: global sizes
+ * A, B: my blocks of A and B (row-major, see the layout above)
+ * C: my block of C, overwritten
+ * panel: panel width along K (0 for MPI_SUMMA_PANEL)
+ */
+void mpi_summa_gemm(const mpi_summa_grid *g, long long M, long long N, long long K,
+		const double *A, const double *B, double *C, int panel) {
+	int m = mpi_summa_rows(g, M), n = mpi_summa_cols(g, N);
+	int lda = mpi_summa_cols(g, K), ldb = n;
+	if (panel <= 0) {
+		panel = MPI_SUMMA_PANEL;
+	}
+	memset(C, 0, (size_t)m * n * sizeof(double));
+
+	_mpi_summa_panel *panels;
+	int num_panels = _mpi_summa_panels(g, K, panel, &panels);
+
+	// two sets of panel buffers: one being multiplied, one being broadcast
+	double *a_buf[2], *b_buf[2];
+	for (int s = 0; s < 2; s++) {
+		a_buf[s] = (double *)malloc(((size_t)m * panel + 1) * sizeof(double));
+		b_buf[s] = (double *)malloc(((size_t)panel * n + 1) * sizeof(double));
+	}
+	MPI_Request requests[2][2];
+
+	if (num_panels > 0) {
+		_mpi_summa_start_panel(g, &panels[0], K, m, n, A, lda, B, ldb, a_buf[0], b_buf[0], requests[0]);
+	}
+	for (int p = 0; p < num_panels; p++) {
+		int s = p & 1;
+		MPI_Waitall(2, requests[s], MPI_STATUSES_IGNORE);
+		if (p + 1 < num_panels) {
+			_mpi_summa_start_panel(g, &panels[p + 1], K, m, n, A, lda, B, ldb, a_buf[!s], b_buf[!s], requests[!s]);
+		}
+		int kb = (int)(panels[p].k1 - panels[p].k0);
+		mpi_gemm_local(m, n, kb, a_buf[s], kb, b_buf[s], n, C, n);
+	}
+
+	for (int s = 0; s < 2; s++) {
+		free(a_buf[s]);
+		free(b_buf[s]);
+	}
+	free(panels);
+}
+
+/*
+ * y = A x with A distributed as for mpi_summa_gemm (collective over the grid)
+ *
+ * g: process grid
+ * M, K: global sizes of A
+ * A: my block of A
+ * x: the mpi_summa_cols(K) entries of x matching my block's columns (same on every rank of a grid column)
+ * y: set to the mpi_summa_rows(M) entries of y matching my block's rows (same on every rank of a grid row)
+ */
+void mpi_summa_gemv(const mpi_summa_grid *g, long long M, long long K, const double *A, const double *x, double *y) {
+	int m = mpi_summa_rows(g, M), k = mpi_summa_cols(g, K);
+	for (int i = 0; i < m; i++) {
+		const double *a = A + (size_t)i * k;
+		double sum = 0.0;
+		for (int j = 0; j < k; j++) {
+			sum += a[j] * x[j];
+		}
+		y[i] = sum;
+	}
+	// partial sums of a row of blocks add up along the grid row
+	MPI_Allreduce(MPI_IN_PLACE, y, m, MPI_DOUBLE, MPI_SUM, g->row_comm);
+}
+
+#endif
@@ -0,0 +1,662 @@
+#ifndef MPI_ZIP_H
+#define MPI_ZIP_H
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mpi.h>
+
+#include "mpi_helper.h"
+
+/*
+ * Opt-in compression of large double payloads on the wire.
+ *
+ * my_mpi_broadcast_z, my_mpi_scatter_z and my_mpi_gather_z move MPI_DOUBLE
+ * buffers in segments of MPI_ZIP_SEGMENT bytes. Every segment is encoded on
+ * its own and sent with MPI_Isend while the next one is encoded; receivers
+ * post the next segment's MPI_Irecv before decoding the current one, so
+ * encoding, transfer and decoding overlap.
+ *
+ * Codec (no external libraries):
+ *   lossless  each value is XORed with the previous one, so the sign, exponent
+ *             and leading mantissa bits of smooth data become zero bytes, the
+ *             8 bytes of every value are split into 8 byte planes (shuffle) so
+ *             those zeros are contiguous, and the planes are run-length coded
+ *   lossy     (tolerance > 0) values are rounded to multiples of 2 * tolerance,
+ *             so every received value is within tolerance of the sent one;
+ *             the integer multiples are delta coded (zigzag), shuffled and
+ *             run-length coded the same way. Segments with values that cannot
+ *             be quantised (NaN, Inf, too large for the step) fall back to
+ *             lossless.
+ *   stored    a segment that does not shrink is sent as it is
+ *
+ * Whether compression pays is decided per message by the sender: the first
+ * MPI_ZIP_PROBE bytes are encoded as a probe, and the message is compressed
+ * only if they came out below MPI_ZIP_MAX_RATIO of their size and encoding
+ * them took less time than sending them raw to every destination at the link
+ * bandwidth (mpi_zip_set_bandwidth, e.g. 1 / G of the inter-node mpi_sim
+ * fit). The default MPI_ZIP_BANDWIDTH stands for a rank's share of an
+ * inter-node link; between ranks of one node, set the shared-memory rate
+ * instead or turn compression off. mpi_zip_set_mode forces compression on or
+ * off (a sender-side choice, receivers follow the segment headers).
+ *
+ * Other datatypes and messages under MPI_ZIP_MIN_BYTES take the plain helper.
+ * In lossy mode the root keeps its exact data, only the copies differ.
+ * mpi_zip_get_stats / mpi_zip_report give the ratio and codec throughput.
+ */
+
+#ifndef MPI_ZIP_SEGMENT
+#define MPI_ZIP_SEGMENT (1 << 18)      // bytes of doubles per pipelined segment
+#endif
+#ifndef MPI_ZIP_MIN_BYTES
+#define MPI_ZIP_MIN_BYTES (1 << 19)    // smaller messages are sent uncompressed by the plain helper
+#endif
+#ifndef MPI_ZIP_PROBE
+#define MPI_ZIP_PROBE (1 << 15)        // bytes at the start of a message encoded to decide on it
+#endif
+#ifndef MPI_ZIP_MAX_RATIO
+#define MPI_ZIP_MAX_RATIO 0.9          // the probe has to shrink at least this much
+#endif
+#ifndef MPI_ZIP_BANDWIDTH
+#define MPI_ZIP_BANDWIDTH 1e9          // default link bandwidth in bytes/s that encoding time is weighed against
+#endif
+#ifndef MPI_ZIP_TAG
+#define MPI_ZIP_TAG 0x5a49
+#endif
+
+enum {
+	MPI_ZIP_OFF = 0,    // send every segment stored
+	MPI_ZIP_AUTO = 1,   // decide per message from a probe
+	MPI_ZIP_ON = 2      // encode every segment
+};
+
+enum {
+	MPI_ZIP_STORED = 0,
+	MPI_ZIP_LOSSLESS = 1,
+	MPI_ZIP_LOSSY = 2
+};
+
+/*
+ * Precedes every encoded segment
+ */
+typedef struct {
+	uint64_t count;   // doubles in the segment
+	uint64_t bytes;   // payload bytes after the header
+	double step;      // quantisation step of MPI_ZIP_LOSSY
+	uint32_t mode;    // MPI_ZIP_STORED, MPI_ZIP_LOSSLESS or MPI_ZIP_LOSSY
+	uint32_t pad;
+} mpi_zip_header;
+
+typedef struct {
+	unsigned long long messages, compressed;      // messages sent, and those that were compressed
+	unsigned long long raw_bytes, wire_bytes;     // bytes sent per destination before and after encoding (headers included)
+	unsigned long long segments_stored, segments_lossless, segments_lossy;
+	unsigned long long encoded_bytes, decoded_bytes;
+	double encode_seconds, decode_seconds;
+} mpi_zip_stats;
+
+static mpi_zip_stats _mpi_zip_counters;
+static int _mpi_zip_mode = MPI_ZIP_AUTO;
+static double _mpi_zip_bandwidth = MPI_ZIP_BANDWIDTH;
+
+/*
+ * Sender policy: MPI_ZIP_OFF, MPI_ZIP_AUTO (default) or MPI_ZIP_ON
+ */
+void mpi_zip_set_mode(int mode) {
+	_mpi_zip_mode = mode;
+}
+
+/*
+ * Link bandwidth in bytes/s used by MPI_ZIP_AUTO
+ */
+void mpi_zip_set_bandwidth(double bytes_per_second) {
+	if (bytes_per_second > 0) {
+		_mpi_zip_bandwidth = bytes_per_second;
+	}
+}
+
+/*
+ * 8 bytes at p, byte j being bits 8j..8j+7 of the word on any endianness
+ */
+static inline uint64_t _mpi_zip_load(const uint8_t *p) {
+	uint64_t v;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	memcpy(&v, p, sizeof(v));
+#else
+	v = 0;
+	for (int j = 0; j < 8; j++) {
+		v |= (uint64_t)p[j] << (8 * j);
+	}
+#endif
+	return v;
+}
+
+static inline void _mpi_zip_store(uint8_t *p, uint64_t v) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	memcpy(p, &v, sizeof(v));
+#else
+	for (int j = 0; j < 8; j++) {
+		p[j] = (uint8_t)(v >> (8 * j));
+	}
+#endif
+}
+
+/*
+ * Run-length coding: a control byte c < 0x80 is followed by c + 1 literal
+ * bytes, c >= 0x80 by one byte repeated c - 0x80 + 3 times
+ *
+ * returns the coded size, 0 if it would exceed cap
+ */
+size_t _mpi_zip_rle_encode(const uint8_t *in, size_t n, uint8_t *out, size_t cap) {
+	size_t i = 0, o = 0;
+	while (i < n) {
+		// literals up to the next run of three equal bytes (or the end)
+		size_t run = i;
+		while (run + 10 <= n) {
+			// 8 positions at a time: d has a zero byte where a run starts
+			uint64_t x = _mpi_zip_load(in + run);
+			uint64_t d = (x ^ _mpi_zip_load(in + run + 1)) | (x ^ _mpi_zip_load(in + run + 2));
+			if (((d - 0x0101010101010101ULL) & ~d & 0x8080808080808080ULL) != 0) {
+				break;
+			}
+			run += 8;
+		}
+		while (run + 2 < n && !(in[run] == in[run + 1] && in[run] == in[run + 2])) {
+			run++;
+		}
+		if (run + 2 >= n) {
+			run = n;
+		}
+		while (i < run) {
+			size_t k = run - i < 128 ? run - i : 128;
+			if (o + 1 + k > cap) {
+				return 0;
+			}
+			out[o++] = (uint8_t)(k - 1);
+			memcpy(out + o, in + i, k);
+			o += k;
+			i += k;
+		}
+		if (run < n) {
+			size_t k = 3;
+			uint64_t repeated = in[run] * 0x0101010101010101ULL;
+			while (run + k + 8 <= n && k + 8 <= 130 && _mpi_zip_load(in + run + k) == repeated) {
+				k += 8;
+			}
+			while (run + k < n && k < 130 && in[run + k] == in[run]) {
+				k++;
+			}
+			if (o + 2 > cap) {
+				return 0;
+			}
+			out[o++] = (uint8_t)(0x80 + k - 3);
+			out[o++] = in[run];
+			i = run + k;
+		}
+	}
+	return o;
+}
+
+/*
+ * returns 0 if in decodes to exactly expect bytes, -1 otherwise
+ */
+int _mpi_zip_rle_decode(const uint8_t *in, size_t n, uint8_t *out, size_t expect) {
+	size_t i = 0, o = 0;
+	while (i < n) {
+		uint8_t c = in[i++];
+		if (c < 0x80) {
+			size_t k = (size_t)c + 1;
+			if (i + k > n || o + k > expect) {
+				return -1;
+			}
+			memcpy(out + o, in + i, k);
+			i += k;
+			o += k;
+		} else {
+			size_t k = (size_t)c - 0x80 + 3;
+			if (i >= n || o + k > expect) {
+				return -1;
+			}
+			memset(out + o, in[i++], k);
+			o += k;
+		}
+	}
+	return o == expect ? 0 : -1;
+}
+
+/*
+ * Transpose the 8 x 8 byte matrix whose row j is a[j] (byte c of a[j] becomes byte j of a[c])
+ */
+static inline void _mpi_zip_transpose(uint64_t a[8]) {
+	for (int j = 0; j < 4; j++) {
+		uint64_t t = ((a[j] >> 32) ^ a[j + 4]) & 0x00000000ffffffffULL;
+		a[j] ^= t << 32;
+		a[j + 4] ^= t;
+	}
+	for (int j = 0; j < 8; j += (j & 1) ? 3 : 1) {
+		uint64_t t = ((a[j] >> 16) ^ a[j + 2]) & 0x0000ffff0000ffffULL;
+		a[j] ^= t << 16;
+		a[j + 2] ^= t;
+	}
+	for (int j = 0; j < 8; j += 2) {
+		uint64_t t = ((a[j] >> 8) ^ a[j + 1]) & 0x00ff00ff00ff00ffULL;
+		a[j] ^= t << 8;
+		a[j + 1] ^= t;
+	}
+}
+
+/*
+ * Byte plane b of the n words goes to planes[b * n ...] (least significant plane first, on any endianness)
+ */
+void _mpi_zip_shuffle(const uint64_t *w, size_t n, uint8_t *planes) {
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		uint64_t a[8];
+		memcpy(a, w + i, sizeof(a));
+		_mpi_zip_transpose(a);
+		for (int b = 0; b < 8; b++) {
+			_mpi_zip_store(planes + b * n + i, a[b]);
+		}
+	}
+	for (; i < n; i++) {
+		for (int b = 0; b < 8; b++) {
+			planes[b * n + i] = (uint8_t)(w[i] >> (8 * b));
+		}
+	}
+}
+
+void _mpi_zip_unshuffle(const uint8_t *planes, size_t n, uint64_t *w) {
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		uint64_t a[8];
+		for (int b = 0; b < 8; b++) {
+			a[b] = _mpi_zip_load(planes + b * n + i);
+		}
+		_mpi_zip_transpose(a);
+		memcpy(w + i, a, sizeof(a));
+	}
+	for (; i < n; i++) {
+		uint64_t v = 0;
+		for (int b = 0; b < 8; b++) {
+			v |= (uint64_t)planes[b * n + i] << (8 * b);
+		}
+		w[i] = v;
+	}
+}
+
+/*
+ * Zigzag coded differences of the multiples of step closest to in; returns 0
+ * (and w is garbage) if a value is not within step / 2 of its multiple
+ */
+int _mpi_zip_quantise(const double *in, size_t n, double step, uint64_t *w) {
+	int64_t prev = 0;
+	for (size_t i = 0; i < n; i++) {
+		double q = rint(in[i] / step);
+		// catches NaN and Inf too; the decoder computes the same q * step, so the bound is exact
+		if (!(fabs(q) < 4503599627370496.0) || !(fabs(q * step - in[i]) <= step / 2)) {
+			return 0;
+		}
+		int64_t d = (int64_t)q - prev;
+		prev = (int64_t)q;
+		w[i] = ((uint64_t)d << 1) ^ (uint64_t)(d >> 63);
+	}
+	return 1;
+}
+
+/*
+ * Largest encoded size of count doubles (header included)
+ */
+size_t mpi_zip_bound(size_t count) {
+	return sizeof(mpi_zip_header) + count * sizeof(double);
+}
+
+/*
+ * Encode count doubles into out (mpi_zip_bound(count) bytes), returns the encoded size
+ *
+ * tolerance: 0 for lossless, otherwise the largest absolute error allowed per value
+ */
+size_t mpi_zip_encode(const double *in, size_t count, double tolerance, void *out) {
+	mpi_zip_header h = {count, 0, 0.0, MPI_ZIP_STORED, 0};
+	size_t raw = count * sizeof(double);
+	uint8_t *payload = (uint8_t *)out + sizeof(h);
+
+	uint64_t *w = count > 0 ? (uint64_t *)mpi_pool_alloc(2 * raw) : NULL;
+	if (w != NULL) {
+		uint8_t *planes = (uint8_t *)(w + count);
+		int lossy = tolerance > 0 && _mpi_zip_quantise(in, count, 2 * tolerance, w);
+		if (!lossy) {
+			uint64_t prev = 0;
+			for (size_t i = 0; i < count; i++) {
+				uint64_t v;
+				memcpy(&v, &in[i], sizeof(v));
+				w[i] = v ^ prev;
+				prev = v;
+			}
+		}
+		_mpi_zip_shuffle(w, count, planes);
+		size_t packed = _mpi_zip_rle_encode(planes, raw, payload, raw - 1);
+		if (packed > 0) {
+			h.mode = lossy ? MPI_ZIP_LOSSY : MPI_ZIP_LOSSLESS;
+			h.step = lossy ? 2 * tolerance : 0.0;
+			h.bytes = packed;
+		}
+		mpi_pool_free(w);
+	}
+	if (h.mode == MPI_ZIP_STORED) {
+		memcpy(payload, in, raw);
+		h.bytes = raw;
+	}
+	memcpy(out, &h, sizeof(h));
+	return sizeof(h) + h.bytes;
+}
+
+/*
+ * Decode bytes of mpi_zip_encode output into count doubles
+ *
+ * returns MPI_SUCCESS, MPI_ERR_TRUNCATE if the data does not decode to count values, MPI_ERR_NO_MEM
+ */
+int mpi_zip_decode(const void *in, size_t bytes, double *out, size_t count) {
+	mpi_zip_header h;
+	if (bytes < sizeof(h)) {
+		return MPI_ERR_TRUNCATE;
+	}
+	memcpy(&h, in, sizeof(h));
+	const uint8_t *payload = (const uint8_t *)in + sizeof(h);
+	size_t raw = count * sizeof(double);
+	if (h.count != count || h.bytes != bytes - sizeof(h)) {
+		return MPI_ERR_TRUNCATE;
+	}
+	if (h.mode == MPI_ZIP_STORED) {
+		if (h.bytes != raw) {
+			return MPI_ERR_TRUNCATE;
+		}
+		memcpy(out, payload, raw);
+		return MPI_SUCCESS;
+	}
+	if (h.mode != MPI_ZIP_LOSSLESS && h.mode != MPI_ZIP_LOSSY) {
+		return MPI_ERR_TRUNCATE;
+	}
+
+	uint64_t *w = (uint64_t *)mpi_pool_alloc(2 * raw);
+	if (w == NULL) {
+		return MPI_ERR_NO_MEM;
+	}
+	uint8_t *planes = (uint8_t *)(w + count);
+	if (_mpi_zip_rle_decode(payload, h.bytes, planes, raw) != 0) {
+		mpi_pool_free(w);
+		return MPI_ERR_TRUNCATE;
+	}
+	_mpi_zip_unshuffle(planes, count, w);
+	if (h.mode == MPI_ZIP_LOSSLESS) {
+		uint64_t v = 0;
+		for (size_t i = 0; i < count; i++) {
+			v ^= w[i];
+			memcpy(&out[i], &v, sizeof(v));
+		}
+	} else {
+		int64_t q = 0;
+		for (size_t i = 0; i < count; i++) {
+			q += (int64_t)(w[i] >> 1) ^ -(int64_t)(w[i] & 1);
+			out[i] = (double)q * h.step;
+		}
+	}
+	mpi_pool_free(w);
+	return MPI_SUCCESS;
+}
+
+/*
+ * Send count doubles to every rank in dsts, segment by segment (the next
+ * segment is encoded while the previous one is in flight)
+ */
+int _mpi_zip_send(const double *buf, long long count, const int *dsts, int num_dsts, double tolerance, MPI_Comm comm) {
+	if (num_dsts == 0) {
+		return MPI_SUCCESS;
+	}
+	const long long per = MPI_ZIP_SEGMENT / sizeof(double);
+	long long segments = (count + per - 1) / per;
+	size_t slot_bytes = mpi_zip_bound((size_t)per);
+	char *slots = (char *)mpi_pool_alloc(2 * slot_bytes);
+	MPI_Request *requests = (MPI_Request *)malloc(2 * (size_t)num_dsts * sizeof(MPI_Request));
+	if (slots == NULL || requests == NULL) {
+		mpi_pool_free(slots);
+		free(requests);
+		return MPI_ERR_NO_MEM;
+	}
+	for (int i = 0; i < 2 * num_dsts; i++) {
+		requests[i] = MPI_REQUEST_NULL;
+	}
+
+	int compress = _mpi_zip_mode != MPI_ZIP_OFF;
+	if (_mpi_zip_mode == MPI_ZIP_AUTO && segments > 0) {
+		// encoding overlaps the transfer of the previous segment, so it only has to keep up with the link
+		long long n = count < MPI_ZIP_PROBE / (long long)sizeof(double) ? count : MPI_ZIP_PROBE / (long long)sizeof(double);
+		size_t raw = (size_t)n * sizeof(double);
+		double start = MPI_Wtime();
+		size_t wire = mpi_zip_encode(buf, (size_t)n, tolerance, slots);
+		double elapsed = MPI_Wtime() - start;
+		compress = wire < MPI_ZIP_MAX_RATIO * raw && elapsed < num_dsts * raw / _mpi_zip_bandwidth;
+	}
+	for (long long s = 0; s < segments; s++) {
+		int k = (int)(s & 1);
+		char *slot = slots + k * slot_bytes;
+		// the slot is free once the segment before last has gone to everyone
+		MPI_Waitall(num_dsts, requests + k * num_dsts, MPI_STATUSES_IGNORE);
+
+		long long n = count - s * per < per ? count - s * per : per;
+		size_t raw = (size_t)n * sizeof(double), wire;
+		if (compress) {
+			double start = MPI_Wtime();
+			wire = mpi_zip_encode(buf + s * per, (size_t)n, tolerance, slot);
+			_mpi_zip_counters.encode_seconds += MPI_Wtime() - start;
+			_mpi_zip_counters.encoded_bytes += raw;
+		} else {
+			mpi_zip_header h = {(uint64_t)n, raw, 0.0, MPI_ZIP_STORED, 0};
+			memcpy(slot, &h, sizeof(h));
+			memcpy(slot + sizeof(h), buf + s * per, raw);
+			wire = sizeof(h) + raw;
+		}
+
+		uint32_t mode;
+		memcpy(&mode, slot + offsetof(mpi_zip_header, mode), sizeof(mode));
+		_mpi_zip_counters.segments_stored += mode == MPI_ZIP_STORED;
+		_mpi_zip_counters.segments_lossless += mode == MPI_ZIP_LOSSLESS;
+		_mpi_zip_counters.segments_lossy += mode == MPI_ZIP_LOSSY;
+		_mpi_zip_counters.raw_bytes += raw;
+		_mpi_zip_counters.wire_bytes += wire;
+		for (int d = 0; d < num_dsts; d++) {
+			MPI_Isend(slot, (int)wire, MPI_BYTE, dsts[d], MPI_ZIP_TAG, comm, &requests[k * num_dsts + d]);
+		}
+	}
+	MPI_Waitall(2 * num_dsts, requests, MPI_STATUSES_IGNORE);
+	_mpi_zip_counters.messages++;
+	_mpi_zip_counters.compressed += compress && segments > 0;
+
+	mpi_pool_free(slots);
+	free(requests);
+	return MPI_SUCCESS;
+}
+
+/*
+ * Receive count doubles from src sent by _mpi_zip_send (the next segment is received while the previous one is decoded)
+ */
+int _mpi_zip_recv(double *buf, long long count, int src, MPI_Comm comm) {
+	const long long per = MPI_ZIP_SEGMENT / sizeof(double);
+	long long segments = (count + per - 1) / per;
+	size_t slot_bytes = mpi_zip_bound((size_t)per);
+	char *slots = (char *)mpi_pool_alloc(2 * slot_bytes);
+	if (slots == NULL) {
+		return MPI_ERR_NO_MEM;
+	}
+
+	MPI_Request requests[2] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL};
+	int err = MPI_SUCCESS;
+	if (segments > 0) {
+		MPI_Irecv(slots, (int)slot_bytes, MPI_BYTE, src, MPI_ZIP_TAG, comm, &requests[0]);
+	}
+	for (long long s = 0; s < segments; s++) {
+		int k = (int)(s & 1);
+		if (s + 1 < segments) {
+			MPI_Irecv(slots + (1 - k) * slot_bytes, (int)slot_bytes, MPI_BYTE, src, MPI_ZIP_TAG, comm, &requests[1 - k]);
+		}
+		MPI_Status status;
+		int bytes;
+		MPI_Wait(&requests[k], &status);
+		MPI_Get_count(&status, MPI_BYTE, &bytes);
+
+		long long n = count - s * per < per ? count - s * per : per;
+		double start = MPI_Wtime();
+		// keep receiving after an error, so the remaining segments do not match a later call
+		int e = mpi_zip_decode(slots + k * slot_bytes, (size_t)bytes, buf + s * per, (size_t)n);
+		_mpi_zip_counters.decode_seconds += MPI_Wtime() - start;
+		_mpi_zip_counters.decoded_bytes += (size_t)n * sizeof(double);
+		if (e != MPI_SUCCESS && err == MPI_SUCCESS) {
+			err = e;
+		}
+	}
+	mpi_pool_free(slots);
+	return err;
+}
+
+/*
+ * my_mpi_broadcast with compression of MPI_DOUBLE payloads
+ *
+ * tolerance: 0 for lossless, otherwise the largest absolute error allowed in the receivers' copies
+ * the other arguments are as for my_mpi_broadcast (dsts can be NULL or a -1 terminated list)
+ */
+int my_mpi_broadcast_z(void *buffer, int count, MPI_Datatype datatype, int src, int *dsts, double tolerance, MPI_Comm comm) {
+	if (datatype != MPI_DOUBLE || (size_t)count * sizeof(double) < MPI_ZIP_MIN_BYTES) {
+		return my_mpi_broadcast(buffer, count, datatype, src, dsts, comm);
+	}
+	int rank, size;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &size);
+
+	if (rank == src) {
+		int *targets = (int *)malloc(size * sizeof(int));
+		int num_targets = 0;
+		for (int i = 0; dsts == NULL ? i < size : dsts[i] != -1; i++) {
+			int dst = dsts == NULL ? i : dsts[i];
+			if (dst != src) {
+				targets[num_targets++] = dst;
+			}
+		}
+		// one encoding per segment, sent to every destination
+		int err = _mpi_zip_send((const double *)buffer, count, targets, num_targets, tolerance, comm);
+		free(targets);
+		return err;
+	}
+
+	int is_dst = dsts == NULL;
+	for (int i = 0; !is_dst && dsts[i] != -1; i++) {
+		is_dst = dsts[i] == rank;
+	}
+	return is_dst ? _mpi_zip_recv((double *)buffer, count, src, comm) : MPI_SUCCESS;
+}
+
+/*
+ * my_mpi_scatter with compression of MPI_DOUBLE payloads (root 0, tolerance as for my_mpi_broadcast_z)
+ *
+ * Each block is a message of its own and is decided on by itself. Every rank
+ * picks the path from recvcount, so sendcount must equal recvcount on rank 0
+ * (MPI_ERR_COUNT otherwise).
+ */
+int my_mpi_scatter_z(void *sendbuf, int sendcount, MPI_Datatype sendtype, void *recvbuf, int recvcount, double tolerance, MPI_Comm comm) {
+	int rank, size;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &size);
+	if (rank == 0 && sendcount != recvcount) {
+		return MPI_ERR_COUNT;
+	}
+	// sendcount is only significant on the root, the block size all ranks know is recvcount
+	if (sendtype != MPI_DOUBLE || (size_t)recvcount * sizeof(double) < MPI_ZIP_MIN_BYTES) {
+		return my_mpi_scatter(sendbuf, sendcount, sendtype, recvbuf, recvcount, comm);
+	}
+
+	if (rank != 0) {
+		return _mpi_zip_recv((double *)recvbuf, recvcount, 0, comm);
+	}
+	int err = MPI_SUCCESS;
+	for (int i = 1; i < size && err == MPI_SUCCESS; i++) {
+		err = _mpi_zip_send((const double *)sendbuf + (size_t)i * sendcount, sendcount, &i, 1, tolerance, comm);
+	}
+	memcpy(recvbuf, sendbuf, (size_t)sendcount * sizeof(double));
+	return err;
+}
+
+/*
+ * Gather to rank 0 with compression of MPI_DOUBLE payloads
+ *
+ * sendbuf: sendcount elements from every rank
+ * recvbuf: size blocks of recvcount elements on rank 0, block i from rank i (rank 0's own block is exact)
+ * tolerance: as for my_mpi_broadcast_z
+ * other datatypes and small blocks use MPI_Gather
+ * returns MPI_ERR_COUNT on rank 0 if sendcount != recvcount there (the blocks must all be the same size)
+ */
+int my_mpi_gather_z(void *sendbuf, int sendcount, MPI_Datatype sendtype, void *recvbuf, int recvcount, double tolerance, MPI_Comm comm) {
+	int rank, size;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &size);
+	if (rank == 0 && sendcount != recvcount) {
+		return MPI_ERR_COUNT;
+	}
+	if (sendtype != MPI_DOUBLE || (size_t)sendcount * sizeof(double) < MPI_ZIP_MIN_BYTES) {
+		return MPI_Gather(sendbuf, sendcount, sendtype, recvbuf, recvcount, sendtype, 0, comm);
+	}
+
+	if (rank != 0) {
+		int root = 0;
+		return _mpi_zip_send((const double *)sendbuf, sendcount, &root, 1, tolerance, comm);
+	}
+	memcpy(recvbuf, sendbuf, (size_t)sendcount * sizeof(double));
+	int err = MPI_SUCCESS;
+	for (int i = 1; i < size; i++) {
+		int e = _mpi_zip_recv((double *)recvbuf + (size_t)i * recvcount, recvcount, i, comm);
+		if (e != MPI_SUCCESS && err == MPI_SUCCESS) {
+			err = e;
+		}
+	}
+	return err;
+}
+
+/*
+ * Snapshot of this process's counters (sends and receives made by the calling process)
+ */
+void mpi_zip_get_stats(mpi_zip_stats *stats) {
+	*stats = _mpi_zip_counters;
+}
+
+void mpi_zip_reset_stats(void) {
+	memset(&_mpi_zip_counters, 0, sizeof(_mpi_zip_counters));
+}
+
+/*
+ * Print the counters summed over comm (collective)
+ */
+void mpi_zip_report(MPI_Comm comm) {
+	mpi_zip_stats s;
+	mpi_zip_get_stats(&s);
+	unsigned long long counts[9] = {s.messages, s.compressed, s.raw_bytes, s.wire_bytes,
+		s.segments_stored, s.segments_lossless, s.segments_lossy, s.encoded_bytes, s.decoded_bytes};
+	double seconds[2] = {s.encode_seconds, s.decode_seconds};
+	unsigned long long total[9];
+	double total_seconds[2];
+	MPI_Reduce(counts, total, 9, MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, comm);
+	MPI_Reduce(seconds, total_seconds, 2, MPI_DOUBLE, MPI_SUM, 0, comm);
+
+	int rank;
+	MPI_Comm_rank(comm, &rank);
+	if (rank == 0) {
+		double ratio = total[2] > 0 ? (double)total[3] / total[2] : 1.0;
+		double encode = total_seconds[0] > 0 ? total[7] / total_seconds[0] / 1e6 : 0.0;
+		double decode = total_seconds[1] > 0 ? total[8] / total_seconds[1] / 1e6 : 0.0;
+		mpi_log_append(0, "zip: %llu of %llu messages compressed, %.1f MiB -> %.1f MiB on the wire (%.3f), segments %llu stored / %llu lossless / %llu lossy, encode %.0f MB/s, decode %.0f MB/s\n",
+			total[1], total[0], total[2] / 1048576.0, total[3] / 1048576.0, ratio,
+			total[4], total[5], total[6], encode, decode);
+	}
+}
+
+#endif
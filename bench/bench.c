@@ -0,0 +1,1130 @@
+#include "mpi_aggr.h"
+#include "mpi_helper.h"
+#include "mpi_place.h"
+#include "mpi_progress.h"
+#include "mpi_sim.h"
+#include "mpi_sort.h"
+#include "mpi_summa.h"
+#include "mpi_zip.h"
+#include <math.h>
+#include <unistd.h>
+
+/*
+ * Point-to-point and collective microbenchmarks.
+ *
+ * Usage:
+ *   mpirun -n <ranks> ./bin/bench [-s max_bytes] [-m min_bytes] [-n samples] [-t tests] [-l loggp_file] [-j]
+ *
+ *   -s  largest message size in bytes (default 64 MiB)
+ *   -m  smallest message size in bytes (default 1 B)
+ *   -n  number of timed samples per case (default 10)
+ *   -t  comma separated list of tests to run: pingpong,ring,bcast,scatter,alltoall,scan,sort,summa,overlap,aggr,place,zip,sim (default all)
+ *   -l  LogGP parameter file for sim: read if it exists, otherwise fitted and written there
+ *   -j  print results as JSON instead of a whitespace separated table
+ *
+ * Sizes are swept in powers of two. Every sample is timed on all ranks and the
+ * slowest rank's time is taken, so collectives are measured until the last
+ * rank has finished. The table/JSON only goes to stdout on rank 0.
+ *
+ * For sort, bytes is the size of each rank's block of random ints and the
+ * bandwidth column is the whole distributed array sorted per second.
+ * For summa, bytes is the size of each rank's n x n block of A, B and C
+ * (weak scaling, capped at 8 MiB) and the bandwidth column is MFLOP/s (whole
+ * grid for summa, one rank for local_gemm). Run it with -n 1 for the
+ * single-rank baseline.
+ *
+ * overlap exchanges a message between rank pairs (0-1, 2-3, ...) around an
+ * estimate_pi style compute loop calibrated to take as long as the exchange
+ * alone. Modes: comm (exchange only), compute (loop only), none (Isend/Irecv,
+ * loop, Waitall), test (loop split into chunks with MPI_Testall in between) and
+ * thread (progress thread of mpi_progress.h, only when MPI provides
+ * MPI_THREAD_MULTIPLE: build with make DEFS=-DMPI_HELPER_THREAD_MULTIPLE, and
+ * each rank has at least two cores). In
+ * the table a comment line per size gives the overlap of each mode:
+ * (comm + compute - mode) / min(comm, compute), 100% meaning fully hidden.
+ *
+ * aggr streams small records (bytes each, up to 1 KiB) to the right-hand
+ * neighbour: direct sends every record as its own message, aggr posts them to
+ * mpi_aggr_post. Times are per record, so 1 / mean is records per second.
+ *
+ * place runs a ring shift and a 2D periodic halo exchange (bytes per face) on
+ * three rank orders: block (MPI_COMM_WORLD), shuffled (a fixed random
+ * permutation, standing in for a badly numbered pattern) and placed (the
+ * shuffled ranks moved by mpi_place.h using the pattern's communication
+ * matrix). A comment line per pattern gives the traffic per level estimated
+ * from the matrix, to compare with the measured times.
+ *
+ * zip runs my_mpi_broadcast_z, my_mpi_scatter_z and my_mpi_gather_z of
+ * mpi_zip.h on a smooth double field (sizes from MPI_ZIP_MIN_BYTES up, bytes
+ * as for bcast/scatter, per rank for gather) next to the uncompressed helper:
+ * modes stored (segmented protocol, nothing encoded), lossless and lossy
+ * (tolerance 1e-6) with compression forced on, and auto (lossless, decided per
+ * message). A comment line per size gives the wire/raw ratio of each mode.
+ *
+ * sim predicts the helper collectives with mpi_sim.h on 4, 16, ... 16384 ranks
+ * (and the current rank count, to set against the bcast/scatter/alltoall/scan
+ * rows) for every fourth size, all on rank 0. The LogGP parameters are fitted
+ * on the ranks of the run unless -l names an existing file, so a run on the
+ * machine with -l writes the file and later single-rank runs anywhere reuse it.
+ * Rows are predictions: iters is 0 and there is no spread.
+ */
+
+typedef struct {
+	size_t min_bytes;
+	size_t max_bytes;
+	int samples;
+	int json;
+	char tests[256];
+	char loggp[256];
+} bench_options;
+
+/*
+ * One benchmark case: op is called iters times per sample with args
+ */
+typedef struct {
+	const char *bench;     // test name (pingpong, ring, ...)
+	const char *mode;      // variant (blocking, nonblocking, sync, mpi, my, ...)
+	size_t bytes;          // message size of the case
+	int peer;              // partner rank for point-to-point tests (-1 otherwise)
+	const char *locality;  // intra/inter node for point-to-point tests ("-" otherwise)
+	double ops_per_iter;   // time per iteration is divided by this (2 for a round trip)
+	double payload;        // bytes moved per op, used for the bandwidth column
+} bench_case;
+
+typedef struct {
+	char *sendbuf;
+	char *recvbuf;
+	size_t bytes;
+	int peer;
+	int rank;
+	int size;
+} bench_args;
+
+static int bench_first_row = 1;
+
+// records per iteration of the aggr test, and the aggregator it streams through
+#define BENCH_AGGR_RECORDS 64
+static struct {
+	mpi_aggr aggr;
+	long long handled;
+} bench_aggr_state;
+
+// compute loop length for the overlap test, calibrated per message size
+static struct {
+	long compute_iters;
+	double sink;  // keeps the loop from being optimised away
+} bench_overlap_state;
+
+// communicator and neighbours the place test currently runs on
+static struct {
+	MPI_Comm comm;
+	int left, right;    // ring
+	int nbrs[4];        // halo: lo/hi in x, lo/hi in y
+} bench_place_state;
+
+// data and compression settings of the zip test
+#define BENCH_ZIP_TOLERANCE 1e-6
+static struct {
+	int mode;           // MPI_ZIP_OFF, MPI_ZIP_AUTO, MPI_ZIP_ON, or -1 for the uncompressed reference
+	double tolerance;   // 0 for lossless
+} bench_zip_state;
+
+// matrices for the summa test, sized for the largest case
+static struct {
+	mpi_summa_grid grid;
+	double *A, *B, *C;
+	long long n;  // local block is n x n, the global matrices n * rows x n * cols (K = n * cols)
+} bench_summa_state;
+
+/*
+ * Number of iterations per sample, so that small messages are repeated
+ * enough to be above the timer resolution and large ones do not take forever
+ */
+int bench_iters(size_t bytes) {
+	size_t iters = ((size_t)1 << 24) / (bytes > 0 ? bytes : 1);
+	if (iters > 1000) iters = 1000;
+	if (iters < 2) iters = 2;
+	return (int)iters;
+}
+
+int bench_enabled(const bench_options *opts, const char *test) {
+	if (opts->tests[0] == '\0') {
+		return 1;
+	}
+	size_t len = strlen(test);
+	for (const char *p = opts->tests; (p = strstr(p, test)) != NULL; p += len) {
+		int starts = (p == opts->tests) || (p[-1] == ',');
+		int ends = (p[len] == '\0') || (p[len] == ',');
+		if (starts && ends) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Print one result row on rank 0 (table or JSON)
+ */
+void bench_print_row(const bench_options *opts, const bench_case *c, int ranks, int iters,
+		double mean, double stddev, double min, double max) {
+	double bw = (mean > 0) ? c->payload / mean / 1e6 : 0.0;
+
+	if (opts->json) {
+		printf("%s{\"bench\": \"%s\", \"mode\": \"%s\", \"bytes\": %zu, \"ranks\": %d, \"peer\": %d, "
+			"\"locality\": \"%s\", \"samples\": %d, \"iters\": %d, \"mean_us\": %.4f, \"stddev_us\": %.4f, "
+			"\"min_us\": %.4f, \"max_us\": %.4f, \"bw_MBps\": %.3f}",
+			bench_first_row ? "[\n  " : ",\n  ",
+			c->bench, c->mode, c->bytes, ranks, c->peer, c->locality, opts->samples, iters,
+			mean * 1e6, stddev * 1e6, min * 1e6, max * 1e6, bw);
+	} else {
+		if (bench_first_row) {
+			printf("# %-10s %-16s %10s %6s %5s %-8s %7s %6s %12s %12s %12s %12s %12s\n",
+				"bench", "mode", "bytes", "ranks", "peer", "locality", "samples", "iters",
+				"mean_us", "stddev_us", "min_us", "max_us", "bw_MBps");
+		}
+		printf("  %-10s %-16s %10zu %6d %5d %-8s %7d %6d %12.4f %12.4f %12.4f %12.4f %12.3f\n",
+			c->bench, c->mode, c->bytes, ranks, c->peer, c->locality, opts->samples, iters,
+			mean * 1e6, stddev * 1e6, min * 1e6, max * 1e6, bw);
+	}
+	bench_first_row = 0;
+	fflush(stdout);
+}
+
+/*
+ * Time op over opts->samples samples and print the statistics (collective over MPI_COMM_WORLD)
+ *
+ * returns the mean time per op (slowest rank) on every rank
+ */
+double bench_run(const bench_options *opts, const bench_case *c, void (*op)(bench_args *), bench_args *args) {
+	int iters = bench_iters(c->bytes);
+	double sum = 0.0, sum_sq = 0.0, min = 1e30, max = 0.0;
+
+	// warm up connections and caches before timing anything
+	op(args);
+	MPI_Barrier(MPI_COMM_WORLD);
+
+	for (int s = 0; s < opts->samples; s++) {
+		MPI_Barrier(MPI_COMM_WORLD);
+		double start = MPI_Wtime();
+		for (int i = 0; i < iters; i++) {
+			op(args);
+		}
+		double local = (MPI_Wtime() - start) / iters / c->ops_per_iter;
+
+		double t;
+		MPI_Allreduce(&local, &t, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+		sum += t;
+		sum_sq += t * t;
+		if (t < min) min = t;
+		if (t > max) max = t;
+	}
+
+	if (args->rank == 0) {
+		double mean = sum / opts->samples;
+		double var = sum_sq / opts->samples - mean * mean;
+		double stddev = (opts->samples > 1 && var > 0) ? sqrt(var * opts->samples / (opts->samples - 1)) : 0.0;
+		bench_print_row(opts, c, args->size, iters, mean, stddev, min, max);
+	}
+	return sum / opts->samples;
+}
+
+/*
+ * Compressed collectives from rank 0 (doubles), with the plain helper / library call as the reference
+ */
+void zip_bcast(bench_args *a) {
+	if (bench_zip_state.mode < 0) {
+		my_mpi_broadcast(a->sendbuf, (int)(a->bytes / sizeof(double)), MPI_DOUBLE, 0, NULL, MPI_COMM_WORLD);
+		return;
+	}
+	my_mpi_broadcast_z(a->sendbuf, (int)(a->bytes / sizeof(double)), MPI_DOUBLE, 0, NULL, bench_zip_state.tolerance, MPI_COMM_WORLD);
+}
+
+void zip_scatter(bench_args *a) {
+	int count = (int)(a->bytes / sizeof(double));
+	if (bench_zip_state.mode < 0) {
+		my_mpi_scatter(a->sendbuf, count, MPI_DOUBLE, a->recvbuf, count, MPI_COMM_WORLD);
+		return;
+	}
+	my_mpi_scatter_z(a->sendbuf, count, MPI_DOUBLE, a->recvbuf, count, bench_zip_state.tolerance, MPI_COMM_WORLD);
+}
+
+void zip_gather(bench_args *a) {
+	int count = (int)(a->bytes / sizeof(double));
+	if (bench_zip_state.mode < 0) {
+		MPI_Gather(a->sendbuf, count, MPI_DOUBLE, a->recvbuf, count, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+		return;
+	}
+	my_mpi_gather_z(a->sendbuf, count, MPI_DOUBLE, a->recvbuf, count, bench_zip_state.tolerance, MPI_COMM_WORLD);
+}
+
+/*
+ * Ping-pong between rank 0 and args->peer
+ */
+void pingpong_blocking(bench_args *a) {
+	int count = (int)a->bytes;
+	if (a->rank == 0) {
+		MPI_Send(a->sendbuf, count, MPI_BYTE, a->peer, 0, MPI_COMM_WORLD);
+		MPI_Recv(a->recvbuf, count, MPI_BYTE, a->peer, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+	} else if (a->rank == a->peer) {
+		MPI_Recv(a->recvbuf, count, MPI_BYTE, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+		MPI_Send(a->sendbuf, count, MPI_BYTE, 0, 0, MPI_COMM_WORLD);
+	}
+}
+
+void pingpong_nonblocking(bench_args *a) {
+	int count = (int)a->bytes;
+	MPI_Request request;
+	if (a->rank == 0) {
+		MPI_Isend(a->sendbuf, count, MPI_BYTE, a->peer, 0, MPI_COMM_WORLD, &request);
+		MPI_Wait(&request, MPI_STATUS_IGNORE);
+		MPI_Irecv(a->recvbuf, count, MPI_BYTE, a->peer, 0, MPI_COMM_WORLD, &request);
+		MPI_Wait(&request, MPI_STATUS_IGNORE);
+	} else if (a->rank == a->peer) {
+		MPI_Irecv(a->recvbuf, count, MPI_BYTE, 0, 0, MPI_COMM_WORLD, &request);
+		MPI_Wait(&request, MPI_STATUS_IGNORE);
+		MPI_Isend(a->sendbuf, count, MPI_BYTE, 0, 0, MPI_COMM_WORLD, &request);
+		MPI_Wait(&request, MPI_STATUS_IGNORE);
+	}
+}
+
+void pingpong_sync(bench_args *a) {
+	int count = (int)a->bytes;
+	if (a->rank == 0) {
+		MPI_Ssend(a->sendbuf, count, MPI_BYTE, a->peer, 0, MPI_COMM_WORLD);
+		MPI_Recv(a->recvbuf, count, MPI_BYTE, a->peer, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+	} else if (a->rank == a->peer) {
+		MPI_Recv(a->recvbuf, count, MPI_BYTE, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+		MPI_Ssend(a->sendbuf, count, MPI_BYTE, 0, 0, MPI_COMM_WORLD);
+	}
+}
+
+/*
+ * Ring shift from week_4: every rank passes its message to the right neighbour, size-1 times
+ */
+void ring_blocking(bench_args *a) {
+	int count = (int)a->bytes;
+	int right = (a->rank + 1) % a->size;
+	int left = (a->rank - 1 + a->size) % a->size;
+	for (int step = 0; step < a->size - 1; step++) {
+		MPI_Sendrecv(a->sendbuf, count, MPI_BYTE, right, 0,
+					 a->recvbuf, count, MPI_BYTE, left, 0,
+					 MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+	}
+}
+
+void ring_nonblocking(bench_args *a) {
+	int count = (int)a->bytes;
+	int right = (a->rank + 1) % a->size;
+	int left = (a->rank - 1 + a->size) % a->size;
+	MPI_Request requests[2];
+	for (int step = 0; step < a->size - 1; step++) {
+		MPI_Irecv(a->recvbuf, count, MPI_BYTE, left, 0, MPI_COMM_WORLD, &requests[0]);
+		MPI_Isend(a->sendbuf, count, MPI_BYTE, right, 0, MPI_COMM_WORLD, &requests[1]);
+		MPI_Waitall(2, requests, MPI_STATUSES_IGNORE);
+	}
+}
+
+void ring_sync(bench_args *a) {
+	int count = (int)a->bytes;
+	int right = (a->rank + 1) % a->size;
+	int left = (a->rank - 1 + a->size) % a->size;
+	MPI_Request request;
+	for (int step = 0; step < a->size - 1; step++) {
+		MPI_Issend(a->sendbuf, count, MPI_BYTE, right, 0, MPI_COMM_WORLD, &request);
+		MPI_Recv(a->recvbuf, count, MPI_BYTE, left, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+		MPI_Wait(&request, MPI_STATUS_IGNORE);
+	}
+}
+
+/*
+ * Broadcast from rank 0, helper versions against the library
+ * (doubles are used for the collectives, the helpers are written around typed buffers)
+ */
+void bcast_my(bench_args *a) {
+	my_mpi_broadcast(a->sendbuf, (int)(a->bytes / sizeof(double)), MPI_DOUBLE, 0, NULL, MPI_COMM_WORLD);
+}
+
+void bcast_my_collective(bench_args *a) {
+	my_mpi_broadcast_collective(a->sendbuf, (int)(a->bytes / sizeof(double)), MPI_DOUBLE, 0, NULL, MPI_COMM_WORLD);
+}
+
+void bcast_mpi(bench_args *a) {
+	MPI_Bcast(a->sendbuf, (int)(a->bytes / sizeof(double)), MPI_DOUBLE, 0, MPI_COMM_WORLD);
+}
+
+void bcast_mpi_nonblocking(bench_args *a) {
+	MPI_Request request;
+	MPI_Ibcast(a->sendbuf, (int)(a->bytes / sizeof(double)), MPI_DOUBLE, 0, MPI_COMM_WORLD, &request);
+	MPI_Wait(&request, MPI_STATUS_IGNORE);
+}
+
+/*
+ * Scatter from rank 0, bytes is the block each rank receives
+ */
+void scatter_my(bench_args *a) {
+	int count = (int)(a->bytes / sizeof(double));
+	my_mpi_scatter(a->sendbuf, count, MPI_DOUBLE, a->recvbuf, count, MPI_COMM_WORLD);
+}
+
+void scatter_my_collective(bench_args *a) {
+	int count = (int)(a->bytes / sizeof(double));
+	my_mpi_scatter_collective(a->sendbuf, count, MPI_DOUBLE, a->recvbuf, count, MPI_COMM_WORLD);
+}
+
+void scatter_mpi(bench_args *a) {
+	int count = (int)(a->bytes / sizeof(double));
+	MPI_Scatter(a->sendbuf, count, MPI_DOUBLE, a->recvbuf, count, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+}
+
+void scatter_mpi_nonblocking(bench_args *a) {
+	int count = (int)(a->bytes / sizeof(double));
+	MPI_Request request;
+	MPI_Iscatter(a->sendbuf, count, MPI_DOUBLE, a->recvbuf, count, MPI_DOUBLE, 0, MPI_COMM_WORLD, &request);
+	MPI_Wait(&request, MPI_STATUS_IGNORE);
+}
+
+/*
+ * All-to-all, bytes is the block each rank sends to every other rank
+ */
+void alltoall_my(bench_args *a) {
+	int count = (int)(a->bytes / sizeof(double));
+	my_mpi_alltoall(a->sendbuf, count, MPI_DOUBLE, a->recvbuf, count, MPI_DOUBLE, MPI_COMM_WORLD);
+}
+
+void alltoall_my_pairwise(bench_args *a) {
+	int count = (int)(a->bytes / sizeof(double));
+	my_mpi_alltoall_pairwise(a->sendbuf, count, MPI_DOUBLE, a->recvbuf, count, MPI_DOUBLE, MPI_COMM_WORLD);
+}
+
+void alltoall_my_bruck(bench_args *a) {
+	int count = (int)(a->bytes / sizeof(double));
+	my_mpi_alltoall_bruck(a->sendbuf, count, MPI_DOUBLE, a->recvbuf, count, MPI_DOUBLE, MPI_COMM_WORLD);
+}
+
+void alltoall_mpi(bench_args *a) {
+	int count = (int)(a->bytes / sizeof(double));
+	MPI_Alltoall(a->sendbuf, count, MPI_DOUBLE, a->recvbuf, count, MPI_DOUBLE, MPI_COMM_WORLD);
+}
+
+/*
+ * Inclusive sum scan of bytes worth of doubles
+ */
+void scan_my(bench_args *a) {
+	my_mpi_scan(a->sendbuf, a->recvbuf, (int)(a->bytes / sizeof(double)), MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+}
+
+void scan_mpi(bench_args *a) {
+	MPI_Scan(a->sendbuf, a->recvbuf, (int)(a->bytes / sizeof(double)), MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+}
+
+/*
+ * SUMMA on the whole process grid against the local GEMM it is built on
+ */
+void summa_gemm(bench_args *a) {
+	(void)a;
+	mpi_summa_grid *g = &bench_summa_state.grid;
+	long long n = bench_summa_state.n;
+	mpi_summa_gemm(g, n * g->rows, n * g->cols, n * g->cols,
+		bench_summa_state.A, bench_summa_state.B, bench_summa_state.C, 0);
+}
+
+void summa_local_gemm(bench_args *a) {
+	(void)a;
+	mpi_summa_grid *g = &bench_summa_state.grid;
+	int n = (int)bench_summa_state.n;
+	memset(bench_summa_state.C, 0, (size_t)n * n * sizeof(double));
+	// same flops as one rank does in summa_gemm, without any communication
+	for (int c = 0; c < g->cols; c++) {
+		mpi_gemm_local(n, n, n, bench_summa_state.A, n, bench_summa_state.B, n, bench_summa_state.C, n);
+	}
+}
+
+/*
+ * Sort random ints held in recvbuf (copied first, the sorts work in place)
+ */
+void sort_sample(bench_args *a) {
+	long long count = (long long)(a->bytes / sizeof(int));
+	void *data = malloc(a->bytes);
+	memcpy(data, a->recvbuf, a->bytes);
+	mpi_sort(MPI_COMM_WORLD, MPI_SORT_INT, MPI_SORT_SAMPLE, &data, &count);
+	free(data);
+}
+
+void sort_histogram(bench_args *a) {
+	long long count = (long long)(a->bytes / sizeof(int));
+	void *data = malloc(a->bytes);
+	memcpy(data, a->recvbuf, a->bytes);
+	mpi_sort(MPI_COMM_WORLD, MPI_SORT_INT, MPI_SORT_HISTOGRAM, &data, &count);
+	free(data);
+}
+
+int sort_compare_int(const void *x, const void *y) {
+	int a = *(const int *)x, b = *(const int *)y;
+	return (a > b) - (a < b);
+}
+
+// the serial baseline: gather everything on rank 0, qsort, scatter the blocks back
+void sort_gather_qsort(bench_args *a) {
+	int count = (int)(a->bytes / sizeof(int));
+	int *data = (int *)malloc(a->bytes);
+	MPI_Gather(a->recvbuf, count, MPI_INT, a->sendbuf, count, MPI_INT, 0, MPI_COMM_WORLD);
+	if (a->rank == 0) {
+		qsort(a->sendbuf, (size_t)count * a->size, sizeof(int), sort_compare_int);
+	}
+	MPI_Scatter(a->sendbuf, count, MPI_INT, data, count, MPI_INT, 0, MPI_COMM_WORLD);
+	free(data);
+}
+
+/*
+ * Exchange with the pair partner around the compute loop of week_2's estimate_pi
+ */
+void bench_compute(long n) {
+	double sum = 0.0;
+	for (long i = 0; i < n; i++) {
+		double x = (i - 0.5) / n;
+		sum += 1. / (1 + x * x);
+	}
+	bench_overlap_state.sink += sum;
+}
+
+void overlap_comm(bench_args *a) {
+	if (a->peer < 0) {
+		return;
+	}
+	MPI_Request requests[2];
+	MPI_Irecv(a->recvbuf, (int)a->bytes, MPI_BYTE, a->peer, 0, MPI_COMM_WORLD, &requests[0]);
+	MPI_Isend(a->sendbuf, (int)a->bytes, MPI_BYTE, a->peer, 0, MPI_COMM_WORLD, &requests[1]);
+	MPI_Waitall(2, requests, MPI_STATUSES_IGNORE);
+}
+
+void overlap_compute(bench_args *a) {
+	(void)a;
+	bench_compute(bench_overlap_state.compute_iters);
+}
+
+void overlap_none(bench_args *a) {
+	MPI_Request requests[2] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL};
+	if (a->peer >= 0) {
+		MPI_Irecv(a->recvbuf, (int)a->bytes, MPI_BYTE, a->peer, 0, MPI_COMM_WORLD, &requests[0]);
+		MPI_Isend(a->sendbuf, (int)a->bytes, MPI_BYTE, a->peer, 0, MPI_COMM_WORLD, &requests[1]);
+	}
+	bench_compute(bench_overlap_state.compute_iters);
+	MPI_Waitall(2, requests, MPI_STATUSES_IGNORE);
+}
+
+void overlap_test(bench_args *a) {
+	const int chunks = 16;
+	MPI_Request requests[2] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL};
+	if (a->peer >= 0) {
+		MPI_Irecv(a->recvbuf, (int)a->bytes, MPI_BYTE, a->peer, 0, MPI_COMM_WORLD, &requests[0]);
+		MPI_Isend(a->sendbuf, (int)a->bytes, MPI_BYTE, a->peer, 0, MPI_COMM_WORLD, &requests[1]);
+	}
+	for (int c = 0; c < chunks; c++) {
+		bench_compute(bench_overlap_state.compute_iters / chunks);
+		int done;
+		MPI_Testall(2, requests, &done, MPI_STATUSES_IGNORE);
+	}
+	MPI_Waitall(2, requests, MPI_STATUSES_IGNORE);
+}
+
+void overlap_thread(bench_args *a) {
+	mpi_progress_op ops[2];
+	if (a->peer >= 0) {
+		mpi_progress_irecv(a->recvbuf, (int)a->bytes, MPI_BYTE, a->peer, 0, MPI_COMM_WORLD, &ops[0]);
+		mpi_progress_isend(a->sendbuf, (int)a->bytes, MPI_BYTE, a->peer, 0, MPI_COMM_WORLD, &ops[1]);
+	}
+	bench_compute(bench_overlap_state.compute_iters);
+	if (a->peer >= 0) {
+		mpi_progress_wait_all(2, ops);
+	}
+}
+
+/*
+ * Stream records to the right-hand neighbour, one message each or aggregated
+ */
+void aggr_direct(bench_args *a) {
+	int right = (a->rank + 1) % a->size;
+	int left = (a->rank - 1 + a->size) % a->size;
+	for (int r = 0; r < BENCH_AGGR_RECORDS; r++) {
+		MPI_Sendrecv(a->sendbuf, (int)a->bytes, MPI_BYTE, right, 0,
+					 a->recvbuf, (int)a->bytes, MPI_BYTE, left, 0,
+					 MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+	}
+}
+
+void aggr_record(int src, const void *record, int bytes, void *ctx) {
+	(void)src;
+	(void)record;
+	(void)bytes;
+	(void)ctx;
+	bench_aggr_state.handled++;
+}
+
+void aggr_coalesced(bench_args *a) {
+	int right = (a->rank + 1) % a->size;
+	for (int r = 0; r < BENCH_AGGR_RECORDS; r++) {
+		mpi_aggr_post(&bench_aggr_state.aggr, right, a->sendbuf, (int)a->bytes);
+	}
+}
+
+/*
+ * Work out whether peer lives on the same node as rank 0 (collective)
+ */
+const char *bench_locality(int peer) {
+	char name[MPI_MAX_PROCESSOR_NAME] = {0};
+	char root_name[MPI_MAX_PROCESSOR_NAME] = {0};
+	int length;
+	MPI_Get_processor_name(name, &length);
+	memcpy(root_name, name, sizeof(name));
+	MPI_Bcast(root_name, MPI_MAX_PROCESSOR_NAME, MPI_CHAR, 0, MPI_COMM_WORLD);
+
+	int same = (strcmp(name, root_name) == 0);
+	MPI_Bcast(&same, 1, MPI_INT, peer, MPI_COMM_WORLD);
+	return same ? "intra" : "inter";
+}
+
+/*
+ * Patterns of the place test, on bench_place_state.comm
+ */
+void place_ring(bench_args *a) {
+	int count = (int)a->bytes;
+	for (int step = 0; step < a->size - 1; step++) {
+		MPI_Sendrecv(a->sendbuf, count, MPI_BYTE, bench_place_state.right, 0,
+					 a->recvbuf, count, MPI_BYTE, bench_place_state.left, 0,
+					 bench_place_state.comm, MPI_STATUS_IGNORE);
+	}
+}
+
+void place_halo(bench_args *a) {
+	int count = (int)a->bytes;
+	for (int d = 0; d < 2; d++) {
+		int lo = bench_place_state.nbrs[2 * d], hi = bench_place_state.nbrs[2 * d + 1];
+		MPI_Sendrecv(a->sendbuf, count, MPI_BYTE, hi, 0, a->recvbuf, count, MPI_BYTE, lo, 0,
+					 bench_place_state.comm, MPI_STATUS_IGNORE);
+		MPI_Sendrecv(a->sendbuf, count, MPI_BYTE, lo, 1, a->recvbuf, count, MPI_BYTE, hi, 1,
+					 bench_place_state.comm, MPI_STATUS_IGNORE);
+	}
+}
+
+/*
+ * Neighbours of the pattern on comm, and the bytes per unit message sent to each rank (row of the matrix)
+ */
+void bench_place_neighbours(MPI_Comm comm, int halo, double *row) {
+	int rank, size;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &size);
+	bench_place_state.comm = comm;
+	if (row != NULL) {
+		memset(row, 0, size * sizeof(double));
+	}
+	if (!halo) {
+		bench_place_state.right = (rank + 1) % size;
+		bench_place_state.left = (rank - 1 + size) % size;
+		if (row != NULL) {
+			row[bench_place_state.right] += size - 1;
+		}
+		return;
+	}
+	// periodic grid as from mpi_topo_create, but row-major on comm's ranks (no reorder by MPI)
+	int dims[2] = {0, 0}, coords[2];
+	MPI_Dims_create(size, 2, dims);
+	coords[0] = rank / dims[1];
+	coords[1] = rank % dims[1];
+	for (int d = 0; d < 2; d++) {
+		for (int dir = 0; dir < 2; dir++) {
+			int c[2] = {coords[0], coords[1]};
+			c[d] = (c[d] + (dir == 0 ? -1 : 1) + dims[d]) % dims[d];
+			int nbr = c[0] * dims[1] + c[1];
+			bench_place_state.nbrs[2 * d + dir] = nbr;
+			if (row != NULL && nbr != rank) {
+				row[nbr] += 1;
+			}
+		}
+	}
+}
+
+void bench_pingpong(const bench_options *opts, bench_args *args) {
+	// rank 1 is the nearest partner, the last rank is the furthest away (other node under block distribution)
+	int peers[2] = {1, args->size - 1};
+	int num_peers = (args->size > 2) ? 2 : 1;
+
+	struct { const char *mode; void (*op)(bench_args *); } modes[] = {
+		{"blocking", pingpong_blocking},
+		{"nonblocking", pingpong_nonblocking},
+		{"sync", pingpong_sync},
+	};
+
+	for (int p = 0; p < num_peers; p++) {
+		const char *locality = bench_locality(peers[p]);
+		args->peer = peers[p];
+		for (size_t bytes = opts->min_bytes; bytes <= opts->max_bytes; bytes *= 2) {
+			args->bytes = bytes;
+			for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+				bench_case c = {"pingpong", modes[m].mode, bytes, peers[p], locality, 2.0, (double)bytes};
+				bench_run(opts, &c, modes[m].op, args);
+			}
+		}
+	}
+	args->peer = -1;
+}
+
+void bench_ring(const bench_options *opts, bench_args *args) {
+	struct { const char *mode; void (*op)(bench_args *); } modes[] = {
+		{"blocking", ring_blocking},
+		{"nonblocking", ring_nonblocking},
+		{"sync", ring_sync},
+	};
+
+	for (size_t bytes = opts->min_bytes; bytes <= opts->max_bytes; bytes *= 2) {
+		args->bytes = bytes;
+		for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+			// one op is the whole ring, so bandwidth is what each rank pushed through it
+			bench_case c = {"ring", modes[m].mode, bytes, -1, "-", 1.0, (double)bytes * (args->size - 1)};
+			bench_run(opts, &c, modes[m].op, args);
+		}
+	}
+}
+
+void bench_collectives(const bench_options *opts, bench_args *args) {
+	struct { const char *bench; const char *mode; void (*op)(bench_args *); } ops[] = {
+		{"bcast", "my", bcast_my},
+		{"bcast", "my_collective", bcast_my_collective},
+		{"bcast", "mpi", bcast_mpi},
+		{"bcast", "mpi_nonblocking", bcast_mpi_nonblocking},
+		{"scatter", "my", scatter_my},
+		{"scatter", "my_collective", scatter_my_collective},
+		{"scatter", "mpi", scatter_mpi},
+		{"scatter", "mpi_nonblocking", scatter_mpi_nonblocking},
+		{"alltoall", "my", alltoall_my},
+		{"alltoall", "my_pairwise", alltoall_my_pairwise},
+		{"alltoall", "my_bruck", alltoall_my_bruck},
+		{"alltoall", "mpi", alltoall_mpi},
+		{"scan", "my", scan_my},
+		{"scan", "mpi", scan_mpi},
+	};
+
+	size_t min_bytes = opts->min_bytes < sizeof(double) ? sizeof(double) : opts->min_bytes;
+	for (size_t bytes = min_bytes; bytes <= opts->max_bytes; bytes *= 2) {
+		args->bytes = bytes;
+		for (size_t o = 0; o < sizeof(ops) / sizeof(ops[0]); o++) {
+			if (!bench_enabled(opts, ops[o].bench)) {
+				continue;
+			}
+			// scatter moves one block to every other rank, alltoall does that on every rank, broadcast the whole buffer
+			double payload = (double)bytes;
+			if (strcmp(ops[o].bench, "scatter") == 0) payload *= args->size - 1;
+			if (strcmp(ops[o].bench, "alltoall") == 0) payload *= (double)args->size * (args->size - 1);
+			bench_case c = {ops[o].bench, ops[o].mode, bytes, -1, "-", 1.0, payload};
+			bench_run(opts, &c, ops[o].op, args);
+		}
+	}
+}
+
+void bench_sort(const bench_options *opts, bench_args *args) {
+	struct { const char *mode; void (*op)(bench_args *); } modes[] = {
+		{"sample", sort_sample},
+		{"histogram", sort_histogram},
+		{"gather_qsort", sort_gather_qsort},
+	};
+
+	// every rank gets different keys, the other tests do not care what is in the buffers
+	srand(12345 + args->rank);
+	for (size_t i = 0; i < opts->max_bytes / sizeof(int); i++) {
+		((int *)args->recvbuf)[i] = rand();
+	}
+
+	size_t min_bytes = opts->min_bytes < sizeof(int) ? sizeof(int) : opts->min_bytes;
+	for (size_t bytes = min_bytes; bytes <= opts->max_bytes; bytes *= 2) {
+		args->bytes = bytes;
+		for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+			bench_case c = {"sort", modes[m].mode, bytes, -1, "-", 1.0, (double)bytes * args->size};
+			bench_run(opts, &c, modes[m].op, args);
+		}
+	}
+}
+
+void bench_summa(const bench_options *opts, bench_args *args) {
+	const size_t max_block = (size_t)8 << 20;
+	size_t max_bytes = opts->max_bytes < max_block ? opts->max_bytes : max_block;
+	mpi_summa_grid *g = &bench_summa_state.grid;
+	mpi_summa_grid_create(MPI_COMM_WORLD, g);
+	bench_summa_state.A = (double *)malloc(max_bytes + sizeof(double));
+	bench_summa_state.B = (double *)malloc(max_bytes + sizeof(double));
+	bench_summa_state.C = (double *)malloc(max_bytes + sizeof(double));
+	for (size_t i = 0; i < max_bytes / sizeof(double); i++) {
+		bench_summa_state.A[i] = 1.0 / (double)(i + 1);
+		bench_summa_state.B[i] = (double)(i % 7);
+	}
+
+	size_t min_bytes = opts->min_bytes < sizeof(double) ? sizeof(double) : opts->min_bytes;
+	for (size_t bytes = min_bytes; bytes <= max_bytes; bytes *= 2) {
+		long long n = (long long)sqrt((double)(bytes / sizeof(double)));
+		if (n < 1 || (bytes > min_bytes && n == bench_summa_state.n)) {
+			continue;
+		}
+		bench_summa_state.n = n;
+		args->bytes = (size_t)(n * n) * sizeof(double);
+		double flops = 2.0 * (double)(n * g->rows) * (double)(n * g->cols) * (double)(n * g->cols);
+		bench_case c = {"summa", "summa", args->bytes, -1, "-", 1.0, flops};
+		bench_run(opts, &c, summa_gemm, args);
+		bench_case local = {"summa", "local_gemm", args->bytes, -1, "-", 1.0, flops / args->size};
+		bench_run(opts, &local, summa_local_gemm, args);
+	}
+
+	free(bench_summa_state.A);
+	free(bench_summa_state.B);
+	free(bench_summa_state.C);
+	mpi_summa_grid_free(g);
+}
+
+void bench_overlap(const bench_options *opts, bench_args *args) {
+	int provided;
+	MPI_Query_thread(&provided);
+	// the progress thread is only wanted in the thread mode
+	int was_active = mpi_progress_active();
+	mpi_progress_stop();
+	// the thread also refuses to start on a rank with a single core
+	int thread_ok = provided >= MPI_THREAD_MULTIPLE && mpi_progress_start(-1) == MPI_SUCCESS;
+	mpi_progress_stop();
+
+	// loop iterations per second, the same on every rank
+	long probe = 1 << 22;
+	double start = MPI_Wtime();
+	bench_compute(probe);
+	double local_rate = probe / (MPI_Wtime() - start), rate;
+	MPI_Allreduce(&local_rate, &rate, 1, MPI_DOUBLE, MPI_MIN, MPI_COMM_WORLD);
+
+	args->peer = (args->rank ^ 1) < args->size ? (args->rank ^ 1) : -1;
+	for (size_t bytes = opts->min_bytes; bytes <= opts->max_bytes; bytes *= 2) {
+		args->bytes = bytes;
+		bench_case comm = {"overlap", "comm", bytes, -1, "-", 1.0, (double)bytes};
+		double t_comm = bench_run(opts, &comm, overlap_comm, args);
+
+		bench_overlap_state.compute_iters = (long)(t_comm * rate) + 1;
+		bench_case compute = {"overlap", "compute", bytes, -1, "-", 1.0, (double)bytes};
+		double t_compute = bench_run(opts, &compute, overlap_compute, args);
+
+		struct { const char *mode; void (*op)(bench_args *); } modes[] = {
+			{"none", overlap_none},
+			{"test", overlap_test},
+			{"thread", overlap_thread},
+		};
+		int num_modes = thread_ok ? 3 : 2;
+		double overlap[3];
+		for (int m = 0; m < num_modes; m++) {
+			if (m == 2) {
+				mpi_progress_start(-1);
+			}
+			bench_case c = {"overlap", modes[m].mode, bytes, -1, "-", 1.0, (double)bytes};
+			double t = bench_run(opts, &c, modes[m].op, args);
+			if (m == 2) {
+				mpi_progress_stop();
+			}
+			double shorter = t_comm < t_compute ? t_comm : t_compute;
+			overlap[m] = shorter > 0 ? 100.0 * (t_comm + t_compute - t) / shorter : 0.0;
+			if (overlap[m] < 0) overlap[m] = 0;
+			if (overlap[m] > 100) overlap[m] = 100;
+		}
+		if (args->rank == 0 && !opts->json) {
+			printf("# overlap %zu B: none %.1f%%, test %.1f%%", bytes, overlap[0], overlap[1]);
+			if (num_modes == 3) {
+				printf(", thread %.1f%%\n", overlap[2]);
+			} else {
+				printf(", thread n/a (%s)\n", provided < MPI_THREAD_MULTIPLE ? "no MPI_THREAD_MULTIPLE" : "one core per rank");
+			}
+		}
+	}
+	args->peer = -1;
+
+	if (was_active) {
+		mpi_progress_start(-1);
+	}
+}
+
+void bench_aggr(const bench_options *opts, bench_args *args) {
+	mpi_aggr_create(&bench_aggr_state.aggr, MPI_COMM_WORLD, aggr_record, NULL, 0, 0);
+	size_t max_bytes = opts->max_bytes < 1024 ? opts->max_bytes : 1024;
+	for (size_t bytes = opts->min_bytes; bytes <= max_bytes; bytes *= 2) {
+		args->bytes = bytes;
+		bench_case direct = {"aggr", "direct", bytes, -1, "-", BENCH_AGGR_RECORDS, (double)bytes};
+		bench_run(opts, &direct, aggr_direct, args);
+		bench_case coalesced = {"aggr", "aggr", bytes, -1, "-", BENCH_AGGR_RECORDS, (double)bytes};
+		bench_run(opts, &coalesced, aggr_coalesced, args);
+		// drain what is still buffered before the next size
+		mpi_aggr_complete(&bench_aggr_state.aggr);
+	}
+	mpi_aggr_free(&bench_aggr_state.aggr);
+}
+
+void bench_place(const bench_options *opts, bench_args *args) {
+	// the same permutation on every rank
+	int *perm = (int *)malloc(args->size * sizeof(int));
+	for (int i = 0; i < args->size; i++) {
+		perm[i] = i;
+	}
+	srand(12345);
+	for (int i = args->size - 1; i > 0; i--) {
+		int j = rand() % (i + 1), t = perm[i];
+		perm[i] = perm[j];
+		perm[j] = t;
+	}
+	MPI_Comm shuffled;
+	MPI_Comm_split(MPI_COMM_WORLD, 0, perm[args->rank], &shuffled);
+	free(perm);
+
+	double *row = (double *)malloc(args->size * sizeof(double));
+	const char *patterns[2] = {"ring", "halo"};
+	for (int halo = 0; halo < 2; halo++) {
+		mpi_place_plan plan;
+		bench_place_neighbours(shuffled, halo, row);
+		mpi_place_plan_create(shuffled, row, 0, &plan);
+		MPI_Comm placed;
+		mpi_place_apply(shuffled, &plan, &placed);
+		if (args->rank == 0 && !opts->json) {
+			printf("# place %s: %d nodes x %d sockets x %d cores, estimated bytes per message byte inter-node %.0f -> %.0f, inter-socket %.0f -> %.0f (shuffled -> placed)\n",
+				patterns[halo], plan.layout.nodes, plan.layout.sockets, plan.layout.cores,
+				plan.before.inter_node, plan.after.inter_node, plan.before.inter_socket, plan.after.inter_socket);
+		}
+		mpi_place_plan_free(&plan);
+
+		struct { const char *mode; MPI_Comm comm; } orders[] = {
+			{"block", MPI_COMM_WORLD},
+			{"shuffled", shuffled},
+			{"placed", placed},
+		};
+		for (size_t bytes = opts->min_bytes; bytes <= opts->max_bytes; bytes *= 2) {
+			args->bytes = bytes;
+			for (size_t o = 0; o < sizeof(orders) / sizeof(orders[0]); o++) {
+				bench_place_neighbours(orders[o].comm, halo, NULL);
+				double payload = halo ? 4.0 * bytes : (double)bytes * (args->size - 1);
+				char mode[32];
+				snprintf(mode, sizeof(mode), "%s_%s", patterns[halo], orders[o].mode);
+				bench_case c = {"place", mode, bytes, -1, "-", 1.0, payload};
+				bench_run(opts, &c, halo ? place_halo : place_ring, args);
+			}
+		}
+		MPI_Comm_free(&placed);
+	}
+	free(row);
+	MPI_Comm_free(&shuffled);
+}
+
+void bench_zip(const bench_options *opts, bench_args *args) {
+	// a smooth field, so the codec has something to find (restored afterwards for the other tests)
+	size_t buf_count = opts->max_bytes * (size_t)args->size / sizeof(double);
+	double *field = (double *)args->sendbuf;
+	for (size_t i = 0; i < buf_count; i++) {
+		field[i] = 100.0 * sin(1e-3 * i) + 1e-4 * i;
+	}
+
+	struct { const char *mode; int zip; double tolerance; } modes[] = {
+		{"my", -1, 0.0},
+		{"stored", MPI_ZIP_OFF, 0.0},
+		{"lossless", MPI_ZIP_ON, 0.0},
+		{"lossy", MPI_ZIP_ON, BENCH_ZIP_TOLERANCE},
+		{"auto", MPI_ZIP_AUTO, 0.0},
+	};
+	struct { const char *name; void (*op)(bench_args *); } ops[] = {
+		{"bcast", zip_bcast},
+		{"scatter", zip_scatter},
+		{"gather", zip_gather},
+	};
+
+	size_t min_bytes = opts->min_bytes < MPI_ZIP_MIN_BYTES ? MPI_ZIP_MIN_BYTES : opts->min_bytes;
+	for (size_t bytes = min_bytes; bytes <= opts->max_bytes; bytes *= 2) {
+		args->bytes = bytes;
+		unsigned long long raw[sizeof(modes) / sizeof(modes[0])] = {0}, wire[sizeof(modes) / sizeof(modes[0])] = {0};
+		unsigned long long messages = 0, compressed = 0;  // of the auto mode
+		for (size_t o = 0; o < sizeof(ops) / sizeof(ops[0]); o++) {
+			for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+				bench_zip_state.mode = modes[m].zip;
+				bench_zip_state.tolerance = modes[m].tolerance;
+				if (modes[m].zip >= 0) {
+					mpi_zip_set_mode(modes[m].zip);
+				}
+				mpi_zip_reset_stats();
+
+				char mode[32];
+				snprintf(mode, sizeof(mode), "%s_%s", ops[o].name, modes[m].mode);
+				double payload = strcmp(ops[o].name, "bcast") == 0 ? (double)bytes : (double)bytes * (args->size - 1);
+				bench_case c = {"zip", mode, bytes, -1, "-", 1.0, payload};
+				bench_run(opts, &c, ops[o].op, args);
+
+				mpi_zip_stats s;
+				mpi_zip_get_stats(&s);
+				unsigned long long local[4] = {s.raw_bytes, s.wire_bytes, s.messages, s.compressed}, total[4];
+				MPI_Allreduce(local, total, 4, MPI_UNSIGNED_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+				raw[m] += total[0];
+				wire[m] += total[1];
+				if (modes[m].zip == MPI_ZIP_AUTO) {
+					messages += total[2];
+					compressed += total[3];
+				}
+			}
+		}
+		if (args->rank == 0 && !opts->json && raw[1] > 0) {
+			printf("# zip %zu: wire/raw stored %.3f, lossless %.3f, lossy %.3f, auto %.3f (%llu of %llu messages compressed)\n",
+				bytes, (double)wire[1] / raw[1], (double)wire[2] / raw[2], (double)wire[3] / raw[3], (double)wire[4] / raw[4],
+				compressed, messages);
+		}
+	}
+	mpi_zip_set_mode(MPI_ZIP_AUTO);
+	memset(args->sendbuf, 1, buf_count * sizeof(double));
+}
+
+// largest simulated rank count, and for the alltoalls (p^2 messages)
+#ifndef BENCH_SIM_MAX_RANKS
+#define BENCH_SIM_MAX_RANKS 16384
+#endif
+#ifndef BENCH_SIM_ALLTOALL_MAX_RANKS
+#define BENCH_SIM_ALLTOALL_MAX_RANKS 1024
+#endif
+
+void bench_sim(const bench_options *opts, bench_args *args) {
+	mpi_sim_params p;
+	int from_file = opts->loggp[0] != '\0' && mpi_sim_params_read(opts->loggp, &p) == MPI_SUCCESS;
+	if (!from_file) {
+		if (args->size < 2) {
+			mpi_printf_once("sim: needs 2 or more ranks to fit the LogGP parameters, or -l with a parameter file\n");
+			return;
+		}
+		int inter = mpi_sim_fit(MPI_COMM_WORLD, &p);
+		if (args->rank == 0 && opts->loggp[0] != '\0') {
+			mpi_sim_params_write(opts->loggp, &p);
+		}
+		if (args->rank == 0 && !inter && !opts->json) {
+			printf("# sim: single node, inter-node parameters copied from intra-node\n");
+		}
+	}
+	if (args->rank != 0) {
+		return;
+	}
+	if (!opts->json) {
+		printf("# sim LogGP intra L %.3g us o %.3g us g %.3g us G %.3g ns/B, inter L %.3g us o %.3g us g %.3g us G %.3g ns/B, %d ranks/node\n",
+			p.intra.L * 1e6, p.intra.o * 1e6, p.intra.g * 1e6, p.intra.G * 1e9,
+			p.inter.L * 1e6, p.inter.o * 1e6, p.inter.g * 1e6, p.inter.G * 1e9, p.ranks_per_node);
+	}
+
+	struct { const char *mode; mpi_sim_schedule schedule; int max_ranks; int payload; } ops[] = {
+		{"bcast_my", mpi_sim_bcast_my, BENCH_SIM_MAX_RANKS, 0},
+		{"bcast_binomial", mpi_sim_bcast_binomial, BENCH_SIM_MAX_RANKS, 0},
+		{"scatter_my", mpi_sim_scatter_my, BENCH_SIM_MAX_RANKS, 1},
+		{"alltoall_my", mpi_sim_alltoall_my, BENCH_SIM_ALLTOALL_MAX_RANKS, 2},
+		{"alltoall_pairwise", mpi_sim_alltoall_pairwise, BENCH_SIM_ALLTOALL_MAX_RANKS, 2},
+		{"alltoall_bruck", mpi_sim_alltoall_bruck, BENCH_SIM_ALLTOALL_MAX_RANKS, 2},
+		{"scan_my", mpi_sim_scan_my, BENCH_SIM_MAX_RANKS, 0},
+	};
+	int counts[16], num_counts = 0;
+	if (args->size > 1) {
+		counts[num_counts++] = args->size;
+	}
+	for (int ranks = 4; ranks <= BENCH_SIM_MAX_RANKS; ranks *= 4) {
+		if (ranks != args->size) {
+			counts[num_counts++] = ranks;
+		}
+	}
+
+	size_t min_bytes = opts->min_bytes < sizeof(double) ? sizeof(double) : opts->min_bytes;
+	for (int k = 0; k < num_counts; k++) {
+		int ranks = counts[k];
+		for (size_t bytes = min_bytes; bytes <= opts->max_bytes; bytes *= 4) {
+			for (size_t o = 0; o < sizeof(ops) / sizeof(ops[0]); o++) {
+				if (ranks > ops[o].max_ranks) {
+					continue;
+				}
+				double t = mpi_sim_run(&p, ranks, bytes, ops[o].schedule, NULL);
+				double payload = (double)bytes;
+				if (ops[o].payload == 1) payload *= ranks - 1;
+				if (ops[o].payload == 2) payload *= (double)ranks * (ranks - 1);
+				bench_case c = {"sim", ops[o].mode, bytes, -1, "-", 1.0, payload};
+				bench_print_row(opts, &c, ranks, 0, t, 0.0, t, t);
+			}
+		}
+	}
+}
+
+int bench_parse_options(int argc, char **argv, bench_options *opts) {
+	opts->min_bytes = 1;
+	opts->max_bytes = (size_t)64 << 20;
+	opts->samples = 10;
+	opts->json = 0;
+	opts->tests[0] = '\0';
+	opts->loggp[0] = '\0';
+
+	int opt;
+	while ((opt = getopt(argc, argv, "s:m:n:t:l:j")) != -1) {
+		switch (opt) {
+		case 's': opts->max_bytes = (size_t)strtoull(optarg, NULL, 10); break;
+		case 'm': opts->min_bytes = (size_t)strtoull(optarg, NULL, 10); break;
+		case 'n': opts->samples = atoi(optarg); break;
+		case 't': snprintf(opts->tests, sizeof(opts->tests), "%s", optarg); break;
+		case 'l': snprintf(opts->loggp, sizeof(opts->loggp), "%s", optarg); break;
+		case 'j': opts->json = 1; break;
+		default: return 1;
+		}
+	}
+	if (opts->min_bytes < 1) opts->min_bytes = 1;
+	if (opts->samples < 1) opts->samples = 1;
+	return 0;
+}
+
+MPI_MAIN(
+	bench_options opts;
+	if (bench_parse_options(argc, argv, &opts) != 0) {
+		mpi_printf_once("Usage: %s [-s max_bytes] [-m min_bytes] [-n samples] [-t pingpong,ring,bcast,scatter,alltoall,scan,sort,summa,overlap,aggr,place,zip,sim] [-l loggp_file] [-j]\n", argv[0]);
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+
+	// scatter needs size blocks on the root and alltoall size blocks on both sides
+	size_t buf_bytes = opts.max_bytes * (size_t)_mpi_size;
+	bench_args args = {0};
+	args.sendbuf = (char *)malloc(buf_bytes);
+	args.recvbuf = (char *)malloc(buf_bytes);
+	args.rank = _mpi_rank;
+	args.size = _mpi_size;
+	args.peer = -1;
+	if (args.sendbuf == NULL || args.recvbuf == NULL) {
+		mpi_printf("Could not allocate %zu bytes of benchmark buffers\n", 2 * buf_bytes);
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	memset(args.sendbuf, 1, buf_bytes);
+	memset(args.recvbuf, 0, buf_bytes);
+
+	if (_mpi_size > 1 && bench_enabled(&opts, "pingpong")) {
+		bench_pingpong(&opts, &args);
+	}
+	if (_mpi_size > 1 && bench_enabled(&opts, "ring")) {
+		bench_ring(&opts, &args);
+	}
+	if (bench_enabled(&opts, "bcast") || bench_enabled(&opts, "scatter") || bench_enabled(&opts, "alltoall") || bench_enabled(&opts, "scan")) {
+		bench_collectives(&opts, &args);
+	}
+	if (bench_enabled(&opts, "sort")) {
+		bench_sort(&opts, &args);
+	}
+	if (bench_enabled(&opts, "summa")) {
+		bench_summa(&opts, &args);
+	}
+	if (_mpi_size > 1 && bench_enabled(&opts, "overlap")) {
+		bench_overlap(&opts, &args);
+	}
+	if (_mpi_size > 1 && bench_enabled(&opts, "aggr")) {
+		bench_aggr(&opts, &args);
+	}
+	if (_mpi_size > 1 && bench_enabled(&opts, "place")) {
+		bench_place(&opts, &args);
+	}
+	if (_mpi_size > 1 && bench_enabled(&opts, "zip")) {
+		bench_zip(&opts, &args);
+	}
+	if (bench_enabled(&opts, "sim")) {
+		bench_sim(&opts, &args);
+	}
+
+	if (_mpi_rank == 0 && opts.json) {
+		printf(bench_first_row ? "[]\n" : "\n]\n");
+	}
+
+	free(args.sendbuf);
+	free(args.recvbuf);
+);
@@ -0,0 +1,198 @@
+#!/bin/bash
+#
+# Performance regression gate.
+#
+# Builds and runs the benchmark suite and the week programs, then compares every
+# timing against bench/baseline.json. A metric fails when it got slower by more
+# than the noise of the two measurements:
+#
+#   current_mean - baseline_mean > K * sqrt(baseline_sd^2 / baseline_n + current_sd^2 / current_n)
+#
+# so noisy metrics get a wide band and stable ones a tight one (no fixed percentage).
+#
+# Usage (from the repository root or bench/):
+#   bench/regress.sh            compare against bench/baseline.json, exit 1 on any regression
+#                               or if there is no baseline
+#   bench/regress.sh --update   measure and write bench/baseline.json (commit it afterwards)
+#
+# Environment:
+#   CC        compiler passed to make (default: the Makefile's, "cc" on ARCHER2)
+#   MPIRUN    launcher (default "mpirun"; use "srun" inside a job)
+#   NP        ranks (default 4, the week_4/week_5 checks assume 4)
+#   K         noise multiplier for the threshold (default 3)
+#   RUNS      runs of each week program (default 5)
+#   WEEKS     week directories to run (default "week_1 week_2 week_3 week_4 week_5")
+#   BENCH_ARGS  arguments for bench (default "-s 1048576 -n 10")
+#   BIN_ROOT  if set, binaries are built under $BIN_ROOT/<dir> instead of each bin/
+
+set -e -o pipefail
+
+ROOT="$(cd "$(dirname "$0")/.." && pwd)"
+BASELINE="$ROOT/bench/baseline.json"
+MPIRUN="${MPIRUN:-mpirun}"
+NP="${NP:-4}"
+K="${K:-3}"
+RUNS="${RUNS:-5}"
+WEEKS="${WEEKS:-week_1 week_2 week_3 week_4 week_5}"
+BENCH_ARGS="${BENCH_ARGS:--s 1048576 -n 10}"
+
+UPDATE=0
+if [ "$1" = "--update" ]; then
+	UPDATE=1
+fi
+
+# baselines are per machine; without one there is nothing to gate against, so
+# fail before spending the time on a run
+if [ "$UPDATE" -eq 0 ] && [ ! -f "$BASELINE" ]; then
+	echo "ERROR: no baseline at $BASELINE" >&2
+	echo "ERROR: record one on this machine with: $0 --update (and commit it)" >&2
+	exit 1
+fi
+
+WORK="$(mktemp -d)"
+trap 'rm -rf "$WORK"' EXIT
+CURRENT="$WORK/current.json"
+
+# build one program directory, echo the path of its executable
+build() {
+	local dir="$1"
+	local bin_dir="$ROOT/$dir/bin"
+	if [ -n "$BIN_ROOT" ]; then
+		bin_dir="$BIN_ROOT/$dir"
+	fi
+	local make_args=("BIN_DIR=$bin_dir")
+	if [ -n "$CC" ]; then
+		make_args+=("CC=$CC")
+	fi
+	make -s -C "$ROOT/$dir" "${make_args[@]}" >&2
+	local program
+	program="$(awk '$1 == "PROGRAM_NAME" { print $3 }' "$ROOT/$dir/Makefile")"
+	echo "$bin_dir/$program"
+}
+
+# convert the bench JSON rows into metric lines: name mean_us stddev_us samples
+bench_metrics() {
+	awk '
+	function field(line, key,    m) {
+		if (match(line, "\"" key "\": *\"?[^,\"}]*")) {
+			m = substr(line, RSTART, RLENGTH)
+			sub(/^"[^"]*": *"?/, "", m)
+			return m
+		}
+		return ""
+	}
+	/"bench":/ {
+		name = "bench/" field($0, "bench") "/" field($0, "mode") "/" field($0, "bytes")
+		if (field($0, "peer") != "-1") {
+			name = name "/peer" field($0, "peer")
+		}
+		print name, field($0, "mean_us"), field($0, "stddev_us"), field($0, "samples")
+	}'
+}
+
+# mean/stddev over runs of "name value" lines: name mean_us stddev_us samples
+summarise() {
+	awk '
+	{ n[$1]++; s[$1] += $2; ss[$1] += $2 * $2; if (!($1 in order)) { order[$1] = ++count; names[count] = $1 } }
+	END {
+		for (i = 1; i <= count; i++) {
+			m = names[i]
+			mean = s[m] / n[m]
+			var = (n[m] > 1) ? (ss[m] - n[m] * mean * mean) / (n[m] - 1) : 0
+			if (var < 0) var = 0
+			printf "%s %.4f %.4f %d\n", m, mean, sqrt(var), n[m]
+		}
+	}'
+}
+
+# run a week program RUNS times, collecting the total wall time and every mpi_time line
+week_metrics() {
+	local dir="$1" exe="$2"
+	local run_dir="$WORK/$dir"
+	mkdir -p "$run_dir"
+	for run in $(seq 1 "$RUNS"); do
+		local start end
+		start="$(date +%s.%N)"
+		if ! (cd "$run_dir" && $MPIRUN -n "$NP" "$exe" > "$run_dir/out.txt" 2>&1); then
+			echo "$dir failed on run $run:" >&2
+			tail -n 20 "$run_dir/out.txt" >&2
+			exit 1
+		fi
+		end="$(date +%s.%N)"
+		rm -f "$run_dir/output.txt"
+		awk -v s="$start" -v e="$end" -v d="$dir" 'BEGIN { printf "%s/wall %.4f\n", d, (e - s) * 1e6 }'
+		# [Rank 0] Average time over 5 samples: 0.123 seconds / [Rank 0] Time: 0.123 seconds
+		awk -v d="$dir" '
+			/Average time over [0-9]+ samples:|\] Time: / {
+				for (i = 1; i <= NF; i++) if ($i == "seconds") t = $(i - 1)
+				printf "%s/timing_%d %.4f\n", d, ++region, t * 1e6
+			}' "$run_dir/out.txt"
+	done | summarise
+}
+
+# write metric lines as the baseline JSON format
+to_json() {
+	awk '
+	BEGIN { print "[" }
+	{ printf "%s  {\"metric\": \"%s\", \"mean_us\": %s, \"stddev_us\": %s, \"samples\": %s}", (NR > 1 ? ",\n" : ""), $1, $2, $3, $4 }
+	END { print "\n]" }'
+}
+
+# metric lines back from the JSON format
+from_json() {
+	awk '
+	/"metric":/ {
+		line = $0
+		gsub(/[{}",]/, " ", line)
+		gsub(/: /, " ", line)
+		split(line, f, " ")
+		# f: metric <name> mean_us <v> stddev_us <v> samples <v>
+		print f[2], f[4], f[6], f[8]
+	}' "$1"
+}
+
+echo "Building and running bench ($MPIRUN -n $NP)" >&2
+BENCH_EXE="$(build bench)"
+$MPIRUN -n "$NP" "$BENCH_EXE" -j $BENCH_ARGS | bench_metrics > "$WORK/metrics.txt"
+
+for week in $WEEKS; do
+	echo "Building and running $week ($RUNS runs)" >&2
+	WEEK_EXE="$(build "$week")"
+	week_metrics "$week" "$WEEK_EXE" >> "$WORK/metrics.txt"
+done
+
+to_json < "$WORK/metrics.txt" > "$CURRENT"
+
+if [ "$UPDATE" -eq 1 ]; then
+	cp "$CURRENT" "$BASELINE"
+	echo "Wrote $(wc -l < "$WORK/metrics.txt") metrics to $BASELINE" >&2
+	exit 0
+fi
+
+from_json "$BASELINE" > "$WORK/baseline.txt"
+
+awk -v k="$K" '
+	FNR == NR { bm[$1] = $2; bs[$1] = $3; bn[$1] = $4; next }
+	{
+		name = $1
+		if (!(name in bm)) {
+			printf "%-48s %14s %14.2f %9s %8s %12s  %s\n", name, "-", $2, "-", "-", "-", "new"
+			next
+		}
+		cm = $2; cs = $3; cn = $4
+		noise = k * sqrt(bs[name] ^ 2 / bn[name] + cs ^ 2 / cn)
+		change = (bm[name] > 0) ? 100.0 * (cm - bm[name]) / bm[name] : 0
+		speedup = (cm > 0) ? bm[name] / cm : 0
+		status = "ok"
+		if (cm - bm[name] > noise) { status = "SLOWER"; failed++ }
+		else if (bm[name] - cm > noise) { status = "faster"; faster++ }
+		printf "%-48s %14.2f %14.2f %+8.1f%% %7.2fx %12.2f  %s\n", name, bm[name], cm, change, speedup, noise, status
+		compared++
+	}
+	BEGIN {
+		printf "%-48s %14s %14s %9s %8s %12s  %s\n", "metric", "baseline_us", "current_us", "change", "speedup", "noise_us", "status"
+	}
+	END {
+		printf "\n%d metrics compared (K = %s): %d slower, %d faster\n", compared, k, failed, faster
+		exit (failed > 0) ? 1 : 0
+	}' "$WORK/baseline.txt" "$WORK/metrics.txt"
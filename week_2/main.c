@@ -1,16 +1,16 @@
 #include "mpi_helper.h"
 #include <math.h>
 
-const int N = 1000000; // 1 millon intervals to sample from
+const long long N = 1000000; // 1 millon intervals to sample from
 
 void estimate_pi(int _mpi_rank, int _mpi_size, double *result) {
-	int comp_per_rank = N / _mpi_size;
-	int remainder = N % _mpi_size;
+	long long comp_per_rank = N / _mpi_size;
+	long long remainder = N % _mpi_size;
     
     // determine start and end indices for each rank
 	// if n is not divisible by size, the first 'remainder' ranks get one extra computation 
 	// (spread the extra between them)
-    int start, end;
+    long long start, end;
     if (_mpi_rank < remainder) {
         start = _mpi_rank * (comp_per_rank + 1);
         end = start + comp_per_rank + 1;
@@ -22,7 +22,7 @@ void estimate_pi(int _mpi_rank, int _mpi_size, double *result) {
 	double local_sum = 0.0;
 	// each rank starts from its index (given by _mpi_rank) times the number of computations per rank
 	// and goes up to the next rank's starting index ((_mpi_rank + 1) * comp_per_rank)
-	for (int i = start; i < end; i++) {
+	for (long long i = start; i < end; i++) {
 		double x = (i-0.5)/N;
 		local_sum += 1. / (1 + pow(x, 2));
 	}
@@ -42,13 +42,13 @@ void estimate_pi(int _mpi_rank, int _mpi_size, double *result) {
 }
 
 void estimate_pi_recv_wildcard_tags(int mpi_rank, int mpi_size, double *result) {
-	int comp_per_rank = N / mpi_size;
-	int remainder = N % mpi_size;
+	long long comp_per_rank = N / mpi_size;
+	long long remainder = N % mpi_size;
 	
 	// determine start and end indices for each rank
 	// if n is not divisible by size, the first 'remainder' ranks get one extra computation 
 	// (spread the extra between them)
-	int start, end;
+	long long start, end;
 	if (mpi_rank < remainder) {
 		start = mpi_rank * (comp_per_rank + 1);
 		end = start + comp_per_rank + 1;
@@ -60,7 +60,7 @@ void estimate_pi_recv_wildcard_tags(int mpi_rank, int mpi_size, double *result)
 	double local_sum = 0.0;
 	// each rank starts from its index (given by _mpi_rank) times the number of computations per rank
 	// and goes up to the next rank's starting index ((_mpi_rank + 1) * comp_per_rank)
-	for (int i = start; i < end; i++) {
+	for (long long i = start; i < end; i++) {
 		double x = (i-0.5)/N;
 		local_sum += 1. / (1 + pow(x, 2));
 	}
@@ -85,13 +85,13 @@ void estimate_pi_recv_wildcard_tags(int mpi_rank, int mpi_size, double *result)
 }
 
 void estimate_pi_recv_wildcard(int mpi_rank, int mpi_size, double *result) {
-	int comp_per_rank = N / mpi_size;
-	int remainder = N % mpi_size;
+	long long comp_per_rank = N / mpi_size;
+	long long remainder = N % mpi_size;
 	
 	// determine start and end indices for each rank
 	// if n is not divisible by size, the first 'remainder' ranks get one extra computation 
 	// (spread the extra between them)
-	int start, end;
+	long long start, end;
 	if (mpi_rank < remainder) {
 		start = mpi_rank * (comp_per_rank + 1);
 		end = start + comp_per_rank + 1;
@@ -103,7 +103,7 @@ void estimate_pi_recv_wildcard(int mpi_rank, int mpi_size, double *result) {
 	double local_sum = 0.0;
 	// each rank starts from its index (given by _mpi_rank) times the number of computations per rank
 	// and goes up to the next rank's starting index ((_mpi_rank + 1) * comp_per_rank)
-	for (int i = start; i < end; i++) {
+	for (long long i = start; i < end; i++) {
 		double x = (i-0.5)/N;
 		local_sum += 1. / (1 + pow(x, 2));
 	}
@@ -112,7 +112,8 @@ void estimate_pi_recv_wildcard(int mpi_rank, int mpi_size, double *result) {
 	if (mpi_rank == 0) {
 		// Note: we need to allocate an array for all local sums to receive them in order
 		// if we dont do this, then we can get non-deterministic results since float summation is not associative due to rounding errors
-        double *all_sums = malloc(mpi_size * sizeof(double));
+        // (from the pool: after the first call this is a free-list pop, not a malloc)
+        double *all_sums = (double *)mpi_pool_alloc(mpi_size * sizeof(double));
         all_sums[0] = local_sum;
 
         for (int i = 1; i < mpi_size; i++) {
@@ -127,7 +128,7 @@ void estimate_pi_recv_wildcard(int mpi_rank, int mpi_size, double *result) {
         for (int i = 0; i < mpi_size; i++) {
             global_sum += all_sums[i];
         }
-        free(all_sums);
+        mpi_pool_free(all_sums);
 
         *result = global_sum * 4.0 / N;
     } else {
@@ -147,7 +148,7 @@ MPI_MAIN(
 	mpi_printf_once("================================\n");
 	mpi_printf_once("Estimating pi using with specific sender and recieve\n");
 	mpi_printf_once("================================\n");
-	mpi_time(5,
+	mpi_time_perf(5,
 		do_n_times(_mpi_rank, _mpi_size, 1000, &pi_estimate, estimate_pi);
 	);
 	mpi_printf_once("Estimated value of pi: %f\n", pi_estimate);
@@ -155,7 +156,7 @@ MPI_MAIN(
 	mpi_printf_once("================================\n");
 	mpi_printf_once("Estimating pi using wildcard recieve with array\n");
 	mpi_printf_once("================================\n");
-	mpi_time(5,
+	mpi_time_perf(5,
 		do_n_times(_mpi_rank, _mpi_size, 1000, &pi_estimate, estimate_pi_recv_wildcard);
 	);
 	mpi_printf_once("Estimated value of pi: %f\n", pi_estimate);
@@ -163,9 +164,10 @@ MPI_MAIN(
 	mpi_printf_once("================================\n");
 	mpi_printf_once("Estimating pi using wildcard recieve with tags\n");
 	mpi_printf_once("================================\n");
-	mpi_time(5,
+	mpi_time_perf(5,
 		do_n_times(_mpi_rank, _mpi_size, 1000, &pi_estimate, estimate_pi_recv_wildcard_tags);
 	);
 	mpi_printf_once("Estimated value of pi: %f\n", pi_estimate);
+	mpi_pool_report(MPI_COMM_WORLD);
 
 );
@@ -67,15 +67,16 @@ int my_mpi_scatter(void *sendbuf, int sendcount, MPI_Datatype sendtype, void *re
     MPI_Comm_size(comm, &size);
 
     if (rank == 0) {
+      // element size in bytes (sizeof(sendtype) would be the size of the handle, not of an element)
+      int typesize;
+      MPI_Type_size(sendtype, &typesize);
       for (int i = 0; i < size; i++) {
         if (i == 0) {
           // rank 0 just copies from sendbuf to recvbuf
-          memcpy(recvbuf, sendbuf, sendcount * sizeof(sendtype));
+          memcpy(recvbuf, sendbuf, (size_t)sendcount * typesize);
           continue;
         }
         // we should send the section that corrosponds to the rank (for example rank 2 gets section 2 of buffer)
-        int typesize;
-        MPI_Type_size(sendtype, &typesize);
         char *shifted_buffer = (char *)sendbuf + (i * sendcount) * typesize;
         MPI_Send(shifted_buffer, sendcount, sendtype, i, 0, comm);
       }
@@ -0,0 +1,207 @@
+#ifndef MPI_PERF_H
+#define MPI_PERF_H
+
+#include <stdio.h>
+#include <string.h>
+
+#include <mpi.h>
+
+#include "mpi_helper.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Hardware performance counters around timed regions (Linux perf_event_open).
+ *
+ * Each rank opens one counter group (cycles is the leader so all events are
+ * scheduled together). If the kernel refuses (perf_event_paranoid, containers,
+ * no PMU, not linux) the counters are marked unavailable and every call below
+ * becomes a no-op, so the same code runs everywhere.
+ *
+ * Compile with -DMPI_HELPER_NO_PERF to compile the counters out entirely.
+ */
+
+enum {
+	MPI_PERF_CYCLES = 0,
+	MPI_PERF_INSTRUCTIONS,
+	MPI_PERF_CACHE_REFERENCES,
+	MPI_PERF_CACHE_MISSES,
+	MPI_PERF_BRANCH_MISSES,
+	MPI_PERF_NUM_EVENTS
+};
+
+typedef struct {
+	int available;                                    // 1 if the whole group opened on this rank
+	int fds[MPI_PERF_NUM_EVENTS];
+	unsigned long long totals[MPI_PERF_NUM_EVENTS];   // accumulated counts over all regions
+	int regions;                                      // number of start/stop pairs accumulated
+	unsigned long long time_enabled, time_running;    // group times when the current region started
+} mpi_perf_counters;
+
+#if defined(__linux__) && !defined(MPI_HELPER_NO_PERF)
+static const unsigned long long _mpi_perf_configs[MPI_PERF_NUM_EVENTS] = {
+	PERF_COUNT_HW_CPU_CYCLES,
+	PERF_COUNT_HW_INSTRUCTIONS,
+	PERF_COUNT_HW_CACHE_REFERENCES,
+	PERF_COUNT_HW_CACHE_MISSES,
+	PERF_COUNT_HW_BRANCH_MISSES,
+};
+#endif
+
+/*
+ * Open the counter group for the calling rank (counts this process, user space only)
+ *
+ * pc: counters to initialise
+ * returns 1 if the counters are available, 0 otherwise
+ */
+int mpi_perf_open(mpi_perf_counters *pc) {
+	memset(pc, 0, sizeof(*pc));
+	for (int e = 0; e < MPI_PERF_NUM_EVENTS; e++) {
+		pc->fds[e] = -1;
+	}
+
+#if defined(__linux__) && !defined(MPI_HELPER_NO_PERF)
+	for (int e = 0; e < MPI_PERF_NUM_EVENTS; e++) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = _mpi_perf_configs[e];
+		attr.disabled = (e == 0); // only the leader starts disabled, members follow it
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+		int group_fd = (e == 0) ? -1 : pc->fds[0];
+		pc->fds[e] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+		if (pc->fds[e] < 0) {
+			// partial groups are useless (IPC needs both cycles and instructions), so back out
+			for (int j = 0; j < e; j++) {
+				close(pc->fds[j]);
+				pc->fds[j] = -1;
+			}
+			pc->fds[e] = -1;
+			return 0;
+		}
+	}
+	pc->available = 1;
+#endif
+	return pc->available;
+}
+
+/*
+ * Reset and start counting a region
+ */
+void mpi_perf_start(mpi_perf_counters *pc) {
+#if defined(__linux__) && !defined(MPI_HELPER_NO_PERF)
+	if (!pc->available) {
+		return;
+	}
+	ioctl(pc->fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	// the reset clears the counts but not time_enabled/time_running, so remember where they stand
+	unsigned long long buf[3 + MPI_PERF_NUM_EVENTS];
+	if (read(pc->fds[0], buf, sizeof(buf)) == (ssize_t)sizeof(buf)) {
+		pc->time_enabled = buf[1];
+		pc->time_running = buf[2];
+	}
+	ioctl(pc->fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#else
+	(void)pc;
+#endif
+}
+
+/*
+ * Stop counting a region and add its counts to the totals
+ */
+void mpi_perf_stop(mpi_perf_counters *pc) {
+#if defined(__linux__) && !defined(MPI_HELPER_NO_PERF)
+	if (!pc->available) {
+		return;
+	}
+	ioctl(pc->fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+	// layout of a group read: nr, time_enabled, time_running, value[nr]
+	unsigned long long buf[3 + MPI_PERF_NUM_EVENTS];
+	if (read(pc->fds[0], buf, sizeof(buf)) != (ssize_t)sizeof(buf)) {
+		return;
+	}
+
+	// if the PMU was multiplexed with other users, scale up to the full region
+	// (by this region's share of the times, which keep accumulating over all regions)
+	unsigned long long enabled = buf[1] - pc->time_enabled;
+	unsigned long long running = buf[2] - pc->time_running;
+	double scale = (running > 0) ? (double)enabled / (double)running : 1.0;
+	for (int e = 0; e < MPI_PERF_NUM_EVENTS; e++) {
+		pc->totals[e] += (unsigned long long)(buf[3 + e] * scale);
+	}
+	pc->regions++;
+#else
+	(void)pc;
+#endif
+}
+
+/*
+ * Close the counter group
+ */
+void mpi_perf_close(mpi_perf_counters *pc) {
+#if defined(__linux__) && !defined(MPI_HELPER_NO_PERF)
+	for (int e = 0; e < MPI_PERF_NUM_EVENTS; e++) {
+		if (pc->fds[e] >= 0) {
+			close(pc->fds[e]);
+			pc->fds[e] = -1;
+		}
+	}
+#endif
+	pc->available = 0;
+}
+
+/*
+ * Reduce the counters over all ranks of comm and print them on rank 0 (collective)
+ *
+ * Counts are summed across ranks for the totals/ratios and the max rank is
+ * reported for cycles so load imbalance shows up next to the wall time.
+ * If any rank could not open its counters nothing but a note is printed.
+ *
+ * pc: counters accumulated with mpi_perf_start/mpi_perf_stop
+ * samples: number of samples the totals were accumulated over (to print per-sample values)
+ * comm: MPI communicator
+ */
+void mpi_perf_report(mpi_perf_counters *pc, int samples, MPI_Comm comm) {
+	int rank;
+	MPI_Comm_rank(comm, &rank);
+
+	int all_available;
+	MPI_Reduce(&pc->available, &all_available, 1, MPI_INT, MPI_MIN, 0, comm);
+
+	unsigned long long sums[MPI_PERF_NUM_EVENTS];
+	unsigned long long max_cycles;
+	MPI_Reduce(pc->totals, sums, MPI_PERF_NUM_EVENTS, MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, comm);
+	MPI_Reduce(&pc->totals[MPI_PERF_CYCLES], &max_cycles, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX, 0, comm);
+
+	if (rank != 0) {
+		return;
+	}
+	if (!all_available) {
+		mpi_printf("Hardware counters unavailable (check /proc/sys/kernel/perf_event_paranoid)\n");
+		return;
+	}
+
+	double n = (samples > 0) ? (double)samples : 1.0;
+	double cycles = (double)sums[MPI_PERF_CYCLES];
+	double instructions = (double)sums[MPI_PERF_INSTRUCTIONS];
+	double cache_refs = (double)sums[MPI_PERF_CACHE_REFERENCES];
+
+	mpi_printf("Counters per sample (sum over ranks): cycles %.3e, instructions %.3e, IPC %.2f\n",
+		cycles / n, instructions / n, cycles > 0 ? instructions / cycles : 0.0);
+	mpi_printf("Cache misses %.3e (%.2f%% of refs), branch misses %.3e, max rank cycles %.3e\n",
+		sums[MPI_PERF_CACHE_MISSES] / n,
+		cache_refs > 0 ? 100.0 * sums[MPI_PERF_CACHE_MISSES] / cache_refs : 0.0,
+		sums[MPI_PERF_BRANCH_MISSES] / n, max_cycles / n);
+}
+
+#endif
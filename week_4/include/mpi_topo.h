@@ -0,0 +1,315 @@
+#ifndef MPI_TOPO_H
+#define MPI_TOPO_H
+
+#include "mpi_helper.h"
+
+/*
+ * Cartesian process topologies (1D, 2D, 3D) and halo exchange of ghost cells.
+ *
+ * The week_4 ring is the 1D periodic case: mpi_topo_create(comm, 1, periodic, 1, &t)
+ * and t.lo[0]/t.hi[0] are the left/right neighbours. Ranks are created with
+ * reorder=1 by default so the library may place grid neighbours on nearby cores;
+ * always use t.comm and t.rank after creating the topology, not the old ranks.
+ *
+ * A halo describes a local row-major block of n[0] x n[1] x ... interior cells
+ * surrounded by 'width' ghost cells on every side. Faces are described with
+ * MPI subarray datatypes on the whole padded block, so nothing is packed by hand.
+ */
+
+#define MPI_TOPO_MAX_DIMS 3
+
+typedef struct {
+	MPI_Comm comm;                  // cartesian communicator (ranks may be reordered)
+	int ndims;
+	int rank;                       // rank in comm
+	int size;
+	int dims[MPI_TOPO_MAX_DIMS];    // processes along each dimension
+	int periods[MPI_TOPO_MAX_DIMS];
+	int coords[MPI_TOPO_MAX_DIMS];  // my position in the process grid
+	int lo[MPI_TOPO_MAX_DIMS];      // neighbour at coords[d] - 1 (MPI_PROC_NULL at a non-periodic edge)
+	int hi[MPI_TOPO_MAX_DIMS];      // neighbour at coords[d] + 1
+} mpi_topo;
+
+/*
+ * Create a cartesian topology over all ranks of comm (collective)
+ *
+ * comm: MPI communicator to build the grid from
+ * ndims: 1, 2 or 3
+ * periodic: per dimension, 1 to wrap around (ring/torus), 0 for a hard edge (NULL means all periodic)
+ * reorder: let MPI renumber the ranks to match the machine (1 recommended)
+ * t: topology to fill in, free with mpi_topo_free
+ */
+int mpi_topo_create(MPI_Comm comm, int ndims, const int *periodic, int reorder, mpi_topo *t) {
+	memset(t, 0, sizeof(*t));
+	if (ndims < 1 || ndims > MPI_TOPO_MAX_DIMS) {
+		return MPI_ERR_DIMS;
+	}
+
+	int size;
+	MPI_Comm_size(comm, &size);
+	t->ndims = ndims;
+	for (int d = 0; d < ndims; d++) {
+		t->periods[d] = (periodic == NULL) ? 1 : periodic[d];
+	}
+
+	// let MPI pick the most square grid for this many ranks
+	MPI_Dims_create(size, ndims, t->dims);
+	int err = MPI_Cart_create(comm, ndims, t->dims, t->periods, reorder, &t->comm);
+	if (err != MPI_SUCCESS) {
+		return err;
+	}
+
+	MPI_Comm_rank(t->comm, &t->rank);
+	MPI_Comm_size(t->comm, &t->size);
+	MPI_Cart_coords(t->comm, t->rank, ndims, t->coords);
+	for (int d = 0; d < ndims; d++) {
+		MPI_Cart_shift(t->comm, d, 1, &t->lo[d], &t->hi[d]);
+	}
+	return MPI_SUCCESS;
+}
+
+void mpi_topo_free(mpi_topo *t) {
+	if (t->comm != MPI_COMM_NULL) {
+		MPI_Comm_free(&t->comm);
+	}
+}
+
+typedef struct {
+	const mpi_topo *topo;
+	int width;                               // ghost cells on each side
+	int n[MPI_TOPO_MAX_DIMS];                // interior cells per dimension
+	int padded[MPI_TOPO_MAX_DIMS];           // n + 2 * width
+	MPI_Datatype etype;
+	// faces only (interior extent in the other dimensions), [dim][0 = lo side, 1 = hi side]
+	MPI_Datatype face_send[MPI_TOPO_MAX_DIMS][2];
+	MPI_Datatype face_recv[MPI_TOPO_MAX_DIMS][2];
+	// faces that also cover the ghosts of earlier dimensions, so exchanging the
+	// dimensions one after the other fills edges and corners too
+	MPI_Datatype full_send[MPI_TOPO_MAX_DIMS][2];
+	MPI_Datatype full_recv[MPI_TOPO_MAX_DIMS][2];
+	// only what full_* adds to face_* (the edges and corners), MPI_DATATYPE_NULL for dimension 0
+	MPI_Datatype corner_send[MPI_TOPO_MAX_DIMS][2];
+	MPI_Datatype corner_recv[MPI_TOPO_MAX_DIMS][2];
+	MPI_Request requests[4 * MPI_TOPO_MAX_DIMS];
+	int num_requests;
+} mpi_halo;
+
+/*
+ * Build one slab datatype of the padded block
+ *
+ * dim/start: the slab is 'width' cells thick in dim, starting at start
+ * full_below: dimensions below dim span the whole padded extent instead of the interior
+ */
+MPI_Datatype _mpi_halo_slab(const mpi_halo *h, int dim, int start, int full_below) {
+	int ndims = h->topo->ndims;
+	int subsizes[MPI_TOPO_MAX_DIMS], starts[MPI_TOPO_MAX_DIMS];
+	for (int k = 0; k < ndims; k++) {
+		if (k == dim) {
+			subsizes[k] = h->width;
+			starts[k] = start;
+		} else if (full_below && k < dim) {
+			subsizes[k] = h->padded[k];
+			starts[k] = 0;
+		} else {
+			subsizes[k] = h->n[k];
+			starts[k] = h->width;
+		}
+	}
+	MPI_Datatype type;
+	MPI_Type_create_subarray(ndims, h->padded, subsizes, starts, MPI_ORDER_C, h->etype, &type);
+	MPI_Type_commit(&type);
+	return type;
+}
+
+/*
+ * Build the part of a full slab that is not in the face slab: the cells of the
+ * slab that lie in the ghosts of earlier dimensions
+ *
+ * dim/start: as for _mpi_halo_slab, dim > 0
+ *
+ * The cells are cut into disjoint pieces, one per earlier dimension k and side:
+ * ghost cells in k, interior in the dimensions before k, whole padded extent
+ * between k and dim.
+ */
+MPI_Datatype _mpi_halo_corners(const mpi_halo *h, int dim, int start) {
+	int ndims = h->topo->ndims;
+	MPI_Datatype pieces[2 * MPI_TOPO_MAX_DIMS] = {MPI_DATATYPE_NULL};
+	int lengths[2 * MPI_TOPO_MAX_DIMS] = {0};
+	MPI_Aint displs[2 * MPI_TOPO_MAX_DIMS] = {0};
+	int num_pieces = 0;
+	for (int k = 0; k < dim; k++) {
+		for (int side = 0; side < 2; side++) {
+			int subsizes[MPI_TOPO_MAX_DIMS], starts[MPI_TOPO_MAX_DIMS];
+			for (int j = 0; j < ndims; j++) {
+				if (j == dim) {
+					subsizes[j] = h->width;
+					starts[j] = start;
+				} else if (j == k) {
+					subsizes[j] = h->width;
+					starts[j] = side ? h->n[j] + h->width : 0;
+				} else if (j > k && j < dim) {
+					subsizes[j] = h->padded[j];
+					starts[j] = 0;
+				} else {
+					subsizes[j] = h->n[j];
+					starts[j] = h->width;
+				}
+			}
+			MPI_Type_create_subarray(ndims, h->padded, subsizes, starts, MPI_ORDER_C, h->etype, &pieces[num_pieces]);
+			lengths[num_pieces] = 1;
+			displs[num_pieces] = 0; // every subarray already points at its cells
+			num_pieces++;
+		}
+	}
+	MPI_Datatype type;
+	MPI_Type_create_struct(num_pieces, lengths, displs, pieces, &type);
+	MPI_Type_commit(&type);
+	for (int p = 0; p < num_pieces; p++) {
+		MPI_Type_free(&pieces[p]);
+	}
+	return type;
+}
+
+/*
+ * Describe a local block with ghost cells and build its face datatypes
+ *
+ * topo: topology the block is decomposed over
+ * local_sizes: interior cells per dimension (topo->ndims entries, row-major, last dimension contiguous)
+ * width: ghost cells on each side (must be <= every local size)
+ * etype: element type
+ * h: halo to fill in, free with mpi_halo_free
+ */
+int mpi_halo_create(const mpi_topo *topo, const int *local_sizes, int width, MPI_Datatype etype, mpi_halo *h) {
+	memset(h, 0, sizeof(*h));
+	h->topo = topo;
+	h->width = width;
+	h->etype = etype;
+	for (int d = 0; d < topo->ndims; d++) {
+		if (width < 1 || local_sizes[d] < width) {
+			return MPI_ERR_ARG;
+		}
+		h->n[d] = local_sizes[d];
+		h->padded[d] = local_sizes[d] + 2 * width;
+	}
+
+	for (int d = 0; d < topo->ndims; d++) {
+		for (int full = 0; full < 2; full++) {
+			MPI_Datatype (*send)[2] = full ? h->full_send : h->face_send;
+			MPI_Datatype (*recv)[2] = full ? h->full_recv : h->face_recv;
+			send[d][0] = _mpi_halo_slab(h, d, width, full);               // my first interior cells
+			send[d][1] = _mpi_halo_slab(h, d, h->n[d], full);             // my last interior cells
+			recv[d][0] = _mpi_halo_slab(h, d, 0, full);                   // low ghost cells
+			recv[d][1] = _mpi_halo_slab(h, d, h->n[d] + width, full);     // high ghost cells
+		}
+		if (d == 0) {
+			for (int s = 0; s < 2; s++) {
+				h->corner_send[d][s] = h->corner_recv[d][s] = MPI_DATATYPE_NULL;
+			}
+			continue;
+		}
+		h->corner_send[d][0] = _mpi_halo_corners(h, d, width);
+		h->corner_send[d][1] = _mpi_halo_corners(h, d, h->n[d]);
+		h->corner_recv[d][0] = _mpi_halo_corners(h, d, 0);
+		h->corner_recv[d][1] = _mpi_halo_corners(h, d, h->n[d] + width);
+	}
+	return MPI_SUCCESS;
+}
+
+void mpi_halo_free(mpi_halo *h) {
+	for (int d = 0; d < h->topo->ndims; d++) {
+		for (int s = 0; s < 2; s++) {
+			MPI_Type_free(&h->face_send[d][s]);
+			MPI_Type_free(&h->face_recv[d][s]);
+			MPI_Type_free(&h->full_send[d][s]);
+			MPI_Type_free(&h->full_recv[d][s]);
+			if (d > 0) {
+				MPI_Type_free(&h->corner_send[d][s]);
+				MPI_Type_free(&h->corner_recv[d][s]);
+			}
+		}
+	}
+}
+
+/*
+ * Post the sends/receives of one dimension. Tags tell the two directions apart,
+ * which matters when lo and hi are the same rank (2 ranks in a periodic dimension).
+ */
+void _mpi_halo_post(mpi_halo *h, void *array, int d, MPI_Datatype (*send)[2], MPI_Datatype (*recv)[2]) {
+	const mpi_topo *t = h->topo;
+	MPI_Request *r = h->requests + h->num_requests;
+	int down = 2 * d, up = 2 * d + 1; // data moving towards lo / towards hi
+	MPI_Irecv(array, 1, recv[d][0], t->lo[d], up, t->comm, &r[0]);
+	MPI_Irecv(array, 1, recv[d][1], t->hi[d], down, t->comm, &r[1]);
+	MPI_Isend(array, 1, send[d][0], t->lo[d], down, t->comm, &r[2]);
+	MPI_Isend(array, 1, send[d][1], t->hi[d], up, t->comm, &r[3]);
+	h->num_requests += 4;
+}
+
+/*
+ * Fill all ghost cells, including edges and corners (Isend/Irecv, one dimension after the other)
+ */
+void mpi_halo_exchange(mpi_halo *h, void *array) {
+	for (int d = 0; d < h->topo->ndims; d++) {
+		h->num_requests = 0;
+		_mpi_halo_post(h, array, d, h->full_send, h->full_recv);
+		MPI_Waitall(h->num_requests, h->requests, MPI_STATUSES_IGNORE);
+	}
+	h->num_requests = 0;
+}
+
+/*
+ * Start filling the face ghost cells of all dimensions at once (no edges/corners)
+ * Compute on cells that do not need ghosts, then call mpi_halo_finish.
+ */
+void mpi_halo_start(mpi_halo *h, void *array) {
+	h->num_requests = 0;
+	for (int d = 0; d < h->topo->ndims; d++) {
+		_mpi_halo_post(h, array, d, h->face_send, h->face_recv);
+	}
+}
+
+void mpi_halo_finish(mpi_halo *h) {
+	MPI_Waitall(h->num_requests, h->requests, MPI_STATUSES_IGNORE);
+	h->num_requests = 0;
+}
+
+/*
+ * mpi_halo_finish, then fill the edge and corner ghost cells too
+ *
+ * A corner comes from a diagonal neighbour, which only has it in its own
+ * ghosts once the faces have arrived, so this is a second, small round: one
+ * dimension after the other, only the cells mpi_halo_start left out.
+ */
+void mpi_halo_finish_corners(mpi_halo *h, void *array) {
+	mpi_halo_finish(h);
+	for (int d = 1; d < h->topo->ndims; d++) {
+		_mpi_halo_post(h, array, d, h->corner_send, h->corner_recv);
+		MPI_Waitall(h->num_requests, h->requests, MPI_STATUSES_IGNORE);
+		h->num_requests = 0;
+	}
+}
+
+/*
+ * Fill the face ghost cells with one MPI_Neighbor_alltoallw call (no edges/corners)
+ *
+ * For a cartesian communicator the neighbour order is lo, hi for dimension 0,
+ * then dimension 1, ... which is the order the face types are listed in.
+ */
+void mpi_halo_exchange_neighbor(mpi_halo *h, void *array) {
+	int ndims = h->topo->ndims;
+	int counts[2 * MPI_TOPO_MAX_DIMS];
+	MPI_Aint displs[2 * MPI_TOPO_MAX_DIMS];
+	MPI_Datatype send_types[2 * MPI_TOPO_MAX_DIMS], recv_types[2 * MPI_TOPO_MAX_DIMS];
+	for (int d = 0; d < ndims; d++) {
+		for (int s = 0; s < 2; s++) {
+			counts[2 * d + s] = 1;
+			displs[2 * d + s] = 0; // the subarray types already point at the right cells
+			send_types[2 * d + s] = h->face_send[d][s];
+			recv_types[2 * d + s] = h->face_recv[d][s];
+		}
+	}
+	MPI_Neighbor_alltoallw(array, counts, displs, send_types,
+						   array, counts, displs, recv_types, h->topo->comm);
+}
+
+#endif
@@ -1,9 +1,14 @@
+#ifndef MPI_HELPER_H
+#define MPI_HELPER_H
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <mpi.h>
 
+#include "mpi_log.h"
+
 /*
  * A custom implementation of broadcast
  *
@@ -67,15 +72,16 @@ int my_mpi_scatter(void *sendbuf, int sendcount, MPI_Datatype sendtype, void *re
     MPI_Comm_size(comm, &size);
 
     if (rank == 0) {
+      // element size in bytes (sizeof(sendtype) would be the size of the handle, not of an element)
+      int typesize;
+      MPI_Type_size(sendtype, &typesize);
       for (int i = 0; i < size; i++) {
         if (i == 0) {
           // rank 0 just copies from sendbuf to recvbuf
-          memcpy(recvbuf, sendbuf, sendcount * sizeof(sendtype));
+          memcpy(recvbuf, sendbuf, (size_t)sendcount * typesize);
           continue;
         }
         // we should send the section that corrosponds to the rank (for example rank 2 gets section 2 of buffer)
-        int typesize;
-        MPI_Type_size(sendtype, &typesize);
         char *shifted_buffer = (char *)sendbuf + (i * sendcount) * typesize;
         MPI_Send(shifted_buffer, sendcount, sendtype, i, 0, comm);
       }
@@ -165,11 +171,13 @@ int my_mpi_scatter_collective(void *sendbuf, int sendcount, MPI_Datatype sendtyp
 #define mpi_print_int_array(x, size) { \
 	mpi_printf("Array: "); \
 	for (int i = 0; i < size; i++) { \
-		printf("%d ", x[i]); \
+		mpi_printf_raw("%d ", x[i]); \
 	} \
-  printf("\n"); \
+  mpi_printf_raw("\n"); \
 } \
 
+#ifdef MPI_HELPER_UNBUFFERED_LOG
+
 /*
  * MPI print to only print with processor 0 (no verbose logging)
  */
@@ -191,6 +199,34 @@ int my_mpi_scatter_collective(void *sendbuf, int sendcount, MPI_Datatype sendtyp
   printf(__VA_ARGS__); \
 }
 
+/*
+ * MPI print without the rank prefix (continues an mpi_printf line)
+ */
+#define mpi_printf_raw(...) printf(__VA_ARGS__)
+
+#else
+
+/*
+ * MPI print to only print with processor 0 (no verbose logging)
+ */
+#define mpi_printf_once(...) { \
+  if (mpi_log_rank() == 0) { \
+    mpi_log_append(0, __VA_ARGS__); \
+  } \
+}
+
+/*
+ * MPI print with all processors (buffered, printed in rank order at the next mpi_log_flush)
+ */
+#define mpi_printf(...) mpi_log_append(1, __VA_ARGS__)
+
+/*
+ * MPI print without the rank prefix (continues an mpi_printf line)
+ */
+#define mpi_printf_raw(...) mpi_log_append(0, __VA_ARGS__)
+
+#endif
+
 /*
  * Macro to time a section of code.
  * Usage:
@@ -216,6 +252,45 @@ int my_mpi_scatter_collective(void *sendbuf, int sendcount, MPI_Datatype sendtyp
       mpi_printf("Time: %f seconds\n", total_time); \
     } \
   } \
+  mpi_log_flush(MPI_COMM_WORLD); \
+}
+
+/*
+ * Macro to time a section of code and sample hardware counters around it.
+ * Same as mpi_time, but each rank also counts cycles, instructions, cache and
+ * branch misses for the timed code only (the barriers are not counted). The
+ * counts are reduced over all ranks and printed under the timing. Falls back
+ * to plain timing when perf counters are not permitted.
+ * Usage:
+ *   mpi_time_perf( number of samples,
+ *       // code to time here
+ *   );
+ */
+#define mpi_time_perf(samples, ...) { \
+  double start_time, end_time; \
+  double total_time = 0.0; \
+  mpi_perf_counters _perf; \
+  mpi_perf_open(&_perf); \
+  for (int i = 0; i < samples; i++) { \
+    MPI_Barrier(MPI_COMM_WORLD); \
+    start_time = MPI_Wtime(); \
+    mpi_perf_start(&_perf); \
+    __VA_ARGS__ \
+    mpi_perf_stop(&_perf); \
+    MPI_Barrier(MPI_COMM_WORLD); \
+    end_time = MPI_Wtime(); \
+    total_time += (end_time - start_time); \
+  } \
+  if (_mpi_rank == 0) { \
+    if (samples > 1) { \
+      mpi_printf("Average time over %d samples: %f seconds\n", samples, total_time / samples); \
+    } else { \
+      mpi_printf("Time: %f seconds\n", total_time); \
+    } \
+  } \
+  mpi_perf_report(&_perf, samples, MPI_COMM_WORLD); \
+  mpi_perf_close(&_perf); \
+  mpi_log_flush(MPI_COMM_WORLD); \
 }
 
 /* 
@@ -233,6 +308,12 @@ int my_mpi_scatter_collective(void *sendbuf, int sendcount, MPI_Datatype sendtyp
         MPI_Comm_size(MPI_COMM_WORLD, &_mpi_size); \
         (void)_mpi_rank; (void)_mpi_size; /* silence unused warnings */ \
         __VA_ARGS__ \
+        mpi_log_flush(MPI_COMM_WORLD); \
         MPI_Finalize(); \
+        mpi_log_free(); \
         return 0; \
-    }
\ No newline at end of file
+    }
+
+#include "mpi_perf.h"
+
+#endif
@@ -0,0 +1,226 @@
+#ifndef MPI_IO_H
+#define MPI_IO_H
+
+#include <stdarg.h>
+
+#include "mpi_helper.h"
+
+/*
+ * Ordered, distributed output through MPI-IO.
+ *
+ * Instead of every rank taking turns to fopen/append/fclose behind a barrier,
+ * each rank works out where its bytes go in the file with an exclusive scan of
+ * the byte counts and all ranks write at once with one collective call. The
+ * result is the same file as the rank-by-rank loop (rank 0's data first).
+ *
+ * All functions are collective over comm and return MPI_SUCCESS or the MPI
+ * error code of the first failing call (files use MPI_ERRORS_RETURN).
+ */
+
+#define MPI_IO_TRUNCATE 0  // start the file from scratch
+#define MPI_IO_APPEND   1  // write after whatever is already in the file
+
+/*
+ * Open filename for writing and return the offset writing should start at
+ */
+int _mpi_io_open_write(MPI_Comm comm, const char *filename, int append, MPI_File *fh, MPI_Offset *base) {
+	int err = MPI_File_open(comm, filename, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, fh);
+	if (err != MPI_SUCCESS) {
+		return err;
+	}
+
+	*base = 0;
+	if (append) {
+		err = MPI_File_get_size(*fh, base);
+	} else {
+		err = MPI_File_set_size(*fh, 0);
+	}
+	if (err != MPI_SUCCESS) {
+		MPI_File_close(fh);
+	}
+	return err;
+}
+
+/*
+ * Write each rank's buffer to filename in rank order using an exclusive scan + MPI_File_write_at_all
+ *
+ * comm: MPI communicator
+ * filename: file to write
+ * append: MPI_IO_APPEND or MPI_IO_TRUNCATE
+ * buf: bytes written by this rank (may differ in length between ranks)
+ * bytes: number of bytes in buf (can be 0)
+ */
+int mpi_write_ordered(MPI_Comm comm, const char *filename, int append, const void *buf, int bytes) {
+	MPI_File fh;
+	MPI_Offset base;
+	int err = _mpi_io_open_write(comm, filename, append, &fh, &base);
+	if (err != MPI_SUCCESS) {
+		return err;
+	}
+
+	// my offset is the number of bytes written by all lower ranks
+	long long my_bytes = bytes, before = 0;
+	int rank;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Exscan(&my_bytes, &before, 1, MPI_LONG_LONG, MPI_SUM, comm);
+	if (rank == 0) {
+		before = 0; // MPI_Exscan leaves rank 0's result undefined
+	}
+
+	err = MPI_File_write_at_all(fh, base + (MPI_Offset)before, buf, bytes, MPI_BYTE, MPI_STATUS_IGNORE);
+	int close_err = MPI_File_close(&fh);
+	return (err != MPI_SUCCESS) ? err : close_err;
+}
+
+/*
+ * Same as mpi_write_ordered but lets the library order the writes through the shared file pointer
+ * (MPI_File_write_ordered), useful to compare against the explicit offset version
+ */
+int mpi_write_ordered_shared(MPI_Comm comm, const char *filename, int append, const void *buf, int bytes) {
+	int amode = MPI_MODE_CREATE | MPI_MODE_WRONLY | (append ? MPI_MODE_APPEND : 0);
+	MPI_File fh;
+	int err = MPI_File_open(comm, filename, amode, MPI_INFO_NULL, &fh);
+	if (err != MPI_SUCCESS) {
+		return err;
+	}
+	if (!append) {
+		err = MPI_File_set_size(fh, 0);
+	}
+	if (err == MPI_SUCCESS) {
+		err = MPI_File_write_ordered(fh, buf, bytes, MPI_BYTE, MPI_STATUS_IGNORE);
+	}
+	int close_err = MPI_File_close(&fh);
+	return (err != MPI_SUCCESS) ? err : close_err;
+}
+
+/*
+ * printf into a file with one line (or any formatted text) per rank, in rank order
+ * Usage:
+ *   mpi_printf_ordered(MPI_COMM_WORLD, "output.txt", MPI_IO_APPEND, "Rank %d: %d\n", rank, value);
+ */
+int mpi_printf_ordered(MPI_Comm comm, const char *filename, int append, const char *format, ...) {
+	char line[256];
+	char *text = line;
+
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+
+	// long output does not fit the stack buffer, format again into one that fits
+	if (len >= (int)sizeof(line)) {
+		text = (char *)malloc(len + 1);
+		va_start(args, format);
+		vsnprintf(text, len + 1, format, args);
+		va_end(args);
+	}
+	if (len < 0) {
+		len = 0;
+	}
+
+	int err = mpi_write_ordered(comm, filename, append, text, len);
+	if (text != line) {
+		free(text);
+	}
+	return err;
+}
+
+/*
+ * Write every rank's buffered mpi_printf output to filename in rank order instead of stdout
+ * (the MPI-IO counterpart of mpi_log_flush, nothing goes through rank 0)
+ */
+int mpi_log_flush_file(MPI_Comm comm, const char *filename, int append) {
+	int err = mpi_write_ordered(comm, filename, append, _mpi_log.data, (int)_mpi_log.len);
+	_mpi_log.len = 0;
+	return err;
+}
+
+/*
+ * Write fixed-width binary records, rank r's records following those of ranks < r
+ *
+ * The file is just the records back to back, so record i of the global array
+ * is at byte i * record_size and can be read back (or mmap'd) directly.
+ *
+ * comm: MPI communicator
+ * filename: file to write (truncated)
+ * records: this rank's records
+ * count: number of records on this rank
+ * record_size: size of one record in bytes (same on every rank)
+ */
+int mpi_write_records(MPI_Comm comm, const char *filename, const void *records, int count, int record_size) {
+	MPI_File fh;
+	MPI_Offset base;
+	int err = _mpi_io_open_write(comm, filename, MPI_IO_TRUNCATE, &fh, &base);
+	if (err != MPI_SUCCESS) {
+		return err;
+	}
+
+	long long my_count = count, first = 0;
+	int rank;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Exscan(&my_count, &first, 1, MPI_LONG_LONG, MPI_SUM, comm);
+	if (rank == 0) {
+		first = 0;
+	}
+
+	// one contiguous type per record keeps the count small for large records
+	MPI_Datatype record_type;
+	MPI_Type_contiguous(record_size, MPI_BYTE, &record_type);
+	MPI_Type_commit(&record_type);
+
+	err = MPI_File_write_at_all(fh, (MPI_Offset)first * record_size, records, count, record_type, MPI_STATUS_IGNORE);
+
+	MPI_Type_free(&record_type);
+	int close_err = MPI_File_close(&fh);
+	return (err != MPI_SUCCESS) ? err : close_err;
+}
+
+/*
+ * Read back a file written by mpi_write_records, split into near-equal blocks over the ranks of comm
+ * (works for any number of ranks, not only the number that wrote the file)
+ *
+ * comm: MPI communicator
+ * filename: file to read
+ * record_size: size of one record in bytes
+ * records: set to a malloc'd array of this rank's records (free it after use)
+ * count: set to the number of records on this rank
+ * first: set to the global index of this rank's first record (can be NULL)
+ */
+int mpi_read_records(MPI_Comm comm, const char *filename, int record_size, void **records, int *count, long long *first) {
+	int rank, size;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &size);
+
+	MPI_File fh;
+	int err = MPI_File_open(comm, filename, MPI_MODE_RDONLY, MPI_INFO_NULL, &fh);
+	if (err != MPI_SUCCESS) {
+		return err;
+	}
+
+	MPI_Offset file_size;
+	MPI_File_get_size(fh, &file_size);
+	long long total = file_size / record_size;
+
+	// same split as estimate_pi: the first 'remainder' ranks get one extra record
+	long long per_rank = total / size, remainder = total % size;
+	long long start = rank * per_rank + (rank < remainder ? rank : remainder);
+	long long my_count = per_rank + (rank < remainder ? 1 : 0);
+
+	*records = malloc(my_count > 0 ? my_count * record_size : 1);
+	*count = (int)my_count;
+	if (first != NULL) {
+		*first = start;
+	}
+
+	MPI_Datatype record_type;
+	MPI_Type_contiguous(record_size, MPI_BYTE, &record_type);
+	MPI_Type_commit(&record_type);
+
+	err = MPI_File_read_at_all(fh, (MPI_Offset)start * record_size, *records, (int)my_count, record_type, MPI_STATUS_IGNORE);
+
+	MPI_Type_free(&record_type);
+	int close_err = MPI_File_close(&fh);
+	return (err != MPI_SUCCESS) ? err : close_err;
+}
+
+#endif